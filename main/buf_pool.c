@@ -0,0 +1,131 @@
+#include "buf_pool.h"
+#include "util.h"
+#include <task.h>
+#include <semphr.h>
+
+// Pool data
+static struct {
+	MwMsgBuf buf[BUF_POOL_LEN];	///< Buffers
+	uint8_t ref[BUF_POOL_LEN];	///< References to each buffer (0 if free)
+	uint8_t free_idx[BUF_POOL_LEN];	///< Stack of free buffer indexes
+	uint8_t free;			///< Number of free buffers
+	SemaphoreHandle_t freed;	///< Signals a buffer returned to the pool
+} p;
+
+void buf_pool_init(void)
+{
+	int i;
+
+	for (i = 0; i < BUF_POOL_LEN; i++) {
+		p.ref[i] = 0;
+		p.free_idx[i] = i;
+	}
+	p.free = BUF_POOL_LEN;
+	p.freed = xSemaphoreCreateBinary();
+}
+
+MwMsgBuf *buf_alloc(uint8_t rsv)
+{
+	MwMsgBuf *buf = NULL;
+	uint8_t idx;
+
+	taskENTER_CRITICAL();
+	if (p.free > rsv) {
+		idx = p.free_idx[--p.free];
+		p.ref[idx] = 1;
+		buf = p.buf + idx;
+	}
+	taskEXIT_CRITICAL();
+
+	return buf;
+}
+
+MwMsgBuf *buf_alloc_wait(uint8_t rsv, TickType_t wait)
+{
+	MwMsgBuf *buf;
+	TimeOut_t tout;
+
+	vTaskSetTimeOutState(&tout);
+	while (!(buf = buf_alloc(rsv))) {
+		if (xTaskCheckForTimeOut(&tout, &wait) ||
+				pdTRUE != xSemaphoreTake(p.freed, wait)) {
+			return NULL;
+		}
+	}
+	// A single waiter is woken up on each release, let the next one try
+	if (buf_free_count()) {
+		xSemaphoreGive(p.freed);
+	}
+
+	return buf;
+}
+
+int buf_idx(const MwMsgBuf *buf)
+{
+	int idx = buf - p.buf;
+
+	if (idx < 0 || idx >= BUF_POOL_LEN || buf != p.buf + idx) {
+		return -1;
+	}
+
+	return idx;
+}
+
+void buf_ref(MwMsgBuf *buf)
+{
+	int idx = buf_idx(buf);
+	bool err = TRUE;
+
+	if (idx >= 0) {
+		taskENTER_CRITICAL();
+		if (p.ref[idx] && p.ref[idx] < UINT8_MAX) {
+			p.ref[idx]++;
+			err = FALSE;
+		}
+		taskEXIT_CRITICAL();
+	}
+	if (err) {
+		LOGE("cannot reference buffer %p", buf);
+	}
+}
+
+void buf_unref(MwMsgBuf *buf)
+{
+	int idx = buf_idx(buf);
+	bool released = FALSE;
+	bool err = TRUE;
+
+	if (idx >= 0) {
+		taskENTER_CRITICAL();
+		if (p.ref[idx]) {
+			err = FALSE;
+			if (!--p.ref[idx]) {
+				p.free_idx[p.free++] = idx;
+				released = TRUE;
+			}
+		}
+		taskEXIT_CRITICAL();
+	}
+	if (err) {
+		// Released more times than referenced, or not from the pool
+		LOGE("cannot release buffer %p", buf);
+	} else if (released) {
+		xSemaphoreGive(p.freed);
+	}
+}
+
+void buf_unref_cb(void *buf)
+{
+	buf_unref(buf);
+}
+
+uint8_t buf_free_count(void)
+{
+	uint8_t free;
+
+	taskENTER_CRITICAL();
+	free = p.free;
+	taskEXIT_CRITICAL();
+
+	return free;
+}
@@ -0,0 +1,52 @@
+#ifndef _BUF_POOL_H_
+#define _BUF_POOL_H_
+
+#include <stdint.h>
+
+#include <FreeRTOS.h>
+
+#include "mw-msg.h"
+
+/// Number of buffers in the pool
+#define BUF_POOL_LEN		11
+
+// Pool of fixed size buffers shared by the LSD receiver, the FSM and the
+// socket paths. Buffers are reference counted: a buffer taken with
+// buf_alloc() has a single reference, each holder passing it to another
+// one can take an additional reference with buf_ref(), and the buffer
+// returns to the pool when the last reference is dropped with buf_unref().
+// References can be dropped in any order, from any task.
+//
+// The rsv parameter of the allocation functions is the number of buffers
+// that must be left in the pool, so a consumer cannot starve the ones
+// allocating with a lower reserve (e.g. the LSD receiver, that uses 0).
+
+// Initializes the pool. Must be called before any other pool function.
+void buf_pool_init(void);
+
+// Takes a buffer from the pool, if more than rsv buffers are free.
+// Returns the buffer, or NULL if there is no buffer available.
+MwMsgBuf *buf_alloc(uint8_t rsv);
+
+// Takes a buffer from the pool, waiting up to wait ticks until more than
+// rsv buffers are free. Returns the buffer, or NULL on timeout.
+MwMsgBuf *buf_alloc_wait(uint8_t rsv, TickType_t wait);
+
+// Adds a reference to a buffer
+void buf_ref(MwMsgBuf *buf);
+
+// Drops a reference to a buffer, returning it to the pool on the last one
+void buf_unref(MwMsgBuf *buf);
+
+// Same as buf_unref(), with the signature of the LSD transmit callbacks,
+// to release a buffer once it has been sent
+void buf_unref_cb(void *buf);
+
+// Returns the index of a buffer in the pool, or -1 if it is not from the
+// pool
+int buf_idx(const MwMsgBuf *buf);
+
+// Returns the number of free buffers in the pool
+uint8_t buf_free_count(void);
+
+#endif /*_BUF_POOL_H_*/
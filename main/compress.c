@@ -0,0 +1,118 @@
+#include <string.h>
+#include "compress.h"
+
+// LZ4 block format constants
+#define LZ4_MIN_MATCH		4
+#define LZ4_LAST_LITERALS	5
+#define LZ4_MFLIMIT		12
+#define LZ4_RUN_MASK		15
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t val;
+
+	memcpy(&val, p, sizeof(val));
+	return val;
+}
+
+static uint16_t hash(uint32_t seq)
+{
+	return (seq * 2654435761U) >> (32 - COMP_HASH_BITS);
+}
+
+// Writes the length bytes following a token nibble set to LZ4_RUN_MASK
+static uint8_t *len_put(uint8_t *op, uint32_t len)
+{
+	len -= LZ4_RUN_MASK;
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+
+	return op;
+}
+
+// Worst case length of a sequence with the specified literals, including
+// token, match offset and the length bytes of the match.
+static uint32_t seq_len(uint32_t lit, uint32_t match)
+{
+	return 1 + lit + lit / 255 + 1 + 2 + match / 255 + 1;
+}
+
+int comp_lz4(const uint8_t *src, uint16_t len, uint8_t *dst, uint16_t max,
+		uint16_t *table)
+{
+	const uint8_t *ip = src;
+	const uint8_t *anchor = src;
+	const uint8_t *iend = src + len;
+	const uint8_t *ref;
+	uint8_t *op = dst;
+	uint8_t *token;
+	uint32_t lit, match;
+	uint16_t h;
+
+	memset(table, 0, COMP_TABLE_LEN * sizeof(uint16_t));
+	while (len > LZ4_MFLIMIT && ip < (iend - LZ4_MFLIMIT)) {
+		h = hash(read32(ip));
+		ref = src + table[h];
+		table[h] = ip - src;
+		if (ref >= ip || read32(ref) != read32(ip)) {
+			// Skip faster over data that does not compress
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+		// Extend match backwards, then forwards
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+		match = LZ4_MIN_MATCH;
+		while ((ip + match) < (iend - LZ4_LAST_LITERALS) &&
+				ip[match] == ref[match]) {
+			match++;
+		}
+		lit = ip - anchor;
+		if ((op - dst) + seq_len(lit, match) > max) {
+			return -1;
+		}
+
+		token = op++;
+		if (lit >= LZ4_RUN_MASK) {
+			*token = LZ4_RUN_MASK<<4;
+			op = len_put(op, lit);
+		} else {
+			*token = lit<<4;
+		}
+		memcpy(op, anchor, lit);
+		op += lit;
+		*op++ = (ip - ref) & 0xFF;
+		*op++ = (ip - ref)>>8;
+		match -= LZ4_MIN_MATCH;
+		if (match >= LZ4_RUN_MASK) {
+			*token |= LZ4_RUN_MASK;
+			op = len_put(op, match);
+		} else {
+			*token |= match;
+		}
+		ip += match + LZ4_MIN_MATCH;
+		anchor = ip;
+	}
+
+	// Last literals
+	lit = iend - anchor;
+	if ((op - dst) + 1 + lit + lit / 255 + 1 > max) {
+		return -1;
+	}
+	token = op++;
+	if (lit >= LZ4_RUN_MASK) {
+		*token = LZ4_RUN_MASK<<4;
+		op = len_put(op, lit);
+	} else {
+		*token = lit<<4;
+	}
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	return op - dst;
+}
@@ -0,0 +1,18 @@
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include <stdint.h>
+
+/// Bits of the match finder hash table index
+#define COMP_HASH_BITS		10
+
+/// Length of the table needed by comp_lz4() (in elements)
+#define COMP_TABLE_LEN		(1<<COMP_HASH_BITS)
+
+// Compresses src into dst, using LZ4 block format. The table must hold
+// COMP_TABLE_LEN elements, its contents need not be initialized.
+// Returns the compressed length, or -1 if it would exceed max.
+int comp_lz4(const uint8_t *src, uint16_t len, uint8_t *dst, uint16_t max,
+		uint16_t *table);
+
+#endif /*_COMPRESS_H_*/
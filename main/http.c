@@ -5,6 +5,7 @@
 #include "util.h"
 #include "http.h"
 #include "lsd.h"
+#include "buf_pool.h"
 
 /// Status of the HTTP command
 enum http_stat {
@@ -28,8 +29,6 @@ struct http_data {
 	uint32_t hash_tmp;
 	/// Partition with the certificate
 	const esp_partition_t *p;
-	/// Buffer used to send/recv HTTP data
-	char *buf;
 };
 
 static struct http_data d;
@@ -40,7 +39,7 @@ static struct http_data d;
 
 #define CERT_P_PTR(type, off)	((type*)SPI_FLASH_ADDR((d.p->address + (off))))
 
-int http_module_init(char *data_buf)
+int http_module_init(void)
 {
 	memset(&d, 0, sizeof(struct http_data));
 
@@ -51,8 +50,6 @@ int http_module_init(char *data_buf)
 		return 1;
 	}
 
-	d.buf = data_buf;
-
 	return 0;
 }
 
@@ -421,6 +418,7 @@ out:
 
 void http_recv(void)
 {
+	MwMsgBuf *b;
 	int readed;
 
 	if (d.s != MW_HTTP_ST_FINISH_CONTENT_WAIT) {
@@ -430,10 +428,15 @@ void http_recv(void)
 	}
 
 	while (d.remaining > 0) {
-		readed = esp_http_client_read(d.h, d.buf, MW_MSG_MAX_BUFLEN);
+		// Buffer is released once data has been sent
+		b = buf_alloc_wait(MW_BUF_RSV_DATA, portMAX_DELAY);
+		readed = esp_http_client_read(d.h, (char*)b->data,
+				MIN(LsdMaxLen(MW_HTTP_CH), sizeof(b->data)));
 		if (-1 == readed) {
+			buf_unref(b);
 			http_err_set("HTTP read error, %d remaining",
 					d.remaining);
+			MwEventSend(MW_EVENT_HTTP, MW_HTTP_CH, 1);
 			return;
 		} else if (0 == readed) {
 			LOGI("server closed the connection");
@@ -441,7 +444,11 @@ void http_recv(void)
 				d.remaining = 0;
 			}
 		}
-		LsdSend((uint8_t*)d.buf, readed, MW_HTTP_CH);
+		if (LsdSendAsync(b->data, readed, MW_HTTP_CH, buf_unref_cb,
+					b) <= 0) {
+			LsdSend(b->data, readed, MW_HTTP_CH);
+			buf_unref(b);
+		}
 		// Only decrement if not on chunked transfer mode
 		if (d.remaining != INT32_MAX) {
 			d.remaining -= readed;
@@ -454,6 +461,7 @@ void http_recv(void)
 	LOGD("HTTP request complete");
 	d.s = MW_HTTP_ST_IDLE;
 	LsdChDisable(MW_HTTP_CH);
+	MwEventSend(MW_EVENT_HTTP, MW_HTTP_CH, 0);
 }
 
 void http_send(const char *data, uint16_t len)
@@ -5,7 +5,7 @@
 #include <stdint.h>
 #include <esp_http_client.h>
 
-int http_module_init(char *data_buf);
+int http_module_init(void);
 
 esp_http_client_handle_t http_init(const char *url,
 		http_event_handle_cb event_cb);
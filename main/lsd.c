@@ -7,18 +7,23 @@
  * \date   2016
  * \todo   Proper implementation of error handling.
  ****************************************************************************/
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "lsd.h"
 #include "mw-msg.h"
 #include "util.h"
+#include "compress.h"
+#include "ring.h"
+#include "buf_pool.h"
 
 #include <driver/uart.h>
+#include <esp8266/uart_register.h>
+#include <esp8266/uart_struct.h>
+#include <esp_timer.h>
 #include <semphr.h>
-
-/// Number of buffer frames available
-#define LSD_BUF_FRAMES			2
+#include <timers.h>
 
 /// Start of data in the buffer (skips STX and LEN fields).
 #define LSD_BUF_DATA_START 		3
@@ -26,28 +31,167 @@
 /// Threshold of the RX FIFO to generate RTS signal
 #define LSD_RX_RTS_THR	(128 - 16)
 
+/// UART registers, must match LSD_UART
+#define LSD_UART_REG		uart0
+
+/// UART interrupts signalling received data
+#define LSD_UART_RX_INT		(UART_RXFIFO_FULL_INT_ENA_M | \
+		UART_RXFIFO_TOUT_INT_ENA_M | UART_RXFIFO_OVF_INT_ENA_M)
+
+/// RX FIFO level that raises the reception interrupt
+#define LSD_UART_RX_FULL_THR	64
+
+/// Idle time (in characters) that raises the reception interrupt, for
+/// data below LSD_UART_RX_FULL_THR not to wait
+#define LSD_UART_RX_TOUT	2
+
+/// TX FIFO level below which the transmit task is woken up
+#define LSD_UART_TX_EMPTY_THR	32
+
+/// Maximum COBS block length, including the code byte
+#define LSD_COBS_BLOCK_MAX	255
+
+/// Maximum length of a frame being sent, before encoding: up to 4 header
+/// bytes (extended header plus sequence number), payload and CRC.
+#define LSD_TX_FRAME_MAX	(MW_MSG_MAX_BUFLEN + 6)
+
+/// Transmit buffer length: COBS overhead plus delimiter (or STX and ETX)
+/// added to the longest frame. Longer frames are sent in several writes.
+#define LSD_TX_BUF_LEN		(1 + LSD_TX_FRAME_MAX + \
+		LSD_TX_FRAME_MAX/(LSD_COBS_BLOCK_MAX - 1) + 2)
+
 /** \addtogroup lsd LsdState Allowed states for reception state machine.
  *  \{ */
 typedef enum {
 	LSD_ST_IDLE = 0,		///< Currently inactive
 	LSD_ST_STX_WAIT,		///< Waiting for STX
 	LSD_ST_CH_LENH_RECV,		///< Receiving channel and length (high bits)
+	LSD_ST_LENH_RECV,		///< Receiving length high (extended header)
 	LSD_ST_LEN_RECV,		///< Receiving frame length
+	LSD_ST_SEQ_RECV,		///< Receiving sequence number
 	LSD_ST_DATA_RECV,		///< Receiving data length
+	LSD_ST_CRC_RECV,		///< Receiving CRC trailer
 	LSD_ST_ETX_RECV,		///< Receiving ETX
+	LSD_ST_COBS_CODE,		///< Receiving COBS block code
+	LSD_ST_COBS_RUN,		///< Receiving COBS block data
+	LSD_ST_COBS_SKIP,		///< Waiting for COBS delimiter
 	LSD_ST_MAX			///< Number of states
 } LsdState;
 /** \} */
 
+/// Reliable mode transmit window slot
+struct lsd_rel_slot {
+	TickType_t sent;		///< Time of the last transmission
+	uint16_t len;			///< Payload length
+	uint8_t ch;			///< Channel number
+	bool acked;			///< Selectively acknowledged
+	uint8_t data[MW_MSG_MAX_BUFLEN];///< Payload, kept for retransmission
+};
+
+/// Reliable mode data
+struct lsd_rel {
+	struct lsd_rel_slot *slot;	///< Transmit window
+	TickType_t rto;			///< Retransmit timeout
+	uint8_t win;			///< Window length (power of two)
+	uint8_t una;			///< Oldest unacknowledged sequence number
+	uint8_t nxt;			///< Next sequence number to send
+	uint8_t rx_next;		///< Next sequence number expected
+	MwMsgBuf *held[LSD_REL_WIN_MAX];///< Frames received out of order
+};
+
+/// Frame queued for sending
+struct lsd_tx_req {
+	const struct lsd_iov *iov;	///< Buffers to send (NULL to use data)
+	const uint8_t *data;		///< Buffer to send
+	uint16_t len;			///< Frame payload length
+	uint8_t iovcnt;			///< Number of buffers in iov
+	lsd_tx_cb cb;			///< Called when frame has been sent
+	void *ctx;			///< Context for cb
+};
+
+/// Link control frame queued for sending
+struct lsd_link_req {
+	uint8_t len;			///< Payload length
+	uint8_t data[LSD_LINK_MAX_LEN];	///< Payload
+};
+
 /** \addtogroup lsd LsdData Local data required by the module.
  *  \{ */
 typedef struct {
-	MwMsgBuf rx[LSD_BUF_FRAMES];	///< Reception buffers.
-	SemaphoreHandle_t sem;		///< Semaphore to control buffers
+	uint8_t rx_owner[BUF_POOL_LEN];	///< Channel + 1 using each pool buffer
+	MwMsgBuf *cur;			///< Buffer for the frame being received
+	SemaphoreHandle_t sem;		///< Signals a buffer has been freed
 	LsdState rxs;			///< Reception state
 	uint8_t en[LSD_MAX_CH];		///< Channel enable
+	uint8_t rx_max[LSD_MAX_CH];	///< Maximum buffers used per channel
+	uint8_t rx_used[LSD_MAX_CH];	///< Buffers in use per channel
+	uint8_t rx_free;		///< Number of free reception buffers
+	uint8_t ch;			///< Channel of the frame being received
+	uint16_t len;			///< Length of the frame being received
 	uint16_t pos;			///< Position in current buffer
-	uint8_t current;		///< Current buffer in use
+	uint8_t *rx_data;		///< Payload destination (NULL to discard)
+	uint16_t rx_len;		///< Payload length of the frame
+	uint8_t rx_hdr;			///< Header bytes in the DATA field
+	uint8_t seq;			///< Sequence number of the frame
+	uint8_t link[LSD_LINK_MAX_LEN];	///< Link control frame payload
+	uint32_t opts;			///< Negotiated link options
+	uint8_t hdr_len;		///< Length of the CH and LEN fields
+	uint32_t rx_opts;		///< Link options used by the receiver
+	uint8_t rx_hdr_len;		///< Length of the received CH and LEN
+	uint32_t rx_opts_new;		///< Link options pending for the receiver
+	bool rx_opts_pend;		///< Receiver must switch to rx_opts_new
+	uint16_t ext_max;		///< Maximum length using extended header
+	uint16_t crc;			///< CRC computed over received frame
+	uint16_t crc_recv;		///< CRC trailer of received frame
+	uint16_t tx_crc;		///< CRC computed over sent frame
+	uint8_t cobs_left;		///< Bytes left in COBS block
+	bool cobs_zero;			///< COBS block ends with implied zero
+	uint16_t tx_left;		///< Payload bytes left to send
+	uint16_t tx_code;		///< Position of the COBS code byte
+	uint16_t tx_pos;		///< Position in transmit buffer
+	uint8_t tx_buf[LSD_TX_BUF_LEN];	///< Frame being sent
+	struct lsd_rel_slot *tx_slot;	///< Window slot of the frame being sent
+	QueueHandle_t tx_q[LSD_MAX_CH];	///< Frames queued for sending
+	QueueHandle_t link_q;		///< Link control frames queued
+	SemaphoreHandle_t tx_sem;	///< Signals transmit task there is work
+	uint32_t tx_weight[LSD_MAX_CH];	///< Bytes sent on each round
+	uint32_t tx_deficit[LSD_MAX_CH];///< Bytes that can be sent this round
+	uint8_t tx_rr;			///< Channel being served this round
+	bool tx_visit;			///< Channel got its weight this round
+	uint16_t tx_frag_off[LSD_MAX_CH];///< Data already sent in fragments
+	uint8_t tx_frag_idx[LSD_MAX_CH];///< Index of the next fragment
+	SemaphoreHandle_t split_mutex;	///< Serializes split frames
+	uint8_t *split;			///< Split frame being accumulated
+	bool split_on;			///< Split frame started
+	uint16_t split_len;		///< Split frame total length
+	uint16_t split_pos;		///< Split frame accumulated length
+	uint8_t split_ch;		///< Split frame channel
+	struct lsd_rel rel;		///< Reliable mode data
+	uint32_t baud;			///< Baud rate in use
+	uint32_t baud_prev;		///< Baud rate in use before probing
+	uint32_t baud_errs;		///< Link errors when probing started
+	uint8_t baud_failed;		///< Baud rates that failed probing
+	bool baud_probe;		///< Probing a new baud rate
+	bool baud_revert;		///< Probe timed out, transmit task reverts
+	TimerHandle_t baud_tim;		///< Baud rate probe timeout
+	uint8_t tx_cnt[LSD_MAX_CH];	///< Frames sent (credit mode)
+	uint8_t tx_limit[LSD_MAX_CH];	///< Credit granted by the other end
+	uint8_t rx_cnt[LSD_MAX_CH];	///< Frames forwarded (credit mode)
+	uint8_t credit_pend;		///< Channels pending to grant credit
+	uint8_t comp;			///< Channels with compression enabled
+	uint16_t *comp_table;		///< Compressor match finder table
+	uint8_t *comp_buf;		///< Compressed payload
+	uint8_t *super;			///< Super-frame being packed
+	TickType_t credit_tick;		///< Last time credit was granted
+	SemaphoreHandle_t tx_mutex;	///< Serializes frame transmission
+	struct lsd_stats stats;		///< Link statistics
+	struct ring rx_ring;		///< Data moved from the UART by the ISR
+	uint8_t rx_ring_buf[LSD_RX_RING_LEN];///< Storage for rx_ring
+	SemaphoreHandle_t rx_sem;	///< Signals data has been received
+	bool rx_stopped;		///< Ring full, reception interrupts off
+	SemaphoreHandle_t tx_fifo_sem;	///< Signals room in the UART TX FIFO
+	struct mq *fsm_q;		///< Queue to forward frames to the FSM
+	uint8_t fsm_lane;		///< Lane of fsm_q used by the receiver
 } LsdData;
 /** \} */
 
@@ -55,15 +199,152 @@ typedef struct {
  * Private prototypes
  */
 void LsdRecvTsk(void *pvParameters);
+void LsdSendTsk(void *pvParameters);
+
+/// CRC-16/CCITT (polynomial 0x1021) lookup table
+static const uint16_t crc16_table[256] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+	0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+	0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+	0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+	0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+	0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+	0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+	0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+	0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+	0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+	0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+	0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+	0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+	0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+	0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+	0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+	0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+	0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+	0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+	0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+	0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+	0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+	0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+	0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+	0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+	0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+	0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+	0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+	0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+	0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+	0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+	0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
+};
+
+/// Initial value for CRC-16 computation
+#define LSD_CRC_INIT		0xFFFF
+
+/************************************************************************//**
+ * Updates a CRC-16/CCITT with the specified data.
+ *
+ * \param[in] crc  CRC computed over the previous data.
+ * \param[in] data Data to add to the CRC.
+ * \param[in] len  Length of data.
+ *
+ * \return The updated CRC value.
+ ****************************************************************************/
+static uint16_t LsdCrc16(uint16_t crc, const uint8_t *data, int len) {
+	while (len--) {
+		crc = (crc<<8) ^ crc16_table[(crc>>8) ^ *data++];
+	}
+
+	return crc;
+}
 
 /// Module data
 static LsdData d;
 
+/// Baud rates that can be negotiated
+static const uint32_t lsd_baud_rates[] = LSD_BAUD_RATES;
+
+/// Zero bytes used to pad payloads
+static const uint8_t lsd_pad[LSD_ALIGN - 1] = {0};
+
+/// Number of baud rates that can be negotiated
+#define LSD_BAUD_RATES_NUM	(sizeof(lsd_baud_rates) / sizeof(uint32_t))
+
+static void LsdBaudTimeout(TimerHandle_t xTimer);
+
+/************************************************************************//**
+ * UART interrupt handler. Moves received data from the RX FIFO to the ring
+ * and wakes up the receive task. If the ring is full, data is left in the
+ * FIFO and reception interrupts are disabled until there is room, so
+ * hardware flow control stops the other end. Also wakes up the transmit
+ * task when the TX FIFO drains.
+ *
+ * \param[in] arg Unused.
+ ****************************************************************************/
+static void IRAM_ATTR LsdUartIsr(void *arg) {
+	uint32_t st = LSD_UART_REG.int_st.val;
+	BaseType_t woken = pdFALSE;
+	uint8_t *span;
+	uint32_t len, i;
+	uint8_t avail;
+
+	UNUSED_PARAM(arg);
+
+	if (st & LSD_UART_RX_INT) {
+		if (st & UART_RXFIFO_OVF_INT_ST_M) {
+			d.stats.rx_ovf++;
+		}
+		avail = LSD_UART_REG.status.rxfifo_cnt;
+		while (avail && (len = ring_write_span(&d.rx_ring, &span))) {
+			len = MIN(len, avail);
+			for (i = 0; i < len; i++) {
+				span[i] = LSD_UART_REG.fifo.rw_byte;
+			}
+			ring_commit(&d.rx_ring, len);
+			avail -= len;
+		}
+		if (avail) {
+			// Ring full, leave data in the FIFO until there is room
+			LSD_UART_REG.int_ena.val &= ~LSD_UART_RX_INT;
+			d.rx_stopped = TRUE;
+			d.stats.rx_stall++;
+		}
+		LSD_UART_REG.int_clr.val = st & LSD_UART_RX_INT;
+		xSemaphoreGiveFromISR(d.rx_sem, &woken);
+	}
+	if (st & UART_TXFIFO_EMPTY_INT_ST_M) {
+		LSD_UART_REG.int_ena.val &= ~UART_TXFIFO_EMPTY_INT_ENA_M;
+		LSD_UART_REG.int_clr.val = UART_TXFIFO_EMPTY_INT_ST_M;
+		xSemaphoreGiveFromISR(d.tx_fifo_sem, &woken);
+	}
+	if (woken) {
+		portYIELD_FROM_ISR();
+	}
+}
+
+/************************************************************************//**
+ * Sets up the UART interrupts, for the module to move data to and from the
+ * UART FIFOs (the UART driver is not installed).
+ ****************************************************************************/
+static void LsdUartInit(void) {
+	uart_intr_config_t intr = {
+		.intr_enable_mask = LSD_UART_RX_INT,
+		.rxfifo_full_thresh = LSD_UART_RX_FULL_THR,
+		.rx_timeout_thresh = LSD_UART_RX_TOUT,
+		.txfifo_empty_intr_thresh = LSD_UART_TX_EMPTY_THR
+	};
+
+	ring_init(&d.rx_ring, d.rx_ring_buf, LSD_RX_RING_LEN);
+	d.rx_sem = xSemaphoreCreateBinary();
+	d.tx_fifo_sem = xSemaphoreCreateBinary();
+	ESP_ERROR_CHECK(uart_isr_register(LSD_UART, LsdUartIsr, NULL));
+	ESP_ERROR_CHECK(uart_intr_config(LSD_UART, &intr));
+}
+
 /************************************************************************//**
  * Module initialization. Call this function before any other one in this
  * module.
  ****************************************************************************/
-void LsdInit(QueueHandle_t q) {
+void LsdInit(struct mq *q, uint8_t lane) {
 	uart_config_t lsd_uart = {
 		.baud_rate = LSD_UART_BR,
 		.data_bits = UART_DATA_8_BITS,
@@ -72,17 +353,49 @@ void LsdInit(QueueHandle_t q) {
 		.flow_ctrl = UART_HW_FLOWCTRL_CTS_RTS,
 		.rx_flow_ctrl_thresh = 122
 	};
+	int i;
+
 	// Set variables to default values
 	memset(&d, 0, sizeof(LsdData));
 	d.rxs = LSD_ST_STX_WAIT;
+	d.hdr_len = 2;
+	d.rx_hdr_len = 2;
+	d.ext_max = LSD_EXT_MAX_LEN;
+	d.fsm_q = q;
+	d.fsm_lane = lane;
+	d.rx_free = LSD_RX_BUFS;
+	// Control channel can use all the buffers, other channels cannot use
+	// the ones reserved for the control channel
+	d.rx_max[0] = LSD_RX_BUFS;
+	for (i = 1; i < LSD_MAX_CH; i++) {
+		d.rx_max[i] = LSD_RX_BUFS - LSD_RX_CTRL_RSV;
+	}
 	// Configure UART
 	ESP_ERROR_CHECK(uart_param_config(UART_NUM_0, &lsd_uart));
 //	ESP_ERROR_CHECK(uart_set_pin(UART_NUM_0, 1, 3, 15, 13));
-	ESP_ERROR_CHECK(uart_driver_install(UART_NUM_0, 1024, 0, 0, NULL, 0));
-	// Create semaphore used to handle receive buffers
-	d.sem = xSemaphoreCreateCounting(LSD_BUF_FRAMES, LSD_BUF_FRAMES);
-	// Create receive task
-	xTaskCreate(LsdRecvTsk, "LSDR", 1024, q, LSD_RECV_PRIO, NULL);
+	LsdUartInit();
+	// Create semaphore used to signal freed receive buffers
+	d.sem = xSemaphoreCreateBinary();
+	d.tx_mutex = xSemaphoreCreateMutex();
+	d.rel.win = LSD_REL_WIN_DEF;
+	d.rel.rto = MAX(1, pdMS_TO_TICKS(LSD_REL_RTO_MS_DEF));
+	d.baud = LSD_UART_BR;
+	d.baud_tim = xTimerCreate("LSDB", pdMS_TO_TICKS(LSD_BAUD_PROBE_MS),
+			pdFALSE, NULL, LsdBaudTimeout);
+	// Create transmit queues, served by the transmit task
+	for (i = 0; i < LSD_MAX_CH; i++) {
+		d.tx_q[i] = xQueueCreate(LSD_TX_QUEUE_LEN,
+				sizeof(struct lsd_tx_req));
+		d.tx_weight[i] = LSD_TX_WEIGHT_DEF;
+	}
+	d.link_q = xQueueCreate(LSD_LINK_QUEUE_LEN,
+			sizeof(struct lsd_link_req));
+	d.tx_sem = xSemaphoreCreateBinary();
+	d.tx_rr = 1;
+	d.split_mutex = xSemaphoreCreateMutex();
+	// Create receive and transmit tasks
+	xTaskCreate(LsdRecvTsk, "LSDR", 1024, NULL, LSD_RECV_PRIO, NULL);
+	xTaskCreate(LsdSendTsk, "LSDT", 1024, NULL, LSD_SEND_PRIO, NULL);
 }
 
 /************************************************************************//**
@@ -117,219 +430,2204 @@ int LsdChDisable(uint8_t ch) {
 }
 
 /************************************************************************//**
- * Sends data through a previously enabled channel.
+ * Flags channels to grant credit to the other end, and wakes up the
+ * transmit task to send the grants.
  *
- * \param[in] data Buffer to send.
- * \param[in] len  Length of the buffer to send.
- * \param[in] ch   Channel number to use for sending.
+ * \param[in] mask Bitmask of the channels to grant credit.
+ ****************************************************************************/
+static void LsdCreditPend(uint8_t mask) {
+	// Control channel is not limited
+	mask &= ~1;
+	if (!mask || !(d.opts & LSD_OPT_CREDIT)) return;
+
+	taskENTER_CRITICAL();
+	d.credit_pend |= mask;
+	taskEXIT_CRITICAL();
+	xSemaphoreGive(d.tx_sem);
+}
+
+/************************************************************************//**
+ * COBS encodes data, appending it to the frame being sent. Must be called
+ * with the TX mutex held.
  *
- * \return -1 if there was an error, or the number of characterse sent
- * 		   otherwise.
+ * \param[in] data Data to encode.
+ * \param[in] len  Length of data.
  ****************************************************************************/
-int LsdSend(const uint8_t *data, uint16_t len, uint8_t ch) {
-	char scratch[3];
+static void LsdCobsPut(const uint8_t *data, int len) {
+	const uint8_t *zero;
+	int n;
 
-	if (len > MW_MSG_MAX_BUFLEN || ch >= LSD_MAX_CH) {
-		LOGE("Invalid length (%d) or channel (%d).", len, ch);
-		return -1;
+	while (len) {
+		// Copy data up to the next zero or the end of the block
+		n = MIN(len, LSD_COBS_BLOCK_MAX - (d.tx_pos - d.tx_code));
+		zero = memchr(data, 0, n);
+		if (zero) {
+			n = zero - data;
+		}
+		memcpy(d.tx_buf + d.tx_pos, data, n);
+		d.tx_pos += n;
+		data += n;
+		len -= n;
+		if (zero) {
+			// Close block, the zero is implied by the code
+			data++;
+			len--;
+		} else if ((d.tx_pos - d.tx_code) < LSD_COBS_BLOCK_MAX) {
+			continue;
+		}
+		d.tx_buf[d.tx_code] = d.tx_pos - d.tx_code;
+		d.tx_code = d.tx_pos++;
 	}
-	if (!d.en[ch]) {
-		LOGE("LsdSend: Channel %d not enabled.", ch);
-		return 0;
+}
+
+/************************************************************************//**
+ * Appends data to the frame being sent, encoding it when using COBS. Must be
+ * called with the TX mutex held.
+ *
+ * \param[in] data Data to append.
+ * \param[in] len  Length of data.
+ ****************************************************************************/
+static void LsdTxPutRaw(const uint8_t *data, int len) {
+	if (d.opts & LSD_OPT_COBS) {
+		LsdCobsPut(data, len);
+	} else {
+		memcpy(d.tx_buf + d.tx_pos, data, len);
+		d.tx_pos += len;
 	}
+}
 
-	LOGD("sending %d bytes", len);
-	scratch[0] = LSD_STX_ETX;
-	scratch[1] = (ch<<4) | (len>>8);
-	scratch[2] = len & 0xFF;
-	// Send STX, channel and length
-	uart_write_bytes(LSD_UART, scratch, sizeof(scratch));
-	// Send data payload
-	uart_write_bytes(LSD_UART, (char*)data, len);
-	// Send ETX
-	uart_write_bytes(LSD_UART, scratch, 1);
+/************************************************************************//**
+ * Writes data to the UART, accounting the time blocked in the statistics.
+ *
+ * \param[in] data Data to write.
+ * \param[in] len  Length of data.
+ ****************************************************************************/
+static void LsdUartWrite(const uint8_t *data, uint16_t len) {
+	int64_t start = esp_timer_get_time();
+	uint16_t room;
 
-	return len;
+	while (len) {
+		room = UART_FIFO_LEN - LSD_UART_REG.status.txfifo_cnt;
+		if (!room) {
+			// Sleep until the FIFO drains below the threshold
+			taskENTER_CRITICAL();
+			LSD_UART_REG.int_clr.val = UART_TXFIFO_EMPTY_INT_ST_M;
+			LSD_UART_REG.int_ena.val |= UART_TXFIFO_EMPTY_INT_ENA_M;
+			taskEXIT_CRITICAL();
+			xSemaphoreTake(d.tx_fifo_sem, portMAX_DELAY);
+			continue;
+		}
+		room = MIN(room, len);
+		len -= room;
+		while (room--) {
+			LSD_UART_REG.fifo.rw_byte = *data++;
+		}
+	}
+	d.stats.tx_write_us += esp_timer_get_time() - start;
 }
 
 /************************************************************************//**
- * Starts sending data through a previously enabled channel. Once started,
- * you can send more additional data inside of the frame by issuing as
- * many LsdSplitNext() calls as needed, and end the frame by calling
- * LsdSplitEnd().
+ * Waits until the data written to the UART has been sent.
  *
- * \param[in] data  Buffer to send.
- * \param[in] len   Length of the data buffer to send.
- * \param[in] total Total length of the data to send using a split frame.
- * \param[in] ch    Channel number to use for sending.
+ * \param[in] wait Maximum time to wait.
+ ****************************************************************************/
+static void LsdUartTxDone(TickType_t wait) {
+	TickType_t start = xTaskGetTickCount();
+
+	while (LSD_UART_REG.status.txfifo_cnt &&
+			(xTaskGetTickCount() - start) < wait) {
+		vTaskDelay(1);
+	}
+	// Let the last character leave the shift register
+	vTaskDelay(1);
+}
+
+/************************************************************************//**
+ * Writes to the UART the part of the frame being sent that is complete,
+ * making room in the transmit buffer. When using COBS, the block being
+ * encoded is kept, since its code byte is not yet known. Must be called
+ * with the TX mutex held.
+ ****************************************************************************/
+static void LsdTxFlush(void) {
+	uint16_t done = (d.opts & LSD_OPT_COBS) ? d.tx_code : d.tx_pos;
+
+	LsdUartWrite(d.tx_buf, done);
+	memmove(d.tx_buf, d.tx_buf + done, d.tx_pos - done);
+	d.tx_pos -= done;
+	d.tx_code -= done;
+}
+
+/************************************************************************//**
+ * Appends data to the frame being sent, encoding it when using COBS. If the
+ * rest of the frame does not fit in the transmit buffer (only possible for
+ * frames using the extended header), data is appended in pieces, flushing
+ * the buffer as needed. Must be called with the TX mutex held.
  *
- * \return -1 if there was an error, or the number of characterse sent
- * 		   otherwise.
+ * \param[in] data Data to append.
+ * \param[in] len  Length of data.
  ****************************************************************************/
-int LsdSplitStart(uint8_t *data, uint16_t len,
-		              uint16_t total, uint8_t ch) {
-	char scratch[3];
+static void LsdTxPut(const uint8_t *data, int len) {
+	// Worst case length of the remaining frame, including CRC trailer,
+	// COBS overhead and ETX/delimiter
+	uint32_t left = len + d.tx_left + 2;
+	int n;
 
-	if (total > MW_MSG_MAX_BUFLEN || ch >= LSD_MAX_CH) return -1;
-	if (!d.en[ch]) return 0;
+	if ((d.tx_pos + left + left / (LSD_COBS_BLOCK_MAX - 1) + 2) <=
+			LSD_TX_BUF_LEN) {
+		LsdTxPutRaw(data, len);
+		return;
+	}
+	while (len) {
+		n = MIN(len, LSD_COBS_BLOCK_MAX - 1);
+		if ((LSD_TX_BUF_LEN - d.tx_pos) < (n + 2)) {
+			LsdTxFlush();
+		}
+		LsdTxPutRaw(data, n);
+		data += n;
+		len -= n;
+	}
+}
+
+/************************************************************************//**
+ * Starts the frame being sent, by appending the header to the transmit
+ * buffer. Must be called with the TX mutex held.
+ *
+ * \param[in] ch  Channel number.
+ * \param[in] len Length of the frame payload.
+ * \param[in] seq Sequence number, or -1 if frame is not sequenced.
+ ****************************************************************************/
+static void LsdTxStart(uint8_t ch, uint16_t len, int seq) {
+	uint8_t hdr[4];
+	int hdr_len = d.hdr_len;
 
-	scratch[0] = LSD_STX_ETX;
-	scratch[1] = (ch<<4) | (total>>8);
-	scratch[2] = total & 0xFF;
-	// Send STX, channel and length
-	LOGD("sending header");
-	uart_write_bytes(LSD_UART, scratch, sizeof(scratch));
-	// Send data payload
-	LOGD("sending %d bytes", len);
-	if (len) {
-		uart_write_bytes(LSD_UART, (char*)data, len);
+	d.tx_left = len;
+	if (seq >= 0) {
+		hdr[hdr_len++] = seq;
+		len++;
 	}
-	return len;
+	if (d.opts & LSD_OPT_EXT_HDR) {
+		hdr[0] = ch;
+		hdr[1] = len>>8;
+	} else {
+		hdr[0] = (ch<<4) | (len>>8);
+	}
+	hdr[d.hdr_len - 1] = len & 0xFF;
+	d.tx_crc = LsdCrc16(LSD_CRC_INIT, hdr, hdr_len);
+	if (d.opts & LSD_OPT_COBS) {
+		d.tx_code = 0;
+		d.tx_pos = 1;
+	} else {
+		d.tx_buf[0] = LSD_STX_ETX;
+		d.tx_pos = 1;
+	}
+	LsdTxPut(hdr, hdr_len);
 }
 
 /************************************************************************//**
- * Appends (sends) additional data to a frame previously started by an
- * LsdSplitStart() call.
+ * Appends payload data to the frame being sent. Must be called with the TX
+ * mutex held.
  *
- * \param[in] data  Buffer to send.
- * \param[in] len   Length of the data buffer to send.
+ * \param[in] data Payload data.
+ * \param[in] len  Length of the payload data.
+ ****************************************************************************/
+static void LsdTxData(const uint8_t *data, uint16_t len) {
+	if (len > d.tx_left) {
+		LOGE("frame overflow, %" PRIu16 " bytes dropped",
+				len - d.tx_left);
+		len = d.tx_left;
+	}
+	if (!len) return;
+
+	d.tx_left -= len;
+
+	// Keep a copy for retransmission
+	if (d.tx_slot) {
+		memcpy(d.tx_slot->data + d.tx_slot->len, data, len);
+		d.tx_slot->len += len;
+	}
+	if (d.opts & LSD_OPT_CRC16) {
+		d.tx_crc = LsdCrc16(d.tx_crc, data, len);
+	}
+	LsdTxPut(data, len);
+}
+
+/************************************************************************//**
+ * Ends the frame being sent, by appending the CRC trailer (if enabled) and
+ * the ETX character (or the delimiter when using COBS). Then the complete
+ * frame (or the part not yet flushed, for frames longer than the transmit
+ * buffer) is sent using a single write. Must be called with the TX mutex
+ * held.
+ ****************************************************************************/
+static void LsdTxEnd(void) {
+	uint8_t crc[2];
+
+	if (d.tx_left) {
+		LOGE("frame underflow, %" PRIu16 " bytes missing", d.tx_left);
+	}
+	if (d.opts & LSD_OPT_CRC16) {
+		crc[0] = d.tx_crc>>8;
+		crc[1] = d.tx_crc & 0xFF;
+		LsdTxPut(crc, sizeof(crc));
+	}
+	if (d.opts & LSD_OPT_COBS) {
+		d.tx_buf[d.tx_code] = d.tx_pos - d.tx_code;
+		d.tx_buf[d.tx_pos++] = LSD_COBS_DELIM;
+	} else {
+		d.tx_buf[d.tx_pos++] = LSD_STX_ETX;
+	}
+	LsdUartWrite(d.tx_buf, d.tx_pos);
+}
+
+/************************************************************************//**
+ * Takes the transmitter to start sending a frame. When reliable mode is
+ * enabled, assigns the frame a sequence number. The transmit window must
+ * have room for the frame.
  *
- * \return -1 if there was an error, or the number of characterse sent
- * 		   otherwise.
+ * \param[in] ch  Channel number.
+ * \param[in] len Length of the frame payload.
  ****************************************************************************/
-int LsdSplitNext(uint8_t *data, uint16_t len) {
-	// send data
-	LOGD("Sending %d bytes", len);
-	uart_write_bytes(LSD_UART, (char*)data, len);
-	return len;
+static void LsdTxBegin(uint8_t ch, uint16_t len) {
+	int seq = -1;
+
+	xSemaphoreTake(d.tx_mutex, portMAX_DELAY);
+	if (d.opts & LSD_OPT_RELIABLE) {
+		seq = d.rel.nxt++;
+		d.tx_slot = &d.rel.slot[seq & (d.rel.win - 1)];
+		d.tx_slot->ch = ch;
+		d.tx_slot->len = 0;
+		d.tx_slot->acked = FALSE;
+	}
+	LsdTxStart(ch, len, seq);
 }
 
 /************************************************************************//**
- * Appends (sends) additional data to a frame previously started by an
- * LsdSplitStart() call, and finally ends the frame.
+ * Ends the frame being sent, and releases the transmitter.
+ ****************************************************************************/
+static void LsdTxFinish(void) {
+	LsdTxEnd();
+	if (d.tx_slot) {
+		d.tx_slot->sent = xTaskGetTickCount();
+		d.tx_slot = NULL;
+	}
+	xSemaphoreGive(d.tx_mutex);
+}
+
+/************************************************************************//**
+ * Queues a link control frame for sending. If the queue is full, the frame
+ * is dropped.
  *
- * \param[in] data  Buffer to send.
- * \param[in] len   Length of the data buffer to send.
+ * \param[in] data Link control frame payload.
+ * \param[in] len  Length of the payload.
+ ****************************************************************************/
+static void LsdLinkSend(const uint8_t *data, uint16_t len) {
+	struct lsd_link_req link;
+
+	link.len = len;
+	memcpy(link.data, data, len);
+	if (pdTRUE != xQueueSend(d.link_q, &link, 0)) {
+		LOGD("link queue full, frame dropped");
+		return;
+	}
+	xSemaphoreGive(d.tx_sem);
+}
+
+/************************************************************************//**
+ * Retransmits the frames in the transmit window that have not been
+ * acknowledged before the retransmit timeout.
+ ****************************************************************************/
+static void LsdRelTick(void) {
+	struct lsd_rel_slot *slot;
+	TickType_t now;
+	uint8_t seq;
+
+	xSemaphoreTake(d.tx_mutex, portMAX_DELAY);
+	now = xTaskGetTickCount();
+	for (seq = d.rel.una; seq != d.rel.nxt; seq++) {
+		slot = &d.rel.slot[seq & (d.rel.win - 1)];
+		if (slot->acked || (now - slot->sent) < d.rel.rto) {
+			continue;
+		}
+		LOGD("ch %" PRIu8 " retransmit seq %" PRIu8, slot->ch, seq);
+		LsdTxStart(slot->ch, slot->len, seq);
+		LsdTxData(slot->data, slot->len);
+		LsdTxEnd();
+		slot->sent = now;
+		// Fragments are accounted to their channel, super-frames are not
+		if ((slot->ch & ~LSD_FRAG_CH) < LSD_MAX_CH) {
+			d.stats.retx[slot->ch & ~LSD_FRAG_CH]++;
+		}
+	}
+	xSemaphoreGive(d.tx_mutex);
+}
+
+/************************************************************************//**
+ * Processes an acknowledgement received from the other end of the link.
  *
- * \return -1 if there was an error, or the number of characterse sent
- * 		   otherwise.
+ * \param[in] ack  Next sequence number expected by the other end.
+ * \param[in] sack Bitmap of frames following ack, received out of order.
  ****************************************************************************/
-int LsdSplitEnd(uint8_t *data, uint16_t len) {
-	char scratch = LSD_STX_ETX;
+static void LsdRelAckRecv(uint8_t ack, uint8_t sack) {
+	uint8_t in_flight;
+	uint8_t seq;
+	bool advance;
+
+	xSemaphoreTake(d.tx_mutex, portMAX_DELAY);
+	in_flight = d.rel.nxt - d.rel.una;
+	// Ignore stale acknowledgements
+	if ((uint8_t)(ack - d.rel.una) > in_flight) {
+		xSemaphoreGive(d.tx_mutex);
+		return;
+	}
+	advance = ack != d.rel.una;
+	d.rel.una = ack;
+	for (seq = ack + 1; sack; seq++, sack >>= 1) {
+		if ((sack & 1) && (uint8_t)(seq - ack) <
+				(uint8_t)(d.rel.nxt - ack)) {
+			d.rel.slot[seq & (d.rel.win - 1)].acked = TRUE;
+		}
+	}
+	xSemaphoreGive(d.tx_mutex);
+	// Wake up transmit task if waiting for room in the window
+	if (advance) {
+		xSemaphoreGive(d.tx_sem);
+	}
+}
 
-	// Send data
-	LOGD("Sending %d bytes", len);
-	uart_write_bytes(LSD_UART, (char*)data, len);
-	
-	// Send ETX
-	LOGD("Sending ETX");
-	uart_write_bytes(LSD_UART, &scratch, 1);
+/************************************************************************//**
+ * Sends an acknowledgement for the frames received in reliable mode.
+ ****************************************************************************/
+static void LsdRelAckSend(void) {
+	uint8_t ack[3];
+	int i;
 
-	return len;
+	ack[0] = LSD_LINK_ACK;
+	ack[1] = d.rel.rx_next;
+	ack[2] = 0;
+	for (i = 0; i < (LSD_REL_WIN_MAX - 1); i++) {
+		if (d.rel.held[(d.rel.rx_next + 1 + i) % LSD_REL_WIN_MAX]) {
+			ack[2] |= 1<<i;
+		}
+	}
+	LsdLinkSend(ack, sizeof(ack));
 }
 
 /************************************************************************//**
- * Frees the oldest receive buffer. This function must be called each time
- * a buffer is processed to allow receiving a new frame.
+ * Configures the reliable mode, allocating the transmit window. Must be
+ * called before enabling LSD_OPT_RELIABLE option. If the option is already
+ * enabled, the configuration is not changed.
+ *
+ * \param[inout] win    Window length in frames (rounded down to a power of
+ *                      two, 0 for default). Returns the one in use.
+ * \param[inout] rto_ms Retransmit timeout in milliseconds (0 for default).
+ *                      Returns the one in use.
  *
- * \warning Calling this function more times than buffers have been received,
- * will likely cause overruns!
+ * \return LSD_OK on success, LSD_ERROR if window could not be allocated.
  ****************************************************************************/
-void LsdRxBufFree(void) {
-	// Just increment the receiver semaphore count. Might cause problems
-	// if not properly used!
-	xSemaphoreGive(d.sem);
+int LsdRelCfg(uint8_t *win, uint16_t *rto_ms) {
+	uint8_t w = *win ? MIN(*win, LSD_REL_WIN_MAX) : LSD_REL_WIN_DEF;
+	uint16_t rto = *rto_ms ? *rto_ms : LSD_REL_RTO_MS_DEF;
+	struct lsd_rel_slot *slot;
+
+	if (d.opts & LSD_OPT_RELIABLE) {
+		goto out;
+	}
+	// Round down to a power of two
+	while (w & (w - 1)) {
+		w &= w - 1;
+	}
+	if (!d.rel.slot || w != d.rel.win) {
+		slot = malloc(w * sizeof(struct lsd_rel_slot));
+		if (!slot) {
+			LOGE("cannot allocate %" PRIu8 " frames window", w);
+			return LSD_ERROR;
+		}
+		free(d.rel.slot);
+		d.rel.slot = slot;
+		d.rel.win = w;
+	}
+	d.rel.rto = MAX(1, pdMS_TO_TICKS(rto));
+
+out:
+	*win = d.rel.win;
+	*rto_ms = d.rel.rto * portTICK_PERIOD_MS;
+	return LSD_OK;
 }
 
-// Macro to ease access to current reception buffer
-#define RXB 	d.rx[d.current]
-// Receive task
-void LsdRecvTsk(void *pvParameters) {
-	QueueHandle_t q = (QueueHandle_t)pvParameters;
-	MwFsmMsg m;
-	uint16_t pos = 0;
-	bool receiving;
-	uint8_t recv;
+/************************************************************************//**
+ * Configures the maximum payload length of the frames sent when using the
+ * extended header. Must be called before enabling LSD_OPT_EXT_HDR option.
+ *
+ * \param[in] max_len Maximum payload length the other end can receive (0
+ *                    for LSD_EXT_MAX_LEN).
+ *
+ * \return The maximum payload length in use.
+ ****************************************************************************/
+uint16_t LsdExtCfg(uint16_t max_len) {
+	if (!max_len || max_len > LSD_EXT_MAX_LEN) {
+		max_len = LSD_EXT_MAX_LEN;
+	}
+	// Shorter frames can always be sent
+	d.ext_max = MAX(max_len, MW_MSG_MAX_BUFLEN);
 
+	return d.ext_max;
+}
 
-	while (1) {
-		// Grab receive buffer semaphore
-		xSemaphoreTake(d.sem, portMAX_DELAY);
-		receiving = TRUE;
-		while (receiving) {
-			// Receive byte by byte
-			if (uart_read_bytes(LSD_UART, &recv, 1, portMAX_DELAY)) {
-				switch (d.rxs) {
-					case LSD_ST_IDLE:			// Do nothing!
-						break;
-	
-					case LSD_ST_STX_WAIT:		// Wait for STX to arrive
-						if (LSD_STX_ETX == recv) {
-							d.rxs = LSD_ST_CH_LENH_RECV;
-						}
-						break;
-	
-					case LSD_ST_CH_LENH_RECV:	// Receive CH and len high
-						// Check special case: if we receive STX and pos == 0,
-						// then this is the real STX (previous one was ETX from
-						// previous frame!).
-						if (!(LSD_STX_ETX == recv && 0 == pos)) {
-							RXB.ch = recv>>4;
-							RXB.len = (recv & 0x0F)<<8;
-							// Sanity check (not exceding number of channels)
-							if (RXB.ch >= LSD_MAX_CH) {
-								d.rxs = LSD_ST_STX_WAIT;
-								LOGE("invalid channel %" PRIu8, RXB.ch);
-							}
-							// Check channel is enabled
-							else if (d.en[RXB.ch]) {
-								d.rxs = LSD_ST_LEN_RECV;
-							}
-							else {
-								d.rxs = LSD_ST_STX_WAIT;
-								LOGE("Recv data on not enabled channel!");
-							}
-						}
-						break;
-	
-					case LSD_ST_LEN_RECV:		// Receive len low
-						RXB.len |= recv;
-						// Sanity check (not exceeding maximum buffer length)
-						if (RXB.len <= MW_MSG_MAX_BUFLEN) {
-							pos = 0;
-							d.rxs = LSD_ST_DATA_RECV;
-						} else {
-							LOGE("Recv length exceeds buffer length!");
-							d.rxs = LSD_ST_STX_WAIT;
-						}
-						break;
-	
-					case LSD_ST_DATA_RECV:		// Receive payload
-						RXB.data[pos++] = recv;
-						if (pos >= RXB.len) d.rxs = LSD_ST_ETX_RECV;
-						break;
-	
-					case LSD_ST_ETX_RECV:		// ETX should come here
-						if (LSD_STX_ETX == recv) {
-							// Send message to FSM and switch buffer
-							m.e = MW_EV_SER_RX;
-							m.d = d.rx + d.current;
-							d.current ^= 1;
-							// Set receiving to false, to grab a new buffer
-							receiving = FALSE;
-							xQueueSend(q, &m, portMAX_DELAY);
-						} else {
-						LOGE("Expecting ETX but not received!");
-						}
-						d.rxs = LSD_ST_STX_WAIT;
-						break;
-	
-					default:
-						// Code should never reach here!
-						break;
-				} // switch(d.rxs)
-			} // if (uart_read_bytes(...))
-		} // while(receiving)
-	} // while(1)
+/************************************************************************//**
+ * Checks if long frames sent through a channel are split in fragments.
+ *
+ * \param[in] ch Channel number.
+ *
+ * \return TRUE if frames are fragmented, FALSE otherwise.
+ ****************************************************************************/
+static bool LsdFragCh(uint8_t ch) {
+	return (d.opts & LSD_OPT_FRAG) && ch && ch < LSD_MAX_CH;
+}
+
+/************************************************************************//**
+ * Gets the maximum payload length of the frames that can be sent through a
+ * channel with the link options in use.
+ *
+ * \param[in] ch Channel number.
+ *
+ * \return Maximum payload length.
+ ****************************************************************************/
+uint16_t LsdMaxLen(uint8_t ch) {
+	uint16_t max = MW_MSG_MAX_BUFLEN;
+
+	// Reliable mode keeps frames for retransmission using fixed size slots,
+	// so long frames only fit if they are sent in fragments
+	if ((d.opts & LSD_OPT_EXT_HDR) && (!(d.opts & LSD_OPT_RELIABLE) ||
+				LsdFragCh(ch))) {
+		max = d.ext_max;
+	}
+	// Room for the compression flags
+	if (ch < LSD_MAX_CH && (d.comp & (1<<ch))) {
+		max--;
+	}
+	// Room for the payload padding
+	if (d.opts & LSD_OPT_ALIGN) {
+		max -= LSD_ALIGN - 1;
+	}
+
+	return max;
+}
+
+/************************************************************************//**
+ * Enables or disables compression of the frames sent through a channel.
+ * Channel 0 cannot be compressed. Compression must be changed while the
+ * channel is idle, usually before connecting the socket.
+ *
+ * \param[in] ch   Channel number.
+ * \param[in] comp LSD_COMP_LZ4 to enable compression, LSD_COMP_RAW to
+ *                 disable it.
+ *
+ * \return LSD_OK on success, LSD_ERROR if parameters are not valid or
+ *         compression buffers could not be allocated.
+ ****************************************************************************/
+int LsdChCompSet(uint8_t ch, uint8_t comp) {
+	if (!ch || ch >= LSD_MAX_CH || comp > LSD_COMP_LZ4) return LSD_ERROR;
+
+	if (!comp) {
+		d.comp &= ~(1<<ch);
+		return LSD_OK;
+	}
+	// Buffers are allocated on first use, and kept since the transmit
+	// task could be using them
+	if (!d.comp_table) {
+		d.comp_table = malloc(COMP_TABLE_LEN * sizeof(uint16_t));
+	}
+	if (!d.comp_buf) {
+		d.comp_buf = malloc(LSD_EXT_MAX_LEN);
+	}
+	if (!d.comp_table || !d.comp_buf) {
+		LOGE("cannot allocate compression buffers");
+		return LSD_ERROR;
+	}
+	d.comp |= 1<<ch;
+
+	return LSD_OK;
+}
+
+/************************************************************************//**
+ * Sets the link options. Options must be changed when both ends of the link
+ * are idle, usually at startup, before any socket is opened.
+ *
+ * \param[in] opts Requested options (LSD_OPT_* flags).
+ *
+ * \return The options set, that are the requested ones masked with the
+ *         ones supported.
+ ****************************************************************************/
+uint32_t LsdOptSet(uint32_t opts) {
+	uint8_t win = 0;
+	uint16_t rto = 0;
+
+	opts &= LSD_OPT_SUPPORTED;
+	// Allocate default window if not previously configured
+	if ((opts & LSD_OPT_RELIABLE) && !d.rel.slot &&
+			LsdRelCfg(&win, &rto) != LSD_OK) {
+		opts &= ~LSD_OPT_RELIABLE;
+	}
+	// Super-frame buffer is allocated on first use, and kept since the
+	// transmit task could be using it
+	if ((opts & LSD_OPT_SUPER) && !d.super &&
+			!(d.super = malloc(MW_MSG_MAX_BUFLEN))) {
+		LOGE("cannot allocate super-frame buffer");
+		opts &= ~LSD_OPT_SUPER;
+	}
+
+	xSemaphoreTake(d.tx_mutex, portMAX_DELAY);
+	if ((d.opts ^ opts) & LSD_OPT_RELIABLE) {
+		// Both ends restart sequence numbers (the receive task resets
+		// the ones it expects, see LsdRxOptApply())
+		d.rel.una = d.rel.nxt = 0;
+	}
+	if ((d.opts ^ opts) & LSD_OPT_CREDIT) {
+		// Both ends restart frame counts, no credit until granted
+		memset(d.tx_cnt, 0, sizeof(d.tx_cnt));
+		memset(d.tx_limit, 0, sizeof(d.tx_limit));
+		memset(d.rx_cnt, 0, sizeof(d.rx_cnt));
+	}
+	if ((d.opts ^ opts) & LSD_OPT_FRAG) {
+		memset(d.tx_frag_off, 0, sizeof(d.tx_frag_off));
+		memset(d.tx_frag_idx, 0, sizeof(d.tx_frag_idx));
+	}
+	// Reception state belongs to the receive task, that switches to the
+	// new options before parsing more data
+	taskENTER_CRITICAL();
+	d.rx_opts_new = opts;
+	d.rx_opts_pend = TRUE;
+	taskEXIT_CRITICAL();
+	d.opts = opts;
+	d.hdr_len = (opts & LSD_OPT_EXT_HDR) ? 3 : 2;
+	if (!(opts & LSD_OPT_RELIABLE) && d.rel.slot) {
+		free(d.rel.slot);
+		d.rel.slot = NULL;
+	}
+	xSemaphoreGive(d.tx_mutex);
+	// Wake up transmit task that could be waiting for room in the window
+	xSemaphoreGive(d.tx_sem);
+	// Grant initial credit
+	LsdCreditPend((1<<LSD_MAX_CH) - 1);
+	LOGI("link options: 0x%08" PRIX32, opts);
+
+	return opts;
+}
+
+/************************************************************************//**
+ * Wakes up a task waiting for a frame to be sent.
+ *
+ * \param[in] ctx Handle of the task to wake up.
+ ****************************************************************************/
+static void LsdTxWake(void *ctx) {
+	xTaskNotifyGive((TaskHandle_t)ctx);
+}
+
+/************************************************************************//**
+ * Queues a frame for sending, and wakes up the transmit task.
+ *
+ * \param[in] req  Frame to send.
+ * \param[in] ch   Channel number.
+ * \param[in] wait Maximum time to wait for room in the queue.
+ *
+ * \return LSD_OK on success, LSD_ERROR if the queue is full.
+ ****************************************************************************/
+static int LsdTxQueue(const struct lsd_tx_req *req, uint8_t ch,
+		TickType_t wait) {
+	if (pdTRUE != xQueueSend(d.tx_q[ch], req, wait)) {
+		return LSD_ERROR;
+	}
+	xSemaphoreGive(d.tx_sem);
+
+	return LSD_OK;
 }
 
+/************************************************************************//**
+ * Sends data through a previously enabled channel.
+ *
+ * \param[in] data Buffer to send.
+ * \param[in] len  Length of the buffer to send.
+ * \param[in] ch   Channel number to use for sending.
+ *
+ * \return -1 if there was an error, or the number of characterse sent
+ * 		   otherwise.
+ ****************************************************************************/
+int LsdSend(const uint8_t *data, uint16_t len, uint8_t ch) {
+	struct lsd_iov iov = {
+		.data = data,
+		.len = len
+	};
+
+	return LsdSendV(&iov, 1, ch);
+}
+
+/************************************************************************//**
+ * Sends data gathered from several buffers through a previously enabled
+ * channel, using a single frame. Waits until the frame has been sent.
+ *
+ * \param[in] iov    Buffers to send.
+ * \param[in] iovcnt Number of buffers in iov.
+ * \param[in] ch     Channel number to use for sending.
+ *
+ * \return -1 if there was an error, or the number of characterse sent
+ * 		   otherwise.
+ ****************************************************************************/
+int LsdSendV(const struct lsd_iov *iov, int iovcnt, uint8_t ch) {
+	struct lsd_tx_req req = {
+		.iov = iov,
+		.iovcnt = iovcnt,
+		.cb = LsdTxWake,
+		.ctx = xTaskGetCurrentTaskHandle()
+	};
+	uint32_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].len;
+	}
+	if (ch >= LSD_MAX_CH || len > LsdMaxLen(ch)) {
+		LOGE("Invalid length (%" PRIu32 ") or channel (%d).", len, ch);
+		return -1;
+	}
+	if (!d.en[ch]) {
+		LOGE("LsdSend: Channel %d not enabled.", ch);
+		return 0;
+	}
+
+	LOGD("sending %" PRIu32 " bytes", len);
+	req.len = len;
+	LsdTxQueue(&req, ch, portMAX_DELAY);
+	// Wait until transmit task is done with the buffers
+	ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+	return len;
+}
+
+/************************************************************************//**
+ * Queues data for sending through a previously enabled channel, without
+ * waiting. The buffer must not be modified until the callback is run.
+ *
+ * \param[in] data Buffer to send.
+ * \param[in] len  Length of the buffer to send.
+ * \param[in] ch   Channel number to use.
+ * \param[in] cb   Function to call when data is sent (can be NULL).
+ * \param[in] ctx  Context passed to cb.
+ *
+ * \return -1 if there was an error, 0 if queue is full (or channel not
+ *         enabled), or the number of characters queued otherwise.
+ ****************************************************************************/
+int LsdSendAsync(const uint8_t *data, uint16_t len, uint8_t ch,
+		lsd_tx_cb cb, void *ctx) {
+	struct lsd_tx_req req = {
+		.data = data,
+		.len = len,
+		.cb = cb,
+		.ctx = ctx
+	};
+
+	if (ch >= LSD_MAX_CH || len > LsdMaxLen(ch)) {
+		LOGE("Invalid length (%d) or channel (%d).", len, ch);
+		return -1;
+	}
+	if (!d.en[ch] || LsdTxQueue(&req, ch, 0) != LSD_OK) {
+		return 0;
+	}
+
+	return len;
+}
+
+/************************************************************************//**
+ * Checks if the other end has granted credit to send a frame through a
+ * channel, besides the frames already queued. Must be called from the
+ * transmit task, or taking into account the result can change.
+ *
+ * \param[in] ch     Channel number.
+ * \param[in] queued Frames already queued for the channel.
+ *
+ * \return TRUE if there is credit left for another frame, FALSE otherwise.
+ ****************************************************************************/
+static bool LsdTxCredit(uint8_t ch, UBaseType_t queued) {
+	if (!ch || !(d.opts & LSD_OPT_CREDIT)) {
+		return TRUE;
+	}
+
+	return (int8_t)(d.tx_limit[ch] - d.tx_cnt[ch]) > (int)queued;
+}
+
+/************************************************************************//**
+ * Checks if a frame sent through a channel can be sent without waiting
+ * for the other end to grant credit. Always TRUE if LSD_OPT_CREDIT is not
+ * enabled.
+ *
+ * \param[in] ch Channel number.
+ *
+ * \return TRUE if there is credit left for another frame, FALSE otherwise.
+ ****************************************************************************/
+bool LsdChReady(uint8_t ch) {
+	if (ch >= LSD_MAX_CH) return FALSE;
+
+	return LsdTxCredit(ch, uxQueueMessagesWaiting(d.tx_q[ch]));
+}
+
+/************************************************************************//**
+ * Sets the weight of a channel, used to share the link between channels
+ * other than the control one.
+ *
+ * \param[in] ch     Channel number.
+ * \param[in] weight Bytes that the channel can send on each round.
+ *
+ * \return LSD_OK on success, LSD_ERROR if parameters are not valid.
+ ****************************************************************************/
+int LsdChWeightSet(uint8_t ch, uint16_t weight) {
+	if (!ch || ch >= LSD_MAX_CH || weight < LSD_TX_WEIGHT_MIN) {
+		return LSD_ERROR;
+	}
+
+	d.tx_weight[ch] = weight;
+
+	return LSD_OK;
+}
+
+/************************************************************************//**
+ * Starts sending data through a previously enabled channel. Once started,
+ * you can send more additional data inside of the frame by issuing as
+ * many LsdSplitNext() calls as needed, and end the frame by calling
+ * LsdSplitEnd(). The frame is accumulated and sent when ended.
+ *
+ * \param[in] data  Buffer to send.
+ * \param[in] len   Length of the data buffer to send.
+ * \param[in] total Total length of the data to send using a split frame.
+ * \param[in] ch    Channel number to use for sending.
+ *
+ * \return -1 if there was an error, or the number of characterse sent
+ * 		   otherwise.
+ ****************************************************************************/
+int LsdSplitStart(uint8_t *data, uint16_t len,
+		              uint16_t total, uint8_t ch) {
+	if (ch >= LSD_MAX_CH || total > LsdMaxLen(ch)) return -1;
+	if (!d.en[ch]) return 0;
+
+	// Hold the split frame until LsdSplitEnd() is called
+	xSemaphoreTake(d.split_mutex, portMAX_DELAY);
+	// Buffer is allocated on first use, and kept for the next frames
+	if (!d.split && !(d.split = malloc(LSD_EXT_MAX_LEN))) {
+		LOGE("cannot allocate split frame buffer");
+		xSemaphoreGive(d.split_mutex);
+		return -1;
+	}
+	d.split_on = TRUE;
+	d.split_len = total;
+	d.split_pos = 0;
+	d.split_ch = ch;
+
+	return LsdSplitNext(data, len);
+}
+
+/************************************************************************//**
+ * Appends (sends) additional data to a frame previously started by an
+ * LsdSplitStart() call.
+ *
+ * \param[in] data  Buffer to send.
+ * \param[in] len   Length of the data buffer to send.
+ *
+ * \return -1 if there was an error, or the number of characterse sent
+ * 		   otherwise.
+ ****************************************************************************/
+int LsdSplitNext(uint8_t *data, uint16_t len) {
+	if (!d.split_on) return -1;
+
+	LOGD("Appending %d bytes", len);
+	len = MIN(len, d.split_len - d.split_pos);
+	memcpy(d.split + d.split_pos, data, len);
+	d.split_pos += len;
+
+	return len;
+}
+
+/************************************************************************//**
+ * Appends (sends) additional data to a frame previously started by an
+ * LsdSplitStart() call, and finally ends the frame.
+ *
+ * \param[in] data  Buffer to send.
+ * \param[in] len   Length of the data buffer to send.
+ *
+ * \return -1 if there was an error, or the number of characterse sent
+ * 		   otherwise.
+ ****************************************************************************/
+int LsdSplitEnd(uint8_t *data, uint16_t len) {
+	int sent;
+
+	if ((sent = LsdSplitNext(data, len)) < 0) return -1;
+
+	LOGD("Sending split frame");
+	LsdSend(d.split, d.split_pos, d.split_ch);
+	d.split_on = FALSE;
+	xSemaphoreGive(d.split_mutex);
+
+	return sent;
+}
+
+/************************************************************************//**
+ * Sends a link control frame.
+ *
+ * \param[in] data Link control frame payload.
+ * \param[in] len  Length of the payload.
+ ****************************************************************************/
+static void LsdLinkTx(const uint8_t *data, uint16_t len) {
+	xSemaphoreTake(d.tx_mutex, portMAX_DELAY);
+	LsdTxStart(LSD_LINK_CH, len, -1);
+	LsdTxData(data, len);
+	LsdTxEnd();
+	xSemaphoreGive(d.tx_mutex);
+}
+
+/************************************************************************//**
+ * Grants credit to the other end for one of the channels pending it. The
+ * limit granted allows filling the reception buffers budget of the channel.
+ *
+ * \return TRUE if credit was granted, FALSE if no channel is pending.
+ ****************************************************************************/
+static bool LsdCreditSend(void) {
+	uint8_t grant[3];
+	uint8_t ch;
+
+	taskENTER_CRITICAL();
+	for (ch = 1; ch < LSD_MAX_CH && !(d.credit_pend & (1<<ch)); ch++);
+	if (ch < LSD_MAX_CH) {
+		d.credit_pend &= ~(1<<ch);
+		grant[2] = d.rx_cnt[ch] +
+			MAX(0, (int)d.rx_max[ch] - d.rx_used[ch]);
+	}
+	taskEXIT_CRITICAL();
+	if (ch >= LSD_MAX_CH) {
+		return FALSE;
+	}
+
+	grant[0] = LSD_LINK_CREDIT;
+	grant[1] = ch;
+	LsdLinkTx(grant, sizeof(grant));
+	d.credit_tick = xTaskGetTickCount();
+
+	return TRUE;
+}
+
+/************************************************************************//**
+ * Checks if a queued frame is sent in fragments.
+ *
+ * \param[in] ch  Channel number.
+ * \param[in] req Frame to check.
+ *
+ * \return TRUE if the frame is fragmented, FALSE otherwise.
+ ****************************************************************************/
+static bool LsdTxFragmented(uint8_t ch, const struct lsd_tx_req *req) {
+	return req->len > LSD_FRAG_LEN && LsdFragCh(ch);
+}
+
+/************************************************************************//**
+ * Computes the payload bytes sent on the next transmission of a queued
+ * frame: the full frame, or its next fragment.
+ *
+ * \param[in] ch  Channel number.
+ * \param[in] req Queued frame.
+ *
+ * \return The payload bytes of the next transmission.
+ ****************************************************************************/
+static uint16_t LsdTxCost(uint8_t ch, const struct lsd_tx_req *req) {
+	if (LsdTxFragmented(ch, req)) {
+		return MIN(req->len - d.tx_frag_off[ch], LSD_FRAG_LEN);
+	}
+
+	return req->len;
+}
+
+/************************************************************************//**
+ * Moves deficit round robin scheduling to the next channel.
+ ****************************************************************************/
+static void LsdTxRrNext(void) {
+	d.tx_rr = d.tx_rr % (LSD_MAX_CH - 1) + 1;
+	d.tx_visit = FALSE;
+}
+
+/************************************************************************//**
+ * Selects the channel of the next frame to send. Channel 0 has strict
+ * priority, remaining channels are served using deficit round robin.
+ * Channels without credit are skipped.
+ *
+ * \return The channel with the frame to send, or -1 if there are no
+ *         frames queued.
+ ****************************************************************************/
+static int LsdTxPick(void) {
+	struct lsd_tx_req req;
+	UBaseType_t queued = 0;
+	uint8_t ch;
+
+	if (uxQueueMessagesWaiting(d.tx_q[0])) {
+		return 0;
+	}
+	for (ch = 1; ch < LSD_MAX_CH; ch++) {
+		if (LsdTxCredit(ch, 0)) {
+			queued += uxQueueMessagesWaiting(d.tx_q[ch]);
+		}
+	}
+	if (!queued) {
+		return -1;
+	}
+
+	while (1) {
+		ch = d.tx_rr;
+		if (!uxQueueMessagesWaiting(d.tx_q[ch]) || !LsdTxCredit(ch, 0)) {
+			d.tx_deficit[ch] = 0;
+			LsdTxRrNext();
+			continue;
+		}
+		if (!d.tx_visit) {
+			d.tx_deficit[ch] += d.tx_weight[ch];
+			d.tx_visit = TRUE;
+		}
+		xQueuePeek(d.tx_q[ch], &req, 0);
+		if (LsdTxCost(ch, &req) <= d.tx_deficit[ch]) {
+			d.tx_deficit[ch] -= LsdTxCost(ch, &req);
+			return ch;
+		}
+		LsdTxRrNext();
+	}
+}
+
+/************************************************************************//**
+ * Sends a part of the data of a gathered frame.
+ *
+ * \param[in] iov    Buffers of the frame.
+ * \param[in] iovcnt Number of buffers in iov.
+ * \param[in] off    Offset of the data to send.
+ * \param[in] len    Length of the data to send.
+ ****************************************************************************/
+static void LsdTxGather(const struct lsd_iov *iov, int iovcnt,
+		uint16_t off, uint16_t len) {
+	uint16_t n;
+	int i;
+
+	for (i = 0; i < iovcnt && len; i++) {
+		if (off >= iov[i].len) {
+			off -= iov[i].len;
+			continue;
+		}
+		n = MIN(iov[i].len - off, len);
+		LsdTxData(iov[i].data + off, n);
+		len -= n;
+		off = 0;
+	}
+}
+
+/************************************************************************//**
+ * Computes the padding needed for the payload of a frame to start aligned,
+ * when LSD_OPT_ALIGN is enabled.
+ *
+ * \param[in] prefix Length of the DATA field bytes before the payload,
+ *                   sequence number excluded.
+ *
+ * \return The padding length.
+ ****************************************************************************/
+static uint8_t LsdTxPadLen(uint8_t prefix) {
+	uint8_t lead = d.hdr_len + prefix;
+
+	if (!(d.opts & LSD_OPT_ALIGN)) {
+		return 0;
+	}
+	if (!(d.opts & LSD_OPT_COBS)) {
+		lead++;		// STX
+	}
+	if (d.opts & LSD_OPT_RELIABLE) {
+		lead++;		// SEQ
+	}
+
+	return -lead & (LSD_ALIGN - 1);
+}
+
+/************************************************************************//**
+ * Computes the padding needed for the payload of a super-frame sub-message
+ * to start aligned, when LSD_OPT_ALIGN is enabled.
+ *
+ * \param[in] pos Position of the sub-message in the super-frame.
+ *
+ * \return The padding length.
+ ****************************************************************************/
+static uint8_t LsdTxSubPad(uint16_t pos) {
+	if (!(d.opts & LSD_OPT_ALIGN)) {
+		return 0;
+	}
+
+	return -(pos + LSD_SUPER_SUB_HDR) & (LSD_ALIGN - 1);
+}
+
+/************************************************************************//**
+ * Sends a queued frame, or a fragment of it. If compression is enabled for
+ * the channel, the flags byte is added, and payload is compressed when it
+ * shrinks. Padding is added before the payload if LSD_OPT_ALIGN is enabled.
+ *
+ * \param[in] ch   Channel number.
+ * \param[in] req  Frame to send.
+ * \param[in] off  Offset of the data to send.
+ * \param[in] len  Length of the data to send.
+ * \param[in] frag FRAG byte of the fragment, or -1 if the frame is not
+ *                 fragmented.
+ ****************************************************************************/
+static void LsdTxFrame(uint8_t ch, const struct lsd_tx_req *req,
+		uint16_t off, uint16_t len, int frag) {
+	uint8_t flags = LSD_COMP_RAW;
+	const uint8_t *data = req->data;
+	bool comp = len && (d.comp & (1<<ch));
+	bool gather = req->iov && req->iovcnt > 1;
+	uint16_t raw = len;
+	uint8_t hdr[2];
+	uint8_t hdr_len = 0;
+	uint8_t pad;
+	int clen;
+
+	if (req->iov && 1 == req->iovcnt) {
+		data = req->iov[0].data;
+	}
+	if (off) {
+		data += off;
+	}
+	// Gathered frames are not compressed
+	if (comp && !gather) {
+		clen = comp_lz4(data, len, d.comp_buf, len - 1, d.comp_table);
+		if (clen > 0) {
+			flags = LSD_COMP_LZ4;
+			data = d.comp_buf;
+			len = clen;
+		}
+		d.stats.comp_in[ch] += raw;
+		d.stats.comp_out[ch] += len;
+	}
+
+	if (frag >= 0) {
+		hdr[hdr_len++] = frag;
+	}
+	if (comp) {
+		hdr[hdr_len++] = flags;
+	}
+	pad = LsdTxPadLen(hdr_len);
+	LsdTxBegin(frag >= 0 ? ch | LSD_FRAG_CH : ch, hdr_len + pad + len);
+	LsdTxData(hdr, hdr_len);
+	LsdTxData(lsd_pad, pad);
+	if (gather) {
+		LsdTxGather(req->iov, req->iovcnt, off, len);
+	} else {
+		LsdTxData(data, len);
+	}
+	LsdTxFinish();
+}
+
+/************************************************************************//**
+ * Sends the next fragment of a queued frame.
+ *
+ * \param[in] ch  Channel number.
+ * \param[in] req Frame to send.
+ *
+ * \return TRUE if the last fragment was sent, FALSE if fragments remain.
+ ****************************************************************************/
+static bool LsdTxFragment(uint8_t ch, const struct lsd_tx_req *req) {
+	uint16_t off = d.tx_frag_off[ch];
+	uint16_t len = LsdTxCost(ch, req);
+	bool last = off + len >= req->len;
+	uint8_t frag = d.tx_frag_idx[ch] & ~LSD_FRAG_LAST;
+
+	LsdTxFrame(ch, req, off, len, last ? frag | LSD_FRAG_LAST : frag);
+	d.stats.tx_frags[ch]++;
+	if (last) {
+		d.tx_frag_off[ch] = 0;
+		d.tx_frag_idx[ch] = 0;
+	} else {
+		d.tx_frag_off[ch] += len;
+		d.tx_frag_idx[ch]++;
+	}
+
+	return last;
+}
+
+/************************************************************************//**
+ * Takes the next frame from a channel queue, and accounts it as sent.
+ *
+ * \param[in]  ch  Channel number.
+ * \param[out] req Frame to send.
+ ****************************************************************************/
+static void LsdTxDequeue(uint8_t ch, struct lsd_tx_req *req) {
+	xQueueReceive(d.tx_q[ch], req, 0);
+	d.tx_cnt[ch]++;
+	d.stats.tx_frames[ch]++;
+	d.stats.tx_bytes[ch] += req->len;
+}
+
+/************************************************************************//**
+ * Checks if a queued frame can be packed into a super-frame.
+ *
+ * \param[in] ch  Channel number.
+ * \param[in] req Frame to check.
+ *
+ * \return TRUE if the frame can be packed, FALSE otherwise.
+ ****************************************************************************/
+static bool LsdTxPackable(uint8_t ch, const struct lsd_tx_req *req) {
+	return req->len <= LSD_SUPER_SUB_MAX && !(d.comp & (1<<ch));
+}
+
+/************************************************************************//**
+ * Appends a frame to the super-frame being packed.
+ *
+ * \param[in] ch  Channel number.
+ * \param[in] req Frame to append.
+ * \param[in] pos Position in the super-frame.
+ *
+ * \return The position in the super-frame after the frame.
+ ****************************************************************************/
+static uint16_t LsdTxPack(uint8_t ch, const struct lsd_tx_req *req,
+		uint16_t pos) {
+	uint8_t pad = LsdTxSubPad(pos);
+	int i;
+
+	d.super[pos++] = (ch<<4) | (req->len>>8);
+	d.super[pos++] = req->len & 0xFF;
+	memset(d.super + pos, 0, pad);
+	pos += pad;
+	if (req->iov) {
+		for (i = 0; i < req->iovcnt; i++) {
+			memcpy(d.super + pos, req->iov[i].data, req->iov[i].len);
+			pos += req->iov[i].len;
+		}
+	} else if (req->len) {
+		memcpy(d.super + pos, req->data, req->len);
+		pos += req->len;
+	}
+
+	return pos;
+}
+
+/************************************************************************//**
+ * Packs the small frames queued for sending into a super-frame, and sends
+ * it. Frames are taken in the order set by LsdTxPick(), until one of them
+ * cannot be packed or does not fit.
+ *
+ * \param[in] ch Channel of the first frame, as returned by LsdTxPick().
+ *
+ * \return TRUE if frames were sent, FALSE if the first frame cannot be
+ *         packed (and it is left in the queue).
+ ****************************************************************************/
+static bool LsdTxSuper(int ch) {
+	struct lsd_tx_req req;
+	struct lsd_tx_req frame = {0};
+	UBaseType_t queued = 0;
+	// Room left for the super-frame padding
+	uint16_t max = MW_MSG_MAX_BUFLEN - LsdTxPadLen(0);
+	uint16_t pos = 0;
+	uint8_t first = ch;
+	int msgs = 0;
+	int i;
+
+	for (i = 0; i < LSD_MAX_CH; i++) {
+		queued += uxQueueMessagesWaiting(d.tx_q[i]);
+	}
+	xQueuePeek(d.tx_q[ch], &req, 0);
+	if (queued < 2 || !LsdTxPackable(ch, &req)) {
+		return FALSE;
+	}
+
+	while (1) {
+		LsdTxDequeue(ch, &req);
+		pos = LsdTxPack(ch, &req, pos);
+		msgs++;
+		// Data has been copied, buffer can be released
+		if (req.cb) {
+			req.cb(req.ctx);
+		}
+		if ((ch = LsdTxPick()) < 0) {
+			break;
+		}
+		xQueuePeek(d.tx_q[ch], &req, 0);
+		if (!LsdTxPackable(ch, &req) || (pos + LSD_SUPER_SUB_HDR +
+					LsdTxSubPad(pos) + req.len) > max) {
+			// Frame is not sent now, return the deficit taken
+			if (ch) {
+				d.tx_deficit[ch] += LsdTxCost(ch, &req);
+			}
+			break;
+		}
+	}
+
+	if (1 == msgs) {
+		// Nothing else to pack, send it as a plain frame
+		frame.data = d.super + LSD_SUPER_SUB_HDR + LsdTxSubPad(0);
+		frame.len = pos - (frame.data - d.super);
+		LsdTxFrame(first, &frame, 0, frame.len, -1);
+	} else {
+		d.stats.super_frames++;
+		d.stats.super_msgs += msgs;
+		frame.data = d.super;
+		frame.len = pos;
+		LsdTxFrame(LSD_SUPER_CH, &frame, 0, frame.len, -1);
+	}
+
+	return TRUE;
+}
+
+/************************************************************************//**
+ * Sends the next queued frame. Link control frames are sent first, then
+ * data frames if there is room in the transmit window.
+ *
+ * \return TRUE if a frame was sent, FALSE if there is nothing to send.
+ ****************************************************************************/
+static bool LsdTxNext(void) {
+	struct lsd_link_req link;
+	struct lsd_tx_req req;
+	int ch;
+
+	if (pdTRUE == xQueueReceive(d.link_q, &link, 0)) {
+		LsdLinkTx(link.data, link.len);
+		return TRUE;
+	}
+	if (LsdCreditSend()) {
+		return TRUE;
+	}
+	if ((d.opts & LSD_OPT_RELIABLE) &&
+			(uint8_t)(d.rel.nxt - d.rel.una) >= d.rel.win) {
+		return FALSE;
+	}
+	if ((ch = LsdTxPick()) < 0) {
+		return FALSE;
+	}
+	if ((d.opts & LSD_OPT_SUPER) && LsdTxSuper(ch)) {
+		return TRUE;
+	}
+
+	xQueuePeek(d.tx_q[ch], &req, 0);
+	if (LsdTxFragmented(ch, &req)) {
+		if (!LsdTxFragment(ch, &req)) {
+			// Let other frames be sent before the next fragment
+			return TRUE;
+		}
+	} else {
+		LsdTxFrame(ch, &req, 0, req.len, -1);
+	}
+	LsdTxDequeue(ch, &req);
+	if (req.cb) {
+		req.cb(req.ctx);
+	}
+
+	return TRUE;
+}
+
+// Transmit task
+void LsdSendTsk(void *pvParameters) {
+	TickType_t wait;
+
+	UNUSED_PARAM(pvParameters);
+
+	while (1) {
+		// Wake up periodically to retransmit and grant credit again
+		if (d.opts & LSD_OPT_RELIABLE) {
+			wait = d.rel.rto;
+		} else if (d.opts & LSD_OPT_CREDIT) {
+			wait = pdMS_TO_TICKS(LSD_CREDIT_REFRESH_MS);
+		} else {
+			wait = portMAX_DELAY;
+		}
+		xSemaphoreTake(d.tx_sem, wait);
+		if (d.baud_revert) {
+			d.baud_revert = FALSE;
+			LsdBaudRevert();
+		}
+		if (d.opts & LSD_OPT_RELIABLE) {
+			LsdRelTick();
+		}
+		if ((xTaskGetTickCount() - d.credit_tick) >=
+				pdMS_TO_TICKS(LSD_CREDIT_REFRESH_MS)) {
+			LsdCreditPend((1<<LSD_MAX_CH) - 1);
+		}
+		while (LsdTxNext());
+	}
+}
+
+/************************************************************************//**
+ * Sets the maximum number of reception buffers a channel can hold
+ * simultaneously.
+ *
+ * \param[in] ch  Channel number.
+ * \param[in] max Maximum number of buffers the channel can hold.
+ *
+ * \return LSD_OK on success, LSD_ERROR if parameters are not valid.
+ ****************************************************************************/
+int LsdRxBudgetSet(uint8_t ch, uint8_t max) {
+	if (ch >= LSD_MAX_CH || !max || max > LSD_RX_BUFS) return LSD_ERROR;
+
+	d.rx_max[ch] = max;
+	LsdCreditPend(1<<ch);
+
+	return LSD_OK;
+}
+
+/************************************************************************//**
+ * Grabs a reception buffer from the pool for the specified channel,
+ * honoring the channel budget and the buffers reserved for the control
+ * channel.
+ *
+ * \param[in] ch Channel number.
+ *
+ * \return The reception buffer, or NULL if no buffer is available.
+ ****************************************************************************/
+static MwMsgBuf *LsdRxBufAlloc(uint8_t ch) {
+	MwMsgBuf *buf = NULL;
+	uint8_t rsv = ch ? LSD_RX_CTRL_RSV : 0;
+	uint8_t used;
+
+	taskENTER_CRITICAL();
+	// Other modules allocate leaving LSD_RX_BUFS buffers in the pool, so
+	// allocation can only fail if a buffer freed here is still referenced
+	if (d.rx_used[ch] < d.rx_max[ch] && d.rx_free > rsv &&
+			(buf = buf_alloc(0))) {
+		d.rx_owner[buf_idx(buf)] = ch + 1;
+		buf->ch = ch;
+		d.rx_used[ch]++;
+		d.rx_free--;
+		used = LSD_RX_BUFS - d.rx_free;
+		d.stats.rx_hwm = MAX(d.stats.rx_hwm, used);
+		d.stats.rx_ch_hwm[ch] = MAX(d.stats.rx_ch_hwm[ch],
+				d.rx_used[ch]);
+	}
+	taskEXIT_CRITICAL();
+
+	return buf;
+}
+
+/************************************************************************//**
+ * Frees a receive buffer. This function must be called each time a buffer
+ * is processed to allow receiving new frames. Buffers can be freed in any
+ * order.
+ *
+ * \param[in] buf Reception buffer to free.
+ ****************************************************************************/
+void LsdRxBufFree(MwMsgBuf *buf) {
+	int idx = buf_idx(buf);
+	uint8_t ch = 0;
+	bool owned = FALSE;
+
+	if (idx < 0) {
+		LOGE("freeing invalid buffer %p", buf);
+		return;
+	}
+
+	taskENTER_CRITICAL();
+	if (d.rx_owner[idx]) {
+		ch = d.rx_owner[idx] - 1;
+		d.rx_used[ch]--;
+		d.rx_owner[idx] = 0;
+		d.rx_free++;
+		owned = TRUE;
+	}
+	taskEXIT_CRITICAL();
+	if (!owned) {
+		LOGE("buffer %p already freed", buf);
+		return;
+	}
+	// Other holders could still have a reference
+	buf_unref(buf);
+	// Wake up receiver if waiting for a buffer
+	xSemaphoreGive(d.sem);
+	LsdCreditPend(1<<ch);
+}
+
+/************************************************************************//**
+ * Counts the link errors detected on all the channels.
+ *
+ * \return The number of link errors.
+ ****************************************************************************/
+static uint32_t LsdErrCount(void) {
+	uint32_t errs = 0;
+	int i;
+
+	for (i = 0; i < LSD_MAX_CH; i++) {
+		errs += d.stats.crc_err[i] + d.stats.resync[i];
+	}
+
+	return errs;
+}
+
+/************************************************************************//**
+ * Selects a baud rate to negotiate.
+ *
+ * \param[in] baud Requested baud rate, or 0 to select the highest one that
+ *                 has not failed probing.
+ *
+ * \return The selected baud rate, or 0 if not supported.
+ ****************************************************************************/
+uint32_t LsdBaudSelect(uint32_t baud) {
+	unsigned i;
+
+	for (i = 0; i < LSD_BAUD_RATES_NUM; i++) {
+		if (baud ? (baud == lsd_baud_rates[i]) :
+				!(d.baud_failed & (1<<i))) {
+			return lsd_baud_rates[i];
+		}
+	}
+
+	return 0;
+}
+
+/************************************************************************//**
+ * Switches to a new baud rate once pending data has been sent, and starts
+ * probing it. If LsdBaudCommit() is not called before LSD_BAUD_PROBE_MS
+ * milliseconds, the previous baud rate is restored.
+ *
+ * \param[in] baud Baud rate previously obtained with LsdBaudSelect().
+ ****************************************************************************/
+void LsdBaudProbe(uint32_t baud) {
+	// Hold the transmitter, so no frame starts before switching
+	xSemaphoreTake(d.tx_mutex, portMAX_DELAY);
+	LsdUartTxDone(portMAX_DELAY);
+	taskENTER_CRITICAL();
+	d.baud_prev = d.baud;
+	d.baud = baud;
+	d.baud_errs = LsdErrCount();
+	d.baud_probe = TRUE;
+	taskEXIT_CRITICAL();
+	uart_set_baudrate(LSD_UART, baud);
+	xSemaphoreGive(d.tx_mutex);
+	xTimerReset(d.baud_tim, portMAX_DELAY);
+	LOGI("probing %" PRIu32 " bps", baud);
+}
+
+/************************************************************************//**
+ * Ends probing the baud rate set with LsdBaudProbe().
+ *
+ * \return LSD_OK if the new baud rate can be kept, LSD_ERROR if too many
+ *         link errors were detected while probing (or probe timed out). On
+ *         error, LsdBaudRevert() must be called.
+ ****************************************************************************/
+int LsdBaudCommit(void) {
+	uint32_t errs;
+	bool probe;
+
+	xTimerStop(d.baud_tim, portMAX_DELAY);
+	taskENTER_CRITICAL();
+	probe = d.baud_probe;
+	errs = LsdErrCount() - d.baud_errs;
+	if (probe && errs <= LSD_BAUD_ERR_MAX) {
+		d.baud_probe = FALSE;
+	}
+	taskEXIT_CRITICAL();
+
+	if (!probe) {
+		LOGE("no baud rate being probed");
+		return LSD_ERROR;
+	}
+	if (errs > LSD_BAUD_ERR_MAX) {
+		LOGE("%" PRIu32 " errors at %" PRIu32 " bps", errs, d.baud);
+		return LSD_ERROR;
+	}
+	LOGI("using %" PRIu32 " bps", d.baud);
+
+	return LSD_OK;
+}
+
+/************************************************************************//**
+ * Restores the baud rate in use before the last LsdBaudProbe() call, once
+ * pending data has been sent. The probed baud rate is flagged as failed.
+ ****************************************************************************/
+void LsdBaudRevert(void) {
+	bool probe;
+	unsigned i;
+
+	taskENTER_CRITICAL();
+	probe = d.baud_probe;
+	d.baud_probe = FALSE;
+	taskEXIT_CRITICAL();
+	if (!probe) return;
+
+	for (i = 0; i < LSD_BAUD_RATES_NUM; i++) {
+		if (d.baud == lsd_baud_rates[i] && d.baud != LSD_UART_BR) {
+			d.baud_failed |= 1<<i;
+		}
+	}
+	xSemaphoreTake(d.tx_mutex, portMAX_DELAY);
+	LsdUartTxDone(pdMS_TO_TICKS(LSD_BAUD_PROBE_MS));
+	LOGE("%" PRIu32 " bps failed, back to %" PRIu32 " bps", d.baud,
+			d.baud_prev);
+	d.baud = d.baud_prev;
+	uart_set_baudrate(LSD_UART, d.baud);
+	xSemaphoreGive(d.tx_mutex);
+}
+
+// Baud rate probe timed out, fall back to previous rate. Reverting waits
+// for the UART, so it is left to the transmit task, not to block the timer
+// service task.
+static void LsdBaudTimeout(TimerHandle_t xTimer) {
+	UNUSED_PARAM(xTimer);
+
+	d.baud_revert = TRUE;
+	xSemaphoreGive(d.tx_sem);
+}
+
+/************************************************************************//**
+ * Gets the baud rate in use.
+ *
+ * \return The baud rate in use.
+ ****************************************************************************/
+uint32_t LsdBaudGet(void) {
+	return d.baud;
+}
+
+/************************************************************************//**
+ * Gets the link options in use.
+ *
+ * \return The link options in use (LSD_OPT_* flags).
+ ****************************************************************************/
+uint32_t LsdOptGet(void) {
+	return d.opts;
+}
+
+/************************************************************************//**
+ * Gets a copy of the link statistics. Counters are updated without locking,
+ * so reading them does not delay the link, but counters updated while the
+ * copy is in progress can be one event apart.
+ *
+ * \param[out] stats Link statistics.
+ ****************************************************************************/
+void LsdStatsGet(struct lsd_stats *stats) {
+	*stats = d.stats;
+}
+
+// Macro to ease access to current reception buffer
+#define RXB 	(*d.cur)
+
+/// Returns the state following payload reception
+#define LSD_ST_DATA_END()	((d.rx_opts & LSD_OPT_CRC16) ? \
+		LSD_ST_CRC_RECV : LSD_ST_ETX_RECV)
+
+/// Returns the state following header reception
+#define LSD_ST_HDR_END()	(d.rx_hdr ? LSD_ST_SEQ_RECV : \
+		d.rx_len ? LSD_ST_DATA_RECV : LSD_ST_DATA_END())
+
+/// Increments a per channel statistic for the frame being received
+#define LSD_STAT_INC(field)	do {				\
+	if (d.ch < LSD_MAX_CH) d.stats.field[d.ch]++;		\
+} while (0)
+
+/************************************************************************//**
+ * Drops the frame being received, and starts waiting for a new one.
+ ****************************************************************************/
+static void LsdRxDrop(void) {
+	if (d.cur) {
+		LsdRxBufFree(d.cur);
+		d.cur = NULL;
+	}
+	LSD_STAT_INC(resync);
+	d.rxs = LSD_ST_STX_WAIT;
+}
+
+/************************************************************************//**
+ * Sets the channel of the frame being received from the first header byte.
+ * When not using the extended header, this byte also holds the high bits
+ * of the length.
+ *
+ * \param[in] hdr First header byte.
+ ****************************************************************************/
+static void LsdRxChSet(uint8_t hdr) {
+	if (d.rx_opts & LSD_OPT_EXT_HDR) {
+		d.ch = hdr;
+		d.len = 0;
+	} else {
+		d.ch = hdr>>4;
+		d.len = hdr & 0x0F;
+	}
+}
+
+/************************************************************************//**
+ * Checks the channel of the frame being received is valid and enabled.
+ *
+ * \return TRUE if the channel is valid, FALSE if frame must be dropped.
+ ****************************************************************************/
+static bool LsdRxChCheck(void) {
+	// Link control frames are used by reliable and credit modes
+	if (LSD_LINK_CH == d.ch &&
+			(d.rx_opts & (LSD_OPT_RELIABLE | LSD_OPT_CREDIT))) {
+		return TRUE;
+	}
+	// Sanity check (not exceding number of channels)
+	if (d.ch >= LSD_MAX_CH) {
+		LOGE("invalid channel %" PRIu8, d.ch);
+		d.stats.inv_ch++;
+		return FALSE;
+	}
+	// Check channel is enabled
+	if (!d.en[d.ch]) {
+		d.stats.resync[d.ch]++;
+		d.stats.dis_ch[d.ch]++;
+		LOGE("Recv data on not enabled channel!");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/************************************************************************//**
+ * Checks the length of the frame being received, and grabs a reception
+ * buffer for it, waiting until the channel budget allows it. In reliable
+ * mode, the frame is discarded instead of waiting (it will be retransmitted
+ * later).
+ *
+ * \return TRUE if the frame can be received, FALSE if it must be dropped.
+ ****************************************************************************/
+static bool LsdRxBufGet(void) {
+	int64_t start;
+
+	d.cur = NULL;
+	d.rx_hdr = 0;
+	if (LSD_LINK_CH == d.ch) {
+		if (d.len > LSD_LINK_MAX_LEN) {
+			LOGE("link frame too long!");
+			return FALSE;
+		}
+		d.rx_data = d.link;
+		d.rx_len = d.len;
+		return TRUE;
+	}
+	if (d.rx_opts & LSD_OPT_RELIABLE) {
+		d.rx_hdr = 1;
+	}
+	// Sanity check (not exceeding maximum buffer length)
+	if (d.len > (MW_MSG_MAX_BUFLEN + d.rx_hdr) || d.len < d.rx_hdr) {
+		LOGE("Recv length exceeds buffer length!");
+		d.stats.resync[d.ch]++;
+		d.stats.oversize[d.ch]++;
+		return FALSE;
+	}
+	d.rx_len = d.len - d.rx_hdr;
+	if (d.rx_opts & LSD_OPT_RELIABLE) {
+		d.cur = LsdRxBufAlloc(d.ch);
+	} else {
+		// Wait until the channel budget allows grabbing a buffer
+		while (!(d.cur = LsdRxBufAlloc(d.ch))) {
+			start = esp_timer_get_time();
+			xSemaphoreTake(d.sem, portMAX_DELAY);
+			d.stats.rx_wait_us += esp_timer_get_time() - start;
+		}
+	}
+	if (d.cur) {
+		RXB.ch = d.ch;
+		RXB.len = d.rx_len;
+		d.rx_data = RXB.data;
+	} else {
+		LOGD("ch %" PRIu8 " no buffer, discarding frame", d.ch);
+		d.rx_data = NULL;
+	}
+
+	return TRUE;
+}
+
+/************************************************************************//**
+ * Waits until data is received, and gets the contiguous data available at
+ * the read position of the ring.
+ *
+ * \param[out] span Received data.
+ * \param[in]  wait Maximum time to wait for data.
+ *
+ * \return Length of the data (0 if nothing was received before timeout).
+ ****************************************************************************/
+static uint32_t LsdRxSpan(uint8_t **span, TickType_t wait) {
+	uint32_t len;
+
+	while (!(len = ring_read_span(&d.rx_ring, span))) {
+		if (pdTRUE != xSemaphoreTake(d.rx_sem, wait)) {
+			return 0;
+		}
+	}
+
+	return len;
+}
+
+/************************************************************************//**
+ * Releases parsed data from the ring. If reception was stopped because the
+ * ring was full, it is resumed.
+ *
+ * \param[in] len Length of the parsed data.
+ ****************************************************************************/
+static void LsdRxConsume(uint32_t len) {
+	ring_consume(&d.rx_ring, len);
+	// Checked with interrupts disabled, so the ISR cannot stop reception
+	// after the ring has been found to have room
+	taskENTER_CRITICAL();
+	if (d.rx_stopped && ring_free(&d.rx_ring) >= UART_FIFO_LEN) {
+		d.rx_stopped = FALSE;
+		LSD_UART_REG.int_ena.val |= LSD_UART_RX_INT;
+	}
+	taskEXIT_CRITICAL();
+}
+
+/************************************************************************//**
+ * Drops the COBS frame being received. Reception buffer is freed if it was
+ * already allocated.
+ *
+ * \param[in] delim TRUE if the frame delimiter has already been received.
+ ****************************************************************************/
+static void LsdRxCobsDrop(bool delim) {
+	if (d.pos >= d.rx_hdr_len) {
+		LsdRxDrop();
+	}
+	d.pos = 0;
+	d.cobs_zero = FALSE;
+	d.rxs = delim ? LSD_ST_COBS_CODE : LSD_ST_COBS_SKIP;
+}
+
+/************************************************************************//**
+ * Processes decoded COBS frame data: header is checked, payload is copied
+ * to the reception buffer and CRC trailer (if enabled) is stored.
+ *
+ * \param[in] data Decoded data.
+ * \param[in] len  Length of decoded data.
+ *
+ * \return TRUE on success, FALSE if the frame must be dropped.
+ ****************************************************************************/
+static bool LsdRxCobsPut(const uint8_t *data, int len) {
+	int n;
+
+	while (len) {
+		if (0 == d.pos) {
+			// Receive CH (and len high if not using extended header)
+			d.crc = LsdCrc16(LSD_CRC_INIT, data, 1);
+			LsdRxChSet(*data);
+			if (!LsdRxChCheck()) return FALSE;
+			n = 1;
+		} else if (d.pos < d.rx_hdr_len) {
+			// Receive len
+			d.crc = LsdCrc16(d.crc, data, 1);
+			d.len = (d.len<<8) | *data;
+			if ((d.pos + 1) == d.rx_hdr_len && !LsdRxBufGet()) {
+				return FALSE;
+			}
+			n = 1;
+		} else if (d.pos < (d.rx_hdr_len + d.rx_hdr)) {
+			// Receive sequence number
+			d.crc = LsdCrc16(d.crc, data, 1);
+			d.seq = *data;
+			n = 1;
+		} else if (d.pos < (d.rx_hdr_len + d.len)) {
+			// Receive payload
+			n = MIN(len, d.rx_hdr_len + d.len - d.pos);
+			if (d.rx_data) {
+				memcpy(d.rx_data + d.pos - d.rx_hdr_len -
+						d.rx_hdr, data, n);
+			}
+			if (d.rx_opts & LSD_OPT_CRC16) {
+				d.crc = LsdCrc16(d.crc, data, n);
+			}
+		} else if ((d.rx_opts & LSD_OPT_CRC16) &&
+				d.pos < (d.rx_hdr_len + d.len + 2)) {
+			// Receive CRC trailer
+			d.crc_recv = (d.crc_recv<<8) | *data;
+			n = 1;
+		} else {
+			LOGE("COBS frame too long!");
+			LSD_STAT_INC(bad_etx);
+			return FALSE;
+		}
+		d.pos += n;
+		data += n;
+		len -= n;
+	}
+
+	return TRUE;
+}
+
+/************************************************************************//**
+ * Ends the COBS frame being received, after the delimiter is found.
+ *
+ * \param[out] frame Set to TRUE if a complete frame has been received.
+ ****************************************************************************/
+static void LsdRxCobsEnd(bool *frame) {
+	uint16_t expected;
+
+	// Delimiters with no data in between are ignored
+	if (!d.pos) {
+		d.cobs_zero = FALSE;
+		return;
+	}
+	if (d.pos < d.rx_hdr_len) {
+		LOGE("COBS frame too short!");
+		LsdRxCobsDrop(TRUE);
+		return;
+	}
+	expected = d.rx_hdr_len + d.len +
+		((d.rx_opts & LSD_OPT_CRC16) ? 2 : 0);
+	if (d.pos != expected) {
+		LOGE("COBS frame length mismatch!");
+		LSD_STAT_INC(bad_etx);
+		LsdRxCobsDrop(TRUE);
+	} else if ((d.rx_opts & LSD_OPT_CRC16) && d.crc_recv != d.crc) {
+		LOGE("ch %" PRIu8 " CRC mismatch: %04" PRIX16 " != %04"
+				PRIX16, d.ch, d.crc_recv, d.crc);
+		LSD_STAT_INC(crc_err);
+		LsdRxCobsDrop(TRUE);
+	} else {
+		*frame = TRUE;
+		d.pos = 0;
+		d.cobs_zero = FALSE;
+		d.rxs = LSD_ST_COBS_CODE;
+	}
+}
+
+/************************************************************************//**
+ * Runs the COBS reception state machine over a span of received data.
+ * Decoded runs are processed in blocks. Parsing stops right after a
+ * complete frame has been received.
+ *
+ * \param[in]  data  Received data.
+ * \param[in]  len   Length of the received data.
+ * \param[out] frame Set to TRUE when a complete frame has been received.
+ *
+ * \return Number of bytes consumed from data.
+ ****************************************************************************/
+static int LsdRxParseCobs(const uint8_t *data, int len, bool *frame) {
+	static const uint8_t zero = 0;
+	const uint8_t *delim;
+	int i = 0;
+	int n;
+
+	while (i < len && !*frame) {
+		switch (d.rxs) {
+			case LSD_ST_COBS_SKIP:		// Wait for delimiter
+				delim = memchr(data + i, LSD_COBS_DELIM, len - i);
+				if (delim) {
+					i = delim - data + 1;
+					d.rxs = LSD_ST_COBS_CODE;
+				} else {
+					i = len;
+				}
+				break;
+
+			case LSD_ST_COBS_CODE:		// Receive block code
+				if (LSD_COBS_DELIM == data[i]) {
+					i++;
+					LsdRxCobsEnd(frame);
+					break;
+				}
+				// Zero implied by previous block is not known to
+				// be data until another block follows
+				if (d.cobs_zero && !LsdRxCobsPut(&zero, 1)) {
+					LsdRxCobsDrop(FALSE);
+					break;
+				}
+				d.cobs_zero = data[i] < LSD_COBS_BLOCK_MAX;
+				d.cobs_left = data[i++] - 1;
+				if (d.cobs_left) {
+					d.rxs = LSD_ST_COBS_RUN;
+				}
+				break;
+
+			case LSD_ST_COBS_RUN:		// Receive block data
+				n = MIN(len - i, d.cobs_left);
+				delim = memchr(data + i, LSD_COBS_DELIM, n);
+				if (delim) {
+					// Truncated frame, next one starts here
+					LOGE("COBS block truncated!");
+					i = delim - data + 1;
+					LsdRxCobsDrop(TRUE);
+					break;
+				}
+				if (!LsdRxCobsPut(data + i, n)) {
+					i += n;
+					LsdRxCobsDrop(FALSE);
+					break;
+				}
+				i += n;
+				d.cobs_left -= n;
+				if (!d.cobs_left) {
+					d.rxs = LSD_ST_COBS_CODE;
+				}
+				break;
+
+			default:
+				// Code should never reach here!
+				i = len;
+				break;
+		} // switch(d.rxs)
+	}
+
+	return i;
+}
+
+/************************************************************************//**
+ * Runs the reception state machine over a span of received data. Payload
+ * bytes are copied to the current reception buffer in blocks. Parsing stops
+ * right after a complete frame has been received.
+ *
+ * \param[in]  data  Received data.
+ * \param[in]  len   Length of the received data.
+ * \param[out] frame Set to TRUE when a complete frame has been received.
+ *
+ * \return Number of bytes consumed from data.
+ ****************************************************************************/
+static int LsdRxParse(const uint8_t *data, int len, bool *frame) {
+	const uint8_t *stx;
+	int i = 0;
+	int n;
+
+	if (d.rx_opts & LSD_OPT_COBS) {
+		return LsdRxParseCobs(data, len, frame);
+	}
+
+	while (i < len && !*frame) {
+		switch (d.rxs) {
+			case LSD_ST_IDLE:			// Do nothing!
+				i = len;
+				break;
+
+			case LSD_ST_STX_WAIT:		// Wait for STX to arrive
+				stx = memchr(data + i, LSD_STX_ETX, len - i);
+				if (stx) {
+					i = stx - data + 1;
+					d.rxs = LSD_ST_CH_LENH_RECV;
+				} else {
+					i = len;
+				}
+				break;
+
+			case LSD_ST_CH_LENH_RECV:	// Receive CH and len high
+				// Check special case: if we receive STX here, then
+				// this is the real STX (previous one was ETX from
+				// previous frame!).
+				if (LSD_STX_ETX == data[i]) {
+					i++;
+					break;
+				}
+				d.crc = LsdCrc16(LSD_CRC_INIT, data + i, 1);
+				LsdRxChSet(data[i++]);
+				if (!LsdRxChCheck()) {
+					d.rxs = LSD_ST_STX_WAIT;
+				} else if (d.rx_opts & LSD_OPT_EXT_HDR) {
+					d.rxs = LSD_ST_LENH_RECV;
+				} else {
+					d.rxs = LSD_ST_LEN_RECV;
+				}
+				break;
+
+			case LSD_ST_LENH_RECV:		// Receive len high
+				d.crc = LsdCrc16(d.crc, data + i, 1);
+				d.len = data[i++];
+				d.rxs = LSD_ST_LEN_RECV;
+				break;
+
+			case LSD_ST_LEN_RECV:		// Receive len low
+				d.crc = LsdCrc16(d.crc, data + i, 1);
+				d.len = (d.len<<8) | data[i++];
+				if (!LsdRxBufGet()) {
+					d.rxs = LSD_ST_STX_WAIT;
+					break;
+				}
+				d.pos = 0;
+				d.rxs = LSD_ST_HDR_END();
+				break;
+
+			case LSD_ST_SEQ_RECV:		// Receive sequence number
+				d.crc = LsdCrc16(d.crc, data + i, 1);
+				d.seq = data[i++];
+				d.rxs = d.rx_len ? LSD_ST_DATA_RECV :
+					LSD_ST_DATA_END();
+				break;
+
+			case LSD_ST_DATA_RECV:		// Receive payload
+				n = MIN(len - i, d.rx_len - d.pos);
+				if (d.rx_data) {
+					memcpy(d.rx_data + d.pos, data + i, n);
+				}
+				if (d.rx_opts & LSD_OPT_CRC16) {
+					d.crc = LsdCrc16(d.crc, data + i, n);
+				}
+				d.pos += n;
+				i += n;
+				if (d.pos >= d.rx_len) {
+					d.pos = 0;
+					d.rxs = LSD_ST_DATA_END();
+				}
+				break;
+
+			case LSD_ST_CRC_RECV:		// Receive CRC trailer
+				d.crc_recv = (d.crc_recv<<8) | data[i++];
+				if (++d.pos < 2) break;
+				if (d.crc_recv == d.crc) {
+					d.rxs = LSD_ST_ETX_RECV;
+				} else {
+					LOGE("ch %" PRIu8 " CRC mismatch: %04"
+							PRIX16 " != %04" PRIX16,
+							d.ch, d.crc_recv, d.crc);
+					LSD_STAT_INC(crc_err);
+					LsdRxDrop();
+				}
+				break;
+
+			case LSD_ST_ETX_RECV:		// ETX should come here
+				if (LSD_STX_ETX == data[i++]) {
+					*frame = TRUE;
+					d.rxs = LSD_ST_STX_WAIT;
+				} else {
+					LOGE("Expecting ETX but not received!");
+					LSD_STAT_INC(bad_etx);
+					LsdRxDrop();
+				}
+				break;
+
+			default:
+				// Code should never reach here!
+				i = len;
+				break;
+		} // switch(d.rxs)
+	}
+
+	return i;
+}
+
+/************************************************************************//**
+ * Processes a link control frame.
+ ****************************************************************************/
+static void LsdLinkRecv(void) {
+	switch (d.rx_len ? d.link[0] : 0) {
+		case LSD_LINK_ACK:
+			if (d.rx_len >= 3) {
+				LsdRelAckRecv(d.link[1], d.link[2]);
+			}
+			break;
+
+		case LSD_LINK_CREDIT:
+			if (d.rx_len >= 3 && d.link[1] && d.link[1] < LSD_MAX_CH) {
+				d.tx_limit[d.link[1]] = d.link[2];
+				xSemaphoreGive(d.tx_sem);
+			}
+			break;
+
+		default:
+			LOGE("unsupported link frame");
+			break;
+	}
+}
+
+/************************************************************************//**
+ * Forwards a received frame to the FSM.
+ *
+ * \param[in] m Message to send to the FSM, with the frame buffer.
+ ****************************************************************************/
+static void LsdRxForward(MwFsmMsg *m) {
+	d.rx_cnt[((MwMsgBuf*)m->d)->ch]++;
+	mq_send(d.fsm_q, d.fsm_lane, m, portMAX_DELAY);
+}
+
+/************************************************************************//**
+ * Processes a frame received in reliable mode. Frames are forwarded to the
+ * FSM in sequence order, and acknowledged.
+ *
+ * \param[in] m Message to send to the FSM.
+ ****************************************************************************/
+static void LsdRelRecv(MwFsmMsg *m) {
+	uint8_t off = d.seq - d.rel.rx_next;
+	MwMsgBuf **held;
+
+	if (!d.cur) {
+		// Discarded, not acknowledged so it is retransmitted
+		return;
+	}
+	held = &d.rel.held[d.seq % LSD_REL_WIN_MAX];
+	if (off >= LSD_REL_WIN_MAX || *held) {
+		// Already received
+		LsdRxBufFree(d.cur);
+		d.stats.dup[d.ch]++;
+	} else if (off) {
+		// Out of order, keep it if it does not starve other frames
+		if (d.rx_free > LSD_RX_CTRL_RSV &&
+				d.rx_used[d.ch] < d.rx_max[d.ch]) {
+			*held = d.cur;
+		} else {
+			LsdRxBufFree(d.cur);
+		}
+	} else {
+		// In order, forward it along with the ones held after it
+		m->d = d.cur;
+		do {
+			LsdRxForward(m);
+			held = &d.rel.held[++d.rel.rx_next % LSD_REL_WIN_MAX];
+			m->d = *held;
+			*held = NULL;
+		} while (m->d);
+	}
+	LsdRelAckSend();
+}
+
+/************************************************************************//**
+ * Switches the receiver to the link options set by LsdOptSet(). On framing
+ * changes, the frame being received (if any) is dropped. When reliable
+ * mode is toggled, frames held out of order are dropped.
+ ****************************************************************************/
+static void LsdRxOptApply(void) {
+	uint32_t opts;
+	int i;
+
+	taskENTER_CRITICAL();
+	opts = d.rx_opts_new;
+	d.rx_opts_pend = FALSE;
+	taskEXIT_CRITICAL();
+
+	if ((d.rx_opts ^ opts) & LSD_OPT_RELIABLE) {
+		// Both ends restart sequence numbers
+		d.rel.rx_next = 0;
+		for (i = 0; i < LSD_REL_WIN_MAX; i++) {
+			if (d.rel.held[i]) {
+				LsdRxBufFree(d.rel.held[i]);
+				d.rel.held[i] = NULL;
+			}
+		}
+	}
+	// Framing change, restart reception state machine
+	if ((d.rx_opts ^ opts) & (LSD_OPT_COBS | LSD_OPT_EXT_HDR)) {
+		if (d.cur) {
+			LsdRxBufFree(d.cur);
+			d.cur = NULL;
+		}
+		d.rxs = (opts & LSD_OPT_COBS) ? LSD_ST_COBS_CODE :
+			LSD_ST_STX_WAIT;
+		d.pos = 0;
+		d.cobs_zero = FALSE;
+	}
+	d.rx_opts = opts;
+	d.rx_hdr_len = (opts & LSD_OPT_EXT_HDR) ? 3 : 2;
+}
+
+// Receive task
+void LsdRecvTsk(void *pvParameters) {
+	MwFsmMsg m;
+	uint8_t *span;
+	uint32_t len;
+	bool frame;
+
+	UNUSED_PARAM(pvParameters);
+	m.e = MW_EV_SER_RX;
+	while (1) {
+		frame = FALSE;
+		while (!frame) {
+			// Parse received data in place, straight from the ring
+			len = LsdRxSpan(&span, portMAX_DELAY);
+			if (d.rx_opts_pend) {
+				LsdRxOptApply();
+			}
+			LsdRxConsume(LsdRxParse(span, len, &frame));
+		}
+		if (LSD_LINK_CH == d.ch) {
+			LsdLinkRecv();
+			continue;
+		}
+		d.stats.rx_frames[d.ch]++;
+		d.stats.rx_bytes[d.ch] += d.rx_len;
+		if (d.rx_opts & LSD_OPT_RELIABLE) {
+			LsdRelRecv(&m);
+		} else {
+			// Send message to FSM. Buffer is freed once processed
+			m.d = d.cur;
+			LsdRxForward(&m);
+		}
+		// Buffer no longer owned by the receiver
+		d.cur = NULL;
+	} // while(1)
+}
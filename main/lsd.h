@@ -15,7 +15,10 @@
  * First initialize the module calling LsdInit().
  * Then enable at least one channel calling LsdEnable().
  *
- * To send data call LsdSend();
+ * To send data call LsdSend(). Frames are queued and sent by the transmit
+ * task: frames on channel 0 (the control channel) are sent first, and the
+ * remaining channels share the link according to their weights. To queue
+ * a frame without waiting for it to be sent, call LsdSendAsync().
  *
  * Data is automatically received and forwarded to the FSM using the queue
  * set during initialization.
@@ -29,6 +32,143 @@
  *   data length.
  * - LENL is the low 8 bits of the data length.
  * - DATA is the payload, of the previously specified length.
+ *
+ * When LSD_OPT_CRC16 option is negotiated, a CRC trailer is added between
+ * DATA and ETX:
+ *
+ * STX : CH-LENH : LENL : DATA : CRCH : CRCL : ETX
+ *
+ * - CRCH:CRCL is the big endian CRC-16/CCITT (polynomial 0x1021, initial
+ *   value 0xFFFF) computed over CH-LENH, LENL and DATA fields.
+ *
+ * When LSD_OPT_COBS option is negotiated, frames are instead encoded using
+ * Consistent Overhead Byte Stuffing, and delimited by a 0x00 byte:
+ *
+ * COBS(CH-LENH : LENL : DATA [: CRCH : CRCL]) : 0x00
+ *
+ * The encoded frame never contains 0x00, so the receiver resynchronizes on
+ * the next delimiter after an error. Encoding overhead is 1 byte per 254
+ * bytes (or fraction) of data, plus the delimiter.
+ *
+ * When LSD_OPT_RELIABLE option is negotiated, a sequence number is added
+ * at the start of the DATA field (and accounted in the frame length) of
+ * frames sent through channels 0 to LSD_MAX_CH - 1:
+ *
+ * SEQ : PAYLOAD
+ *
+ * Frames are acknowledged by sending link control frames through the
+ * LSD_LINK_CH channel. Link control frames carry no sequence number. ACK
+ * link control frames have the following DATA:
+ *
+ * LSD_LINK_ACK : ACK : SACK
+ *
+ * - ACK is the next sequence number expected (all the previous ones have
+ *   been received).
+ * - SACK is a bitmap of the frames following ACK that have been received
+ *   out of order: bit 0 for ACK + 1, bit 1 for ACK + 2, etc.
+ *
+ * Frames not acknowledged after the retransmit timeout are sent again.
+ *
+ * When LSD_OPT_CREDIT option is negotiated, each end limits the frames the
+ * other one can send on channels 1 to LSD_MAX_CH - 1, using CREDIT link
+ * control frames (channel 0 is not limited):
+ *
+ * LSD_LINK_CREDIT : CH : LIMIT
+ *
+ * - LIMIT is the number of frames (modulo 256) that can be sent through
+ *   CH since the option was enabled. Frames can be sent on CH while the
+ *   count of sent frames is behind LIMIT.
+ *
+ * Credit is granted again periodically, so a lost CREDIT frame does not
+ * stall the channel. Frames lost when LSD_OPT_RELIABLE is not enabled are
+ * never credited back.
+ *
+ * Frames sent by the module through channels with compression enabled
+ * (see LsdChCompSet()) carry a flags byte before the payload:
+ *
+ * FLAGS : PAYLOAD
+ *
+ * - FLAGS is LSD_COMP_LZ4 if PAYLOAD is compressed using LZ4 block format,
+ *   or LSD_COMP_RAW if PAYLOAD is not compressed (because it did not
+ *   shrink).
+ *
+ * Empty frames carry no flags byte.
+ *
+ * When LSD_OPT_EXT_HDR option is negotiated, the CH-LENH and LENL fields
+ * are replaced by an extended header, with a full byte for the channel
+ * number and a 16-bit data length:
+ *
+ * STX : CH : LENH : LENL : DATA : ETX
+ *
+ * Extended header can be combined with the other options. Frames sent
+ * by the module can then be up to the length negotiated with LsdExtCfg()
+ * (LSD_EXT_MAX_LEN at most). Frames received are still limited to
+ * LSD_MAX_LEN, and so are frames sent when LSD_OPT_RELIABLE is enabled
+ * (unless LSD_OPT_FRAG is also enabled).
+ *
+ * When LSD_OPT_SUPER option is negotiated, the module packs several small
+ * frames queued for sending (possibly for different channels) into a
+ * single super-frame, sent through the LSD_SUPER_CH channel. The DATA
+ * field of the super-frame is a sequence of sub-messages:
+ *
+ * CH-LENH : LENL : PAYLOAD [: CH-LENH : LENL : PAYLOAD ...]
+ *
+ * - CH-LENH and LENL have the same meaning as in the basic frame header.
+ * - PAYLOAD is the data of the frame (flags byte excluded: frames from
+ *   compressed channels are never packed).
+ *
+ * The super-frame gets a single sequence number in reliable mode, but
+ * each sub-message counts as a frame of its channel for credit. Only
+ * frames up to LSD_SUPER_SUB_MAX bytes are packed. Super-frames are only
+ * sent by the module, frames received on LSD_SUPER_CH are dropped. As
+ * LsdSend() waits until each frame is sent, consecutive frames sent by a
+ * task only share a super-frame if queued with LsdSendAsync().
+ *
+ * When LSD_OPT_FRAG option is negotiated, frames longer than LSD_FRAG_LEN
+ * sent by the module through channels 1 to LSD_MAX_CH - 1 are split in
+ * fragments, sent through channel CH | LSD_FRAG_CH. Frames from other
+ * channels (and link control frames) can be sent between two fragments,
+ * so a long frame does not delay the replies on the control channel. The
+ * DATA field of each fragment is:
+ *
+ * FRAG : PAYLOAD
+ *
+ * - FRAG bits 6 to 0 are the fragment index, starting from 0. Bit 7
+ *   (LSD_FRAG_LAST) is set on the last fragment of the frame.
+ * - PAYLOAD is the next piece of the frame data. On compressed channels,
+ *   each fragment carries its own flags byte, and is compressed on its
+ *   own.
+ *
+ * The receiver concatenates the fragments of each channel in order, and
+ * discards the frame if a fragment index is not the expected one. A
+ * fragmented frame counts as a single frame for credit, but each fragment
+ * gets its own sequence number in reliable mode. Fragments are only sent
+ * by the module.
+ *
+ * When LSD_OPT_ALIGN option is negotiated, frames sent by the module
+ * through channels 0 to LSD_MAX_CH - 1 (and fragments and super-frames)
+ * carry zero padding bytes before the payload:
+ *
+ * [SEQ :] [FRAG :] [FLAGS :] PAD : PAYLOAD
+ *
+ * - PAD is the number of 0x00 bytes (0 to LSD_ALIGN - 1) making the offset
+ *   of PAYLOAD from the start of the frame a multiple of LSD_ALIGN. The
+ *   frame starts at STX, or at the first decoded byte when using COBS.
+ *   The padding is accounted in the frame length and covered by the CRC.
+ *
+ * The receiver computes the padding length from the header length and the
+ * options in use, so it can copy payloads to aligned buffers without
+ * shifting them. The DATA field of a super-frame starts aligned, and each
+ * sub-message gets its own padding:
+ *
+ * CH-LENH : LENL : PAD : PAYLOAD
+ *
+ * - PAD makes the offset of PAYLOAD from the start of DATA a multiple of
+ *   LSD_ALIGN.
+ *
+ * UDP payloads received in reuse mode are forwarded with an 8 byte remote
+ * address prefix (IPv4, port and 2 zero padding bytes) instead of the 6
+ * byte one, so they stay aligned too.
  */
 
 #ifndef _LSD_H_
@@ -40,6 +180,9 @@
 #include <task.h>
 #include <queue.h>
 
+#include "mw-msg.h"
+#include "mq.h"
+
 /// LSD UART baud rate
 //#define LSD_UART_BR		(475625LU/2)
 //#define LSD_UART_BR		(477500/2)
@@ -48,6 +191,16 @@
 //#define LSD_UART_BR		750000
 //#define LSD_UART_BR		115200
 
+/// Baud rates that can be negotiated at runtime, in descending order. The
+/// last one must be LSD_UART_BR.
+#define LSD_BAUD_RATES		{4000000, 3000000, 2000000, LSD_UART_BR}
+
+/// Time to wait for a negotiated baud rate to be committed (milliseconds)
+#define LSD_BAUD_PROBE_MS	500
+
+/// Maximum link errors allowed while probing a negotiated baud rate
+#define LSD_BAUD_ERR_MAX	2
+
 /** \addtogroup lsd ReturnCodes OK/Error codes returned by several functions.
  *  \{ */
 /// Function completed successfully
@@ -61,26 +214,210 @@
 /// LSD frame overhead in bytes
 #define LSD_OVERHEAD		4
 
+/** \addtogroup lsd LsdOpt Link options that can be negotiated.
+ *  \{ */
+/// Frames carry a CRC-16 trailer
+#define LSD_OPT_CRC16		(1<<0)
+/// Frames are COBS encoded and 0x00 delimited
+#define LSD_OPT_COBS		(1<<1)
+/// Frames are sequenced, acknowledged and retransmitted if lost
+#define LSD_OPT_RELIABLE	(1<<2)
+/// Frames use the extended header (8-bit channel, 16-bit length)
+#define LSD_OPT_EXT_HDR		(1<<3)
+/// Frames on data channels are limited by credit granted by the receiver
+#define LSD_OPT_CREDIT		(1<<4)
+/// Small frames are packed into super-frames
+#define LSD_OPT_SUPER		(1<<5)
+/// Long frames are split in fragments that can interleave with others
+#define LSD_OPT_FRAG		(1<<6)
+/// Payloads are padded to start on LSD_ALIGN byte boundaries
+#define LSD_OPT_ALIGN		(1<<7)
+/** \} */
+
+/// Link options supported by this implementation
+#define LSD_OPT_SUPPORTED	(LSD_OPT_CRC16 | LSD_OPT_COBS | \
+		LSD_OPT_RELIABLE | LSD_OPT_EXT_HDR | LSD_OPT_CREDIT | \
+		LSD_OPT_SUPER | LSD_OPT_FRAG | LSD_OPT_ALIGN)
+
+/// Channel used for link control frames
+#define LSD_LINK_CH		0x0F
+
+/// Channel used for super-frames
+#define LSD_SUPER_CH		0x0E
+
+/// Maximum payload length of frames packed into super-frames
+#define LSD_SUPER_SUB_MAX	256
+
+/// Length of the super-frame sub-message header
+#define LSD_SUPER_SUB_HDR	2
+
+/// Flag added to the channel number of fragments
+#define LSD_FRAG_CH		0x08
+
+/// Maximum payload length of a fragment (FRAG byte excluded). Must not be
+/// less than LSD_SUPER_SUB_MAX
+#define LSD_FRAG_LEN		512
+
+/// FRAG byte flag set on the last fragment of a frame
+#define LSD_FRAG_LAST		0x80
+
+/// Payload alignment when LSD_OPT_ALIGN is enabled. Must be a power of 2
+#define LSD_ALIGN		4
+
+/// Maximum payload length of link control frames
+#define LSD_LINK_MAX_LEN	8
+
+/** \addtogroup lsd LsdLink Link control frame types.
+ *  \{ */
+/// Cumulative and selective acknowledgement
+#define LSD_LINK_ACK		0x01
+/// Channel credit grant
+#define LSD_LINK_CREDIT		0x02
+/** \} */
+
+/** \addtogroup lsd LsdComp Payload compression flags.
+ *  \{ */
+/// Payload is not compressed
+#define LSD_COMP_RAW		0x00
+/// Payload is compressed using LZ4 block format
+#define LSD_COMP_LZ4		0x01
+/** \} */
+
+/// Period to grant credit again, when LSD_OPT_CREDIT is enabled
+/// (milliseconds)
+#define LSD_CREDIT_REFRESH_MS	100
+
+/// Maximum reliable mode window length (frames)
+#define LSD_REL_WIN_MAX		8
+
+/// Default reliable mode window length (frames)
+#define LSD_REL_WIN_DEF		4
+
+/// Default reliable mode retransmit timeout (milliseconds)
+#define LSD_REL_RTO_MS_DEF	50
+
 /// Uart used for LSD
 #define LSD_UART			0
 
 /// Start/end of transmission character
 #define LSD_STX_ETX		0x7E
 
+/// Frame delimiter when using COBS framing
+#define LSD_COBS_DELIM		0x00
+
 /// Maximum number of available simultaneous channels
 #define LSD_MAX_CH			4
 
 /// Receive task priority
 #define LSD_RECV_PRIO		2
 
+/// Transmit task priority
+#define LSD_SEND_PRIO		2
+
+/// Frames that can be queued for sending on each channel
+#define LSD_TX_QUEUE_LEN	4
+
+/// Link control frames that can be queued for sending
+#define LSD_LINK_QUEUE_LEN	4
+
+/// Default channel weight (bytes sent on each round)
+#define LSD_TX_WEIGHT_DEF	MW_MSG_MAX_BUFLEN
+
+/// Minimum channel weight
+#define LSD_TX_WEIGHT_MIN	64
+
 /// Maximum data payload length
 #define LSD_MAX_LEN		 CONFIG_TCP_MSS
 
+/// Maximum data payload length of frames sent using the extended header
+#define LSD_EXT_MAX_LEN		4096
+
+/// Length of the ring receiving data from the UART (power of two)
+#define LSD_RX_RING_LEN		1024
+
+/// Maximum number of pool buffers held by the receiver. Other pool users
+/// must leave this many buffers free
+#define LSD_RX_BUFS		4
+
+/// Reception buffers reserved for the control channel (channel 0)
+#define LSD_RX_CTRL_RSV		1
+
+/************************************************************************//**
+ * Called by the transmit task once a frame queued with LsdSendAsync() has
+ * been sent, and its buffer can be reused.
+ *
+ * \param[in] ctx Context passed to LsdSendAsync().
+ ****************************************************************************/
+typedef void (*lsd_tx_cb)(void *ctx);
+
+/// Buffer to send, used to gather a frame from several buffers
+struct lsd_iov {
+	const void *data;	///< Buffer data
+	uint16_t len;		///< Buffer length
+};
+
+/// Link statistics
+struct lsd_stats {
+	/// Maximum number of reception buffers simultaneously in use
+	uint32_t rx_hwm;
+	/// Maximum number of reception buffers simultaneously in use by
+	/// each channel
+	uint32_t rx_ch_hwm[LSD_MAX_CH];
+	/// Frames dropped because of CRC mismatch on each channel
+	uint32_t crc_err[LSD_MAX_CH];
+	/// Frames dropped to resynchronize on each channel
+	uint32_t resync[LSD_MAX_CH];
+	/// Frames retransmitted on each channel (reliable mode)
+	uint32_t retx[LSD_MAX_CH];
+	/// Duplicated frames received on each channel (reliable mode)
+	uint32_t dup[LSD_MAX_CH];
+	/// Frames received on each channel
+	uint32_t rx_frames[LSD_MAX_CH];
+	/// Payload bytes received on each channel
+	uint32_t rx_bytes[LSD_MAX_CH];
+	/// Frames sent on each channel (not counting retransmissions)
+	uint32_t tx_frames[LSD_MAX_CH];
+	/// Payload bytes sent on each channel
+	uint32_t tx_bytes[LSD_MAX_CH];
+	/// Frames dropped on each channel because ETX (or COBS delimiter) was
+	/// not found where expected
+	uint32_t bad_etx[LSD_MAX_CH];
+	/// Frames dropped because of an invalid channel number
+	uint32_t inv_ch;
+	/// Frames dropped because channel was not enabled
+	uint32_t dis_ch[LSD_MAX_CH];
+	/// Frames dropped because they exceeded the maximum length
+	uint32_t oversize[LSD_MAX_CH];
+	/// Time the receive task was blocked waiting for a buffer
+	/// (microseconds, wraps around)
+	uint32_t rx_wait_us;
+	/// Time the transmit task was blocked writing to the UART
+	/// (microseconds, wraps around)
+	uint32_t tx_write_us;
+	/// Payload bytes before compression on each channel
+	uint32_t comp_in[LSD_MAX_CH];
+	/// Payload bytes after compression on each channel
+	uint32_t comp_out[LSD_MAX_CH];
+	/// Super-frames sent
+	uint32_t super_frames;
+	/// Frames sent packed into super-frames
+	uint32_t super_msgs;
+	/// Fragments sent on each channel
+	uint32_t tx_frags[LSD_MAX_CH];
+	/// UART RX FIFO overruns
+	uint32_t rx_ovf;
+	/// Times reception was stopped because the receive ring was full
+	uint32_t rx_stall;
+};
+
 /************************************************************************//**
  * Module initialization. Call this function before any other one in this
  * module.
+ *
+ * \param[in] q    Queue to forward received frames to the FSM.
+ * \param[in] lane Lane of q used to forward the frames.
  ****************************************************************************/
-void LsdInit(QueueHandle_t q);
+void LsdInit(struct mq *q, uint8_t lane);
 
 /************************************************************************//**
  * Enables a channel to start reception and be able to send data.
@@ -103,6 +440,114 @@ int LsdChEnable(uint8_t ch);
 int LsdChDisable(uint8_t ch);
 
 
+/************************************************************************//**
+ * Sets the link options. Options must be changed when both ends of the link
+ * are idle, usually at startup, before any socket is opened.
+ *
+ * \param[in] opts Requested options (LSD_OPT_* flags).
+ *
+ * \return The options set, that are the requested ones masked with the
+ *         ones supported.
+ ****************************************************************************/
+uint32_t LsdOptSet(uint32_t opts);
+
+/************************************************************************//**
+ * Configures the reliable mode, allocating the transmit window. Must be
+ * called before enabling LSD_OPT_RELIABLE option. If the option is already
+ * enabled, the configuration is not changed.
+ *
+ * \param[inout] win    Window length in frames (rounded down to a power of
+ *                      two, 0 for default). Returns the one in use.
+ * \param[inout] rto_ms Retransmit timeout in milliseconds (0 for default).
+ *                      Returns the one in use.
+ *
+ * \return LSD_OK on success, LSD_ERROR if window could not be allocated.
+ ****************************************************************************/
+int LsdRelCfg(uint8_t *win, uint16_t *rto_ms);
+
+/************************************************************************//**
+ * Configures the maximum payload length of the frames sent when using the
+ * extended header. Must be called before enabling LSD_OPT_EXT_HDR option.
+ *
+ * \param[in] max_len Maximum payload length the other end can receive (0
+ *                    for LSD_EXT_MAX_LEN).
+ *
+ * \return The maximum payload length in use.
+ ****************************************************************************/
+uint16_t LsdExtCfg(uint16_t max_len);
+
+/************************************************************************//**
+ * Gets the maximum payload length of the frames that can be sent through a
+ * channel with the link options in use.
+ *
+ * \param[in] ch Channel number.
+ *
+ * \return Maximum payload length.
+ ****************************************************************************/
+uint16_t LsdMaxLen(uint8_t ch);
+
+/************************************************************************//**
+ * Enables or disables compression of the frames sent through a channel.
+ * Channel 0 cannot be compressed. Compression must be changed while the
+ * channel is idle, usually before connecting the socket.
+ *
+ * \param[in] ch   Channel number.
+ * \param[in] comp LSD_COMP_LZ4 to enable compression, LSD_COMP_RAW to
+ *                 disable it.
+ *
+ * \return LSD_OK on success, LSD_ERROR if parameters are not valid or
+ *         compression buffers could not be allocated.
+ ****************************************************************************/
+int LsdChCompSet(uint8_t ch, uint8_t comp);
+
+/************************************************************************//**
+ * Selects a baud rate to negotiate.
+ *
+ * \param[in] baud Requested baud rate, or 0 to select the highest one that
+ *                 has not failed probing.
+ *
+ * \return The selected baud rate, or 0 if not supported.
+ ****************************************************************************/
+uint32_t LsdBaudSelect(uint32_t baud);
+
+/************************************************************************//**
+ * Switches to a new baud rate once pending data has been sent, and starts
+ * probing it. If LsdBaudCommit() is not called before LSD_BAUD_PROBE_MS
+ * milliseconds, the previous baud rate is restored.
+ *
+ * \param[in] baud Baud rate previously obtained with LsdBaudSelect().
+ ****************************************************************************/
+void LsdBaudProbe(uint32_t baud);
+
+/************************************************************************//**
+ * Ends probing the baud rate set with LsdBaudProbe().
+ *
+ * \return LSD_OK if the new baud rate can be kept, LSD_ERROR if too many
+ *         link errors were detected while probing (or probe timed out). On
+ *         error, LsdBaudRevert() must be called.
+ ****************************************************************************/
+int LsdBaudCommit(void);
+
+/************************************************************************//**
+ * Restores the baud rate in use before the last LsdBaudProbe() call, once
+ * pending data has been sent. The probed baud rate is flagged as failed.
+ ****************************************************************************/
+void LsdBaudRevert(void);
+
+/************************************************************************//**
+ * Gets the baud rate in use.
+ *
+ * \return The baud rate in use.
+ ****************************************************************************/
+uint32_t LsdBaudGet(void);
+
+/************************************************************************//**
+ * Gets the link options in use.
+ *
+ * \return The link options in use (LSD_OPT_* flags).
+ ****************************************************************************/
+uint32_t LsdOptGet(void);
+
 /************************************************************************//**
  * Sends data through a previously enabled channel.
  *
@@ -115,6 +560,57 @@ int LsdChDisable(uint8_t ch);
  ****************************************************************************/
 int LsdSend(const uint8_t *data, uint16_t len, uint8_t ch);
 
+/************************************************************************//**
+ * Queues data for sending through a previously enabled channel, without
+ * waiting. The buffer must not be modified until the callback is run.
+ *
+ * \param[in] data Buffer to send.
+ * \param[in] len  Length of the buffer to send.
+ * \param[in] ch   Channel number to use.
+ * \param[in] cb   Function to call when data is sent (can be NULL).
+ * \param[in] ctx  Context passed to cb.
+ *
+ * \return -1 if there was an error, 0 if queue is full (or channel not
+ *         enabled), or the number of characters queued otherwise.
+ ****************************************************************************/
+int LsdSendAsync(const uint8_t *data, uint16_t len, uint8_t ch,
+		lsd_tx_cb cb, void *ctx);
+
+/************************************************************************//**
+ * Checks if a frame sent through a channel can be sent without waiting
+ * for the other end to grant credit. Always TRUE if LSD_OPT_CREDIT is not
+ * enabled.
+ *
+ * \param[in] ch Channel number.
+ *
+ * \return TRUE if there is credit left for another frame, FALSE otherwise.
+ ****************************************************************************/
+bool LsdChReady(uint8_t ch);
+
+/************************************************************************//**
+ * Sets the weight of a channel, used to share the link between channels
+ * other than the control one.
+ *
+ * \param[in] ch     Channel number.
+ * \param[in] weight Bytes that the channel can send on each round.
+ *
+ * \return LSD_OK on success, LSD_ERROR if parameters are not valid.
+ ****************************************************************************/
+int LsdChWeightSet(uint8_t ch, uint16_t weight);
+
+/************************************************************************//**
+ * Sends data gathered from several buffers through a previously enabled
+ * channel, using a single frame.
+ *
+ * \param[in] iov    Buffers to send.
+ * \param[in] iovcnt Number of buffers in iov.
+ * \param[in] ch     Channel number to use for sending.
+ *
+ * \return -1 if there was an error, or the number of characterse sent
+ * 		   otherwise.
+ ****************************************************************************/
+int LsdSendV(const struct lsd_iov *iov, int iovcnt, uint8_t ch);
+
 /************************************************************************//**
  * Starts sending data through a previously enabled channel. Once started,
  * you can send more additional data inside of the frame by issuing as
@@ -157,13 +653,35 @@ int LsdSplitNext(uint8_t *data, uint16_t len);
 int LsdSplitEnd(uint8_t *data, uint16_t len);
 
 /************************************************************************//**
- * Frees the oldest receive buffer. This function must be called each time
- * a buffer is processed to allow receiving a new frame.
+ * Frees a receive buffer. This function must be called each time a buffer
+ * is processed to allow receiving new frames. Buffers can be freed in any
+ * order. Buffers come from the pool (see buf_pool.h), and holders taking
+ * an additional reference must drop it with buf_unref().
+ *
+ * \param[in] buf Reception buffer to free.
+ ****************************************************************************/
+void LsdRxBufFree(MwMsgBuf *buf);
+
+/************************************************************************//**
+ * Sets the maximum number of reception buffers a channel can hold
+ * simultaneously. Channels other than the control one can never use the
+ * LSD_RX_CTRL_RSV buffers reserved for the control channel.
+ *
+ * \param[in] ch  Channel number.
+ * \param[in] max Maximum number of buffers the channel can hold.
+ *
+ * \return LSD_OK on success, LSD_ERROR if parameters are not valid.
+ ****************************************************************************/
+int LsdRxBudgetSet(uint8_t ch, uint8_t max);
+
+/************************************************************************//**
+ * Gets a copy of the link statistics. Counters are updated without locking,
+ * so reading them does not delay the link, but counters updated while the
+ * copy is in progress can be one event apart.
  *
- * \warning Calling this function more times than buffers have been received,
- * will likely cause overruns!
+ * \param[out] stats Link statistics.
  ****************************************************************************/
-void LsdRxBufFree(void);
+void LsdStatsGet(struct lsd_stats *stats);
 
 #endif /*_LSD_H_*/
 /** \} */
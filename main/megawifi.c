@@ -7,8 +7,10 @@
 
 // Newlib
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 // FreeRTOS
 #include <freertos/FreeRTOS.h>
@@ -52,6 +54,8 @@
 #include "globals.h"
 #include "net_util.h"
 #include "lsd.h"
+#include "buf_pool.h"
+#include "worker.h"
 #include "util.h"
 #include "led.h"
 #include "http.h"
@@ -66,6 +70,14 @@
 /// Sleep timer period in ms
 #define MW_SLEEP_TIMER_MS	30000
 
+/// Length of the remote address (IPv4 and port) preceding UDP data in
+/// reuse mode
+#define MW_UDP_ADDR_LEN		6
+
+/// Length of the remote address preceding received UDP data in reuse mode,
+/// padded to keep data aligned when LSD_OPT_ALIGN is enabled
+#define MW_UDP_ADDR_ALIGN_LEN	8
+
 /// Default PHY protocol bitmap
 #define MW_PHY_PROTO_DEF	WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | \
 	WIFI_PROTOCOL_11N
@@ -78,65 +90,65 @@ typedef enum {
 	MW_FD_REM			///< Remove socket from the FD set
 } MwFdOps;
 
-/// Commands allowed while in IDLE state
-const static uint32_t idleCmdMask[2] = {
-	(1<<MW_CMD_VERSION)               | (1<<MW_CMD_ECHO)                |
-	(1<<MW_CMD_AP_SCAN)               | (1<<MW_CMD_AP_CFG)              |
-	(1<<MW_CMD_AP_CFG_GET)            | (1<<MW_CMD_IP_CFG)              |
-	(1<<MW_CMD_IP_CFG_GET)            | (1<<MW_CMD_DEF_AP_CFG)          |
-	(1<<MW_CMD_DEF_AP_CFG_GET)        | (1<<MW_CMD_AP_JOIN)             |
-	(1<<MW_CMD_SNTP_CFG)              | (1<<MW_CMD_SNTP_CFG_GET)        |
-	(1<<MW_CMD_DATETIME)              | (1<<MW_CMD_DT_SET)              |
-	(1<<MW_CMD_FLASH_WRITE)           | (1<<MW_CMD_FLASH_READ)          |
-	(1<<MW_CMD_FLASH_ERASE)           | (1<<MW_CMD_FLASH_ID)            |
-	(1<<MW_CMD_SYS_STAT)              | (1<<MW_CMD_DEF_CFG_SET),
-	(1<<(MW_CMD_HRNG_GET - 32))       | (1<<(MW_CMD_BSSID_GET - 32))    |
-	(1<<(MW_CMD_GAMERTAG_SET - 32))   | (1<<(MW_CMD_GAMERTAG_GET - 32)) |
-	(1<<(MW_CMD_LOG - 32))            | (1<<(MW_CMD_FACTORY_RESET - 32))|
-	(1<<(MW_CMD_SLEEP - 32))          | (1<<(MW_CMD_HTTP_URL_SET - 32)) |
-	(1<<(MW_CMD_HTTP_METHOD_SET - 32))| (1<<(MW_CMD_HTTP_CERT_QUERY - 32))|
-	(1<<(MW_CMD_HTTP_CERT_SET - 32))  | (1<<(MW_CMD_HTTP_HDR_ADD - 32)) |
-	(1<<(MW_CMD_HTTP_HDR_DEL - 32))   | (1<<(MW_CMD_HTTP_CLEANUP - 32)) |
-	(1<<(MW_CMD_SERVER_URL_GET - 32)) | (1<<(MW_CMD_SERVER_URL_SET - 32)) |
-	(1<<(MW_CMD_WIFI_ADV_GET - 32))   | (1<<(MW_CMD_WIFI_ADV_SET - 32)) |
-	(1<<(MW_CMD_NV_CFG_SAVE - 32))    | (1<<(MW_CMD_GAME_ENDPOINT_SET - 32)) |
-	(1<<(MW_CMD_GAME_KEYVAL_ADD - 32))
+/// Set of states, for the command table
+#define MW_IN(state)		(1<<(state))
+
+/// How command replies are sent
+enum mw_rep_class {
+	MW_REP_NONE = 0,	///< Sent (if needed) by the command handler
+	MW_REP_HEAD,		///< Header only
+	MW_REP_DATA		///< Header and the data length the handler returns
+};
+
+/// Resources used by commands. While a job holds a resource, the commands
+/// using it are deferred until the job completes.
+enum mw_res {
+	MW_RES_HTTP = 1<<0,	///< HTTP client and certificate store
+	MW_RES_FLASH = 1<<1,	///< User flash area
+	MW_RES_OTA = 1<<2	///< Firmware upgrade and server URL
+};
+
+// Requests of running and deferred commands are held out of the LSD
+// receiver buffers, and replies must still find a buffer on top of the
+// reserve, as buf_alloc() only succeeds with more than the reserve free
+_Static_assert(BUF_POOL_LEN >= LSD_RX_BUFS + MW_JOBS + MW_DEFER_LEN +
+		MW_BUF_RSV_REPLY + 1, "pool too small for jobs and deferred commands");
+
+// Each worker has its own lane, so the lane lengths follow MW_WORKERS
+_Static_assert(sizeof((uint8_t[])MW_FSM_LANE_LEN) == MW_LANES,
+		"MW_FSM_LANE_LEN does not match the number of lanes");
+
+/// Command table entry
+struct mw_cmd_entry {
+	/// Runs the command, returns the reply data length
+	uint16_t (*handler)(MwCmd *c, uint16_t len, MwCmd *reply);
+	uint16_t min_len;	///< Minimum request data length
+	uint8_t rep;		///< Reply class (mw_rep_class)
+	uint8_t states;		///< States allowing the command (MW_IN() set)
+	/// Runs after the reply is sent, if the command succeeded (optional)
+	void (*post)(void);
+	/// The handler and post action run on a worker task, and build the
+	/// reply over the request. They must not touch FSM data, but for the
+	/// resources they hold.
+	bool job;
+	uint8_t res;		///< Resources used (mw_res set)
 };
 
-/// Commands allowed while in READY state
-const static uint32_t readyCmdMask[2] = {
-	(1<<MW_CMD_VERSION)              | (1<<MW_CMD_ECHO)                  |
-	(1<<MW_CMD_AP_CFG)               | (1<<MW_CMD_AP_CFG_GET)            |
-	(1<<MW_CMD_IP_CURRENT)           | (1<<MW_CMD_IP_CFG)                |
-	(1<<MW_CMD_IP_CFG_GET)           | (1<<MW_CMD_DEF_AP_CFG)            |
-	(1<<MW_CMD_DEF_AP_CFG_GET)       | (1<<MW_CMD_AP_LEAVE)              |
-	(1<<MW_CMD_TCP_CON)              | (1<<MW_CMD_TCP_BIND)              |
-	(1<<MW_CMD_CLOSE)                | (1<<MW_CMD_UDP_SET)               |
-	(1<<MW_CMD_SOCK_STAT)            | (1<<MW_CMD_PING)                  |
-	(1<<MW_CMD_SNTP_CFG)             | (1<<MW_CMD_SNTP_CFG_GET)          |
-	(1<<MW_CMD_DATETIME)             | (1<<MW_CMD_DT_SET)                |
-	(1<<MW_CMD_FLASH_WRITE)          | (1<<MW_CMD_FLASH_READ)            |
-	(1<<MW_CMD_FLASH_ERASE)          | (1<<MW_CMD_FLASH_ID)              |
-	(1<<MW_CMD_SYS_STAT)             | (1<<MW_CMD_DEF_CFG_SET),
-	(1<<(MW_CMD_HRNG_GET - 32))      | (1<<(MW_CMD_BSSID_GET - 32))      |
-	(1<<(MW_CMD_GAMERTAG_SET - 32))  | (1<<(MW_CMD_GAMERTAG_GET - 32))   |
-	(1<<(MW_CMD_LOG - 32))           | (1<<(MW_CMD_SLEEP - 32))          |
-	(1<<(MW_CMD_HTTP_URL_SET - 32))  | (1<<(MW_CMD_HTTP_METHOD_SET - 32))|
-	(1<<(MW_CMD_HTTP_CERT_QUERY - 32))|(1<<(MW_CMD_HTTP_CERT_SET - 32))  |
-	(1<<(MW_CMD_HTTP_HDR_ADD - 32))  | (1<<(MW_CMD_HTTP_HDR_DEL - 32))   |
-	(1<<(MW_CMD_HTTP_OPEN - 32))     | (1<<(MW_CMD_HTTP_FINISH - 32))    |
-	(1<<(MW_CMD_HTTP_CLEANUP - 32))  | (1<<(MW_CMD_SERVER_URL_GET - 32)) |
-	(1<<(MW_CMD_SERVER_URL_SET - 32))| (1<<(MW_CMD_WIFI_ADV_GET - 32))   |
-	(1<<(MW_CMD_WIFI_ADV_SET - 32))  | (1<<(MW_CMD_NV_CFG_SAVE - 32))    |
-	(1<<(MW_CMD_UPGRADE_LIST - 32))  | (1<<(MW_CMD_UPGRADE_PERFORM - 32))|
-	(1<<(MW_CMD_GAME_ENDPOINT_SET - 32))| (1<<(MW_CMD_GAME_KEYVAL_ADD - 32))|
-	(1<<(MW_CMD_GAME_REQUEST - 32))
+/// Command running on a worker task
+struct mw_job {
+	struct worker_job w;		///< Worker job, must be the first field
+	const struct mw_cmd_entry *e;	///< Command table entry
+	MwMsgBuf *b;			///< Request, replaced by the reply
+	uint16_t len;			///< Request data length
+	uint8_t tag;			///< Request tag
+	bool busy;			///< Job slot in use
 };
 
 /*
  * PRIVATE PROTOTYPES
  */
 static void MwFsm(MwFsmMsg *msg);
+static void job_done_cb(struct worker_job *w, uint8_t worker);
 void MwFsmTsk(void *pvParameters);
 void MwFsmSockTsk(void *pvParameters);
 
@@ -182,12 +194,15 @@ typedef struct {
 	int8_t sock[MW_MAX_SOCK];
 	/// Socket status. As with sock[], index must be channel number - 1.
 	MwSockStat ss[MW_MAX_SOCK];
+	/// Close count of each channel, so connects in progress notice they
+	/// were cancelled, even if the channel was reserved again
+	uint8_t closes[MW_MAX_SOCK];
 	/// Channel associated with each socket (like sock[] but reversed). NOTE:
 	/// An extra socket placeholder is reserved because of server sockets that
 	/// might use a temporary additional socket during the accept() stage.
 	int8_t chan[MW_MAX_SOCK + 1];
 	/// FSM queue for event reception
-	QueueHandle_t q;
+	struct mq q;
 	/// Sleep inactivity timer
 	TimerHandle_t tim;
 	/// File descriptor set for select()
@@ -200,6 +215,35 @@ typedef struct {
 	uint8_t n_reassoc;
 	/// Current PHY type
 	uint8_t phy;
+	/// Tag of the command being processed
+	uint8_t tag;
+	/// Tag of the command waiting for the AP scan to complete
+	uint8_t scan_tag;
+	/// An AP scan is in progress
+	bool scan_pending;
+	/// Enabled event notifications (MW_EVENT_BIT() set)
+	uint32_t ev_mask;
+	/// Commands running on worker tasks
+	struct mw_job job[MW_JOBS];
+	/// Requests waiting for a busy resource or a free job slot, in order
+	MwMsgBuf *deferred[MW_DEFER_LEN];
+	/// Number of deferred requests
+	uint8_t n_deferred;
+	/// Reply of the batch sub-request running. Not taken from the pool,
+	/// as the batch reply already holds a pool buffer.
+	MwCmd batch_rep;
+	/// Resources held by running jobs (mw_res set)
+	uint8_t res_busy;
+	/// Resources used by deferred requests (mw_res set)
+	uint8_t res_wait;
+	/// Copies of the WiFi events waiting for the FSM
+	system_event_t ev[MW_EV_SLOTS];
+	/// Event slots in use
+	bool ev_used[MW_EV_SLOTS];
+	/// Maximum number of event slots simultaneously in use
+	uint8_t ev_hwm;
+	/// WiFi events dropped because all the slots were in use
+	uint32_t ev_no_slot;
 	/// Configuration partition handle
 	const esp_partition_t *p_cfg;
 	/// Flash chip device id
@@ -216,31 +260,40 @@ typedef struct {
 static MwNvCfg cfg;
 /// Module static data
 static MwData d;
-/// Temporal data buffer for data forwarding
-/// \todo FIXME This buffer is used by MwFsmSckTsk, and by the HTTP module.
-/// Access should be synchronized, and it is not.
-static uint8_t buf[LSD_MAX_LEN];
 
 static void time_sync_cb(struct timeval *tv)
 {
-	UNUSED_PARAM(tv);
-
 	d.s.dt_ok = TRUE;
 
 	LOGI("date/time set");
+	MwEventSend(MW_EVENT_SNTP, 0, tv->tv_sec);
 }
 
 /// Closes a socket on the specified channel
 static void MwSockClose(int ch) {
 	// Close socket, remove from file descriptor set and mark as unused
 	int idx = ch - 1;
+	int s;
 
-	FD_CLR(d.sock[idx], &d.fds);
-	lwip_close(d.sock[idx]);
-	// No channel associated with this socket
-	d.chan[d.sock[idx] - LWIP_SOCKET_OFFSET] = -1;
+	// Same lock as MwTcpConEnd(), so a connect completing meanwhile
+	// either records its socket before it is taken here, or notices the
+	// channel was closed and closes the socket itself
+	taskENTER_CRITICAL();
+	s = d.sock[idx];
+	// Channels still connecting have no socket yet
+	if (s >= 0) {
+		FD_CLR(s, &d.fds);
+		// No channel associated with this socket
+		d.chan[s - LWIP_SOCKET_OFFSET] = -1;
+	}
 	d.sock[idx] = -1; // No socket on this channel
 	d.ss[idx] = MW_SOCK_NONE;
+	d.closes[idx]++;
+	taskEXIT_CRITICAL();
+
+	if (s >= 0) {
+		lwip_close(s);
+	}
 }
 
 /// Close all opened sockets
@@ -285,9 +338,35 @@ void sleep_timer_cb(TimerHandle_t xTimer)
 	deep_sleep();
 }
 
+// Takes a free WiFi event slot, or returns NULL if all are in use
+static system_event_t *ev_slot_alloc(void)
+{
+	system_event_t *ev = NULL;
+	uint8_t used = 0;
+	int i;
+
+	taskENTER_CRITICAL();
+	for (i = 0; i < MW_EV_SLOTS; i++) {
+		if (!d.ev_used[i] && !ev) {
+			d.ev_used[i] = TRUE;
+			ev = &d.ev[i];
+		}
+		used += d.ev_used[i];
+	}
+	d.ev_hwm = MAX(d.ev_hwm, used);
+	taskEXIT_CRITICAL();
+
+	return ev;
+}
+
+static void ev_slot_free(system_event_t *ev)
+{
+	d.ev_used[ev - d.ev] = FALSE;
+}
+
 static esp_err_t event_handler(void *ctx, system_event_t *event)
 {
-	QueueHandle_t q = (QueueHandle_t)ctx;
+	struct mq *q = ctx;
 	MwFsmMsg msg;
 
 	if (!ctx || !event) {
@@ -295,12 +374,20 @@ static esp_err_t event_handler(void *ctx, system_event_t *event)
 		return ESP_ERR_INVALID_ARG;
 	}
 
-	// Forward event to sysfsm
+	// Forward event to sysfsm. Never wait, not to stall the event task
+	// (and the WiFi stack) while the FSM is busy.
+	if (!(msg.d = ev_slot_alloc())) {
+		d.ev_no_slot++;
+		LOGW("no slot for event %d", event->event_id);
+		return ESP_OK;
+	}
 	msg.e = MW_EV_WIFI;
-	msg.d = malloc(sizeof(system_event_t));
 	memcpy(msg.d, event, sizeof(system_event_t));
 
-	xQueueSend(q, &msg, portMAX_DELAY);
+	if (!mq_send(q, MW_LANE_WIFI, &msg, 0)) {
+		LOGW("queue full, event %d dropped", event->event_id);
+		ev_slot_free(msg.d);
+	}
 	return ESP_OK;
 }
 
@@ -322,11 +409,41 @@ static void ap_print(const wifi_ap_record_t *ap, int n_aps) {
 	LOGI("That's all!");
 }
 
-// Raises an event pending flag on requested channel
+void MwEventSend(uint8_t type, uint8_t ch, uint32_t data)
+{
+	MwMsgBuf *b;
+	MwCmd *ev;
+
+	if (type >= MW_EVENT_MAX || !(d.ev_mask & MW_EVENT_BIT(type))) {
+		return;
+	}
+	// Do not wait for buffers, as callbacks from other tasks send events
+	if (!(b = buf_alloc(MW_BUF_RSV_DATA))) {
+		LOGW("event %d lost", type);
+		return;
+	}
+	ev = &b->cmd;
+	ev->cmd = htons(MW_CMD_EVENT);
+	ev->datalen = htons(sizeof(struct mw_event));
+	ev->event.type = type;
+	ev->event.ch = ch;
+	ev->event.reserved[0] = ev->event.reserved[1] = 0;
+	ev->event.data = htonl(data);
+	if (LsdSendAsync(b->data, MW_CMD_HEADLEN + sizeof(struct mw_event),
+				MW_CTRL_CH, buf_unref_cb, b) <= 0) {
+		LOGW("event %d lost", type);
+		buf_unref(b);
+	}
+}
+
+// Raises an event pending flag on requested channel, and notifies the
+// channel status
 static void MwFsmRaiseChEvent(int ch) {
-	if ((ch < 1) || (ch >= LSD_MAX_CH)) return;
+	// Only socket channels have a status to notify
+	if ((ch < 1) || (ch > MW_MAX_SOCK)) return;
 
 	d.s.ch_ev |= 1<<ch;
+	MwEventSend(MW_EVENT_CH, ch, d.ss[ch - 1]);
 }
 
 // Clears an event pending flag on requested channel
@@ -387,7 +504,7 @@ static esp_err_t wifi_init(void)
 
 	tcpip_adapter_init();
 
-	err = esp_event_loop_init(event_handler, d.q);
+	err = esp_event_loop_init(event_handler, &d.q);
 	if (err) {
 		LOGE("failed to initialize event loop: %s",
 				esp_err_to_name(err));
@@ -407,11 +524,9 @@ out:
 	return err;
 }
 
-static int wifi_scan(uint8_t phy_type, uint8_t *data)
+// Starts an AP scan, completed by scan_done() on the SCAN_DONE event
+static int wifi_scan_start(uint8_t phy_type)
 {
-	int length = -1;
-	uint16_t n_aps = 0;
-	wifi_ap_record_t *ap = NULL;
 	wifi_scan_config_t scan_cfg = {};
 	esp_err_t err;
 
@@ -419,14 +534,26 @@ static int wifi_scan(uint8_t phy_type, uint8_t *data)
 	err = esp_wifi_start();
 	if (ESP_OK != err) {
 		LOGE("wifi start failed: %s!", esp_err_to_name(err));
-		goto out;
+		return -1;
 	}
-	err = esp_wifi_scan_start(&scan_cfg, true);
+	err = esp_wifi_scan_start(&scan_cfg, false);
 	if (ESP_OK != err) {
 		LOGE("scan failed: %s!", esp_err_to_name(err));
-		goto out;
+		esp_wifi_stop();
+		return -1;
 	}
 
+	return 0;
+}
+
+// Builds the scan reply data once the scan completes, and stops WiFi
+static int wifi_scan_get(uint8_t *data)
+{
+	int length = -1;
+	uint16_t n_aps = 0;
+	wifi_ap_record_t *ap = NULL;
+	esp_err_t err;
+
 	esp_wifi_scan_get_ap_num(&n_aps);
 	LOGI("found %d APs", n_aps);
 	ap = calloc(n_aps, sizeof(wifi_ap_record_t));
@@ -451,13 +578,28 @@ out:
 	return length;
 }
 
-static int MwChannelCheck(int ch) {
+/// Checks a channel is valid and not in use, and reserves it with the
+/// specified status while its socket is set up. If closes is not NULL, it
+/// gets the close count of the channel. Returns 0 on success.
+static int MwChannelReserve(int ch, MwSockStat st, uint8_t *closes) {
+	bool busy;
+
 	// Check channel is valid and not in use.
-	if (ch >= LSD_MAX_CH) {
+	if ((ch < 1) || (ch > MW_MAX_SOCK)) {
 		LOGE("Requested unavailable channel %d", ch);
 		return -1;
 	}
-	if (d.ss[ch - 1]) {
+	// Workers reserve channels concurrently with the FSM
+	taskENTER_CRITICAL();
+	busy = d.ss[ch - 1] != MW_SOCK_NONE;
+	if (!busy) {
+		d.ss[ch - 1] = st;
+	}
+	if (closes) {
+		*closes = d.closes[ch - 1];
+	}
+	taskEXIT_CRITICAL();
+	if (busy) {
 		LOGW("Requested already in-use channel %d", ch);
 		return -1;
 	}
@@ -465,16 +607,97 @@ static int MwChannelCheck(int ch) {
 	return 0;
 }
 
-/// Establish a connection with a remote server
-static int MwFsmTcpCon(MwMsgInAddr* addr) {
+/// Checks a connection attempt is still in progress: the channel has not
+/// been closed since reserved with the closes count
+static bool MwTcpConLive(int ch, uint8_t closes) {
+	return MW_SOCK_TCP_CONNECTING == d.ss[ch - 1] &&
+		closes == d.closes[ch - 1];
+}
+
+/// Ends a connection attempt on a reserved channel, recording the
+/// connected socket s, or releasing the channel if s is negative. The FSM
+/// can close the channel while connecting: then the socket is closed.
+/// Returns s if the socket is recorded, or -1 otherwise.
+static int MwTcpConEnd(int ch, uint8_t closes, int s) {
+	int idx = ch - 1;
+	bool live;
+
+	taskENTER_CRITICAL();
+	live = MwTcpConLive(ch, closes);
+	if (live && s >= 0) {
+		// Record socket number, type and mark channel as in use.
+		d.sock[idx] = s;
+		d.ss[idx] = MW_SOCK_TCP_EST;
+		// Record channel number associated with socket
+		d.chan[s - LWIP_SOCKET_OFFSET] = ch;
+		// Add socket to the FD set and update maximum socket value
+		FD_SET(s, &d.fds);
+		d.fdMax = MAX(s, d.fdMax);
+		// Enable LSD channel
+		LsdChEnable(ch);
+	} else if (live) {
+		d.ss[idx] = MW_SOCK_NONE;
+	}
+	taskEXIT_CRITICAL();
+
+	if (!live && s >= 0) {
+		LOGW("ch %d closed while connecting", ch);
+		lwip_close(s);
+	}
+
+	return live ? s : -1;
+}
+
+/// Waits for a non-blocking connect to complete. The socket is polled each
+/// MW_TCP_CON_POLL_MS, to stop if the channel is closed meanwhile. Returns
+/// 0 when connected, or -1 on error, timeout or cancellation.
+static int MwTcpConWait(int ch, uint8_t closes, int s, uint16_t tmo_ms) {
+	TickType_t start = xTaskGetTickCount();
+	struct timeval poll;
+	socklen_t optlen = sizeof(int);
+	fd_set wset, eset;
+	int err = 0;
+	int ret;
+
+	do {
+		if (!MwTcpConLive(ch, closes)) {
+			LOGI("ch %d connect cancelled", ch);
+			return -1;
+		}
+		if (xTaskGetTickCount() - start >= pdMS_TO_TICKS(tmo_ms)) {
+			LOGE("ch %d connect timed out", ch);
+			return -1;
+		}
+		FD_ZERO(&wset);
+		FD_SET(s, &wset);
+		eset = wset;
+		poll.tv_sec = 0;
+		poll.tv_usec = MW_TCP_CON_POLL_MS * 1000;
+		ret = select(s + 1, NULL, &wset, &eset, &poll);
+	} while (!ret);
+
+	if (ret < 0 || lwip_getsockopt(s, SOL_SOCKET, SO_ERROR, &err,
+				&optlen) || err) {
+		LOGE("ch %d connect failed, error %d", ch, err);
+		return -1;
+	}
+
+	return 0;
+}
+
+/// Establish a connection with a remote server, waiting up to tmo_ms for
+/// the connect to complete. Runs on a worker task, with the channel
+/// reserved while connecting.
+static int MwFsmTcpCon(MwMsgInAddr* addr, uint16_t tmo_ms) {
 	struct addrinfo *res;
+	uint8_t closes;
 	int err;
 	int s;
 
 	LOGI("Con. ch %d to %s:%s", addr->channel, addr->data,
 			addr->dst_port);
 
-	err = MwChannelCheck(addr->channel);
+	err = MwChannelReserve(addr->channel, MW_SOCK_TCP_CONNECTING, &closes);
 	if (err) {
 		return err;
 	}
@@ -482,6 +705,7 @@ static int MwFsmTcpCon(MwMsgInAddr* addr) {
 	// DNS lookup
 	err = net_dns_lookup(addr->data, addr->dst_port, &res);
 	if (err) {
+		MwTcpConEnd(addr->channel, closes, -1);
 		return err;
 	}
 
@@ -489,32 +713,29 @@ static int MwFsmTcpCon(MwMsgInAddr* addr) {
 	if(s < 0) {
 		LOGE("... Failed to allocate socket.");
 		freeaddrinfo(res);
+		MwTcpConEnd(addr->channel, closes, -1);
 		return -1;
 	}
 
 	LOGI("... allocated socket");
 
-	if(lwip_connect(s, res->ai_addr, res->ai_addrlen) != 0) {
+	// Connect without blocking, to wait for it with a timeout
+	lwip_fcntl(s, F_SETFL, O_NONBLOCK);
+	if ((lwip_connect(s, res->ai_addr, res->ai_addrlen) != 0 &&
+				EINPROGRESS != errno) ||
+			MwTcpConWait(addr->channel, closes, s, tmo_ms)) {
 		lwip_close(s);
 		freeaddrinfo(res);
 		LOGE("... socket connect failed.");
+		MwTcpConEnd(addr->channel, closes, -1);
 		return -1;
 	}
+	lwip_fcntl(s, F_SETFL, 0);
 
 	LOGI("... connected sock %d on ch %d", s, addr->channel);
 	freeaddrinfo(res);
-	// Record socket number, type and mark channel as in use.
-	d.sock[addr->channel - 1] = s;
-	d.ss[addr->channel - 1] = MW_SOCK_TCP_EST;
-	// Record channel number associated with socket
-	d.chan[s - LWIP_SOCKET_OFFSET] = addr->channel;
-	// Add socket to the FD set and update maximum socket valud
-	FD_SET(s, &d.fds);
-	d.fdMax = MAX(s, d.fdMax);
 
-	// Enable LSD channel
-	LsdChEnable(addr->channel);
-	return s;
+	return MwTcpConEnd(addr->channel, closes, s);
 }
 
 static int MwFsmTcpBind(MwMsgBind *b) {
@@ -525,7 +746,7 @@ static int MwFsmTcpBind(MwMsgBind *b) {
 	uint16_t port;
 	int err;
 
-	err = MwChannelCheck(b->channel);
+	err = MwChannelReserve(b->channel, MW_SOCK_TCP_LISTEN, NULL);
 	if (err) {
 		return err;
 	}
@@ -533,14 +754,14 @@ static int MwFsmTcpBind(MwMsgBind *b) {
 	// Create socket, set options
 	if ((serv = lwip_socket(AF_INET, SOCK_STREAM, 0)) < 0) {
 		LOGE("Could not create server socket!");
-		return -1;
+		goto err;
 	}
 
 	if (lwip_setsockopt(serv, SOL_SOCKET, SO_REUSEADDR, &optval,
 				sizeof(int)) < 0) {
 		lwip_close(serv);
 		LOGE("setsockopt failed!");
-		return -1;
+		goto err;
 	}
 
 	// Fill in address information
@@ -555,14 +776,14 @@ static int MwFsmTcpBind(MwMsgBind *b) {
 	if (lwip_bind(serv, (struct sockaddr*)&saddr, sizeof(saddr)) < -1) {
 		lwip_close(serv);
 		LOGE("Bind to port %d failed!", port);
-		return -1;
+		goto err;
 	}
 
 	// Listen for incoming connections
 	if (lwip_listen(serv, MW_MAX_SOCK) < 0) {
 		lwip_close(serv);
 		LOGE("Listen to port %d failed!", port);
-		return -1;
+		goto err;
 	}
 	LOGE("Listening to port %d.", port);
 
@@ -576,6 +797,11 @@ static int MwFsmTcpBind(MwMsgBind *b) {
 	d.fdMax = MAX(serv, d.fdMax);
 
 	return 0;
+
+err:
+	// Release the channel
+	d.ss[b->channel - 1] = MW_SOCK_NONE;
+	return -1;
 }
 
 static int MwUdpSet(MwMsgInAddr* addr) {
@@ -587,7 +813,7 @@ static int MwUdpSet(MwMsgInAddr* addr) {
 	struct addrinfo *raddr;
 	struct sockaddr_in local;
 
-	err = MwChannelCheck(addr->channel);
+	err = MwChannelReserve(addr->channel, MW_SOCK_UDP_READY, NULL);
 	if (err) {
 		return err;
 	}
@@ -598,7 +824,7 @@ static int MwUdpSet(MwMsgInAddr* addr) {
 
 	if ((s = lwip_socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
 		LOGE("Failed to create UDP socket");
-		return -1;
+		goto err;
 	}
 
 	memset(local.sin_zero, 0, sizeof(local.sin_zero));
@@ -614,7 +840,7 @@ static int MwUdpSet(MwMsgInAddr* addr) {
 		err = net_dns_lookup(addr->data, addr->dst_port, &raddr);
 		if (err) {
 			lwip_close(s);
-			return -1;
+			goto err;
 		}
 		d.raddr[idx] = *((struct sockaddr_in*)raddr->ai_addr);
 		freeaddrinfo(raddr);
@@ -624,14 +850,15 @@ static int MwUdpSet(MwMsgInAddr* addr) {
 		d.raddr[idx] = local;
 	} else {
 		LOGE("Invalid UDP socket data");
-		return -1;
+		lwip_close(s);
+		goto err;
 	}
 
 	if (lwip_bind(s, (struct sockaddr*)&local,
 				sizeof(struct sockaddr_in)) < 0) {
 		LOGE("bind() failed. Is UDP port in use?");
 		lwip_close(s);
-		return -1;
+		goto err;
 	}
 
 	LOGI("UDP socket %d bound", s);
@@ -647,18 +874,11 @@ static int MwUdpSet(MwMsgInAddr* addr) {
 	d.fdMax = MAX(s, d.fdMax);
 
 	return s;
-}
 
-/// Check if a command is on a command list mask
-static int MwCmdInList(uint8_t cmd, const uint32_t list[2]) {
-
-	if (cmd < 32) {
-		return (((1<<cmd) & list[0]) != 0);
-	} else if (cmd < 64) {
-		return (((1<<(cmd - 32)) & list[1]) != 0);
-	} else {
-		return 0;
-	}
+err:
+	// Release the channel
+	d.ss[idx] = MW_SOCK_NONE;
+	return -1;
 }
 
 /// Set default configuration.
@@ -894,15 +1114,17 @@ static void print_flash_id(void)
  * Module initialization. Must be called in user_init() context.
  ****************************************************************************/
 int MwInit(void) {
+	const uint8_t lane_len[MW_LANES] = MW_FSM_LANE_LEN;
 	MwFsmMsg m;
 	int i;
 
 	sntp_set_time_sync_notification_cb(time_sync_cb);
 	memset(&d, 0, sizeof(d));
+	buf_pool_init();
 	if (flash_init()) {
 		PANIC("could not initialize user data partition");
 	}
-	if (http_module_init((char*)buf)) {
+	if (http_module_init()) {
 		PANIC("http module initialization failed");
 	}
 	if (!(d.p_cfg = esp_partition_find_first(MW_DATA_PART_TYPE,
@@ -925,7 +1147,7 @@ int MwInit(void) {
 	}
 
 	// Create system queue
-	if (!(d.q = xQueueCreate(MW_FSM_QUEUE_LEN, sizeof(MwFsmMsg)))) {
+	if (mq_init(&d.q, lane_len, MW_LANES)) {
 		LOGE("could not create system queue!");
 		goto err;
 	};
@@ -945,17 +1167,23 @@ int MwInit(void) {
 		LOGE("could not create FsmSock task!");
 		goto err;
 	}
+	// Create the tasks running long commands
+	if (worker_pool_init(MW_WORKERS, MW_JOBS, MW_WORKER_PRIO,
+				MW_WORKER_STACK_LEN, job_done_cb)) {
+		LOGE("could not create worker tasks!");
+		goto err;
+	}
 	// Initialize SNTP
 	// TODO: Maybe this should be moved to the "READY" state
 	sntp_setoperatingmode(SNTP_OPMODE_POLL);
 	sntp_set_config();
 	sntp_init();
 	// Initialize LSD layer (will create receive task among other stuff).
-	LsdInit(d.q);
+	LsdInit(&d.q, MW_LANE_SER);
 	LsdChEnable(MW_CTRL_CH);
 	// Send the init done message
 	m.e = MW_EV_INIT_DONE;
-	xQueueSend(d.q, &m, portMAX_DELAY);
+	mq_send(&d.q, MW_LANE_SYS, &m, portMAX_DELAY);
 
 	// Start the one-shot inactivity sleep timer
 	d.tim = xTimerCreate("SLEEP", MW_SLEEP_TIMER_MS / portTICK_PERIOD_MS,
@@ -991,6 +1219,42 @@ static void reply_set_ok_empty(MwCmd *reply)
 	reply->cmd = MW_CMD_OK;
 }
 
+// Sends a reply with the specified tag. The reply command word must hold
+// just the reply code.
+static void reply_send_tag(MwCmd *reply, uint8_t tag, uint16_t replen)
+{
+	reply->cmd = htons(MW_CMD_TAGGED(tag, ntohs(reply->cmd)));
+	LsdSend((uint8_t*)reply, MW_CMD_HEADLEN + replen, 0);
+}
+
+// Sends a reply to the command being processed
+static void reply_send(MwCmd *reply, uint16_t replen)
+{
+	reply_send_tag(reply, d.tag, replen);
+}
+
+// Sends a reply with the specified tag. Replies in a pool buffer (b is
+// not NULL) are queued without waiting, so replies queued together can
+// share a super-frame, holding a buffer reference until sent. As with
+// socket data and events, this is only done while the data reserve is
+// left free.
+static void reply_queue(MwCmd *reply, MwMsgBuf *b, uint8_t tag,
+		uint16_t replen)
+{
+	if (!b || buf_free_count() <= MW_BUF_RSV_DATA) {
+		reply_send_tag(reply, tag, replen);
+		return;
+	}
+	reply->cmd = htons(MW_CMD_TAGGED(tag, ntohs(reply->cmd)));
+	buf_ref(b);
+	if (LsdSendAsync((uint8_t*)reply, MW_CMD_HEADLEN + replen,
+				MW_CTRL_CH, buf_unref_cb, b) <= 0) {
+		// Queue full, wait for the reply to be sent
+		buf_unref(b);
+		LsdSend((uint8_t*)reply, MW_CMD_HEADLEN + replen, MW_CTRL_CH);
+	}
+}
+
 static void rand_fill(uint8_t *buf, uint16_t len)
 {
 	uint32_t *data = (uint32_t*)buf;
@@ -1251,512 +1515,1203 @@ static void parse_game_add_keyval(const char *data, MwCmd *reply)
 	}
 }
 
-/// Process command requests (coming from the serial line)
-int MwFsmCmdProc(MwCmd *c, uint16_t totalLen) {
-	MwCmd reply;
-	uint16_t len = ByteSwapWord(c->datalen);
-	time_t ts;	// For datetime replies
-	uint16_t tmp, replen;
-	
-	// Sanity check: total Lengt - header length = data length
-	if ((totalLen - MW_CMD_HEADLEN) != len) {
-		LOGE("ERROR: Length inconsistent");
-		LOGE("totalLen=%d, dataLen=%d", totalLen, len);
-		return MW_CMD_FMT_ERROR;
+static int lsd_stats_get(MwCmd *reply)
+{
+	struct lsd_stats stats;
+	const uint32_t *word = (const uint32_t*)&stats;
+	int i;
+
+	LsdStatsGet(&stats);
+	for (i = 0; i < sizeof(stats) / sizeof(uint32_t); i++) {
+		reply->dwData[i] = htonl(word[i]);
 	}
+	reply->datalen = htons(sizeof(stats));
 
-	// parse command
-	LOGI("CmdRequest: %d", ByteSwapWord(c->cmd));
-	reply_set_ok_empty(&reply);
-	switch (ByteSwapWord(c->cmd)) {
-		case MW_CMD_VERSION:
-			// Cancel sleep timer
-			if (d.tim) {
-				xTimerStop(d.tim, 0);
-				xTimerDelete(d.tim, 0);
-				d.tim = NULL;
-			}
-			reply.cmd = MW_CMD_OK;
-			reply.datalen = ByteSwapWord(3 + sizeof(MW_FW_VARIANT));
-			reply.data[0] = MW_FW_VERSION_MAJOR;
-			reply.data[1] = MW_FW_VERSION_MINOR;
-			reply.data[2] = MW_FW_VERSION_MICRO;
-			memcpy(reply.data + 3, MW_FW_VARIANT, sizeof(MW_FW_VARIANT));
-			LsdSend((uint8_t*)&reply, ByteSwapWord(reply.datalen) +
-					MW_CMD_HEADLEN, 0);
-			break;
+	return sizeof(stats);
+}
 
-		case MW_CMD_ECHO:		// Echo request
-			reply.datalen = c->datalen;
-			LOGI("SENDING ECHO!");
-			// Send the command response
-			if ((LsdSplitStart((uint8_t*)&reply, MW_CMD_HEADLEN,
-					len + MW_CMD_HEADLEN, 0) == MW_CMD_HEADLEN) &&
-					len) {
-				// Send echoed data
-				LsdSplitEnd(c->data, len);
-			}
-			break;
+// Sends the reply using current link options, then switches to new ones
+static void lsd_opt_set(const struct mw_lsd_opt *req, uint16_t len,
+		MwCmd *reply)
+{
+	uint32_t requested = ntohl(req->opts);
+	uint32_t opts = requested & LSD_OPT_SUPPORTED;
+	uint8_t win = 0;
+	uint16_t rto_ms = 0;
+	uint16_t max_len = 0;
 
-		case MW_CMD_AP_SCAN:
-	    		LOGI("SCAN!");
-			int scan_len = wifi_scan(c->data[0], reply.data);
-			if (scan_len <= 0) {
-				reply.cmd = ByteSwapWord(MW_CMD_ERROR);
-			} else {
-				reply.datalen = scan_len;
-				reply.datalen = ByteSwapWord(reply.datalen);
-			}
-			LsdSend((uint8_t*)&reply, scan_len + MW_CMD_HEADLEN, 0);
-			break;
+	// Reliable mode and extended header parameters are optional
+	if (len >= offsetof(struct mw_lsd_opt, ext_max_len)) {
+		win = req->rel_win;
+		rto_ms = ntohs(req->rel_rto_ms);
+	}
+	if (len >= sizeof(struct mw_lsd_opt)) {
+		max_len = ntohs(req->ext_max_len);
+	}
+	if ((opts & LSD_OPT_RELIABLE) && LsdRelCfg(&win, &rto_ms) != LSD_OK) {
+		opts &= ~LSD_OPT_RELIABLE;
+	}
+	if (opts & LSD_OPT_EXT_HDR) {
+		max_len = LsdExtCfg(max_len);
+	} else {
+		max_len = 0;
+	}
+	LOGI("link options requested: 0x%08" PRIX32 ", set: 0x%08" PRIX32,
+			requested, opts);
+	reply->lsd_opt.opts = htonl(opts);
+	reply->lsd_opt.rel_win = win;
+	reply->lsd_opt.reserved = 0;
+	reply->lsd_opt.rel_rto_ms = htons(rto_ms);
+	reply->lsd_opt.ext_max_len = htons(max_len);
+	reply->lsd_opt.reserved2 = 0;
+	reply->datalen = htons(sizeof(struct mw_lsd_opt));
+	reply_send(reply, sizeof(struct mw_lsd_opt));
+	LsdOptSet(opts);
+}
 
-		case MW_CMD_AP_CFG:
-			ap_cfg_set(c->apCfg.cfgNum, c->apCfg.phy_type, c->apCfg.ssid,
-					c->apCfg.pass, &reply);
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
+// Negotiates the serial link baud rate. The new rate is probed until the
+// console commits it, falling back to the previous one on failure.
+static void lsd_baud(const struct mw_lsd_baud *req, uint16_t len,
+		MwCmd *reply)
+{
+	uint32_t baud;
+	uint16_t replen = sizeof(struct mw_lsd_baud);
+
+	memset(&reply->lsd_baud, 0, sizeof(struct mw_lsd_baud));
+	reply->lsd_baud.phase = req->phase;
+	switch (req->phase) {
+	case MW_LSD_BAUD_SWITCH:
+		baud = LsdBaudSelect(ntohl(req->baud));
+		if (!baud) {
+			LOGE("unsupported baud rate %" PRIu32, ntohl(req->baud));
+			reply->cmd = htons(MW_CMD_ERROR);
 			break;
+		}
+		// Reply using the current rate, then switch
+		reply->lsd_baud.baud = htonl(baud);
+		reply->datalen = htons(replen);
+		reply_send(reply, replen);
+		LsdBaudProbe(baud);
+		return;
+
+	case MW_LSD_BAUD_TEST:
+		// Echo the test pattern
+		replen = len;
+		memcpy(reply->lsd_baud.pattern, req->pattern,
+				len - sizeof(struct mw_lsd_baud));
+		break;
+
+	case MW_LSD_BAUD_COMMIT:
+		if (LsdBaudCommit() != LSD_OK) {
+			reply->cmd = htons(MW_CMD_ERROR);
+			reply_send(reply, 0);
+			LsdBaudRevert();
+			return;
+		}
+		break;
 
-		case MW_CMD_AP_CFG_GET:
-			tmp = c->apCfg.cfgNum;
-			if (tmp >= MW_NUM_AP_CFGS) {
-				LOGE("Requested AP for cfg %d!", tmp);
-				reply.cmd = ByteSwapWord(MW_CMD_ERROR);
-				replen = 0;
-			} else {
-				LOGI("Getting AP configuration %d...", tmp);
-				replen = sizeof(MwMsgApCfg);
-				reply.datalen = ByteSwapWord(sizeof(MwMsgApCfg));
-				reply.apCfg.cfgNum = c->apCfg.cfgNum;
-				strncpy(reply.apCfg.ssid, cfg.ap[tmp].ssid, MW_SSID_MAXLEN);
-				strncpy(reply.apCfg.pass, cfg.ap[tmp].pass, MW_PASS_MAXLEN);
-				reply.apCfg.phy_type = cfg.ap[tmp].phy;
-				LOGI("phy: 0x%X, ssid: %s, pass: %s", reply.apCfg.phy_type,
-						reply.apCfg.ssid, reply.apCfg.pass);
-			} 
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN + replen, 0);
-			break;
+	default:
+		reply->cmd = htons(MW_CMD_ERROR);
+		break;
+	}
+	if (MW_CMD_OK == reply->cmd) {
+		reply->lsd_baud.baud = htonl(LsdBaudGet());
+		reply->datalen = htons(replen);
+	} else {
+		replen = 0;
+	}
+	reply_send(reply, replen);
+}
 
-		case MW_CMD_IP_CURRENT:
-			replen = 0;
-			LOGI("Getting current IP configuration...");
-			replen = sizeof(MwMsgIpCfg);
-			reply.datalen = ByteSwapWord(sizeof(MwMsgIpCfg));
-			reply.ipCfg.cfgNum = 0;
-			tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_STA, &reply.ipCfg.cfg);
-			reply.ipCfg.dns1 = *dns_getserver(0);
-			reply.ipCfg.dns2 = *dns_getserver(1);
-			log_ip_cfg(&reply.ipCfg);
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN + replen, 0);
-			break;
+// Command handlers. Each one gets the request, its data length and the
+// reply (already set to an empty OK reply), and returns the reply data
+// length. The reply is then sent by MwFsmCmdProc() according to the
+// command reply class, excepting MW_REP_NONE commands, that send their
+// replies (if any) by themselves.
 
-		case MW_CMD_IP_CFG:
-			tmp = (uint8_t)c->ipCfg.cfgNum;
-			if (tmp >= MW_NUM_AP_CFGS) {
-				LOGE("Tried to set IP for cfg %d!", tmp);
-				reply.cmd = ByteSwapWord(MW_CMD_ERROR);
-			} else {
-				LOGI("Setting IP configuration %d...", tmp);
-				cfg.ip[tmp] = c->ipCfg.cfg;
-				cfg.dns[tmp][0] = c->ipCfg.dns1;
-				cfg.dns[tmp][1] = c->ipCfg.dns2;
-				log_ip_cfg(&c->ipCfg);
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+static uint16_t cmd_version(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	// Cancel sleep timer
+	if (d.tim) {
+		xTimerStop(d.tim, 0);
+		xTimerDelete(d.tim, 0);
+		d.tim = NULL;
+	}
+	reply->datalen = ByteSwapWord(3 + sizeof(MW_FW_VARIANT));
+	reply->data[0] = MW_FW_VERSION_MAJOR;
+	reply->data[1] = MW_FW_VERSION_MINOR;
+	reply->data[2] = MW_FW_VERSION_MICRO;
+	memcpy(reply->data + 3, MW_FW_VARIANT, sizeof(MW_FW_VARIANT));
+
+	return 3 + sizeof(MW_FW_VARIANT);
+}
 
-		case MW_CMD_IP_CFG_GET:
-			tmp = c->ipCfg.cfgNum;
-			replen = 0;
-			if (tmp >= MW_NUM_AP_CFGS) {
-				LOGE("Requested IP for cfg %d!", tmp);
-				reply.cmd = ByteSwapWord(MW_CMD_ERROR);
-			} else {
-				LOGI("Getting IP configuration %d...", tmp);
-				replen = sizeof(MwMsgIpCfg);
-				reply.datalen = ByteSwapWord(sizeof(MwMsgIpCfg));
-				reply.ipCfg.cfgNum = c->ipCfg.cfgNum;
-				reply.ipCfg.cfg = cfg.ip[tmp];
-				reply.ipCfg.dns1 = cfg.dns[tmp][0];
-				reply.ipCfg.dns2 = cfg.dns[tmp][1];
-				log_ip_cfg(&reply.ipCfg);
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN + replen, 0);
-			break;
+static uint16_t cmd_echo(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	struct lsd_iov iov[2];
+
+	reply->cmd = htons(MW_CMD_TAGGED(d.tag, MW_CMD_OK));
+	reply->datalen = c->datalen;
+	LOGI("SENDING ECHO!");
+	// Send the command response along with echoed data
+	iov[0].data = reply;
+	iov[0].len = MW_CMD_HEADLEN;
+	iov[1].data = c->data;
+	iov[1].len = len;
+	LsdSendV(iov, 2, 0);
 
-		case MW_CMD_DEF_AP_CFG:
-			tmp = c->data[0];
-			if (tmp < MW_NUM_AP_CFGS) {
-				cfg.defaultAp = tmp;
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+	return len;
+}
 
-		case MW_CMD_DEF_AP_CFG_GET:
-			reply.datalen = ByteSwapWord(1);
-			reply.data[0] = cfg.defaultAp;
-			LOGI("Sending default AP: %d", cfg.defaultAp);
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN + 1, 0);
-			break;
+// Replies when the scan completes, see scan_done()
+static uint16_t cmd_ap_scan(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	LOGI("SCAN!");
+	if (d.scan_pending || wifi_scan_start(c->data[0])) {
+		reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+		reply_send(reply, 0);
+	} else {
+		d.scan_pending = TRUE;
+		d.scan_tag = d.tag;
+	}
 
-		case MW_CMD_AP_JOIN:
-			// Start connecting to AP and jump to AP_JOIN state
-			if ((c->data[0] >= MW_NUM_AP_CFGS) ||
-					!(cfg.ap[c->data[0]].ssid[0])) {
-				reply.cmd = ByteSwapWord(MW_CMD_ERROR);
-				LOGE("Invalid AP_JOIN on config %d", c->data[0]);
-			} else {
-				MwApJoin(c->data[0]);
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+	return 0;
+}
 
-		case MW_CMD_AP_LEAVE:	// Leave access point
-			LOGI("Disconnecting from AP");
-			disconnect();
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+static uint16_t cmd_ap_cfg(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	ap_cfg_set(c->apCfg.cfgNum, c->apCfg.phy_type, c->apCfg.ssid,
+			c->apCfg.pass, reply);
 
-		case MW_CMD_TCP_CON:
-			LOGI("TRYING TO CONNECT TCP SOCKET...");
-			if (MwFsmTcpCon(&c->inAddr) < 0) {
-				reply.cmd = ByteSwapWord(MW_CMD_ERROR);
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+	return 0;
+}
 
-		case MW_CMD_TCP_BIND:
-			if (MwFsmTcpBind(&c->bind)) {
-				reply.cmd = ByteSwapWord(MW_CMD_ERROR);
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+static uint16_t cmd_ap_cfg_get(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	uint8_t num = c->apCfg.cfgNum;
 
-		case MW_CMD_CLOSE:
-			// If channel number OK, disconnect the socket on requested channel
-			if ((c->data[0] > 0) && (c->data[0] <= LSD_MAX_CH) &&
-					d.ss[c->data[0] - 1]) {
-				LOGI("Closing socket %d from channel %d",
-						d.sock[c->data[0] - 1], c->data[0]);
-				MwSockClose(c->data[0]);
-				LsdChDisable(c->data[0]);
-			} else {
-				reply.cmd = ByteSwapWord(MW_CMD_ERROR);
-				LOGE("Requested disconnect of not opened channel %d.",
-						c->data[0]);
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+	if (num >= MW_NUM_AP_CFGS) {
+		LOGE("Requested AP for cfg %d!", num);
+		reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+		return 0;
+	}
+	LOGI("Getting AP configuration %d...", num);
+	reply->datalen = ByteSwapWord(sizeof(MwMsgApCfg));
+	reply->apCfg.cfgNum = c->apCfg.cfgNum;
+	strncpy(reply->apCfg.ssid, cfg.ap[num].ssid, MW_SSID_MAXLEN);
+	strncpy(reply->apCfg.pass, cfg.ap[num].pass, MW_PASS_MAXLEN);
+	reply->apCfg.phy_type = cfg.ap[num].phy;
+	LOGI("phy: 0x%X, ssid: %s, pass: %s", reply->apCfg.phy_type,
+			reply->apCfg.ssid, reply->apCfg.pass);
 
-		case MW_CMD_UDP_SET:
-			LOGI("Configuring UDP socket...");
-			if (MwUdpSet(&c->inAddr) < 0) {
-				reply.cmd = ByteSwapWord(MW_CMD_ERROR);
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+	return sizeof(MwMsgApCfg);
+}
 
-		case MW_CMD_SOCK_STAT:
-			if ((c->data[0] > 0) && (c->data[0] < LSD_MAX_CH)) {
-				// Send channel status and clear channel event flag
-				replen = 1;
-				reply.datalen = ByteSwapWord(1);
-				reply.data[0] = (uint8_t)d.ss[c->data[0] - 1];
-				MwFsmClearChEvent(c->data[0]);
-			} else {
-				replen = 0;
-				reply.cmd = ByteSwapWord(MW_CMD_ERROR);
-				LOGE("Requested unavailable channel!");
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN + replen, 0);
-			break;
+static uint16_t cmd_ip_current(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	LOGI("Getting current IP configuration...");
+	reply->datalen = ByteSwapWord(sizeof(MwMsgIpCfg));
+	reply->ipCfg.cfgNum = 0;
+	tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_STA, &reply->ipCfg.cfg);
+	reply->ipCfg.dns1 = *dns_getserver(0);
+	reply->ipCfg.dns2 = *dns_getserver(1);
+	log_ip_cfg(&reply->ipCfg);
+
+	return sizeof(MwMsgIpCfg);
+}
 
-		case MW_CMD_PING:
-			LOGE("PING unimplemented");
-			break;
+static uint16_t cmd_ip_cfg(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	uint8_t num = c->ipCfg.cfgNum;
 
-		case MW_CMD_SNTP_CFG:
-			LOGI("setting SNTP cfg for zone %s", c->data);
-			sntp_config_set((char*)c->data, len, &reply);
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+	if (num >= MW_NUM_AP_CFGS) {
+		LOGE("Tried to set IP for cfg %d!", num);
+		reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+	} else {
+		LOGI("Setting IP configuration %d...", num);
+		cfg.ip[num] = c->ipCfg.cfg;
+		cfg.dns[num][0] = c->ipCfg.dns1;
+		cfg.dns[num][1] = c->ipCfg.dns2;
+		log_ip_cfg(&c->ipCfg);
+	}
 
-		case MW_CMD_SNTP_CFG_GET:
-			replen = cfg.ntpPoolLen;
-			LOGI("sending SNTP cfg (%d bytes)", replen);
-			memcpy(reply.data, cfg.ntpPool, replen);
-			reply.datalen = htons(replen);
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN + replen, 0);
-			break;
+	return 0;
+}
 
-		case MW_CMD_DATETIME:
-			ts = time(NULL);
-			reply.datetime.dtBin[0] = 0;
-			reply.datetime.dtBin[1] = ByteSwapDWord((uint32_t)ts);
-			strcpy(reply.datetime.dtStr, ctime(&ts));
-			LOGI("sending datetime %s", reply.datetime.dtStr);
-			tmp = 2*sizeof(uint32_t) + strlen(reply.datetime.dtStr);
-			reply.datalen = ByteSwapWord(tmp);
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN + tmp, 0);
-			break;
+static uint16_t cmd_ip_cfg_get(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	uint8_t num = c->ipCfg.cfgNum;
 
-		case MW_CMD_DT_SET:
-			LOGE("DT_SET unimplemented");
-			break;
+	if (num >= MW_NUM_AP_CFGS) {
+		LOGE("Requested IP for cfg %d!", num);
+		reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+		return 0;
+	}
+	LOGI("Getting IP configuration %d...", num);
+	reply->datalen = ByteSwapWord(sizeof(MwMsgIpCfg));
+	reply->ipCfg.cfgNum = c->ipCfg.cfgNum;
+	reply->ipCfg.cfg = cfg.ip[num];
+	reply->ipCfg.dns1 = cfg.dns[num][0];
+	reply->ipCfg.dns2 = cfg.dns[num][1];
+	log_ip_cfg(&reply->ipCfg);
 
-		case MW_CMD_FLASH_WRITE:
-			if (flash_write(ntohl(c->flData.addr),
-						len - sizeof(uint32_t),
-						(char*)c->flData.data)) {
-				reply.cmd = ByteSwapWord(MW_CMD_ERROR);
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+	return sizeof(MwMsgIpCfg);
+}
 
-		case MW_CMD_FLASH_READ:
-			c->flRange.addr = ntohl(c->flRange.addr);
-			c->flRange.len = ntohs(c->flRange.len);
-			if (flash_read(c->flRange.addr, c->flRange.len,
-						(char*)reply.data)) {
-				reply.cmd = ByteSwapWord(MW_CMD_ERROR);
-				c->flRange.len = 0;
-			}
-			LsdSend((uint8_t*)&reply, c->flRange.len + MW_CMD_HEADLEN, 0);
-			break;
+static uint16_t cmd_def_ap_cfg(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	if (c->data[0] < MW_NUM_AP_CFGS) {
+		cfg.defaultAp = c->data[0];
+	}
 
-		case MW_CMD_FLASH_ERASE:
-			if (flash_erase(ntohs(c->flSect))) {
-				reply.cmd = ByteSwapWord(MW_CMD_ERROR);
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+	return 0;
+}
 
-		case MW_CMD_FLASH_ID:
-			reply.flash_id.device = htons(d.flash_dev);
-			reply.flash_id.manufacturer = d.flash_man;
-			reply.datalen = htons(3);
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN + 3, 0);
-			break;
+static uint16_t cmd_def_ap_cfg_get(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	reply->datalen = ByteSwapWord(1);
+	reply->data[0] = cfg.defaultAp;
+	LOGI("Sending default AP: %d", cfg.defaultAp);
 
-		case MW_CMD_SYS_STAT:
-			MwSysStatFill(&reply);
-			LOGI("%02X %02X %02X %02X", reply.data[0], reply.data[1],
-					reply.data[2], reply.data[3]);
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN + sizeof(MwMsgSysStat),
-				0);
-			break;
+	return 1;
+}
 
-		case MW_CMD_DEF_CFG_SET:
-			// Check lengt and magic value
-			if ((len != 4) || (c->dwData[0] !=
-						ByteSwapDWord(MW_FACT_RESET_MAGIC))) {
-				LOGE("Wrong DEF_CFG_SET command invocation!");
-				reply.cmd = ByteSwapWord(MW_CMD_ERROR);
-			} else if (esp_partition_erase_range(d.p_cfg, 0,
-						MW_CFG_SECT_LEN) != ESP_OK) {
-				LOGE("Config flash sector erase failed!");
-				reply.cmd = ByteSwapWord(MW_CMD_ERROR);
-			} else {
-				LOGI("Configuration set to default.");
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+static uint16_t cmd_ap_join(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	// Start connecting to AP and jump to AP_JOIN state
+	if (d.scan_pending) {
+		reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+		LOGE("AP_JOIN while scanning");
+	} else if ((c->data[0] >= MW_NUM_AP_CFGS) ||
+			!(cfg.ap[c->data[0]].ssid[0])) {
+		reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+		LOGE("Invalid AP_JOIN on config %d", c->data[0]);
+	} else {
+		MwApJoin(c->data[0]);
+	}
 
-		case MW_CMD_HRNG_GET:
-			replen = ByteSwapWord(c->rndLen);
-			if (replen > MW_CMD_MAX_BUFLEN) {
-				replen = 0;
-				reply.cmd = ByteSwapWord(MW_CMD_ERROR);
-			} else {
-				reply.datalen = c->rndLen;
-				rand_fill(reply.data, replen);
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN + replen, 0);
-			break;
+	return 0;
+}
 
-		case MW_CMD_BSSID_GET:
-			reply.datalen = ByteSwapWord(6);
-			esp_wifi_get_mac(c->data[0], reply.data);
-			LOGI("Got BSSID(%d) %02X:%02X:%02X:%02X:%02X:%02X",
-					c->data[0], reply.data[0], reply.data[1],
-					reply.data[2], reply.data[3],
-					reply.data[4], reply.data[5]);
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN + 6, 0);
-			break;
+static uint16_t cmd_ap_leave(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	LOGI("Disconnecting from AP");
+	disconnect();
 
-		case MW_CMD_GAMERTAG_SET:
-			if (c->gamertag_set.slot >= MW_NUM_GAMERTAGS ||
-					len != sizeof(struct mw_gamertag_set_msg)) {
-				reply.cmd = ByteSwapWord(MW_CMD_ERROR);
-			} else {
-				// Copy gamertag and save to flash
-				memcpy(&cfg.gamertag[c->gamertag_set.slot],
-						&c->gamertag_set.gamertag,
-						sizeof(struct mw_gamertag));
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+	return 0;
+}
 
-		case MW_CMD_GAMERTAG_GET:
-			if (c->data[0] >= MW_NUM_GAMERTAGS) {
-				replen = 0;
-				reply.cmd = ByteSwapWord(MW_CMD_ERROR);
-			} else {
-				replen = sizeof(struct mw_gamertag);
-				memcpy(&reply.gamertag_get, &cfg.gamertag[c->data[0]],
-						replen);
-			}
-			reply.datalen = ByteSwapWord(replen);
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN + replen, 0);
-			break;
+// Gets the connect timeout, that can follow the host name of the request
+static uint16_t tcp_con_tmo(const MwMsgInAddr *addr, uint16_t len)
+{
+	const uint16_t off = offsetof(MwMsgInAddr, data);
+	uint16_t host_len = strnlen(addr->data, len - off);
+	const uint8_t *tmo = (const uint8_t*)addr->data + host_len + 1;
+	uint16_t tmo_ms;
 
-		case MW_CMD_LOG:
-			puts((char*)c->data);
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+	if (len != off + host_len + 1 + sizeof(uint16_t)) {
+		return MW_TCP_CON_TMO_MS;
+	}
+	// Might be unaligned
+	tmo_ms = (tmo[0]<<8) | tmo[1];
 
-		case MW_CMD_FACTORY_RESET:
-			MwSetDefaultCfg();
-			// Fallthrough
+	return tmo_ms ? tmo_ms : MW_TCP_CON_TMO_MS;
+}
 
-		case MW_CMD_NV_CFG_SAVE:
-			if (mw_nv_cfg_save() < 0) {
-				reply.cmd = ByteSwapWord(MW_CMD_ERROR);
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+static uint16_t cmd_tcp_con(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	LOGI("TRYING TO CONNECT TCP SOCKET...");
+	if (MwFsmTcpCon(&c->inAddr, tcp_con_tmo(&c->inAddr, len)) < 0) {
+		reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+	}
 
-		case MW_CMD_SLEEP:
-			// No reply, wakeup continues from user_init()
-			deep_sleep();
-			LOGI("Entering deep sleep");
-			esp_deep_sleep(0);
-			// As it takes a little for the module to enter deep
-			// sleep, stay here for a while
-			vTaskDelayMs(60000);
-			// fallthrough
-
-		case MW_CMD_HTTP_URL_SET:
-			if (http_url_set((char*)c->data)) {
-				reply.cmd = htons(MW_CMD_ERROR);
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+	return 0;
+}
 
-		case MW_CMD_HTTP_METHOD_SET:
-			if (http_method_set(c->data[0])) {
-				reply.cmd = htons(MW_CMD_ERROR);
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+static uint16_t cmd_tcp_bind(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	if (MwFsmTcpBind(&c->bind)) {
+		reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+	}
 
-		case MW_CMD_HTTP_HDR_ADD:
-			if (http_header_add((char*)c->data)) {
-				reply.cmd = htons(MW_CMD_ERROR);
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+	return 0;
+}
 
-		case MW_CMD_HTTP_HDR_DEL:
-			if (http_header_del((char*)c->data)) {
-				reply.cmd = htons(MW_CMD_ERROR);
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+static uint16_t cmd_close(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	uint8_t ch = c->data[0];
 
-		case MW_CMD_HTTP_OPEN:
-			if (http_open(ntohl(c->dwData[0]))) {
-				reply.cmd = htons(MW_CMD_ERROR);
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+	// If channel number OK, disconnect the socket on requested channel
+	if ((ch > 0) && (ch <= LSD_MAX_CH) && d.ss[ch - 1]) {
+		LOGI("Closing socket %d from channel %d", d.sock[ch - 1], ch);
+		MwSockClose(ch);
+		LsdChDisable(ch);
+	} else {
+		reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+		LOGE("Requested disconnect of not opened channel %d.", ch);
+	}
 
-		case MW_CMD_HTTP_FINISH:
-			replen = http_parse_finish(&reply);
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN + replen, 0);
-			/// TODO: Thread this
-			http_recv();
-			break;
+	return 0;
+}
 
-		case MW_CMD_HTTP_CLEANUP:
-			if (http_cleanup()) {
-				reply.cmd = htons(MW_CMD_ERROR);
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+static uint16_t cmd_udp_set(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	LOGI("Configuring UDP socket...");
+	if (MwUdpSet(&c->inAddr) < 0) {
+		reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+	}
 
-		case MW_CMD_HTTP_CERT_QUERY:
-			reply.dwData[0] = htonl(http_cert_query());
-			if (0xFFFFFFFF == reply.dwData[0]) {
-				reply.cmd = htons(MW_CMD_ERROR);
-			} else {
-				replen = 4;
-				reply.datalen = htons(4);
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN + replen, 0);
-			break;
+	return 0;
+}
 
-		case MW_CMD_HTTP_CERT_SET:
-			if (http_cert_set(ntohl(c->dwData[0]),
-					ntohs(c->wData[2]))) {
-				reply.cmd = htons(MW_CMD_ERROR);
-			}
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+static uint16_t cmd_sock_stat(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	uint8_t ch = c->data[0];
 
-		case MW_CMD_SERVER_URL_GET:
-			replen = parse_server_url_get(&reply);
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN + replen, 0);
-			break;
+	if ((ch == 0) || (ch >= LSD_MAX_CH)) {
+		reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+		LOGE("Requested unavailable channel!");
+		return 0;
+	}
+	// Send channel status and clear channel event flag
+	reply->datalen = ByteSwapWord(1);
+	reply->data[0] = (uint8_t)d.ss[ch - 1];
+	MwFsmClearChEvent(ch);
 
-		case MW_CMD_SERVER_URL_SET:
-			parse_server_url_set((char*)c->data, &reply);
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+	return 1;
+}
 
-		case MW_CMD_WIFI_ADV_GET:
-			replen = parse_wifi_adv_get(&reply);
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN + replen, 0);
-			break;
+static uint16_t cmd_ping(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	LOGE("PING unimplemented");
 
-		case MW_CMD_WIFI_ADV_SET:
-			parse_wifi_adv_set(&c->wifi_adv_cfg, &reply);
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+	return 0;
+}
 
-		case MW_CMD_UPGRADE_LIST:
-			// TODO
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+static uint16_t cmd_sntp_cfg(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	LOGI("setting SNTP cfg for zone %s", c->data);
+	sntp_config_set((char*)c->data, len, reply);
 
-		case MW_CMD_UPGRADE_PERFORM:
-			parse_upgrade((char*)c->data, &reply);
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+	return 0;
+}
 
-		case MW_CMD_GAME_ENDPOINT_SET:
-			parse_game_endpoint_set((char*)c->data, &reply);
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+static uint16_t cmd_sntp_cfg_get(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	uint16_t replen = cfg.ntpPoolLen;
 
-		case MW_CMD_GAME_KEYVAL_ADD:
-			parse_game_add_keyval((char*)c->data, &reply);
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN, 0);
-			break;
+	LOGI("sending SNTP cfg (%d bytes)", replen);
+	memcpy(reply->data, cfg.ntpPool, replen);
+	reply->datalen = htons(replen);
 
-		case MW_CMD_GAME_REQUEST:
-			replen = parse_game_request(&c->ga_request, &reply);
-			LsdSend((uint8_t*)&reply, MW_CMD_HEADLEN + replen, 0);
-			/// TODO: Thread this
-			http_recv();
-			break;
+	return replen;
+}
 
-		default:
-			LOGE("UNKNOWN REQUEST!");
+static uint16_t cmd_datetime(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	time_t ts = time(NULL);
+	uint16_t replen;
+
+	reply->datetime.dtBin[0] = 0;
+	reply->datetime.dtBin[1] = ByteSwapDWord((uint32_t)ts);
+	strcpy(reply->datetime.dtStr, ctime(&ts));
+	LOGI("sending datetime %s", reply->datetime.dtStr);
+	replen = 2*sizeof(uint32_t) + strlen(reply->datetime.dtStr);
+	reply->datalen = ByteSwapWord(replen);
+
+	return replen;
+}
+
+static uint16_t cmd_dt_set(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	LOGE("DT_SET unimplemented");
+
+	return 0;
+}
+
+static uint16_t cmd_flash_write(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	if (flash_write(ntohl(c->flData.addr), len - sizeof(uint32_t),
+				(char*)c->flData.data)) {
+		reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+	}
+
+	return 0;
+}
+
+static uint16_t cmd_flash_read(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	uint32_t addr = ntohl(c->flRange.addr);
+	uint16_t replen = ntohs(c->flRange.len);
+
+	if (flash_read(addr, replen, (char*)reply->data)) {
+		reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+		return 0;
+	}
+
+	return replen;
+}
+
+static uint16_t cmd_flash_erase(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	if (flash_erase(ntohs(c->flSect))) {
+		reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+	}
+
+	return 0;
+}
+
+static uint16_t cmd_flash_id(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	reply->flash_id.device = htons(d.flash_dev);
+	reply->flash_id.manufacturer = d.flash_man;
+	reply->datalen = htons(3);
+
+	return 3;
+}
+
+static uint16_t cmd_sys_stat(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	MwSysStatFill(reply);
+	LOGI("%02X %02X %02X %02X", reply->data[0], reply->data[1],
+			reply->data[2], reply->data[3]);
+
+	return sizeof(MwMsgSysStat);
+}
+
+static uint16_t cmd_def_cfg_set(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	// Check lengt and magic value
+	if ((len != 4) || (c->dwData[0] !=
+				ByteSwapDWord(MW_FACT_RESET_MAGIC))) {
+		LOGE("Wrong DEF_CFG_SET command invocation!");
+		reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+	} else if (esp_partition_erase_range(d.p_cfg, 0,
+				MW_CFG_SECT_LEN) != ESP_OK) {
+		LOGE("Config flash sector erase failed!");
+		reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+	} else {
+		LOGI("Configuration set to default.");
+	}
+
+	return 0;
+}
+
+static uint16_t cmd_hrng_get(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	uint16_t replen = ByteSwapWord(c->rndLen);
+
+	if (replen > MW_CMD_MAX_BUFLEN) {
+		reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+		return 0;
+	}
+	reply->datalen = c->rndLen;
+	rand_fill(reply->data, replen);
+
+	return replen;
+}
+
+static uint16_t cmd_bssid_get(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	reply->datalen = ByteSwapWord(6);
+	esp_wifi_get_mac(c->data[0], reply->data);
+	LOGI("Got BSSID(%d) %02X:%02X:%02X:%02X:%02X:%02X",
+			c->data[0], reply->data[0], reply->data[1],
+			reply->data[2], reply->data[3],
+			reply->data[4], reply->data[5]);
+
+	return 6;
+}
+
+static uint16_t cmd_gamertag_set(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	if (c->gamertag_set.slot >= MW_NUM_GAMERTAGS ||
+			len != sizeof(struct mw_gamertag_set_msg)) {
+		reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+	} else {
+		// Copy gamertag and save to flash
+		memcpy(&cfg.gamertag[c->gamertag_set.slot],
+				&c->gamertag_set.gamertag,
+				sizeof(struct mw_gamertag));
+	}
+
+	return 0;
+}
+
+static uint16_t cmd_gamertag_get(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	uint16_t replen = 0;
+
+	if (c->data[0] >= MW_NUM_GAMERTAGS) {
+		reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+	} else {
+		replen = sizeof(struct mw_gamertag);
+		memcpy(&reply->gamertag_get, &cfg.gamertag[c->data[0]],
+				replen);
+	}
+	reply->datalen = ByteSwapWord(replen);
+
+	return replen;
+}
+
+static uint16_t cmd_log(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	puts((char*)c->data);
+
+	return 0;
+}
+
+static uint16_t cmd_nv_cfg_save(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	if (mw_nv_cfg_save() < 0) {
+		reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+	}
+
+	return 0;
+}
+
+static uint16_t cmd_factory_reset(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	MwSetDefaultCfg();
+
+	return cmd_nv_cfg_save(c, len, reply);
+}
+
+static uint16_t cmd_sleep(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	// No reply, wakeup continues from user_init()
+	deep_sleep();
+	LOGI("Entering deep sleep");
+	esp_deep_sleep(0);
+	// As it takes a little for the module to enter deep
+	// sleep, stay here for a while
+	vTaskDelayMs(60000);
+
+	return 0;
+}
+
+static uint16_t cmd_http_url_set(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	if (http_url_set((char*)c->data)) {
+		reply->cmd = htons(MW_CMD_ERROR);
+	}
+
+	return 0;
+}
+
+static uint16_t cmd_http_method_set(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	if (http_method_set(c->data[0])) {
+		reply->cmd = htons(MW_CMD_ERROR);
+	}
+
+	return 0;
+}
+
+static uint16_t cmd_http_hdr_add(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	if (http_header_add((char*)c->data)) {
+		reply->cmd = htons(MW_CMD_ERROR);
+	}
+
+	return 0;
+}
+
+static uint16_t cmd_http_hdr_del(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	if (http_header_del((char*)c->data)) {
+		reply->cmd = htons(MW_CMD_ERROR);
+	}
+
+	return 0;
+}
+
+static uint16_t cmd_http_open(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	if (http_open(ntohl(c->dwData[0]))) {
+		reply->cmd = htons(MW_CMD_ERROR);
+	}
+
+	return 0;
+}
+
+static uint16_t cmd_http_finish(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	return http_parse_finish(reply);
+}
+
+static uint16_t cmd_http_cleanup(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	if (http_cleanup()) {
+		reply->cmd = htons(MW_CMD_ERROR);
+	}
+
+	return 0;
+}
+
+static uint16_t cmd_http_cert_query(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	reply->dwData[0] = htonl(http_cert_query());
+	if (0xFFFFFFFF == reply->dwData[0]) {
+		reply->cmd = htons(MW_CMD_ERROR);
+		return 0;
+	}
+	reply->datalen = htons(4);
+
+	return 4;
+}
+
+static uint16_t cmd_http_cert_set(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	if (http_cert_set(ntohl(c->dwData[0]), ntohs(c->wData[2]))) {
+		reply->cmd = htons(MW_CMD_ERROR);
+	}
+
+	return 0;
+}
+
+static uint16_t cmd_server_url_get(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	return parse_server_url_get(reply);
+}
+
+static uint16_t cmd_server_url_set(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	parse_server_url_set((char*)c->data, reply);
+
+	return 0;
+}
+
+static uint16_t cmd_wifi_adv_get(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	return parse_wifi_adv_get(reply);
+}
+
+static uint16_t cmd_wifi_adv_set(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	parse_wifi_adv_set(&c->wifi_adv_cfg, reply);
+
+	return 0;
+}
+
+static uint16_t cmd_upgrade_list(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	// TODO
+	return 0;
+}
+
+static uint16_t cmd_upgrade_perform(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	parse_upgrade((char*)c->data, reply);
+
+	return 0;
+}
+
+static uint16_t cmd_game_endpoint_set(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	parse_game_endpoint_set((char*)c->data, reply);
+
+	return 0;
+}
+
+static uint16_t cmd_game_keyval_add(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	parse_game_add_keyval((char*)c->data, reply);
+
+	return 0;
+}
+
+static uint16_t cmd_game_request(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	return parse_game_request(&c->ga_request, reply);
+}
+
+// Receives the HTTP reply body, once the request reply has been sent
+static void cmd_http_recv(void)
+{
+	http_recv();
+}
+
+static uint16_t cmd_lsd_stats(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	return lsd_stats_get(reply);
+}
+
+static uint16_t cmd_lsd_opt(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	lsd_opt_set(&c->lsd_opt, len, reply);
+
+	return 0;
+}
+
+static uint16_t cmd_lsd_baud(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	lsd_baud(&c->lsd_baud, len, reply);
+
+	return 0;
+}
+
+static uint16_t cmd_lsd_comp(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	if (LsdChCompSet(c->lsd_comp.channel, c->lsd_comp.comp)) {
+		reply->cmd = htons(MW_CMD_ERROR);
+	}
+
+	return 0;
+}
+
+static uint16_t cmd_event_set(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	d.ev_mask = ntohl(c->dwData[0]) &
+		(MW_EVENT_BIT(MW_EVENT_MAX) - 1);
+	LOGI("event mask: 0x%02" PRIX32, d.ev_mask);
+	reply->dwData[0] = htonl(d.ev_mask);
+	reply->datalen = htons(sizeof(uint32_t));
+
+	return sizeof(uint32_t);
+}
+
+static uint16_t cmd_fsm_stats(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	struct mw_fsm_stats *stats = &reply->fsm_stats;
+
+	stats->ev_no_slot = htonl(d.ev_no_slot);
+	stats->ev_q_full = htonl(mq_full_count(&d.q, MW_LANE_WIFI));
+	stats->ev_hwm = htonl(d.ev_hwm);
+	reply->datalen = htons(sizeof(struct mw_fsm_stats));
+
+	return sizeof(struct mw_fsm_stats);
+}
+
+static uint16_t cmd_batch(MwCmd *c, uint16_t len, MwCmd *reply);
+
+/// Shorthands for the command table state sets
+#define S_IDLE		MW_IN(MW_ST_IDLE)
+#define S_JOIN		MW_IN(MW_ST_AP_JOIN)
+#define S_READY		MW_IN(MW_ST_READY)
+
+/// Command table, indexed by command code. Commands without handler are
+/// unknown.
+static const struct mw_cmd_entry mw_cmd_tbl[] = {
+	[MW_CMD_VERSION] = {cmd_version, 0, MW_REP_DATA,
+		S_IDLE | S_JOIN | S_READY},
+	[MW_CMD_ECHO] = {cmd_echo, 0, MW_REP_NONE, S_IDLE | S_READY},
+	[MW_CMD_AP_SCAN] = {cmd_ap_scan, 1, MW_REP_NONE, S_IDLE},
+	[MW_CMD_AP_CFG] = {cmd_ap_cfg, offsetof(MwMsgApCfg, ssid),
+		MW_REP_HEAD, S_IDLE | S_READY},
+	[MW_CMD_AP_CFG_GET] = {cmd_ap_cfg_get, 1, MW_REP_DATA,
+		S_IDLE | S_READY},
+	[MW_CMD_IP_CURRENT] = {cmd_ip_current, 0, MW_REP_DATA, S_READY},
+	[MW_CMD_IP_CFG] = {cmd_ip_cfg, sizeof(MwMsgIpCfg), MW_REP_HEAD,
+		S_IDLE | S_READY},
+	[MW_CMD_IP_CFG_GET] = {cmd_ip_cfg_get, 1, MW_REP_DATA,
+		S_IDLE | S_READY},
+	[MW_CMD_DEF_AP_CFG] = {cmd_def_ap_cfg, 1, MW_REP_HEAD,
+		S_IDLE | S_READY},
+	[MW_CMD_DEF_AP_CFG_GET] = {cmd_def_ap_cfg_get, 0, MW_REP_DATA,
+		S_IDLE | S_READY},
+	[MW_CMD_AP_JOIN] = {cmd_ap_join, 1, MW_REP_HEAD, S_IDLE},
+	[MW_CMD_AP_LEAVE] = {cmd_ap_leave, 0, MW_REP_HEAD, S_JOIN | S_READY},
+	[MW_CMD_TCP_CON] = {cmd_tcp_con, offsetof(MwMsgInAddr, data),
+		MW_REP_HEAD, S_READY, .job = TRUE},
+	[MW_CMD_TCP_BIND] = {cmd_tcp_bind, sizeof(MwMsgBind), MW_REP_HEAD,
+		S_READY},
+	[MW_CMD_CLOSE] = {cmd_close, 1, MW_REP_HEAD, S_READY},
+	[MW_CMD_UDP_SET] = {cmd_udp_set, offsetof(MwMsgInAddr, data),
+		MW_REP_HEAD, S_READY},
+	[MW_CMD_SOCK_STAT] = {cmd_sock_stat, 1, MW_REP_DATA, S_READY},
+	[MW_CMD_PING] = {cmd_ping, 0, MW_REP_NONE, S_READY},
+	[MW_CMD_SNTP_CFG] = {cmd_sntp_cfg, 0, MW_REP_HEAD, S_IDLE | S_READY},
+	[MW_CMD_SNTP_CFG_GET] = {cmd_sntp_cfg_get, 0, MW_REP_DATA,
+		S_IDLE | S_READY},
+	[MW_CMD_DATETIME] = {cmd_datetime, 0, MW_REP_DATA, S_IDLE | S_READY},
+	[MW_CMD_DT_SET] = {cmd_dt_set, 0, MW_REP_NONE, S_IDLE | S_READY},
+	[MW_CMD_FLASH_WRITE] = {cmd_flash_write, sizeof(uint32_t),
+		MW_REP_HEAD, S_IDLE | S_READY, .res = MW_RES_FLASH},
+	[MW_CMD_FLASH_READ] = {cmd_flash_read,
+		sizeof(uint32_t) + sizeof(uint16_t), MW_REP_DATA,
+		S_IDLE | S_READY, .res = MW_RES_FLASH},
+	[MW_CMD_FLASH_ERASE] = {cmd_flash_erase, sizeof(uint16_t),
+		MW_REP_HEAD, S_IDLE | S_READY, .job = TRUE,
+		.res = MW_RES_FLASH},
+	[MW_CMD_FLASH_ID] = {cmd_flash_id, 0, MW_REP_DATA, S_IDLE | S_READY},
+	[MW_CMD_SYS_STAT] = {cmd_sys_stat, 0, MW_REP_DATA,
+		S_IDLE | S_JOIN | S_READY},
+	[MW_CMD_DEF_CFG_SET] = {cmd_def_cfg_set, sizeof(uint32_t),
+		MW_REP_HEAD, S_IDLE | S_READY},
+	[MW_CMD_HRNG_GET] = {cmd_hrng_get, sizeof(uint16_t), MW_REP_DATA,
+		S_IDLE | S_READY},
+	[MW_CMD_BSSID_GET] = {cmd_bssid_get, 1, MW_REP_DATA, S_IDLE | S_READY},
+	[MW_CMD_GAMERTAG_SET] = {cmd_gamertag_set,
+		sizeof(struct mw_gamertag_set_msg), MW_REP_HEAD,
+		S_IDLE | S_READY},
+	[MW_CMD_GAMERTAG_GET] = {cmd_gamertag_get, 1, MW_REP_DATA,
+		S_IDLE | S_READY},
+	[MW_CMD_LOG] = {cmd_log, 0, MW_REP_HEAD, S_IDLE | S_READY},
+	[MW_CMD_FACTORY_RESET] = {cmd_factory_reset, 0, MW_REP_HEAD, S_IDLE},
+	[MW_CMD_SLEEP] = {cmd_sleep, 0, MW_REP_NONE, S_IDLE | S_READY},
+	[MW_CMD_HTTP_URL_SET] = {cmd_http_url_set, 0, MW_REP_HEAD,
+		S_IDLE | S_READY, .res = MW_RES_HTTP},
+	[MW_CMD_HTTP_METHOD_SET] = {cmd_http_method_set, 1, MW_REP_HEAD,
+		S_IDLE | S_READY, .res = MW_RES_HTTP},
+	[MW_CMD_HTTP_CERT_QUERY] = {cmd_http_cert_query, 0, MW_REP_DATA,
+		S_IDLE | S_READY, .res = MW_RES_HTTP},
+	[MW_CMD_HTTP_CERT_SET] = {cmd_http_cert_set,
+		sizeof(uint32_t) + sizeof(uint16_t), MW_REP_HEAD,
+		S_IDLE | S_READY, .job = TRUE, .res = MW_RES_HTTP},
+	[MW_CMD_HTTP_HDR_ADD] = {cmd_http_hdr_add, 0, MW_REP_HEAD,
+		S_IDLE | S_READY, .res = MW_RES_HTTP},
+	[MW_CMD_HTTP_HDR_DEL] = {cmd_http_hdr_del, 0, MW_REP_HEAD,
+		S_IDLE | S_READY, .res = MW_RES_HTTP},
+	[MW_CMD_HTTP_OPEN] = {cmd_http_open, sizeof(uint32_t), MW_REP_HEAD,
+		S_READY, .job = TRUE, .res = MW_RES_HTTP},
+	[MW_CMD_HTTP_FINISH] = {cmd_http_finish, 0, MW_REP_DATA, S_READY,
+		cmd_http_recv, .job = TRUE, .res = MW_RES_HTTP},
+	[MW_CMD_HTTP_CLEANUP] = {cmd_http_cleanup, 0, MW_REP_HEAD,
+		S_IDLE | S_READY, .res = MW_RES_HTTP},
+	[MW_CMD_SERVER_URL_GET] = {cmd_server_url_get, 0, MW_REP_DATA,
+		S_IDLE | S_READY},
+	[MW_CMD_SERVER_URL_SET] = {cmd_server_url_set, 0, MW_REP_HEAD,
+		S_IDLE | S_READY, .res = MW_RES_OTA},
+	[MW_CMD_WIFI_ADV_GET] = {cmd_wifi_adv_get, 0, MW_REP_DATA,
+		S_IDLE | S_READY},
+	[MW_CMD_WIFI_ADV_SET] = {cmd_wifi_adv_set,
+		sizeof(struct mw_wifi_adv_cfg), MW_REP_HEAD, S_IDLE | S_READY},
+	[MW_CMD_NV_CFG_SAVE] = {cmd_nv_cfg_save, 0, MW_REP_HEAD,
+		S_IDLE | S_READY},
+	[MW_CMD_UPGRADE_LIST] = {cmd_upgrade_list, 0, MW_REP_HEAD, S_READY},
+	[MW_CMD_UPGRADE_PERFORM] = {cmd_upgrade_perform, 0, MW_REP_HEAD,
+		S_READY, .job = TRUE, .res = MW_RES_OTA},
+	[MW_CMD_GAME_ENDPOINT_SET] = {cmd_game_endpoint_set, 0, MW_REP_HEAD,
+		S_IDLE | S_READY, .res = MW_RES_HTTP},
+	[MW_CMD_GAME_KEYVAL_ADD] = {cmd_game_keyval_add, 0, MW_REP_HEAD,
+		S_IDLE | S_READY, .res = MW_RES_HTTP},
+	[MW_CMD_GAME_REQUEST] = {cmd_game_request,
+		sizeof(struct mw_ga_request), MW_REP_DATA, S_READY,
+		cmd_http_recv, .job = TRUE, .res = MW_RES_HTTP},
+	[MW_CMD_LSD_STATS] = {cmd_lsd_stats, 0, MW_REP_DATA, S_IDLE | S_READY},
+	[MW_CMD_LSD_OPT] = {cmd_lsd_opt, sizeof(uint32_t), MW_REP_NONE,
+		S_IDLE | S_READY},
+	[MW_CMD_LSD_BAUD] = {cmd_lsd_baud, sizeof(struct mw_lsd_baud),
+		MW_REP_NONE, S_IDLE | S_READY},
+	[MW_CMD_LSD_COMP] = {cmd_lsd_comp, sizeof(struct mw_lsd_comp),
+		MW_REP_HEAD, S_IDLE | S_READY},
+	[MW_CMD_BATCH] = {cmd_batch, 0, MW_REP_NONE, S_IDLE | S_READY},
+	[MW_CMD_EVENT_SET] = {cmd_event_set, sizeof(uint32_t), MW_REP_DATA,
+		S_IDLE | S_JOIN | S_READY},
+	[MW_CMD_FSM_STATS] = {cmd_fsm_stats, 0, MW_REP_DATA,
+		S_IDLE | S_JOIN | S_READY}
+};
+
+#undef S_IDLE
+#undef S_JOIN
+#undef S_READY
+
+// Replies a command error, reusing the request buffer
+static void cmd_error(MwCmd *c)
+{
+	c->datalen = 0;
+	c->cmd = ByteSwapWord(MW_CMD_ERROR);
+	reply_send(c, 0);
+}
+
+// Completes an AP scan, replying with the found APs
+static void scan_done(const system_event_t *wifi)
+{
+	MwMsgBuf *rb;
+	MwCmd *reply;
+	int scan_len = -1;
+
+	if (!d.scan_pending) {
+		return;
+	}
+	d.scan_pending = FALSE;
+	rb = buf_alloc_wait(MW_BUF_RSV_REPLY, portMAX_DELAY);
+	reply = &rb->cmd;
+	reply_set_ok_empty(reply);
+	if (wifi->event_info.scan_done.status) {
+		LOGE("scan failed, status %" PRIu32,
+				wifi->event_info.scan_done.status);
+		esp_wifi_stop();
+	} else {
+		scan_len = wifi_scan_get(reply->data);
+	}
+	if (scan_len <= 0) {
+		reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+		scan_len = 0;
+	} else {
+		reply->datalen = ByteSwapWord(scan_len);
+	}
+	reply_queue(reply, rb, d.scan_tag, scan_len);
+	buf_unref(rb);
+}
+
+// Looks up a command, checking it is allowed on the current state and the
+// request is long enough. Returns the command table entry, or NULL if the
+// command cannot run.
+static const struct mw_cmd_entry *cmd_lookup(uint8_t cmd, uint16_t len)
+{
+	const struct mw_cmd_entry *e;
+
+	if (cmd >= ARRAY_SIZE(mw_cmd_tbl) || !mw_cmd_tbl[cmd].handler) {
+		LOGE("UNKNOWN REQUEST %d!", cmd);
+		return NULL;
+	}
+	e = &mw_cmd_tbl[cmd];
+	if (!(e->states & MW_IN(d.s.sys_stat))) {
+		LOGE("Command %d not allowed on state %d", cmd, d.s.sys_stat);
+		return NULL;
+	}
+	if (len < e->min_len) {
+		LOGE("Command %d too short (%d bytes)", cmd, len);
+		return NULL;
+	}
+
+	return e;
+}
+
+static uint16_t cmd_batch(MwCmd *c, uint16_t len, MwCmd *reply)
+{
+	const struct mw_cmd_entry *e;
+	MwCmd *sub_rep = &d.batch_rep;
+	MwCmd *sub;
+	uint16_t sub_len;
+	uint16_t replen;
+	uint16_t pos = 0;
+	uint16_t out = 0;
+	uint16_t next;
+	int n = 0;
+
+	// Sub-replies are built apart, as they can be as long as a reply
+	while (pos < len) {
+		sub = (MwCmd*)(c->data + pos);
+		if (n >= MW_BATCH_MAX || pos + MW_CMD_HEADLEN > len ||
+				pos + MW_CMD_HEADLEN + ntohs(sub->datalen) > len) {
+			LOGE("bad batch sub-request %d", n);
+			reply->cmd = ByteSwapWord(MW_CMD_ERROR);
 			break;
+		}
+		sub_len = ntohs(sub->datalen);
+		pos += ALIGN_UP(MW_CMD_HEADLEN + sub_len, MW_BATCH_ALIGN);
+
+		reply_set_ok_empty(sub_rep);
+		replen = 0;
+		e = cmd_lookup(MW_CMD_CODE(ntohs(sub->cmd)), sub_len);
+		// Sub-requests cannot be deferred, and jobs would block the FSM.
+		// Only jobs have post actions, so none is run for the batch.
+		if (!e || MW_REP_NONE == e->rep || e->job ||
+				(e->res & (d.res_busy | d.res_wait))) {
+			sub_rep->cmd = ByteSwapWord(MW_CMD_ERROR);
+		} else {
+			replen = e->handler(sub, sub_len, sub_rep);
+		}
+		if (MW_CMD_OK != sub_rep->cmd || MW_REP_HEAD == e->rep) {
+			replen = 0;
+		}
+		next = out + MW_CMD_HEADLEN + replen;
+		if (next > MW_CMD_MAX_BUFLEN) {
+			LOGE("batch reply too long");
+			reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+			break;
+		}
+		sub_rep->datalen = htons(replen);
+		memcpy(reply->data + out, sub_rep, MW_CMD_HEADLEN + replen);
+		out = MIN(ALIGN_UP(next, MW_BATCH_ALIGN), MW_CMD_MAX_BUFLEN);
+		memset(reply->data + next, 0, out - next);
+		if (MW_CMD_OK != sub_rep->cmd) {
+			reply->cmd = ByteSwapWord(MW_CMD_ERROR);
+			break;
+		}
+		n++;
+	}
+	LOGI("batch: %d sub-requests done, %d reply bytes", n, out);
+	reply->datalen = htons(out);
+	reply_send(reply, out);
+
+	return out;
+}
+
+// Sends a command reply with the specified tag, and runs the command post
+// action if it succeeded. If the reply is in a pool buffer (b is not NULL)
+// it is queued without waiting. Jobs pass NULL, as their post actions
+// reuse the reply buffer.
+static void cmd_reply(const struct mw_cmd_entry *e, MwCmd *reply,
+		MwMsgBuf *b, uint8_t tag, uint16_t replen)
+{
+	switch (e->rep) {
+	case MW_REP_HEAD:
+		reply_queue(reply, b, tag, 0);
+		break;
+
+	case MW_REP_DATA:
+		reply_queue(reply, b, tag, replen);
+		break;
+
+	default:
+		break;
+	}
+	if (e->post && MW_CMD_CODE(ntohs(reply->cmd)) == MW_CMD_OK) {
+		e->post();
+	}
+}
+
+// Keeps a request to process it again once a job completes. Requests are
+// at the start of a pool buffer. Returns TRUE if the request was deferred.
+static bool cmd_defer(MwCmd *c, const struct mw_cmd_entry *e)
+{
+	MwMsgBuf *b = (MwMsgBuf*)c;
+
+	if (d.n_deferred >= MW_DEFER_LEN) {
+		return FALSE;
+	}
+	buf_ref(b);
+	d.deferred[d.n_deferred++] = b;
+	// Later requests using the same resources wait behind this one
+	d.res_wait |= e->res;
+
+	return TRUE;
+}
+
+// Returns a free job slot, or NULL if all the slots are in use
+static struct mw_job *job_slot_get(void)
+{
+	int i;
+
+	for (i = 0; i < MW_JOBS; i++) {
+		if (!d.job[i].busy) {
+			return &d.job[i];
+		}
 	}
+
+	return NULL;
+}
+
+// Runs a command on a worker task. The reply is built over the request,
+// whose header is not needed anymore.
+static void job_run(struct worker_job *w)
+{
+	struct mw_job *j = (struct mw_job*)w;
+	MwCmd *c = &j->b->cmd;
+	uint16_t replen;
+
+	reply_set_ok_empty(c);
+	replen = j->e->handler(c, j->len, c);
+	cmd_reply(j->e, c, NULL, j->tag, replen);
+}
+
+// Called on the worker task once a job has run. The request buffer is
+// returned to the pool here, not to hold it until the FSM is notified.
+static void job_done_cb(struct worker_job *w, uint8_t worker)
+{
+	MwFsmMsg m = {
+		.e = MW_EV_JOB_DONE,
+		.d = w
+	};
+
+	buf_unref(((struct mw_job*)w)->b);
+	mq_send(&d.q, MW_LANE_WORK + worker, &m, portMAX_DELAY);
+}
+
+// Releases a job slot and the resources held by the job
+static void job_end(struct mw_job *j)
+{
+	d.res_busy &= ~j->e->res;
+	j->busy = FALSE;
+}
+
+// Submits a command to run on a worker task, using job slot j
+static void job_submit(struct mw_job *j, const struct mw_cmd_entry *e,
+		MwCmd *c, uint16_t len)
+{
+	j->w.run = job_run;
+	j->e = e;
+	j->b = (MwMsgBuf*)c;
+	j->len = len;
+	j->tag = d.tag;
+	j->busy = TRUE;
+	d.res_busy |= e->res;
+	// Request is kept after the receiver buffer is freed
+	buf_ref(j->b);
+	if (!worker_submit(&j->w)) {
+		// Not expected, the queue has room for all the job slots
+		LOGE("cannot submit job");
+		buf_unref(j->b);
+		job_end(j);
+		cmd_error(c);
+	}
+}
+
+/// Process command requests (coming from the serial line), if allowed on
+/// the current state. Commands running as jobs are submitted to the
+/// workers, and the ones that cannot run yet are deferred.
+int MwFsmCmdProc(MwCmd *c, uint16_t totalLen) {
+	const struct mw_cmd_entry *e;
+	struct mw_job *j = NULL;
+	MwMsgBuf *rb;
+	MwCmd *reply;
+	uint16_t len = ByteSwapWord(c->datalen);
+	uint16_t replen;
+	
+	// Sanity check: total Lengt - header length = data length
+	if ((totalLen - MW_CMD_HEADLEN) != len) {
+		LOGE("ERROR: Length inconsistent");
+		LOGE("totalLen=%d, dataLen=%d", totalLen, len);
+		return MW_CMD_FMT_ERROR;
+	}
+
+	d.tag = MW_CMD_TAG(ByteSwapWord(c->cmd));
+	LOGI("CmdRequest: %d, tag %d", MW_CMD_CODE(ByteSwapWord(c->cmd)), d.tag);
+	e = cmd_lookup(MW_CMD_CODE(ByteSwapWord(c->cmd)), len);
+	if (!e) {
+		cmd_error(c);
+		return MW_ERROR;
+	}
+
+	// Wait for the jobs holding the resources, or a job slot
+	if ((e->res & (d.res_busy | d.res_wait)) ||
+			(e->job && !(j = job_slot_get()))) {
+		if (!cmd_defer(c, e)) {
+			LOGE("too many deferred commands");
+			cmd_error(c);
+			return MW_ERROR;
+		}
+		LOGD("command deferred");
+		return MW_OK;
+	}
+	if (e->job) {
+		job_submit(j, e, c, len);
+		return MW_OK;
+	}
+
+	// Reply is built in a pool buffer, not to hold it in the stack
+	rb = buf_alloc_wait(MW_BUF_RSV_REPLY, portMAX_DELAY);
+	reply = &rb->cmd;
+	reply_set_ok_empty(reply);
+	replen = e->handler(c, len, reply);
+	cmd_reply(e, reply, rb, d.tag, replen);
+	buf_unref(rb);
+
 	return MW_OK;
 }
 
+// Completes a job, and processes again the deferred requests. The ones
+// that still cannot run are deferred again, in the same order.
+static void job_complete(struct mw_job *j)
+{
+	MwMsgBuf *b[MW_DEFER_LEN];
+	int n = d.n_deferred;
+	int i;
+
+	job_end(j);
+	memcpy(b, d.deferred, n * sizeof(MwMsgBuf*));
+	d.n_deferred = 0;
+	d.res_wait = 0;
+	for (i = 0; i < n; i++) {
+		MwFsmCmdProc(&b[i]->cmd, b[i]->len);
+		buf_unref(b[i]);
+	}
+}
+
 static int MwUdpSend(int idx, const void *data, int len) {
 	struct sockaddr_in remote;
 	int s = d.sock[idx];
@@ -1773,8 +2728,9 @@ static int MwUdpSend(int idx, const void *data, int len) {
 		remote.sin_family = AF_INET;
 		remote.sin_len = sizeof(struct sockaddr_in);
 		memset(remote.sin_zero, 0, sizeof(remote.sin_zero));
-		sent = lwip_sendto(s, data + 6, len - 6, 0, (struct sockaddr*)
-				&remote, sizeof(struct sockaddr_in)) + 6;
+		sent = lwip_sendto(s, data + MW_UDP_ADDR_LEN,
+				len - MW_UDP_ADDR_LEN, 0, (struct sockaddr*)
+				&remote, sizeof(struct sockaddr_in)) + MW_UDP_ADDR_LEN;
 	}
 
 	return sent;
@@ -1806,7 +2762,14 @@ void MwFsmReady(MwFsmMsg *msg) {
 
 	switch (msg->e) {
 		case MW_EV_WIFI:		///< WiFi events, excluding scan related.
-			LOGI("WIFI_EVENT %d (not parsed)", wifi->event_id);
+			if (SYSTEM_EVENT_STA_DISCONNECTED == wifi->event_id) {
+				LOGE("disconnected, reason: %d",
+						wifi->event_info.disconnected.reason);
+				MwEventSend(MW_EVENT_WIFI_DOWN, 0,
+						wifi->event_info.disconnected.reason);
+			} else {
+				LOGI("WIFI_EVENT %d (not parsed)", wifi->event_id);
+			}
 			break;
 
 		case MW_EV_SER_RX:		///< Data reception from serial line.
@@ -1814,18 +2777,7 @@ void MwFsmReady(MwFsmMsg *msg) {
 			// If using channel 0, process command. Else forward message
 			// to the appropiate socket.
 			if (MW_CTRL_CH == b->ch) {
-				// Check command is allowed on READY state
-				if (MwCmdInList(b->cmd.cmd>>8, readyCmdMask)) {
-					MwFsmCmdProc((MwCmd*)b, b->len);
-				} else {
-					LOGE("Command %d not allowed on READY state",
-							b->cmd.cmd>>8);
-					// TODO: Throw error event?
-					rep = (MwCmd*)msg->d;
-					rep->datalen = 0;
-					rep->cmd = ByteSwapWord(MW_CMD_ERROR);
-					LsdSend((uint8_t*)rep, MW_CMD_HEADLEN, 0);
-				}
+				MwFsmCmdProc((MwCmd*)b, b->len);
 			} else if (MW_HTTP_CH == b->ch) {
 				// Process channel using HTTP state machine
 				http_send((char*)b->data, b->len);
@@ -1872,11 +2824,14 @@ static void ap_join_ev_handler(system_event_t *wifi)
 					&wifi->event_info.got_ip.ip_info.ip));
 			d.s.sys_stat = MW_ST_READY;
 			d.s.online = TRUE;
+			MwEventSend(MW_EVENT_IP, 0,
+					ntohl(wifi->event_info.got_ip.ip_info.ip.addr));
 			break;
 
 		case SYSTEM_EVENT_STA_CONNECTED:
 			LOGD("station:"MACSTR" join",
 					MAC2STR(wifi->event_info.connected.bssid));
+			MwEventSend(MW_EVENT_WIFI_UP, 0, 0);
 			break;
 
 		case SYSTEM_EVENT_STA_DISCONNECTED:
@@ -1892,6 +2847,8 @@ static void ap_join_ev_handler(system_event_t *wifi)
 				LOGE("Too many assoc attempts, dessisting");
 				esp_wifi_disconnect();
 				d.s.sys_stat = MW_ST_IDLE;
+				MwEventSend(MW_EVENT_WIFI_DOWN, 0,
+						wifi->event_info.disconnected.reason);
 			}
 			break;
 
@@ -1905,7 +2862,12 @@ static void ap_join_ev_handler(system_event_t *wifi)
 
 static void MwFsm(MwFsmMsg *msg) {
 	MwMsgBuf *b = msg->d;
-	MwCmd *rep;
+
+	// Jobs complete the same way on any state
+	if (MW_EV_JOB_DONE == msg->e) {
+		job_complete(msg->d);
+		return;
+	}
 
 	switch (d.s.sys_stat) {
 		case MW_ST_INIT:
@@ -1920,53 +2882,27 @@ static void MwFsm(MwFsmMsg *msg) {
 			if (MW_EV_WIFI == msg->e) {
 				ap_join_ev_handler(msg->d);
 			} else if (MW_EV_SER_RX == msg->e) {
-				// The only rx events supported during AP_JOIN are AP_LEAVE,
-				// VERSION_GET and SYS_STAT
-				if (MW_CMD_AP_LEAVE == (b->cmd.cmd>>8)) {
+				// Only a few commands are allowed, see mw_cmd_tbl
+				if (MW_CTRL_CH == b->ch) {
 					MwFsmCmdProc((MwCmd*)b, b->len);
-				} else if (MW_CMD_VERSION == (b->cmd.cmd>>8)) {
-					rep = (MwCmd*)msg->d;
-					rep->cmd = MW_CMD_OK;
-					rep->datalen = ByteSwapWord(2 + sizeof(MW_FW_VARIANT) - 1);
-					rep->data[0] = MW_FW_VERSION_MAJOR;
-					rep->data[1] = MW_FW_VERSION_MINOR;
-					memcpy(rep->data + 2, MW_FW_VARIANT,
-							sizeof(MW_FW_VARIANT) - 1);
-					LsdSend((uint8_t*)rep, ByteSwapWord(rep->datalen) +
-							MW_CMD_HEADLEN, 0);
-				} else if (MW_CMD_SYS_STAT == (b->cmd.cmd>>8)) {
-					rep = (MwCmd*)msg->d;
-					rep->cmd = MW_CMD_OK;
-					MwSysStatFill(rep);
-					LOGD("%02X %02X %02X %02X", rep->data[0],
-							rep->data[1], rep->data[2], rep->data[3]);
-					LsdSend((uint8_t*)rep, sizeof(MwMsgSysStat) + MW_CMD_HEADLEN,
-							0);
 				} else {
-					LOGE("Command %d not allowed on AP_JOIN state",
-							b->cmd.cmd>>8);
+					LOGE("AP_JOIN received data on non ctrl channel!");
 				}
 			}
 			break;
 
 		case MW_ST_IDLE:
 			// IDLE state is abandoned once connected to an AP
-			if (MW_EV_SER_RX == msg->e) {
+			if (MW_EV_WIFI == msg->e) {
+				if (SYSTEM_EVENT_SCAN_DONE ==
+						((system_event_t*)msg->d)->event_id) {
+					scan_done(msg->d);
+				}
+			} else if (MW_EV_SER_RX == msg->e) {
 				// Parse commands on channel 0 only
 				LOGD("Serial recvd %d bytes.", b->len);
 				if (MW_CTRL_CH == b->ch) {
-					// Check command is allowed on IDLE state
-					if (MwCmdInList(b->cmd.cmd>>8, idleCmdMask)) {
-						MwFsmCmdProc((MwCmd*)b, b->len);
-					} else {
-						LOGE("Command %d not allowed on IDLE state",
-								b->cmd.cmd>>8);
-						// TODO: Throw error event?
-						rep = (MwCmd*)msg->d;
-						rep->datalen = 0;
-						rep->cmd = ByteSwapWord(MW_CMD_ERROR);
-						LsdSend((uint8_t*)rep, MW_CMD_HEADLEN, 0);
-					}
+					MwFsmCmdProc((MwCmd*)b, b->len);
 				} else {
 					LOGE("IDLE received data on non ctrl channel!");
 				}
@@ -1991,7 +2927,7 @@ static void MwFsm(MwFsmMsg *msg) {
 	}
 	// Free WiFi event
 	if (MW_EV_WIFI == msg->e) {
-		free(msg->d);
+		ev_slot_free(msg->d);
 	}
 }
 
@@ -2027,15 +2963,16 @@ static int MwAccept(int sock, int ch) {
 	return 0;
 }
 
-static int MwUdpRecv(int idx, char *buf) {
+static int MwUdpRecv(int idx, char *buf, int len) {
 	ssize_t recvd;
 	int s = d.sock[idx];
 	struct sockaddr_in remote;
 	socklen_t addr_len = sizeof(remote);
+	int prefix;
 
 	if (d.raddr[idx].sin_addr.s_addr != lwip_htonl(INADDR_ANY)) {
 		// Receive only from specified address
-		recvd = lwip_recvfrom(s, buf, LSD_MAX_LEN, 0,
+		recvd = lwip_recvfrom(s, buf, len, 0,
 				(struct sockaddr*)&remote, &addr_len);
 		if (recvd > 0) {
 			if (remote.sin_addr.s_addr != d.raddr[idx].sin_addr.s_addr) {
@@ -2044,13 +2981,18 @@ static int MwUdpRecv(int idx, char *buf) {
 			}
 		}
 	} else {
-		// Reuse mode, data is preceded by remote IPv4 and port
-		recvd = lwip_recvfrom(s, buf + 6, LSD_MAX_LEN - 6, 0,
+		// Reuse mode, data is preceded by remote IPv4 and port, padded
+		// if payloads are aligned
+		prefix = (LsdOptGet() & LSD_OPT_ALIGN) ? MW_UDP_ADDR_ALIGN_LEN :
+			MW_UDP_ADDR_LEN;
+		recvd = lwip_recvfrom(s, buf + prefix, len - prefix, 0,
 				(struct sockaddr*)&remote, &addr_len);
 		if (recvd > 0) {
 			*((uint32_t*)buf) = remote.sin_addr.s_addr;
 			*((uint16_t*)(buf + 4)) = remote.sin_port;
-			recvd += 6;
+			memset(buf + MW_UDP_ADDR_LEN, 0,
+					prefix - MW_UDP_ADDR_LEN);
+			recvd += prefix;
 		}
 	}
 
@@ -2062,14 +3004,13 @@ static int MwRecv(int ch, char *buf, int len) {
 	int s = d.sock[idx];
 	// No IPv6 support yet
 	ssize_t recvd;
-	UNUSED_PARAM(len);
 
 	switch(d.ss[idx]) {
 		case MW_SOCK_TCP_EST:
-			return lwip_recv(s, buf, LSD_MAX_LEN, 0);
+			return lwip_recv(s, buf, len, 0);
 
 		case MW_SOCK_UDP_READY:
-			recvd = MwUdpRecv(idx, buf);
+			recvd = MwUdpRecv(idx, buf, len);
 			return recvd;
 
 		default:
@@ -2077,16 +3018,47 @@ static int MwRecv(int ch, char *buf, int len) {
 	}
 }
 
+// Removes from the set the sockets whose channel has no link credit left,
+// so data is not read from them and TCP flow control slows down the peer.
+// Sockets in the set are up to max. Returns the number of sockets removed.
+static int sock_credit_gate(fd_set *readset, int max)
+{
+	int gated = 0;
+	int i, ch;
+
+	for (i = LWIP_SOCKET_OFFSET; i <= max; i++) {
+		if (!FD_ISSET(i, readset)) {
+			continue;
+		}
+		ch = d.chan[i - LWIP_SOCKET_OFFSET];
+		if (d.ss[ch - 1] != MW_SOCK_TCP_LISTEN && !LsdChReady(ch)) {
+			FD_CLR(i, readset);
+			gated++;
+		}
+	}
+
+	return gated;
+}
+
 /// Polls sockets for data or incoming connections using select()
 void MwFsmSockTsk(void *pvParameters) {
 	fd_set readset;
 	int i, ch, retval;
 	int max;
 	ssize_t recvd;
+	// Data is read to pool buffers and queued without waiting, so LSD can
+	// pack data of the sockets read in the same pass in super-frames
+	MwMsgBuf *b;
+	uint16_t len;
 	struct timeval tv = {
 		.tv_sec = 1,
 		.tv_usec = 0
 	};
+	struct timeval poll = {
+		.tv_sec = 0,
+		.tv_usec = MW_SOCK_CREDIT_POLL_MS * 1000
+	};
+	bool gated;
 
 	//QueueHandle_t *q = (QueueHandle_t *)pvParameters;
 	UNUSED_PARAM(pvParameters);
@@ -2095,14 +3067,21 @@ void MwFsmSockTsk(void *pvParameters) {
 
 	while (1) {
 		led_toggle();
-		// Update list of active sockets
+		// Update list of active sockets. Workers add the sockets they
+		// connect, so the set is copied with them locked out.
+		taskENTER_CRITICAL();
 		readset = d.fds;
+		max = d.fdMax;
+		taskEXIT_CRITICAL();
+		// Channels waiting for credit are polled until it is granted
+		gated = sock_credit_gate(&readset, max) > 0;
 
 		// Wait until event or timeout
 		// TODO: d.fdMax is initialized to -1. How does select() behave if
 		// nfds = 0?
 		LOGD(".");
-		if ((retval = select(d.fdMax + 1, &readset, NULL, NULL, &tv)) < 0) {
+		if ((retval = select(max + 1, &readset, NULL, NULL,
+						gated ? &poll : &tv)) < 0) {
 			// Error.
 			LOGE("select() completed with error!");
 			vTaskDelayMs(1000);
@@ -2112,24 +3091,30 @@ void MwFsmSockTsk(void *pvParameters) {
 		if (0 == retval) continue;
 		// Poll the socket for data, and forward through the associated
 		// channel.
-		max = d.fdMax;
 		for (i = LWIP_SOCKET_OFFSET; i <= max; i++) {
 			if (FD_ISSET(i, &readset)) {
 				// Check if new connection or data received
 				ch = d.chan[i - LWIP_SOCKET_OFFSET];
 				if (d.ss[ch - 1] != MW_SOCK_TCP_LISTEN) {
 					LOGD("Rx: sock=%d, ch=%d", i, ch);
-					if ((recvd = MwRecv(ch, (char*)buf, LSD_MAX_LEN)) < 0) {
+					// Buffer is released once data has been sent
+					b = buf_alloc_wait(MW_BUF_RSV_DATA,
+							portMAX_DELAY);
+					len = MIN(LsdMaxLen(ch), sizeof(b->data));
+					if ((recvd = MwRecv(ch, (char*)b->data, len)) < 0) {
 						// Error!
+						buf_unref(b);
 						MwSockClose(ch);
 						LsdChDisable(ch);
 						LOGE("Error %d receiving from socket!", recvd);
+						MwFsmRaiseChEvent(ch);
 					} else if (0 == recvd) {
 						// Socket closed
 						// A listen on a socket closed, should trigger
 						// a 0-byte reception, for the client to be able to
 						// check server state and close the connection.
 						LOGD("Received 0!");
+						buf_unref(b);
 						MwSockClose(ch);
 						LOGE("Socket closed!");
 						MwFsmRaiseChEvent(ch);
@@ -2139,9 +3124,14 @@ void MwFsmSockTsk(void *pvParameters) {
 						LsdChDisable(ch);
 					} else {
 						LOGD("%02X %02X %02X %02X: WF->MD %d bytes",
-								buf[0], buf[1], buf[2], buf[3],
-								recvd);
-						LsdSend(buf, (uint16_t)recvd, ch);
+								b->data[0], b->data[1], b->data[2],
+								b->data[3], recvd);
+						if (LsdSendAsync(b->data, (uint16_t)recvd, ch,
+									buf_unref_cb, b) <= 0) {
+							// Queue full, wait for room
+							LsdSend(b->data, (uint16_t)recvd, ch);
+							buf_unref(b);
+						}
 					}
 				} else {
 					// Incoming connection. Accept it.
@@ -2154,15 +3144,21 @@ void MwFsmSockTsk(void *pvParameters) {
 }
 
 void MwFsmTsk(void *pvParameters) {
-	QueueHandle_t *q = (QueueHandle_t *)pvParameters;
-	MwFsmMsg m;
+	struct mq *q = pvParameters;
+	MwFsmMsg m[MW_FSM_BATCH];
+	int n, i;
 
 	while(1) {
-		if (xQueueReceive(*q, &m, 1000)) {
-			LOGD("Recv msg, evt=%d", m.e);
-			MwFsm(&m);
-			// If event was MW_EV_SER_RX, free the buffer
-			LsdRxBufFree();
+		// Process all the messages queued on each wakeup
+		if ((n = mq_recv(q, m, MW_FSM_BATCH, 1000))) {
+			for (i = 0; i < n; i++) {
+				LOGD("Recv msg, evt=%d", m[i].e);
+				MwFsm(&m[i]);
+				// If event was MW_EV_SER_RX, free the buffer
+				if (MW_EV_SER_RX == m[i].e) {
+					LsdRxBufFree(m[i].d);
+				}
+			}
 		} else {
 			// Timeout
 			LOGD(".");
@@ -27,8 +27,34 @@
 #define MW_NUM_DNS_SERVERS	2
 /// Number of gamertags that can be stored in the module
 #define MW_NUM_GAMERTAGS	3
-/// Length of the FSM queue
-#define MW_FSM_QUEUE_LEN	8
+/// FSM queue lane for system messages. Lanes are listed by priority: the
+/// FSM gets the messages of the first ones before the others.
+#define MW_LANE_SYS		0
+/// FSM queue lane for frames received from the serial line. Control
+/// commands share it with channel data, as they must be processed in order
+/// (e.g. HTTP body data before MW_CMD_HTTP_FINISH).
+#define MW_LANE_SER		1
+/// FSM queue lane for the jobs completed by the first worker task. Each
+/// worker uses its own lane, following this one.
+#define MW_LANE_WORK		2
+/// Number of worker tasks, running the commands that block for long
+#define MW_WORKERS		2
+/// FSM queue lane for WiFi events
+#define MW_LANE_WIFI		(MW_LANE_WORK + MW_WORKERS)
+/// Number of FSM queue lanes
+#define MW_LANES		(MW_LANE_WIFI + 1)
+/// Length of each FSM queue lane (in messages, power of two). Holds an
+/// entry for each worker lane, so it must be updated with MW_WORKERS.
+#define MW_FSM_LANE_LEN		{2, 8, 2, 2, MW_EV_SLOTS}
+/// Maximum number of commands running (or waiting to run) on workers
+#define MW_JOBS			2
+/// Maximum number of commands waiting for a busy resource or a job slot.
+/// Enough for one per resource, and for pipelined HTTP requests (e.g.
+/// MW_CMD_HTTP_FINISH and MW_CMD_HTTP_CLEANUP sent while the
+/// MW_CMD_HTTP_OPEN job runs). Each one holds a pool buffer.
+#define MW_DEFER_LEN		3
+/// Maximum number of FSM messages received on each wakeup
+#define MW_FSM_BATCH		8
 /// Maximum number of simultaneous TCP connections
 #define MW_MAX_SOCK		2
 /// Maximum length of the default server
@@ -55,6 +81,26 @@
 /// Stack size (in elements) for SOCK task
 #define MW_SOCK_STACK_LEN	1024
 
+/// Stack size (in elements) for the worker tasks. They run the TLS
+/// handshakes of HTTP requests and firmware upgrades.
+#define MW_WORKER_STACK_LEN	8192
+
+/// Socket poll period while a channel waits for link credit (milliseconds)
+#define MW_SOCK_CREDIT_POLL_MS	10
+
+/// Socket poll period while connecting, to notice cancellations
+/// (milliseconds)
+#define MW_TCP_CON_POLL_MS	100
+
+/// Pool buffers left free when allocating command replies, for the LSD
+/// receiver. Just one, as the requests of running and deferred commands
+/// are held out of the receiver buffers, and replies must not wait for them.
+#define MW_BUF_RSV_REPLY	1
+
+/// Pool buffers left free when allocating buffers for socket data and
+/// events, so data waiting for link credit cannot stall command replies
+#define MW_BUF_RSV_DATA		(LSD_RX_BUFS + 1)
+
 /// Control channel used for command interpreter
 #define MW_CTRL_CH			0
 /// Channel used for HTTP requests and cert sets
@@ -70,6 +116,10 @@
 /// Priority for the WPOLL task
 #define MW_WPOLL_PRIO		1
 
+/// Priority for the worker tasks, below the link and socket tasks, so long
+/// commands do not delay data
+#define MW_WORKER_PRIO		1
+
 /** \addtogroup MwApi RetCodes Return values for functions of this module.
  *  \{ */
 /// Operation completed successfully
@@ -143,9 +193,90 @@
 #define MW_CMD_GAME_ENDPOINT_SET	 56	///< Set game API endpoint
 #define MW_CMD_GAME_KEYVAL_ADD		 57	///< Add key/value appended to requests
 #define MW_CMD_GAME_REQUEST		 58	///< Perform a game API request
+#define MW_CMD_LSD_STATS		 59	///< Get serial link statistics
+#define MW_CMD_LSD_OPT			 60	///< Negotiate serial link options
+#define MW_CMD_LSD_BAUD			 61	///< Negotiate serial link baud rate
+#define MW_CMD_LSD_COMP			 62	///< Set serial link compression
+#define MW_CMD_BATCH			 63	///< Run several commands in order
+#define MW_CMD_EVENT_SET		 64	///< Enable event notifications
+#define MW_CMD_FSM_STATS		 65	///< Get FSM queue statistics
+#define MW_CMD_EVENT			254	///< Event notification (not a reply)
 #define MW_CMD_ERROR			255	///< Error command reply
 /** \} */
 
+/** \addtogroup MwApi CmdTag Request tags.
+ *  The command code uses the low byte of the command word. The high byte is
+ *  an optional request tag, echoed in the reply, so the console can have
+ *  several commands in flight and match the replies as they complete.
+ *  Replies to long-running commands (e.g. MW_CMD_AP_SCAN) can then arrive
+ *  after the replies to commands sent later. Tag 0 is for untagged
+ *  requests, and consoles using it must wait for each reply before sending
+ *  the next command.
+ *  \{ */
+/// Gets the command code from a command word (in host byte order)
+#define MW_CMD_CODE(cmd)		((cmd) & 0xFF)
+/// Gets the request tag from a command word (in host byte order)
+#define MW_CMD_TAG(cmd)			((cmd)>>8)
+/// Builds a command word (in host byte order) from a tag and a code
+#define MW_CMD_TAGGED(tag, code)	(((tag)<<8) | (code))
+/** \} */
+
+/** \addtogroup MwApi CmdBatch Batch requests.
+ *  MW_CMD_BATCH data is a list of sub-requests, each one a command header
+ *  followed by its data, padded to MW_BATCH_ALIGN bytes. Sub-requests run
+ *  in order until one fails. The reply holds the replies of the
+ *  sub-requests that ran, using the same layout, and its code is
+ *  MW_CMD_ERROR if any sub-request failed. Sub-request tags are ignored.
+ *  Commands sending their own replies (e.g. MW_CMD_ECHO or MW_CMD_AP_SCAN),
+ *  and commands running on worker tasks (e.g. MW_CMD_TCP_CON,
+ *  MW_CMD_HTTP_OPEN or MW_CMD_HTTP_FINISH) cannot be batched.
+ *  \{ */
+/// Alignment of the sub-requests and sub-replies
+#define MW_BATCH_ALIGN		4
+/// Maximum number of sub-requests in a batch
+#define MW_BATCH_MAX		16
+/** \} */
+
+/** \addtogroup MwApi CmdTcpCon TCP connections.
+ *  MW_CMD_TCP_CON is replied once the connection completes or fails,
+ *  without blocking other commands, and the channel status is
+ *  MW_SOCK_TCP_CONNECTING meanwhile. The NULL terminated host name in the
+ *  request can be followed by a big endian 16-bit connect timeout, in
+ *  milliseconds (MW_TCP_CON_TMO_MS if missing or 0). MW_CMD_CLOSE on a
+ *  connecting channel cancels the connection: the MW_CMD_TCP_CON reply is
+ *  then MW_CMD_ERROR.
+ *  \{ */
+/// Default connect timeout (milliseconds)
+#define MW_TCP_CON_TMO_MS	10000
+/** \} */
+
+/** \addtogroup MwApi CmdEvent Event notifications.
+ *  Events enabled with MW_CMD_EVENT_SET are sent on the control channel
+ *  as unsolicited MW_CMD_EVENT frames, with untagged command words and a
+ *  struct mw_event as data, so the console does not have to poll
+ *  MW_CMD_SYS_STAT. All events are disabled after reset.
+ *
+ *  Events are sent without waiting, and are lost if the module runs out of
+ *  buffers: MW_CMD_SYS_STAT and MW_CMD_SOCK_STAT still report the current
+ *  state. Control frames are sent before data frames, so data of a channel
+ *  can arrive after an event about it (e.g. its close, or the completion of
+ *  an HTTP request).
+ *  \{ */
+/// Event mask bit for an event type (mw_event_type)
+#define MW_EVENT_BIT(type)	(1<<(type))
+/** \} */
+
+/** \addtogroup MwApi CmdFsmStats FSM queue statistics.
+ *  WiFi events are copied to one of MW_EV_SLOTS slots while they wait for
+ *  the FSM, and are dropped when the module cannot keep up with them (e.g.
+ *  on disconnect storms). MW_CMD_FSM_STATS replies a struct mw_fsm_stats
+ *  (big endian words) with the dropped event counts, that are never reset.
+ *  \{ */
+/// Number of WiFi events that can wait for the FSM. Further events are
+/// dropped instead of blocking the event task.
+#define MW_EV_SLOTS		8
+/** \} */
+
 /** \addtogroup MwApi ApCfg Configuration needed to connect to an AP
  *  \{ */
 typedef struct {
@@ -169,6 +300,10 @@ typedef struct {
 
 int MwInit(void);
 
+/// Sends an event notification, if the console enabled the event type.
+/// Never blocks, so it can be called from any task.
+void MwEventSend(uint8_t type, uint8_t ch, uint32_t data);
+
 /** \} */
 
 
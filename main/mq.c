@@ -0,0 +1,105 @@
+#include <stdlib.h>
+#include <string.h>
+#include "mq.h"
+#include "util.h"
+
+int mq_init(struct mq *q, const uint8_t *len, uint8_t lanes)
+{
+	struct mq_lane *l;
+	uint8_t *buf;
+	int i;
+
+	memset(q, 0, sizeof(struct mq));
+	if (!(q->avail = xSemaphoreCreateBinary())) {
+		return -1;
+	}
+	for (i = 0; i < lanes && i < MQ_LANES_MAX; i++) {
+		l = &q->lane[i];
+		buf = malloc(len[i] * sizeof(MwFsmMsg));
+		l->room = xSemaphoreCreateBinary();
+		if (!buf || !l->room) {
+			return -1;
+		}
+		ring_init(&l->r, buf, len[i] * sizeof(MwFsmMsg));
+		q->lanes++;
+	}
+
+	return 0;
+}
+
+bool mq_send(struct mq *q, uint8_t lane, const MwFsmMsg *m, TickType_t wait)
+{
+	struct mq_lane *l = &q->lane[lane];
+	uint8_t *span;
+	TimeOut_t tout;
+
+	vTaskSetTimeOutState(&tout);
+	// Lane length is a multiple of the message length, so the span at the
+	// write position always holds a whole message if not full
+	while (ring_write_span(&l->r, &span) < sizeof(MwFsmMsg)) {
+		if (xTaskCheckForTimeOut(&tout, &wait) ||
+				pdTRUE != xSemaphoreTake(l->room, wait)) {
+			l->full++;
+			return FALSE;
+		}
+	}
+	memcpy(span, m, sizeof(MwFsmMsg));
+	ring_commit(&l->r, sizeof(MwFsmMsg));
+	xSemaphoreGive(q->avail);
+
+	return TRUE;
+}
+
+// Moves up to max messages from the lanes to m
+static int mq_drain(struct mq *q, MwFsmMsg *m, int max)
+{
+	struct mq_lane *l;
+	uint8_t *span;
+	uint32_t len;
+	int n = 0;
+	int got;
+	int cnt;
+	int i;
+
+	for (i = 0; i < q->lanes && n < max; i++) {
+		l = &q->lane[i];
+		got = 0;
+		// Up to two spans, when messages wrap around the ring end
+		while (n < max && (len = ring_read_span(&l->r, &span))) {
+			cnt = MIN((int)(len / sizeof(MwFsmMsg)), max - n);
+			memcpy(m + n, span, cnt * sizeof(MwFsmMsg));
+			ring_consume(&l->r, cnt * sizeof(MwFsmMsg));
+			n += cnt;
+			got += cnt;
+		}
+		if (got) {
+			xSemaphoreGive(l->room);
+		}
+	}
+
+	return n;
+}
+
+int mq_recv(struct mq *q, MwFsmMsg *m, int max, TickType_t wait)
+{
+	TimeOut_t tout;
+	int n;
+
+	vTaskSetTimeOutState(&tout);
+	// The semaphore latches, so messages queued after draining always wake
+	// up the consumer. It is not a task notification, because the consumer
+	// also waits for them when sending through LSD.
+	while (!(n = mq_drain(q, m, max))) {
+		if (xTaskCheckForTimeOut(&tout, &wait) ||
+				pdTRUE != xSemaphoreTake(q->avail, wait)) {
+			return 0;
+		}
+	}
+
+	return n;
+}
+
+uint32_t mq_full_count(const struct mq *q, uint8_t lane)
+{
+	return q->lane[lane].full;
+}
@@ -0,0 +1,57 @@
+#ifndef _MQ_H_
+#define _MQ_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <FreeRTOS.h>
+#include <semphr.h>
+
+#include "mw-msg.h"
+#include "ring.h"
+
+/// Maximum number of lanes of a message queue
+#define MQ_LANES_MAX		6
+
+// Bounded multiple producer, single consumer queue of FSM messages. The
+// queue is split in lanes, each one a lock-free ring (see ring.h) fed by a
+// single producer task, so a producer filling its lane never blocks the
+// other ones. Messages are copied to the ring, and the consumer gets them
+// in batches: all the lanes are drained in order on each wakeup, so lanes
+// with lower indexes have priority when more messages than requested are
+// queued.
+//
+// Message order is kept within each lane, but not between lanes.
+
+// Queue lane
+struct mq_lane {
+	struct ring r;			///< Queued messages
+	SemaphoreHandle_t room;		///< Signals the consumer freed room
+	uint32_t full;			///< Messages not queued, lane full
+};
+
+// Message queue
+struct mq {
+	struct mq_lane lane[MQ_LANES_MAX];	///< Lanes, drained in order
+	uint8_t lanes;			///< Number of lanes in use
+	SemaphoreHandle_t avail;	///< Signals messages have been queued
+};
+
+// Initializes a queue with the specified number of lanes. len holds the
+// length (in messages, a power of two) of each lane. Returns 0 on success,
+// or -1 if memory could not be allocated.
+int mq_init(struct mq *q, const uint8_t *len, uint8_t lanes);
+
+// Producer: copies a message to a lane, waiting up to wait ticks for room.
+// Each lane must be used by a single task. Returns TRUE if the message was
+// queued, FALSE on timeout. Timeouts are counted, see mq_full_count().
+bool mq_send(struct mq *q, uint8_t lane, const MwFsmMsg *m, TickType_t wait);
+
+// Consumer: gets up to max messages, waiting up to wait ticks until there
+// is at least one. Returns the number of messages received.
+int mq_recv(struct mq *q, MwFsmMsg *m, int max, TickType_t wait);
+
+// Gets the number of messages not queued to a lane because it was full
+uint32_t mq_full_count(const struct mq *q, uint8_t lane);
+
+#endif /*_MQ_H_*/
@@ -39,6 +39,7 @@ typedef enum {
 	MW_EV_INIT_DONE,	///< Initialization complete.
 	MW_EV_WIFI,		///< WiFi events.
 	MW_EV_SER_RX,		///< Data reception from serial line.
+	MW_EV_JOB_DONE,		///< Command completed by a worker task.
 	MW_EV_MAX		///< Number of total events.
 } MwEvent;
 /** \} */
@@ -164,13 +165,72 @@ struct mw_ga_request {
 	char req[];		///< Request data
 };
 
+/// Serial link options. Reliable mode and extended header parameters are
+/// optional in requests
+struct mw_lsd_opt {
+	uint32_t opts;		///< Link options (LSD_OPT_* flags)
+	uint8_t rel_win;	///< Reliable mode window length (0 for default)
+	uint8_t reserved;	///< Reserved, set to 0
+	uint16_t rel_rto_ms;	///< Reliable mode retransmit timeout (0 default)
+	uint16_t ext_max_len;	///< Extended header max frame length (0 default)
+	uint16_t reserved2;	///< Reserved, set to 0
+};
+
+/// Serial link baud rate negotiation phases
+enum mw_lsd_baud_phase {
+	MW_LSD_BAUD_SWITCH = 0,	///< Switch to the requested rate
+	MW_LSD_BAUD_TEST,	///< Echo test pattern using the new rate
+	MW_LSD_BAUD_COMMIT	///< Keep using the new rate
+};
+
+/// Serial link baud rate negotiation
+struct mw_lsd_baud {
+	uint32_t baud;		///< Baud rate (0 to select automatically)
+	uint8_t phase;		///< Negotiation phase (mw_lsd_baud_phase)
+	uint8_t reserved[3];	///< Reserved, set to 0
+	uint8_t pattern[];	///< Test pattern (MW_LSD_BAUD_TEST phase)
+};
+
+/// Serial link channel compression
+struct mw_lsd_comp {
+	uint8_t channel;	///< Channel number
+	uint8_t comp;		///< Compression (LSD_COMP_RAW or LSD_COMP_LZ4)
+};
+
+/// Event notification types
+enum mw_event_type {
+	MW_EVENT_CH = 0,	///< Channel status changed, data is MwSockStat
+	MW_EVENT_WIFI_UP,	///< Associated to the AP
+	MW_EVENT_WIFI_DOWN,	///< Disconnected from the AP, data is reason
+	MW_EVENT_IP,		///< DHCP completed, data is IPv4 address
+	MW_EVENT_SNTP,		///< Date and time synchronized, data is time
+	MW_EVENT_HTTP,		///< HTTP request complete, data is 0 if OK
+	MW_EVENT_MAX		///< Number of event types
+};
+
+/// FSM queue statistics
+struct mw_fsm_stats {
+	uint32_t ev_no_slot;	///< WiFi events dropped, no free event slot
+	uint32_t ev_q_full;	///< WiFi events dropped, FSM queue lane full
+	uint32_t ev_hwm;	///< Maximum number of event slots in use
+};
+
+/// Event notification
+struct mw_event {
+	uint8_t type;		///< Event type (mw_event_type)
+	uint8_t ch;		///< Channel of the event, or 0
+	uint8_t reserved[2];	///< Reserved, set to 0
+	uint32_t data;		///< Event data, depending on type
+};
+
 /** \addtogroup MwApi MwSockStat Socket status.
  *  \{ */
 typedef enum {
 	MW_SOCK_NONE = 0,	///< Unused socket.
 	MW_SOCK_TCP_LISTEN,	///< Socket bound and listening.
 	MW_SOCK_TCP_EST,	///< TCP socket, connection established.
-	MW_SOCK_UDP_READY	///< UDP socket ready for sending/receiving
+	MW_SOCK_UDP_READY,	///< UDP socket ready for sending/receiving
+	MW_SOCK_TCP_CONNECTING	///< TCP socket, connection in progress.
 } MwSockStat;
 /** \} */
 
@@ -222,7 +282,7 @@ typedef struct {
 /** \} *//** \addtogroup MwApi MwCmd Command sent to system FSM
  *  \{ */
 typedef struct {
-	uint16_t cmd;		///< Command code
+	uint16_t cmd;		///< Command code and request tag (MW_CMD_TAGGED())
 	uint16_t datalen;	///< Data length
 	// If datalen is nonzero, additional command data goes here until
 	// filling datalen bytes.
@@ -244,6 +304,11 @@ typedef struct {
 		struct mw_wifi_adv_cfg wifi_adv_cfg;
 		struct mw_flash_id flash_id;
 		struct mw_ga_request ga_request;	///< Game API request
+		struct mw_lsd_opt lsd_opt;		///< Serial link options
+		struct mw_lsd_baud lsd_baud;		///< Serial link baud rate
+		struct mw_lsd_comp lsd_comp;		///< Serial link compression
+		struct mw_event event;			///< Event notification
+		struct mw_fsm_stats fsm_stats;		///< FSM queue statistics
 		uint16_t flSect;	// Flash sector
 		uint32_t flId;		// Flash IDs
 		uint16_t rndLen;	// Length of the random buffer to fill
@@ -0,0 +1,92 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stdint.h>
+
+// Lock-free single producer, single consumer byte ring. The producer (e.g.
+// an ISR) only writes head, and the consumer only writes tail, so neither
+// side needs locks, nor disabling interrupts. Indexes run freely and are
+// masked on access, so the ring length must be a power of two.
+//
+// Data is moved in contiguous spans: the producer gets a span of free room
+// with ring_write_span(), fills it and publishes it with ring_commit(). The
+// consumer gets a span of data with ring_read_span(), and releases it with
+// ring_consume() once processed.
+struct ring {
+	uint8_t *buf;		///< Ring storage
+	uint32_t mask;		///< Ring length minus 1
+	uint32_t head;		///< Free running write index (producer)
+	uint32_t tail;		///< Free running read index (consumer)
+};
+
+// Initializes an empty ring using buf for storage. The length of buf must
+// be a power of two.
+static inline void ring_init(struct ring *r, uint8_t *buf, uint32_t len)
+{
+	r->buf = buf;
+	r->mask = len - 1;
+	r->head = r->tail = 0;
+}
+
+// Returns the number of bytes in the ring
+static inline uint32_t ring_used(const struct ring *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+// Returns the number of bytes that can be written to the ring
+static inline uint32_t ring_free(const struct ring *r)
+{
+	return r->mask + 1 - ring_used(r);
+}
+
+// Producer: gets the contiguous free room at the write position. Returns
+// its length (0 if the ring is full).
+static inline uint32_t ring_write_span(struct ring *r, uint8_t **span)
+{
+	uint32_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	// Acquire makes sure the consumer is done with the room it released
+	uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	uint32_t pos = head & r->mask;
+	uint32_t room = r->mask + 1 - (head - tail);
+	uint32_t contig = r->mask + 1 - pos;
+
+	*span = r->buf + pos;
+	return room < contig ? room : contig;
+}
+
+// Producer: publishes len bytes written to the span
+static inline void ring_commit(struct ring *r, uint32_t len)
+{
+	uint32_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+	// Release makes the data visible before the new head
+	__atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+}
+
+// Consumer: gets the contiguous data at the read position. Returns its
+// length (0 if the ring is empty).
+static inline uint32_t ring_read_span(struct ring *r, uint8_t **span)
+{
+	uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	// Acquire makes sure data written by the producer is visible
+	uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	uint32_t pos = tail & r->mask;
+	uint32_t avail = head - tail;
+	uint32_t contig = r->mask + 1 - pos;
+
+	*span = r->buf + pos;
+	return avail < contig ? avail : contig;
+}
+
+// Consumer: releases len bytes of the span, so the producer can reuse them
+static inline void ring_consume(struct ring *r, uint32_t len)
+{
+	uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+
+	// Release makes sure data is read before the room is handed back
+	__atomic_store_n(&r->tail, tail + len, __ATOMIC_RELEASE);
+}
+
+#endif /*_RING_H_*/
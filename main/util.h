@@ -22,6 +22,12 @@
 /// Stringify token
 #define STR(x)		_STR(x)
 
+/// Number of elements of an array
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+
+/// Rounds x up to a multiple of a, that must be a power of 2
+#define ALIGN_UP(x, a)		(((x) + (a) - 1) & ~((a) - 1))
+
 /// Remove compiler warnings when not using a function parameter
 #define UNUSED_PARAM(x)		(void)x
 
@@ -0,0 +1,51 @@
+#include "worker.h"
+#include "util.h"
+#include <task.h>
+#include <queue.h>
+
+// Pool data
+static struct {
+	QueueHandle_t jobs;	///< Jobs waiting for a worker
+	worker_done_cb done;	///< Called once each job has run
+} w;
+
+static void worker_tsk(void *arg)
+{
+	uint8_t idx = (uintptr_t)arg;
+	struct worker_job *job;
+
+	while (1) {
+		if (pdTRUE == xQueueReceive(w.jobs, &job, portMAX_DELAY)) {
+			job->run(job);
+			w.done(job, idx);
+		}
+	}
+}
+
+int worker_pool_init(uint8_t workers, uint8_t queue_len, UBaseType_t prio,
+		uint32_t stack_len, worker_done_cb done)
+{
+	static const char * const name[WORKER_MAX] = {
+		"WRK0", "WRK1", "WRK2", "WRK3"
+	};
+	int i;
+
+	w.done = done;
+	if (!(w.jobs = xQueueCreate(queue_len, sizeof(struct worker_job*)))) {
+		return -1;
+	}
+	for (i = 0; i < workers && i < WORKER_MAX; i++) {
+		if (pdPASS != xTaskCreate(worker_tsk, name[i], stack_len,
+					(void*)(uintptr_t)i, prio, NULL)) {
+			LOGE("could not create worker %d", i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+bool worker_submit(struct worker_job *job)
+{
+	return pdTRUE == xQueueSend(w.jobs, &job, 0);
+}
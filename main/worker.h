@@ -0,0 +1,43 @@
+#ifndef _WORKER_H_
+#define _WORKER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <FreeRTOS.h>
+
+/// Maximum number of worker tasks in the pool
+#define WORKER_MAX		4
+
+// Pool of worker tasks running long (blocking) jobs, so the task submitting
+// them keeps processing other requests meanwhile. Jobs are queued, and run
+// in submission order by the first idle worker. Once a job has run, the
+// done callback of the pool is called from the worker that ran it, e.g. to
+// send a completion message to the submitter.
+
+struct worker_job;
+
+// Runs a job, on a worker task
+typedef void (*worker_run_cb)(struct worker_job *job);
+
+// Called on the worker task once a job has run. worker is the index of the
+// worker (from 0 to the number of workers minus 1), so each worker can use
+// its own completion queue.
+typedef void (*worker_done_cb)(struct worker_job *job, uint8_t worker);
+
+// Job. Embed it in a larger struct to hold the job data.
+struct worker_job {
+	worker_run_cb run;	///< Runs the job
+};
+
+// Creates the job queue, with room for queue_len jobs, and the worker
+// tasks. Returns 0 on success, or -1 on error.
+int worker_pool_init(uint8_t workers, uint8_t queue_len, UBaseType_t prio,
+		uint32_t stack_len, worker_done_cb done);
+
+// Queues a job, without waiting. The job must not be modified until the
+// done callback runs. Returns TRUE if the job was queued, FALSE if the
+// queue is full.
+bool worker_submit(struct worker_job *job);
+
+#endif /*_WORKER_H_*/
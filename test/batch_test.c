@@ -0,0 +1,279 @@
+// Test of the batch requests. MW_CMD_BATCH requests are built with the
+// sub-request layout of the API, padding filled with garbage, and the
+// reply is parsed back, checking the sub-replies, their padding, and that
+// sub-requests stop running on the first failure. Batches with sub-requests
+// not allowed, failing, truncated, nested, replying by themselves, running
+// as jobs (MW_CMD_HTTP_FINISH), too many of them, or none at all are
+// checked, as is the tag of plain and batch replies.
+//
+// Usage: batch_test
+
+#include "mw_test.h"
+
+/// Tag of the batch requests
+#define BATCH_TAG	0x42
+/// Tag of the sub-requests, that must be ignored
+#define SUB_TAG		0x99
+
+// Sub-reply expected
+struct sub_rep {
+	uint8_t code;		///< Reply code
+	uint16_t len;		///< Data length
+	const void *data;	///< Data, not checked if NULL
+};
+
+// Batch request being built
+static struct {
+	uint8_t data[MW_CMD_MAX_BUFLEN];
+	uint16_t len;
+} b;
+
+static void batch_start(void)
+{
+	b.len = 0;
+}
+
+// Writes a command header, big endian
+static void head_set(uint8_t *head, uint16_t cmd, uint16_t len)
+{
+	head[0] = cmd>>8;
+	head[1] = cmd & 0xFF;
+	head[2] = len>>8;
+	head[3] = len & 0xFF;
+}
+
+// Appends a sub-request
+static void batch_add(uint8_t cmd, const void *data, uint16_t len)
+{
+	uint8_t *sub = b.data + b.len;
+	uint16_t end = b.len + MW_CMD_HEADLEN + len;
+	uint16_t next = ALIGN_UP(end, MW_BATCH_ALIGN);
+
+	head_set(sub, MW_CMD_TAGGED(SUB_TAG, cmd), len);
+	memcpy(sub + MW_CMD_HEADLEN, data, len);
+	memset(b.data + end, 0xEE, next - end);
+	b.len = next;
+}
+
+static void batch_add_mask(uint32_t mask)
+{
+	uint32_t data = htonl(mask);
+
+	batch_add(MW_CMD_EVENT_SET, &data, sizeof(data));
+}
+
+// Fills the free pool buffers with garbage, for the reply to be built over
+static void pool_dirty(void)
+{
+	MwMsgBuf *held[BUF_POOL_LEN + 1];
+	int n = 0;
+
+	while ((held[n] = buf_alloc(0))) {
+		memset(held[n++], 0xEE, sizeof(MwMsgBuf));
+	}
+	while (n) {
+		buf_unref(held[--n]);
+	}
+}
+
+// Sends the batch, and checks the reply code and sub-replies
+static void batch_check(uint8_t code, const struct sub_rep *exp, int n)
+{
+	const struct mw_test_frame *f = mw_test_frame(0);
+	const MwCmd *sub;
+	uint16_t pos = 0;
+	uint16_t next;
+	int i;
+
+	pool_dirty();
+	mw_test_clear();
+	mw_test_req(BATCH_TAG, MW_CMD_BATCH, b.data, b.len);
+	if (!mw_test_check(1 == mt.frames) || !mw_test_check(ntohs(f->cmd.cmd)
+				== MW_CMD_TAGGED(BATCH_TAG, code))) {
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		sub = (const MwCmd*)(f->cmd.data + pos);
+		mw_test_check(ntohs(sub->cmd) == exp[i].code);
+		if (!mw_test_check(ntohs(sub->datalen) == exp[i].len)) {
+			return;
+		}
+		if (exp[i].data) {
+			mw_test_check(!memcmp(sub->data, exp[i].data,
+						exp[i].len));
+		}
+		pos += MW_CMD_HEADLEN + exp[i].len;
+		next = ALIGN_UP(pos, MW_BATCH_ALIGN);
+		// Padding is zeroed
+		for (; pos < next; pos++) {
+			mw_test_check(!f->cmd.data[pos]);
+		}
+	}
+	mw_test_check(ntohs(f->cmd.datalen) == pos);
+	mw_test_check(f->len == MW_CMD_HEADLEN + pos);
+	mw_test_check(BUF_POOL_LEN == buf_free_count());
+}
+
+// All the sub-requests succeed, replies with and without data
+static void test_ok(void)
+{
+	uint8_t version[3 + sizeof(MW_FW_VARIANT)] = {MW_FW_VERSION_MAJOR,
+		MW_FW_VERSION_MINOR, MW_FW_VERSION_MICRO};
+	const struct mw_lsd_comp comp = {1, LSD_COMP_LZ4};
+	const uint32_t mask = htonl(MW_EVENT_BIT(MW_EVENT_MAX) - 1);
+	const struct sub_rep exp[] = {
+		{MW_CMD_OK, sizeof(version), version},
+		{MW_CMD_OK, 0, NULL},
+		{MW_CMD_OK, sizeof(mask), &mask}
+	};
+
+	memcpy(version + 3, MW_FW_VARIANT, sizeof(MW_FW_VARIANT));
+	batch_start();
+	batch_add(MW_CMD_VERSION, NULL, 0);
+	batch_add(MW_CMD_LSD_COMP, &comp, sizeof(comp));
+	batch_add_mask(0xFFFFFFFF);
+	batch_check(MW_CMD_OK, exp, ARRAY_SIZE(exp));
+	mw_test_check(ntohl(mask) == d.ev_mask);
+
+	batch_start();
+	batch_check(MW_CMD_OK, NULL, 0);
+}
+
+// Sub-requests stop on the first one failing
+static void test_fail(void)
+{
+	const struct mw_lsd_comp comp = {LSD_MAX_CH, LSD_COMP_LZ4};
+	const uint32_t mask = htonl(1);
+	const struct sub_rep exp[] = {
+		{MW_CMD_OK, sizeof(mask), &mask},
+		{MW_CMD_ERROR, 0, NULL}
+	};
+
+	// Not allowed on IDLE
+	batch_start();
+	batch_add_mask(1);
+	batch_add(MW_CMD_AP_LEAVE, NULL, 0);
+	batch_add_mask(2);
+	batch_check(MW_CMD_ERROR, exp, ARRAY_SIZE(exp));
+	mw_test_check(1 == d.ev_mask);
+
+	// Handler failing
+	batch_start();
+	batch_add_mask(1);
+	batch_add(MW_CMD_LSD_COMP, &comp, sizeof(comp));
+	batch_add_mask(2);
+	batch_check(MW_CMD_ERROR, exp, ARRAY_SIZE(exp));
+	mw_test_check(1 == d.ev_mask);
+
+	// Wrong length
+	batch_start();
+	batch_add_mask(1);
+	batch_add(MW_CMD_EVENT_SET, NULL, 0);
+	batch_add_mask(2);
+	batch_check(MW_CMD_ERROR, exp, ARRAY_SIZE(exp));
+	mw_test_check(1 == d.ev_mask);
+}
+
+// Sub-requests not fitting in the batch end it, without a sub-reply
+static void test_truncated(void)
+{
+	const uint32_t mask = htonl(1);
+	const struct sub_rep exp[] = {
+		{MW_CMD_OK, sizeof(mask), &mask}
+	};
+	uint16_t len;
+
+	// Data past the end
+	batch_start();
+	batch_add_mask(1);
+	len = b.len;
+	batch_add_mask(2);
+	b.len -= 2;
+	batch_check(MW_CMD_ERROR, exp, ARRAY_SIZE(exp));
+	mw_test_check(1 == d.ev_mask);
+
+	// Header past the end
+	b.len = len + MW_CMD_HEADLEN - 1;
+	batch_check(MW_CMD_ERROR, exp, ARRAY_SIZE(exp));
+
+	// Too many sub-requests
+	batch_start();
+	for (len = 0; len <= MW_BATCH_MAX; len++) {
+		batch_add_mask(1);
+	}
+	mw_test_clear();
+	mw_test_req(BATCH_TAG, MW_CMD_BATCH, b.data, b.len);
+	if (mw_test_check(1 == mt.frames)) {
+		mw_test_check(ntohs(mw_test_frame(0)->cmd.cmd) ==
+				MW_CMD_TAGGED(BATCH_TAG, MW_CMD_ERROR));
+		mw_test_check(ntohs(mw_test_frame(0)->cmd.datalen) ==
+				MW_BATCH_MAX * (MW_CMD_HEADLEN + sizeof(mask)));
+	}
+}
+
+// Commands replying by themselves, including batches, and jobs are rejected
+static void test_rejected(void)
+{
+	const uint32_t mask = htonl(1);
+	const struct sub_rep exp[] = {
+		{MW_CMD_OK, sizeof(mask), &mask},
+		{MW_CMD_ERROR, 0, NULL}
+	};
+	uint8_t nested[MW_CMD_HEADLEN];
+
+	// Nested batch with a sub-request of its own
+	head_set(nested, MW_CMD_VERSION, 0);
+	batch_start();
+	batch_add_mask(1);
+	batch_add(MW_CMD_BATCH, nested, MW_CMD_HEADLEN);
+	batch_check(MW_CMD_ERROR, exp, ARRAY_SIZE(exp));
+
+	// Nothing echoed
+	batch_start();
+	batch_add_mask(1);
+	batch_add(MW_CMD_ECHO, "echo", 4);
+	batch_check(MW_CMD_ERROR, exp, ARRAY_SIZE(exp));
+
+	// Job, only allowed on READY, and its post action not run
+	d.s.sys_stat = MW_ST_READY;
+	batch_start();
+	batch_add_mask(1);
+	batch_add(MW_CMD_HTTP_FINISH, NULL, 0);
+	batch_add_mask(2);
+	batch_check(MW_CMD_ERROR, exp, ARRAY_SIZE(exp));
+	mw_test_check(!d.job[0].busy && !d.job[1].busy && !d.res_busy);
+	mw_test_check(1 == d.ev_mask);
+	d.s.sys_stat = MW_ST_IDLE;
+}
+
+// Plain requests are replied with their tag
+static void test_tagged(void)
+{
+	const struct mw_test_frame *f = mw_test_frame(0);
+
+	mw_test_clear();
+	mw_test_req(0xA5, MW_CMD_VERSION, NULL, 0);
+	if (mw_test_check(1 == mt.frames)) {
+		mw_test_reply(f, MW_CMD_TAGGED(0xA5, MW_CMD_OK),
+				3 + sizeof(MW_FW_VARIANT));
+	}
+	mw_test_clear();
+	mw_test_req(0xA6, MW_CMD_AP_LEAVE, NULL, 0);
+	if (mw_test_check(1 == mt.frames)) {
+		mw_test_reply(f, MW_CMD_TAGGED(0xA6, MW_CMD_ERROR), 0);
+	}
+	mw_test_check(BUF_POOL_LEN == buf_free_count());
+}
+
+int main(void)
+{
+	mw_test_init(MW_ST_IDLE, FALSE);
+
+	test_ok();
+	test_fail();
+	test_truncated();
+	test_rejected();
+	test_tagged();
+
+	return mw_test_end();
+}
@@ -0,0 +1,252 @@
+// Stress test of the buffer pool: several tasks allocate buffers, pass
+// references to each other and drop them in any order. Each buffer is
+// filled on allocation with a pattern derived from an allocation serial
+// number, that holders check before dropping their reference, and a shadow
+// reference count tracks the holders. The pool must never hand out a
+// buffer still referenced (the shadow count must be 0, and the pattern of
+// the previous owner intact), and all the buffers must be back in the pool
+// at the end.
+//
+// Usage: buf_pool_stress [operations per task]
+
+#include <unistd.h>
+
+#include "buf_pool.h"
+#include "util.h"
+#include <task.h>
+#include <semphr.h>
+
+/// Number of tasks
+#define TASKS		4
+/// Buffers each task can hold at once
+#define HOLD_MAX	3
+/// References waiting to be taken by another task
+#define SHARED_MAX	8
+/// Bytes of each buffer filled with the pattern
+#define PATTERN_LEN	256
+
+// Reference to a buffer, with the serial number it was allocated with
+struct ref {
+	MwMsgBuf *buf;
+	uint32_t serial;
+};
+
+// Test data
+static struct {
+	SemaphoreHandle_t lock;		///< Guards shared
+	struct ref shared[SHARED_MAX];	///< References passed between tasks
+	int n_shared;
+	uint32_t sref[BUF_POOL_LEN];	///< Shadow reference counts
+	uint32_t serial;		///< Last allocation serial number
+	uint32_t errors;
+	uint32_t allocs;
+	uint32_t passed;
+	uint32_t no_buf;
+	uint32_t ops;			///< Operations per task
+	uint32_t done;			///< Tasks finished
+} t;
+
+static void error(const char *msg, const MwMsgBuf *buf)
+{
+	if (__atomic_fetch_add(&t.errors, 1, __ATOMIC_RELAXED) < 10) {
+		printf("buffer %d: %s\n", buf_idx(buf), msg);
+	}
+}
+
+static void fill(MwMsgBuf *buf, uint32_t serial)
+{
+	int i;
+
+	for (i = 0; i < PATTERN_LEN; i++) {
+		buf->data[i] = serial * 31 + i;
+	}
+}
+
+static bool check(const MwMsgBuf *buf, uint32_t serial)
+{
+	int i;
+
+	for (i = 0; i < PATTERN_LEN; i++) {
+		if (buf->data[i] != (uint8_t)(serial * 31 + i)) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static bool ref_alloc(struct ref *r, unsigned *seed)
+{
+	int idx;
+
+	// Waiting allocations let others take the buffers freed meanwhile
+	if (rand_r(seed) % 16) {
+		r->buf = buf_alloc(rand_r(seed) % 3);
+	} else {
+		r->buf = buf_alloc_wait(0, 1);
+	}
+	if (!r->buf) {
+		__atomic_add_fetch(&t.no_buf, 1, __ATOMIC_RELAXED);
+		return FALSE;
+	}
+	idx = buf_idx(r->buf);
+	if (idx < 0) {
+		error("not from the pool", r->buf);
+		return FALSE;
+	}
+	if (__atomic_fetch_add(&t.sref[idx], 1, __ATOMIC_ACQ_REL)) {
+		error("allocated while referenced", r->buf);
+	}
+	r->serial = __atomic_add_fetch(&t.serial, 1, __ATOMIC_RELAXED);
+	fill(r->buf, r->serial);
+	__atomic_add_fetch(&t.allocs, 1, __ATOMIC_RELAXED);
+
+	return TRUE;
+}
+
+static void ref_drop(struct ref *r)
+{
+	int idx = buf_idx(r->buf);
+
+	if (!check(r->buf, r->serial)) {
+		error("overwritten while referenced", r->buf);
+	}
+	// Shadow count drops first, the buffer can be allocated again as
+	// soon as it is back in the pool
+	if (!__atomic_fetch_sub(&t.sref[idx], 1, __ATOMIC_ACQ_REL)) {
+		error("dropped more times than referenced", r->buf);
+	}
+	buf_unref(r->buf);
+}
+
+// Passes a new reference to the buffer to other tasks. Returns FALSE if
+// there is no room for it.
+static bool ref_pass(const struct ref *r)
+{
+	bool ok = FALSE;
+
+	xSemaphoreTake(t.lock, portMAX_DELAY);
+	if (t.n_shared < SHARED_MAX) {
+		__atomic_add_fetch(&t.sref[buf_idx(r->buf)], 1,
+				__ATOMIC_ACQ_REL);
+		buf_ref(r->buf);
+		t.shared[t.n_shared++] = *r;
+		ok = TRUE;
+	}
+	xSemaphoreGive(t.lock);
+	if (ok) {
+		__atomic_add_fetch(&t.passed, 1, __ATOMIC_RELAXED);
+	}
+
+	return ok;
+}
+
+// Takes a reference passed by a task. Returns FALSE if there is none.
+static bool ref_take(struct ref *r, unsigned *seed)
+{
+	int i;
+
+	xSemaphoreTake(t.lock, portMAX_DELAY);
+	if (!t.n_shared) {
+		xSemaphoreGive(t.lock);
+		return FALSE;
+	}
+	i = rand_r(seed) % t.n_shared;
+	*r = t.shared[i];
+	t.shared[i] = t.shared[--t.n_shared];
+	xSemaphoreGive(t.lock);
+
+	return TRUE;
+}
+
+static void stress_tsk(void *arg)
+{
+	unsigned seed = (uintptr_t)arg;
+	struct ref held[HOLD_MAX];
+	int n = 0;
+	uint32_t op;
+	int i;
+
+	for (op = 0; op < t.ops; op++) {
+		switch (rand_r(&seed) % 4) {
+		case 0:
+			if (n < HOLD_MAX && ref_alloc(&held[n], &seed)) {
+				n++;
+			}
+			break;
+
+		case 1:
+			if (n) {
+				ref_pass(&held[rand_r(&seed) % n]);
+			}
+			break;
+
+		case 2:
+			if (n < HOLD_MAX && ref_take(&held[n], &seed)) {
+				n++;
+			}
+			break;
+
+		default:
+			if (n) {
+				// Drop in any order
+				i = rand_r(&seed) % n;
+				ref_drop(&held[i]);
+				held[i] = held[--n];
+			}
+			break;
+		}
+		if (!(rand_r(&seed) % 64)) {
+			taskYIELD();
+		}
+	}
+	while (n) {
+		ref_drop(&held[--n]);
+	}
+	__atomic_add_fetch(&t.done, 1, __ATOMIC_RELEASE);
+	vTaskDelete(NULL);
+}
+
+int main(int argc, char **argv)
+{
+	struct ref r;
+	unsigned seed = 17;
+	int i;
+
+	t.ops = argc > 1 ? atoi(argv[1]) : 1000000;
+	t.lock = xSemaphoreCreateMutex();
+	buf_pool_init();
+	for (i = 0; i < TASKS; i++) {
+		xTaskCreate(stress_tsk, "STRS", 0, (void*)(uintptr_t)(i + 1),
+				1, NULL);
+	}
+	while (__atomic_load_n(&t.done, __ATOMIC_ACQUIRE) < TASKS) {
+		usleep(10000);
+	}
+	while (ref_take(&r, &seed)) {
+		ref_drop(&r);
+	}
+	for (i = 0; i < BUF_POOL_LEN; i++) {
+		if (t.sref[i]) {
+			printf("buffer %d: still referenced\n", i);
+			t.errors++;
+		}
+	}
+
+	// Dropping or referencing a free buffer must not change the pool
+	r.buf = buf_alloc(0);
+	buf_unref(r.buf);
+	buf_unref(r.buf);
+	buf_ref(r.buf);
+
+	printf("%u allocations, %u references passed, %u times no buffer, "
+			"%u errors, %d buffers free\n", t.allocs, t.passed,
+			t.no_buf, t.errors, buf_free_count());
+	if (t.errors || buf_free_count() != BUF_POOL_LEN) {
+		printf("FAIL\n");
+		return 1;
+	}
+	printf("PASS\n");
+
+	return 0;
+}
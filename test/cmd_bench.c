@@ -0,0 +1,193 @@
+// Microbenchmark of the command dispatch. For each command in the command
+// table, the lookup (table index, state and length checks) is timed on the
+// states allowing it, then a random mix of all the commands is timed, as
+// the branch predictor sees it on a real session. Last, whole requests are
+// timed through MwFsmCmdProc(): a VERSION request, and a request rejected
+// with an error reply, both including the reply sent through LSD.
+//
+// Usage: cmd_bench [lookups per command]
+
+#include <time.h>
+
+#include "../main/megawifi.c"
+
+/// Length of the random command mix
+#define MIX_LEN		4096
+/// Whole requests processed
+#define REQS		20000
+/// Times each lookup is timed
+#define RUNS		3
+
+// Each lookup result goes here, for the compiler to keep the lookups
+static const struct mw_cmd_entry * volatile sink;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static const char * const rep_names[] = {"none", "head", "data"};
+
+static const char *state_name(uint8_t state)
+{
+	switch (state) {
+	case MW_ST_IDLE:
+		return "IDLE";
+
+	case MW_ST_AP_JOIN:
+		return "AP_JOIN";
+
+	case MW_ST_READY:
+		return "READY";
+
+	default:
+		return "?";
+	}
+}
+
+// Times lookups of a command on the current state. Returns ns per lookup,
+// the best of RUNS runs.
+static double lookup_time(uint8_t cmd, uint16_t len, uint32_t n)
+{
+	double best = 0;
+	double start;
+	double ns;
+	uint32_t i;
+	int run;
+
+	for (run = 0; run < RUNS; run++) {
+		start = now_ns();
+		for (i = 0; i < n; i++) {
+			// Hide the command from the compiler, for the lookup
+			// not to be moved out of the loop
+			__asm__ volatile("" : "+r" (cmd));
+			sink = cmd_lookup(cmd, len);
+		}
+		ns = (now_ns() - start) / n;
+		if (!run || ns < best) {
+			best = ns;
+		}
+	}
+
+	return best;
+}
+
+// Prints the lookup time of each command on each state allowing it
+static void bench_commands(uint32_t n)
+{
+	const uint8_t states[] = {MW_ST_IDLE, MW_ST_AP_JOIN, MW_ST_READY};
+	const struct mw_cmd_entry *e;
+	unsigned cmd, i;
+
+	printf("cmd  min len  reply  job  ns/lookup (state)\n");
+	for (cmd = 0; cmd < ARRAY_SIZE(mw_cmd_tbl); cmd++) {
+		e = &mw_cmd_tbl[cmd];
+		if (!e->handler) {
+			continue;
+		}
+		printf("%3u  %7u  %5s  %3s ", cmd, e->min_len,
+				rep_names[e->rep], e->job ? "yes" : "no");
+		for (i = 0; i < ARRAY_SIZE(states); i++) {
+			if (e->states & MW_IN(states[i])) {
+				d.s.sys_stat = states[i];
+				printf("  %5.2f (%s)", lookup_time(cmd,
+							e->min_len, n),
+						state_name(states[i]));
+			}
+		}
+		putchar('\n');
+	}
+}
+
+// Times lookups of a random mix of the known commands on the READY state,
+// and of unknown commands and commands not allowed on the state
+static void bench_mix(uint32_t n)
+{
+	static uint8_t mix[MIX_LEN];
+	uint8_t known[ARRAY_SIZE(mw_cmd_tbl)];
+	unsigned n_known = 0;
+	unsigned cmd;
+	uint32_t reps = n / MIX_LEN + 1;
+	uint32_t i, j;
+	uint32_t found = 0;
+	double start;
+
+	d.s.sys_stat = MW_ST_READY;
+	for (cmd = 0; cmd < ARRAY_SIZE(mw_cmd_tbl); cmd++) {
+		if (mw_cmd_tbl[cmd].handler) {
+			known[n_known++] = cmd;
+		}
+	}
+	for (i = 0; i < MIX_LEN; i++) {
+		mix[i] = known[random() % n_known];
+	}
+	start = now_ns();
+	for (j = 0; j < reps; j++) {
+		for (i = 0; i < MIX_LEN; i++) {
+			// Request long enough for any command
+			sink = cmd_lookup(mix[i], UINT16_MAX);
+			found += !!sink;
+		}
+	}
+	printf("\n%u commands, random mix on READY: %.2f ns/lookup "
+			"(%u of %u allowed)\n", n_known,
+			(now_ns() - start) / (reps * MIX_LEN), found / reps,
+			MIX_LEN);
+	printf("unknown command: %.2f ns/lookup\n",
+			lookup_time(ARRAY_SIZE(mw_cmd_tbl), 0, n));
+	printf("AP_SCAN on READY (not allowed): %.2f ns/lookup\n",
+			lookup_time(MW_CMD_AP_SCAN, 1, n));
+}
+
+// Times whole requests, including the reply sent through LSD
+static void bench_requests(void)
+{
+	MwMsgBuf *b = buf_alloc(0);
+	MwCmd *c = &b->cmd;
+	double start;
+	int i;
+
+	d.s.sys_stat = MW_ST_READY;
+	start = now_ns();
+	for (i = 0; i < REQS; i++) {
+		c->cmd = htons(MW_CMD_VERSION);
+		c->datalen = 0;
+		MwFsmCmdProc(c, MW_CMD_HEADLEN);
+	}
+	printf("\nVERSION request and reply: %.0f ns\n",
+			(now_ns() - start) / REQS);
+
+	// Error reply is built over the request
+	c->data[0] = 0;
+	start = now_ns();
+	for (i = 0; i < REQS; i++) {
+		c->cmd = htons(MW_CMD_AP_SCAN);
+		c->datalen = htons(1);
+		MwFsmCmdProc(c, MW_CMD_HEADLEN + 1);
+	}
+	printf("rejected request and error reply: %.0f ns\n",
+			(now_ns() - start) / REQS);
+	buf_unref(b);
+}
+
+int main(int argc, char **argv)
+{
+	const uint8_t lanes[] = {8};
+	uint32_t n = argc > 1 ? atoi(argv[1]) : 1000000;
+	struct mq q;
+
+	mq_init(&q, lanes, 1);
+	buf_pool_init();
+	LsdInit(&q, 0);
+	LsdChEnable(0);
+
+	bench_commands(n);
+	bench_mix(n);
+	bench_requests();
+
+	return 0;
+}
@@ -0,0 +1,250 @@
+// Benchmark of the LSD framings under bit errors. A stream of frames is
+// recorded for each framing, bits are flipped at random with the given bit
+// error rate, and the corrupted stream is fed to the parser. Frames are
+// identified by their contents: the ones delivered intact make the goodput
+// (payload bytes delivered per byte sent), the ones delivered with errors
+// are counted as bad, and lost frames not hit by any error (lost while
+// resynchronizing) are counted apart.
+//
+// Usage: cobs_bench [frames]
+
+#include <math.h>
+
+#include "lsd_test.h"
+
+/// Bytes per second at 1.5 Mbaud, 8N1
+#define LINK_BPS	(1500000 / 10)
+
+/// Framings compared
+static const uint32_t opt_sets[] = {
+	0,
+	LSD_OPT_CRC16,
+	LSD_OPT_COBS,
+	LSD_OPT_COBS | LSD_OPT_CRC16
+};
+
+/// Bit error rates
+static const double bers[] = {0, 1e-6, 1e-5, 1e-4, 1e-3};
+
+/// Longest payload of the frames sent, for each run
+static const uint16_t max_lens[] = {MW_MSG_MAX_BUFLEN, 64};
+
+// Stream of frames, with the offset each one starts at
+struct stream {
+	struct lsd_stream s;
+	uint16_t max_len;	///< Longest payload
+	uint32_t *start;	///< Offset of each frame, and the stream length
+};
+
+// Run results
+struct result {
+	uint32_t flips;		///< Bits flipped
+	uint32_t hit;		///< Frames with flipped bits
+	uint32_t intact;	///< Frames delivered intact
+	uint32_t bad;		///< Frames delivered with errors
+	uint32_t collateral;	///< Frames lost without errors
+	uint64_t goodput;	///< Payload bytes delivered intact
+};
+
+// Payload length of frame k, from 4 to max_len bytes
+static uint16_t frame_len(uint32_t k, uint16_t max_len)
+{
+	return 4 + (k * 2654435761u >> 8) % (max_len - 3);
+}
+
+// Checks a received buffer holds frame k. Returns TRUE if it does.
+static bool frame_check(const MwMsgBuf *buf, uint32_t k, uint16_t max_len)
+{
+	uint8_t payload[MW_MSG_MAX_BUFLEN];
+	uint16_t len = frame_len(k, max_len);
+
+	if (buf->ch != lsd_test_ch(k) || buf->len != len) {
+		return FALSE;
+	}
+	lsd_test_fill(payload, len, k);
+
+	return !memcmp(buf->data, payload, len);
+}
+
+// Builds a stream with frames 0 to frames - 1, of up to max_len bytes
+static void stream_build(struct stream *st, uint32_t frames, uint16_t max_len)
+{
+	uint8_t payload[MW_MSG_MAX_BUFLEN];
+	struct lsd_stream *s = &st->s;
+	uint32_t cap = 0;
+	uint32_t k;
+	uint16_t len;
+
+	memset(s, 0, sizeof(struct lsd_stream));
+	st->max_len = max_len;
+	st->start = malloc((frames + 1) * sizeof(uint32_t));
+	for (k = 0; k < frames; k++) {
+		if (cap - s->len < LSD_TX_BUF_LEN) {
+			cap = 2 * cap + LSD_TX_BUF_LEN;
+			s->data = realloc(s->data, cap);
+		}
+		st->start[k] = s->len;
+		len = frame_len(k, max_len);
+		lsd_test_fill(payload, len, k);
+		s->len += lsd_test_encode(lsd_test_ch(k), payload, len,
+				s->data + s->len);
+		s->payload += len;
+	}
+	st->start[frames] = s->len;
+	s->frames = frames;
+}
+
+// Frame the byte at pos belongs to
+static uint32_t frame_at(const struct stream *st, uint32_t pos)
+{
+	uint32_t lo = 0;
+	uint32_t hi = st->s.frames;
+	uint32_t mid;
+
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (st->start[mid] <= pos) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+// Flips bits of data at the bit error rate, marking the frames hit
+static void corrupt(const struct stream *st, uint8_t *data, double ber,
+		bool *hit, struct result *r)
+{
+	uint64_t bits = (uint64_t)st->s.len * 8;
+	uint64_t bit = 0;
+	uint32_t k;
+
+	if (!ber) {
+		return;
+	}
+	while (1) {
+		// Bits between errors follow a geometric distribution
+		bit += (uint64_t)(log(1 - drand48()) / log(1 - ber));
+		if (bit >= bits) {
+			break;
+		}
+		data[bit / 8] ^= 1<<(bit % 8);
+		k = frame_at(st, bit / 8);
+		if (!hit[k]) {
+			hit[k] = TRUE;
+			r->hit++;
+		}
+		r->flips++;
+		bit++;
+	}
+}
+
+// Restarts the receiver with the link options
+static void rx_reset(uint32_t opts)
+{
+	LsdOptSet(opts ^ LSD_OPT_COBS);
+	LsdRxOptApply();
+	LsdOptSet(opts);
+	LsdRxOptApply();
+}
+
+// Parses the corrupted stream, sorting out the frames delivered
+static void parse(const struct stream *st, const uint8_t *data,
+		const bool *hit, struct result *r)
+{
+	bool *got = calloc(st->s.frames, sizeof(bool));
+	uint32_t pos = 0;
+	uint32_t k;
+	bool frame;
+
+	while (pos < st->s.len) {
+		frame = FALSE;
+		pos += LsdRxParse(data + pos, MIN(UART_FIFO_LEN, st->s.len - pos),
+				&frame);
+		if (!frame || !d.cur) {
+			continue;
+		}
+		memcpy(&k, d.cur->data, sizeof(k));
+		if (d.cur->len >= sizeof(k) && k < st->s.frames && !got[k] &&
+				frame_check(d.cur, k, st->max_len)) {
+			got[k] = TRUE;
+			r->intact++;
+			r->goodput += d.cur->len;
+		} else {
+			r->bad++;
+		}
+		LsdRxBufFree(d.cur);
+		d.cur = NULL;
+	}
+	for (k = 0; k < st->s.frames; k++) {
+		if (!got[k] && !hit[k]) {
+			r->collateral++;
+		}
+	}
+	free(got);
+}
+
+static void run(const struct stream *st, double ber, struct result *r)
+{
+	bool *hit = calloc(st->s.frames, sizeof(bool));
+	uint8_t *data = malloc(st->s.len);
+
+	memset(r, 0, sizeof(struct result));
+	memcpy(data, st->s.data, st->s.len);
+	corrupt(st, data, ber, hit, r);
+	parse(st, data, hit, r);
+	free(data);
+	free(hit);
+}
+
+int main(int argc, char **argv)
+{
+	const uint8_t lanes[] = {8};
+	uint32_t frames = argc > 1 ? atoi(argv[1]) : 20000;
+	struct stream st;
+	struct result r;
+	struct mq q;
+	double ratio;
+	char name[16];
+	bool fail = FALSE;
+	unsigned i, j, l;
+
+	mq_init(&q, lanes, 1);
+	lsd_test_init(&q, 0);
+	srand48(1);
+	for (l = 0; l < ARRAY_SIZE(max_lens); l++) {
+		printf("%s%" PRIu32 " frames of 4 to %u bytes\n", l ? "\n" : "",
+				frames, max_lens[l]);
+		printf("framing          BER  errors  frames hit  intact     bad  "
+				"lost w/o err  goodput   kB/s\n");
+		for (i = 0; i < ARRAY_SIZE(opt_sets); i++) {
+			LsdOptSet(opt_sets[i]);
+			stream_build(&st, frames, max_lens[l]);
+			lsd_test_opts_name(opt_sets[i], name);
+			for (j = 0; j < ARRAY_SIZE(bers); j++) {
+				rx_reset(opt_sets[i]);
+				run(&st, bers[j], &r);
+				ratio = (double)r.goodput / st.s.len;
+				printf("%-12s %7.0e  %6u  %10u  %6u  %6u  %12u  "
+						"%6.2f%%  %5.1f\n", j ? "" : name,
+						bers[j], r.flips, r.hit, r.intact,
+						r.bad, r.collateral, 100 * ratio,
+						ratio * LINK_BPS / 1000);
+				// Without errors, everything must get through
+				if (!bers[j] && (r.intact != frames || r.bad)) {
+					fail = TRUE;
+				}
+			}
+			free(st.s.data);
+			free(st.start);
+		}
+	}
+	if (fail) {
+		printf("FAIL: frames lost without bit errors\n");
+		return 1;
+	}
+
+	return 0;
+}
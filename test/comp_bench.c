@@ -0,0 +1,326 @@
+// Benchmark of the LZ4 compression of the LSD transmit path. Frames of
+// several kinds of data are sent through a channel with compression
+// disabled and enabled, and the bytes on the wire, the transmit time and
+// the time the frame takes on the link are reported. Each compressed
+// frame is parsed back and decoded, and comp_lz4() is checked on its own
+// against a reference LZ4 block decoder, using lengths and data reaching
+// every branch of the encoder.
+//
+// Usage: comp_bench [frames]
+
+#include <time.h>
+
+#include "lsd_test.h"
+
+/// Bytes per second at 1.5 Mbaud, 8N1
+#define LINK_BPS	(1500000 / 10)
+/// Channel the frames are sent through
+#define BENCH_CH	1
+
+// LZ4 block format constants
+#define LZ4_MIN_MATCH		4
+#define LZ4_LAST_LITERALS	5
+#define LZ4_MFLIMIT		12
+#define LZ4_RUN_MASK		15
+
+/// Kinds of data sent
+enum data_kind {
+	DATA_TEXT,	///< JSON records, as the game API sends
+	DATA_FILL,	///< Runs of equal bytes (see lsd_test_fill())
+	DATA_ZERO,	///< All zeros
+	DATA_RANDOM,	///< Random bytes, that do not compress
+	DATA_KINDS
+};
+
+static const char * const kind_names[] = {"text", "fill", "zero", "random"};
+
+/// Payload lengths of the frames sent. Compressed channels take a byte for
+/// the flags (see LsdMaxLen()).
+static const uint16_t lens[] = {MW_MSG_MAX_BUFLEN - 1, 256, 64};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Fills data with len bytes of the kind, different for each frame k
+static void data_fill(uint8_t *data, uint16_t len, enum data_kind kind,
+		uint32_t k)
+{
+	char rec[64];
+	uint16_t pos = 0;
+	int n;
+
+	switch (kind) {
+	case DATA_TEXT:
+		while (pos < len) {
+			n = sprintf(rec, "{\"id\":%" PRIu32 ",\"name\":\"player%"
+					PRIu32 "\",\"score\":%ld},", k, k % 97,
+					lrand48() % 100000);
+			n = MIN(n, len - pos);
+			memcpy(data + pos, rec, n);
+			pos += n;
+			k++;
+		}
+		break;
+
+	case DATA_FILL:
+		lsd_test_fill(data, len, k);
+		break;
+
+	case DATA_ZERO:
+		memset(data, 0, len);
+		break;
+
+	default:
+		for (pos = 0; pos < len; pos++) {
+			data[pos] = lrand48();
+		}
+		break;
+	}
+}
+
+// Reads the length bytes following a token nibble set to LZ4_RUN_MASK.
+// Returns FALSE if the block ends before.
+static bool len_get(const uint8_t **ip, const uint8_t *iend, uint32_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= iend) {
+			return FALSE;
+		}
+		b = *(*ip)++;
+		*len += b;
+	} while (255 == b);
+
+	return TRUE;
+}
+
+// Decodes an LZ4 block, checking it follows the format rules for the last
+// sequences. Returns the decoded length, or -1 if the block is malformed
+// or does not fit in max bytes.
+static int lz4_decode(const uint8_t *src, uint16_t len, uint8_t *dst,
+		uint16_t max)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = src + len;
+	uint8_t *op = dst;
+	uint32_t match_start = 0;
+	uint32_t match_end = 0;
+	uint32_t lit, match, off;
+	uint8_t token;
+
+	while (ip < iend) {
+		token = *ip++;
+		lit = token>>4;
+		if (LZ4_RUN_MASK == lit && !len_get(&ip, iend, &lit)) {
+			return -1;
+		}
+		if (lit > (uint32_t)(iend - ip) ||
+				lit > (uint32_t)(max - (op - dst))) {
+			return -1;
+		}
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		// Last sequence has only literals
+		if (ip == iend) {
+			break;
+		}
+		if (iend - ip < 2) {
+			return -1;
+		}
+		off = ip[0] | ip[1]<<8;
+		ip += 2;
+		match = token & LZ4_RUN_MASK;
+		if (LZ4_RUN_MASK == match && !len_get(&ip, iend, &match)) {
+			return -1;
+		}
+		match += LZ4_MIN_MATCH;
+		if (!off || off > (uint32_t)(op - dst) ||
+				match > (uint32_t)(max - (op - dst))) {
+			return -1;
+		}
+		match_start = op - dst;
+		// Byte by byte, as the match can overlap the output
+		while (match--) {
+			*op = *(op - off);
+			op++;
+		}
+		match_end = op - dst;
+	}
+	// Last match must start LZ4_MFLIMIT bytes before the end, and be
+	// followed by LZ4_LAST_LITERALS literals
+	if (match_end && (match_start + LZ4_MFLIMIT > (uint32_t)(op - dst) ||
+			match_end + LZ4_LAST_LITERALS > (uint32_t)(op - dst))) {
+		return -1;
+	}
+
+	return op - dst;
+}
+
+// Compresses data with comp_lz4() and decodes it back. Returns FALSE if
+// the data decoded does not match, or compression failed with room to
+// spare.
+static bool round_trip(const uint8_t *data, uint16_t len)
+{
+	static uint16_t table[COMP_TABLE_LEN];
+	// Enough for the data not compressing
+	static uint8_t comp[LSD_EXT_MAX_LEN + LSD_EXT_MAX_LEN / 255 + 16];
+	static uint8_t out[LSD_EXT_MAX_LEN];
+	int clen;
+
+	clen = comp_lz4(data, len, comp, sizeof(comp), table);
+	if (clen < 0 || lz4_decode(comp, clen, out, sizeof(out)) != len ||
+			memcmp(out, data, len)) {
+		return FALSE;
+	}
+	// Limited as the transmit path does, the block must fit or fail
+	clen = comp_lz4(data, len, comp, len ? len - 1 : 0, table);
+	if (clen >= len || (clen >= 0 && (lz4_decode(comp, clen, out,
+			sizeof(out)) != len || memcmp(out, data, len)))) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+// Checks comp_lz4() round trips on every kind of data, for all the lengths
+// up to 300 bytes (reaching the literal and match length bytes) and some
+// longer ones. Returns the number of failures.
+static uint32_t check_lz4(void)
+{
+	static const uint16_t long_lens[] = {
+		510, 1000, MW_MSG_MAX_BUFLEN, 2048, LSD_EXT_MAX_LEN
+	};
+	static uint8_t data[LSD_EXT_MAX_LEN];
+	uint32_t fails = 0;
+	uint32_t checks = 0;
+	unsigned kind, i;
+	uint16_t len, pos, run;
+
+	for (kind = 0; kind < DATA_KINDS; kind++) {
+		for (len = 0; len <= 300; len++) {
+			data_fill(data, len, kind, len);
+			fails += !round_trip(data, len);
+			checks++;
+		}
+		for (i = 0; i < ARRAY_SIZE(long_lens); i++) {
+			data_fill(data, long_lens[i], kind, i);
+			fails += !round_trip(data, long_lens[i]);
+			checks++;
+		}
+	}
+	// Random data with runs, so matches and literals of any length mix
+	for (i = 0; i < 2000; i++) {
+		len = lrand48() % (LSD_EXT_MAX_LEN + 1);
+		data_fill(data, len, DATA_RANDOM, i);
+		for (pos = 0; pos < len; pos += lrand48() % 64 + 1) {
+			run = lrand48() % 300;
+			run = MIN(run, len - pos);
+			if (lrand48() & 1) {
+				memset(data + pos, data[pos], run);
+			}
+		}
+		fails += !round_trip(data, len);
+		checks++;
+	}
+	printf("LZ4 round trips: %" PRIu32 " blocks, %" PRIu32 " failed\n\n",
+			checks, fails);
+
+	return fails;
+}
+
+// Parses the frame left in the transmit buffer, and checks it holds the
+// data sent. Returns FALSE if it does not.
+static bool frame_check(const uint8_t *data, uint16_t len, bool comp)
+{
+	static uint8_t out[MW_MSG_MAX_BUFLEN];
+	bool frame = FALSE;
+	bool ok = FALSE;
+	MwMsgBuf *b;
+
+	LsdRxParse(d.tx_buf, d.tx_pos, &frame);
+	if (!frame || !(b = d.cur)) {
+		return FALSE;
+	}
+	if (!comp) {
+		ok = b->len == len && !memcmp(b->data, data, len);
+	} else if (LSD_COMP_RAW == b->data[0]) {
+		ok = b->len == len + 1 && !memcmp(b->data + 1, data, len);
+	} else if (LSD_COMP_LZ4 == b->data[0]) {
+		ok = lz4_decode(b->data + 1, b->len - 1, out, sizeof(out)) ==
+			len && !memcmp(out, data, len);
+	}
+	LsdRxBufFree(b);
+	d.cur = NULL;
+
+	return ok;
+}
+
+// Sends frames of the kind through the transmit path, with compression
+// enabled or not, and prints the results. Returns the number of frames
+// that did not decode back to the data sent.
+static uint32_t bench(enum data_kind kind, uint16_t len, bool comp,
+		uint32_t frames)
+{
+	static uint8_t data[MW_MSG_MAX_BUFLEN];
+	struct lsd_tx_req req = {.data = data, .len = len};
+	uint64_t wire = 0;
+	uint32_t fails = 0;
+	uint32_t k;
+	double start;
+	double ns = 0;
+
+	LsdChCompSet(BENCH_CH, comp ? LSD_COMP_LZ4 : LSD_COMP_RAW);
+	for (k = 0; k < frames; k++) {
+		data_fill(data, len, kind, k);
+		start = now_ns();
+		LsdTxFrame(BENCH_CH, &req, 0, len, -1);
+		ns += now_ns() - start;
+		wire += d.tx_pos;
+		fails += !frame_check(data, len, comp);
+	}
+	printf("%-7s %5u  %-4s  %10.1f  %6.1f%%  %9.0f  %11.1f\n",
+			kind_names[kind], len, comp ? "lz4" : "off",
+			(double)wire / frames, 100.0 * wire / frames / len,
+			ns / frames, 1e6 * wire / frames / LINK_BPS);
+
+	return fails;
+}
+
+int main(int argc, char **argv)
+{
+	const uint8_t lanes[] = {8};
+	uint32_t frames = argc > 1 ? atoi(argv[1]) : 2000;
+	uint32_t fails;
+	struct mq q;
+	unsigned kind, i;
+
+	mq_init(&q, lanes, 1);
+	lsd_test_init(&q, 0);
+	LsdRxOptApply();
+	srand48(1);
+
+	fails = check_lz4();
+	printf("data      len  comp  wire B/frm    ratio  tx ns/frm  "
+			"link us/frm\n");
+	for (kind = 0; kind < DATA_KINDS; kind++) {
+		for (i = 0; i < ARRAY_SIZE(lens); i++) {
+			fails += bench(kind, lens[i], FALSE, frames);
+			fails += bench(kind, lens[i], TRUE, frames);
+		}
+	}
+	if (fails) {
+		printf("FAIL: %" PRIu32 " frames or blocks did not decode\n",
+				fails);
+		return 1;
+	}
+
+	return 0;
+}
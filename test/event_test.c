@@ -0,0 +1,166 @@
+// Test of the event notifications. Events are checked to be off until
+// enabled with MW_CMD_EVENT_SET, to be sent untagged with the layout and
+// byte order of struct mw_event, and to follow the mask. WiFi events go
+// through the event handler and the FSM as on the module. Last, events are
+// checked to be dropped without blocking, and without leaking the buffer,
+// when the transmit queue is full or the pool is short of buffers.
+//
+// Usage: event_test
+
+#include "mw_test.h"
+
+// Checks the frame captured is an event with the type, channel and data
+static void event_check(const struct mw_test_frame *f, uint8_t type,
+		uint8_t ch, uint32_t data)
+{
+	const uint8_t *ev = f->cmd.data;
+
+	if (!mw_test_reply(f, MW_CMD_EVENT, sizeof(struct mw_event))) {
+		return;
+	}
+	mw_test_check(ev[0] == type);
+	mw_test_check(ev[1] == ch);
+	mw_test_check(!ev[2] && !ev[3]);
+	// Data is big endian
+	mw_test_check(ev[4] == data>>24 && ev[5] == ((data>>16) & 0xFF) &&
+			ev[6] == ((data>>8) & 0xFF) && ev[7] == (data & 0xFF));
+}
+
+// Sets the event mask with a tagged request, and checks the reply
+static void mask_set(uint8_t tag, uint32_t mask)
+{
+	uint32_t req = htonl(mask);
+	const struct mw_test_frame *f = mw_test_frame(0);
+
+	mw_test_clear();
+	mw_test_req(tag, MW_CMD_EVENT_SET, &req, sizeof(req));
+	if (mw_test_check(1 == mt.frames) && mw_test_reply(f,
+				MW_CMD_TAGGED(tag, MW_CMD_OK), sizeof(req))) {
+		// Reply holds the mask set, unknown events removed
+		mw_test_check(ntohl(f->cmd.dwData[0]) ==
+				(mask & (MW_EVENT_BIT(MW_EVENT_MAX) - 1)));
+	}
+	mw_test_check(d.ev_mask == (mask & (MW_EVENT_BIT(MW_EVENT_MAX) - 1)));
+}
+
+// Feeds a WiFi event to the event handler, and runs the FSM on it
+static void wifi_event(system_event_t *ev)
+{
+	mw_test_check(ESP_OK == event_handler(&d.q, ev));
+	mw_test_fsm_run(0);
+}
+
+// Events are not sent until enabled
+static void test_default_off(void)
+{
+	struct timeval tv = {.tv_sec = 1234567890};
+
+	mw_test_init(MW_ST_IDLE, FALSE);
+	mw_test_clear();
+	MwEventSend(MW_EVENT_WIFI_UP, 0, 0);
+	d.ss[0] = MW_SOCK_TCP_EST;
+	MwFsmRaiseChEvent(1);
+	time_sync_cb(&tv);
+	mw_test_check(!mt.frames);
+	mw_test_check(BUF_POOL_LEN == buf_free_count());
+}
+
+// WiFi events from the event handler, while joining the AP
+static void test_wifi(void)
+{
+	system_event_t ev = {.event_id = SYSTEM_EVENT_STA_GOT_IP};
+
+	mw_test_init(MW_ST_AP_JOIN, FALSE);
+	// Unknown bits are dropped
+	mask_set(5, 0xFFFFFFFF & ~MW_EVENT_BIT(MW_EVENT_WIFI_UP));
+
+	// Masked event is not sent
+	mw_test_clear();
+	ev.event_id = SYSTEM_EVENT_STA_CONNECTED;
+	wifi_event(&ev);
+	mw_test_check(!mt.frames);
+
+	// DHCP event carries the address, in network order as the console
+	// reads it
+	ev.event_id = SYSTEM_EVENT_STA_GOT_IP;
+	ev.event_info.got_ip.ip_info.ip.addr = htonl(0xC0A80117);
+	wifi_event(&ev);
+	mw_test_check(MW_ST_READY == d.s.sys_stat);
+	if (mw_test_check(1 == mt.frames)) {
+		event_check(mw_test_frame(0), MW_EVENT_IP, 0, 0xC0A80117);
+	}
+	mw_test_check(BUF_POOL_LEN == buf_free_count());
+}
+
+// Channel and SNTP events
+static void test_channel(void)
+{
+	struct timeval tv = {.tv_sec = 1234567890};
+
+	mw_test_init(MW_ST_READY, FALSE);
+	mask_set(0, MW_EVENT_BIT(MW_EVENT_CH) | MW_EVENT_BIT(MW_EVENT_SNTP));
+
+	mw_test_clear();
+	d.ss[MW_MAX_SOCK - 1] = MW_SOCK_TCP_EST;
+	MwFsmRaiseChEvent(MW_MAX_SOCK);
+	// Only socket channels have events
+	MwFsmRaiseChEvent(0);
+	MwFsmRaiseChEvent(MW_MAX_SOCK + 1);
+	if (mw_test_check(1 == mt.frames)) {
+		event_check(mw_test_frame(0), MW_EVENT_CH, MW_MAX_SOCK,
+				MW_SOCK_TCP_EST);
+	}
+	mw_test_check(d.s.ch_ev == 1<<MW_MAX_SOCK);
+
+	mw_test_clear();
+	time_sync_cb(&tv);
+	if (mw_test_check(1 == mt.frames)) {
+		event_check(mw_test_frame(0), MW_EVENT_SNTP, 0, 1234567890);
+	}
+	mw_test_check(BUF_POOL_LEN == buf_free_count());
+}
+
+// Events are dropped, returning the buffer, when the transmit queue is full,
+// and not sent without waiting when the pool is short of buffers
+static void test_drop(void)
+{
+	MwMsgBuf *held[BUF_POOL_LEN];
+	int n = 0;
+
+	mw_test_init(MW_ST_READY, FALSE);
+	mask_set(0, MW_EVENT_BIT(MW_EVENT_WIFI_DOWN));
+
+	mw_test_clear();
+	mt.async_full = TRUE;
+	MwEventSend(MW_EVENT_WIFI_DOWN, 0, 1);
+	mt.async_full = FALSE;
+	mw_test_check(!mt.frames);
+	mw_test_check(BUF_POOL_LEN == buf_free_count());
+
+	// Buffers are kept for the data and the replies, so the event is
+	// dropped (the call returning at all shows it did not wait)
+	while (buf_free_count() > MW_BUF_RSV_DATA) {
+		held[n++] = buf_alloc(0);
+	}
+	MwEventSend(MW_EVENT_WIFI_DOWN, 0, 2);
+	mw_test_check(!mt.frames);
+	mw_test_check(MW_BUF_RSV_DATA == buf_free_count());
+	while (n) {
+		buf_unref(held[--n]);
+	}
+	MwEventSend(MW_EVENT_WIFI_DOWN, 0, 3);
+	if (mw_test_check(1 == mt.frames)) {
+		event_check(mw_test_frame(0), MW_EVENT_WIFI_DOWN, 0, 3);
+	}
+	mw_test_check(BUF_POOL_LEN == buf_free_count());
+}
+
+int main(void)
+{
+	test_default_off();
+	test_wifi();
+	test_channel();
+	test_drop();
+
+	return mw_test_end();
+}
@@ -0,0 +1,230 @@
+// Benchmark of the LSD extended header. A transfer is sent through the
+// transmit path in frames as long as LsdMaxLen() allows, with and without
+// LSD_OPT_EXT_HDR, for each framing. The data the module writes to the
+// UART is decoded back as the console does, checking every frame, and the
+// frames needed, the framing overhead and the link time are reported.
+//
+// Usage: ext_bench [transfer length]
+
+#include <time.h>
+
+#include "lsd_test.h"
+
+/// Bytes per second at 1.5 Mbaud, 8N1
+#define LINK_BPS	(1500000 / 10)
+/// Channel the transfer is sent through
+#define BENCH_CH	1
+
+/// Framings compared
+static const uint32_t opt_sets[] = {
+	0,
+	LSD_OPT_CRC16,
+	LSD_OPT_COBS,
+	LSD_OPT_COBS | LSD_OPT_CRC16
+};
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Moves the complete part of the transmit buffer to the stream, as
+// LsdTxFlush() does to the UART
+static void tx_flush(struct lsd_stream *s)
+{
+	uint16_t done = (d.opts & LSD_OPT_COBS) ? d.tx_code : d.tx_pos;
+
+	memcpy(s->data + s->len, d.tx_buf, done);
+	s->len += done;
+	memmove(d.tx_buf, d.tx_buf + done, d.tx_pos - done);
+	d.tx_pos -= done;
+	d.tx_code -= done;
+}
+
+// Sends a frame through the transmit path, appending to the stream what
+// the module writes to the UART. Frames longer than the transmit buffer
+// are fed in pieces, flushing the buffer here before LsdTxPut() would
+// flush it to the UART.
+static void frame_encode(struct lsd_stream *s, const uint8_t *data,
+		uint16_t len)
+{
+	uint16_t n;
+
+	LsdTxBegin(BENCH_CH, len);
+	while (len) {
+		if (LSD_TX_BUF_LEN - d.tx_pos < 2 * LSD_COBS_BLOCK_MAX) {
+			tx_flush(s);
+		}
+		n = MIN(len, LSD_COBS_BLOCK_MAX - 1);
+		LsdTxData(data, n);
+		data += n;
+		len -= n;
+	}
+	LsdTxFinish();
+	// Frame end is kept in the transmit buffer
+	memcpy(s->data + s->len, d.tx_buf, d.tx_pos);
+	s->len += d.tx_pos;
+	s->frames++;
+}
+
+// Undoes the COBS encoding of the frame at the start of in, up to the
+// delimiter. Returns the encoded length, or 0 if no delimiter is found.
+static uint32_t cobs_decode(const uint8_t *in, uint32_t avail, uint8_t *out,
+		uint32_t *out_len)
+{
+	uint32_t pos = 0;
+	uint8_t code;
+
+	*out_len = 0;
+	while (pos < avail && in[pos] != LSD_COBS_DELIM) {
+		code = in[pos++];
+		if (pos + code - 1 > avail) {
+			return 0;
+		}
+		memcpy(out + *out_len, in + pos, code - 1);
+		*out_len += code - 1;
+		pos += code - 1;
+		// Block ends with an implied zero, but for the last one
+		if (code < LSD_COBS_BLOCK_MAX && pos < avail &&
+				in[pos] != LSD_COBS_DELIM) {
+			out[(*out_len)++] = 0;
+		}
+	}
+
+	return pos < avail ? pos + 1 : 0;
+}
+
+// Decodes the frame at the start of in, as the console does, and checks
+// it holds len bytes of data. Returns the encoded length, or 0 if the
+// frame is not valid.
+static uint32_t frame_check(const uint8_t *in, uint32_t avail, uint32_t opts,
+		const uint8_t *data, uint16_t len)
+{
+	static uint8_t raw[LSD_EXT_MAX_LEN + 8];
+	uint8_t hdr_len = (opts & LSD_OPT_EXT_HDR) ? 3 : 2;
+	uint8_t crc_len = (opts & LSD_OPT_CRC16) ? 2 : 0;
+	uint32_t raw_len;
+	uint32_t used;
+	uint16_t frame_len;
+	uint16_t crc;
+	uint8_t ch;
+
+	if (opts & LSD_OPT_COBS) {
+		used = cobs_decode(in, avail, raw, &raw_len);
+	} else {
+		raw_len = hdr_len + len + crc_len;
+		used = raw_len + 2;
+		if (used > avail || in[0] != LSD_STX_ETX ||
+				in[used - 1] != LSD_STX_ETX) {
+			return 0;
+		}
+		memcpy(raw, in + 1, raw_len);
+	}
+	if (!used || raw_len != (uint32_t)hdr_len + len + crc_len) {
+		return 0;
+	}
+	if (opts & LSD_OPT_EXT_HDR) {
+		ch = raw[0];
+		frame_len = raw[1]<<8 | raw[2];
+	} else {
+		ch = raw[0]>>4;
+		frame_len = (raw[0] & 0xF)<<8 | raw[1];
+	}
+	if (ch != BENCH_CH || frame_len != len ||
+			memcmp(raw + hdr_len, data, len)) {
+		return 0;
+	}
+	if (crc_len) {
+		crc = LsdCrc16(LSD_CRC_INIT, raw, hdr_len + len);
+		if (raw[hdr_len + len] != crc>>8 ||
+				raw[hdr_len + len + 1] != (crc & 0xFF)) {
+			return 0;
+		}
+	}
+
+	return used;
+}
+
+// Sends the transfer with the link options set, checks the frames sent,
+// and prints the results. Returns FALSE if a frame was not valid.
+static bool run(const uint8_t *data, uint32_t total, uint32_t opts)
+{
+	struct lsd_stream s = {
+		.data = malloc(total + total / 64 + LSD_TX_BUF_LEN)
+	};
+	uint16_t max = LsdMaxLen(BENCH_CH);
+	uint32_t pos = 0;
+	uint32_t off = 0;
+	uint32_t used;
+	uint16_t len;
+	char name[24];
+	double start;
+	double us;
+	bool ok = TRUE;
+
+	start = now_us();
+	while (pos < total) {
+		len = MIN(max, total - pos);
+		frame_encode(&s, data + pos, len);
+		pos += len;
+	}
+	us = now_us() - start;
+	for (pos = 0; pos < total; pos += len) {
+		len = MIN(max, total - pos);
+		used = frame_check(s.data + off, s.len - off, opts, data + pos,
+				len);
+		if (!used) {
+			ok = FALSE;
+			break;
+		}
+		off += used;
+	}
+	lsd_test_opts_name(opts & ~LSD_OPT_EXT_HDR, name);
+	printf("%-12s %-4s %6u  %6" PRIu32 "  %8" PRIu32 "  %7.2f%%  %9.0f  "
+			"%7.1f  %s\n", name,
+			opts & LSD_OPT_EXT_HDR ? "ext" : "std", max, s.frames,
+			s.len, 100.0 * (s.len - total) / total, us,
+			1e3 * s.len / LINK_BPS, ok && off == s.len ? "ok" : "FAIL");
+	free(s.data);
+
+	return ok && off == s.len;
+}
+
+int main(int argc, char **argv)
+{
+	const uint8_t lanes[] = {8};
+	uint32_t total = argc > 1 ? atoi(argv[1]) : 65536;
+	uint8_t *data = malloc(total);
+	bool fail = FALSE;
+	struct mq q;
+	uint32_t i;
+
+	mq_init(&q, lanes, 1);
+	lsd_test_init(&q, 0);
+	// Random data, zeros included, as COBS overhead depends on them
+	srand48(1);
+	for (i = 0; i < total; i++) {
+		data[i] = lrand48();
+	}
+
+	printf("%" PRIu32 " byte transfer\n", total);
+	printf("framing      hdr     max  frames  wire len  overhead  "
+			"encode us  link ms  decode\n");
+	for (i = 0; i < ARRAY_SIZE(opt_sets); i++) {
+		LsdOptSet(opt_sets[i]);
+		fail |= !run(data, total, opt_sets[i]);
+		LsdOptSet(opt_sets[i] | LSD_OPT_EXT_HDR);
+		fail |= !run(data, total, opt_sets[i] | LSD_OPT_EXT_HDR);
+	}
+	free(data);
+	if (fail) {
+		printf("FAIL: frames sent do not decode\n");
+		return 1;
+	}
+
+	return 0;
+}
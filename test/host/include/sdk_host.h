@@ -0,0 +1,526 @@
+#ifndef _SDK_HOST_H_
+#define _SDK_HOST_H_
+
+// Declarations of the SDK (FreeRTOS, ESP8266 RTOS SDK and lwIP) used by the
+// firmware modules, to build them for the host. The SDK headers included
+// by the modules all resolve to this file. FreeRTOS is implemented on top
+// of POSIX threads by host/rtos.c, and the rest of the functions needed to
+// link the host programs are stubs in host/sdk.c.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/select.h>
+
+// Generated from the project configuration
+#include <sdkconfig.h>
+
+/*** FreeRTOS ***/
+
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t TickType_t;
+typedef TickType_t portTickType;
+
+typedef void *QueueHandle_t;
+typedef void *SemaphoreHandle_t;
+typedef void *TaskHandle_t;
+typedef void *TimerHandle_t;
+typedef void (*TaskFunction_t)(void *);
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t);
+
+typedef struct {
+	TickType_t start;
+} TimeOut_t;
+
+#define pdTRUE			1
+#define pdFALSE			0
+#define pdPASS			pdTRUE
+#define pdFAIL			pdFALSE
+#define portMAX_DELAY		0xFFFFFFFFu
+#define portTICK_PERIOD_MS	10
+#define portTICK_RATE_MS	portTICK_PERIOD_MS
+#define pdMS_TO_TICKS(ms)	((ms) / portTICK_PERIOD_MS)
+#define configMAX_PRIORITIES	15
+#define tskIDLE_PRIORITY	0
+
+typedef enum {
+	eNoAction = 0,
+	eSetBits,
+	eIncrement
+} eNotifyAction;
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack,
+		void *arg, UBaseType_t prio, TaskHandle_t *task);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait);
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction act);
+BaseType_t xTaskNotifyWait(uint32_t clr_entry, uint32_t clr_exit,
+		uint32_t *value, TickType_t wait);
+void vTaskSetTimeOutState(TimeOut_t *tout);
+BaseType_t xTaskCheckForTimeOut(TimeOut_t *tout, TickType_t *wait);
+void taskYIELD(void);
+
+// Critical sections stand for disabling interrupts: a single lock, that
+// can be taken recursively
+void vPortEnterCritical(void);
+void vPortExitCritical(void);
+#define taskENTER_CRITICAL()	vPortEnterCritical()
+#define taskEXIT_CRITICAL()	vPortExitCritical()
+#define portENTER_CRITICAL()	vPortEnterCritical()
+#define portEXIT_CRITICAL()	vPortExitCritical()
+#define portYIELD_FROM_ISR()	taskYIELD()
+
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t item_len);
+BaseType_t xQueueSendToBack(QueueHandle_t q, const void *item,
+		TickType_t wait);
+BaseType_t xQueueSendToFront(QueueHandle_t q, const void *item,
+		TickType_t wait);
+BaseType_t xQueueSendFromISR(QueueHandle_t q, const void *item,
+		BaseType_t *woken);
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t wait);
+BaseType_t xQueuePeek(QueueHandle_t q, void *item, TickType_t wait);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q);
+#define xQueueSend		xQueueSendToBack
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max,
+		UBaseType_t initial);
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t wait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem);
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t sem, BaseType_t *woken);
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t sem, TickType_t wait);
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t sem);
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period,
+		UBaseType_t reload, void *id, TimerCallbackFunction_t cb);
+BaseType_t xTimerStart(TimerHandle_t tim, TickType_t wait);
+BaseType_t xTimerStop(TimerHandle_t tim, TickType_t wait);
+BaseType_t xTimerReset(TimerHandle_t tim, TickType_t wait);
+BaseType_t xTimerChangePeriod(TimerHandle_t tim, TickType_t period,
+		TickType_t wait);
+BaseType_t xTimerDelete(TimerHandle_t tim, TickType_t wait);
+void *pvTimerGetTimerID(TimerHandle_t tim);
+
+/*** ESP8266 RTOS SDK ***/
+
+typedef int esp_err_t;
+
+#define ESP_OK			0
+#define ESP_FAIL		-1
+#define ESP_ERR_NO_MEM		0x101
+#define ESP_ERR_INVALID_ARG	0x102
+#define ESP_ERR_TIMEOUT		0x107
+#define ESP_ERROR_CHECK(x)	(void)(x)
+
+#define ESP_LOGE(tag, fmt, ...)	printf("E %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...)	printf("W %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...)	printf("I %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...)	printf("D %s: " fmt "\n", tag, ##__VA_ARGS__)
+
+#define IRAM_ATTR
+
+const char *esp_err_to_name(esp_err_t err);
+int64_t esp_timer_get_time(void);
+uint32_t esp_random(void);
+void esp_deep_sleep(uint64_t time_us);
+
+/*** UART ***/
+
+typedef int uart_port_t;
+
+#define UART_NUM_0			0
+#define UART_NUM_1			1
+#define UART_DATA_8_BITS		3
+#define UART_PARITY_DISABLE		0
+#define UART_STOP_BITS_1		1
+#define UART_HW_FLOWCTRL_CTS_RTS	3
+#define UART_FIFO_LEN			128
+
+#define UART_RXFIFO_FULL_INT_ENA_M	(1<<0)
+#define UART_TXFIFO_EMPTY_INT_ENA_M	(1<<1)
+#define UART_FRM_ERR_INT_ENA_M		(1<<3)
+#define UART_RXFIFO_OVF_INT_ENA_M	(1<<4)
+#define UART_RXFIFO_TOUT_INT_ENA_M	(1<<8)
+#define UART_RXFIFO_FULL_INT_ST_M	UART_RXFIFO_FULL_INT_ENA_M
+#define UART_TXFIFO_EMPTY_INT_ST_M	UART_TXFIFO_EMPTY_INT_ENA_M
+#define UART_FRM_ERR_INT_ST_M		UART_FRM_ERR_INT_ENA_M
+#define UART_RXFIFO_OVF_INT_ST_M	UART_RXFIFO_OVF_INT_ENA_M
+#define UART_RXFIFO_TOUT_INT_ST_M	UART_RXFIFO_TOUT_INT_ENA_M
+
+typedef struct {
+	int baud_rate;
+	int data_bits;
+	int parity;
+	int stop_bits;
+	int flow_ctrl;
+	uint8_t rx_flow_ctrl_thresh;
+} uart_config_t;
+
+typedef struct {
+	uint32_t intr_enable_mask;
+	uint8_t rx_timeout_thresh;
+	uint8_t txfifo_empty_intr_thresh;
+	uint8_t rxfifo_full_thresh;
+} uart_intr_config_t;
+
+// UART registers. On the host nothing backs them: a test standing in for
+// the UART sets the RX FIFO count and data, and the transmitted data is
+// discarded (the TX FIFO is always empty).
+typedef volatile struct {
+	union {
+		struct {
+			uint32_t rw_byte:8;
+			uint32_t reserved:24;
+		};
+		uint32_t val;
+	} fifo;
+	union { uint32_t val; } int_raw;
+	union { uint32_t val; } int_st;
+	union { uint32_t val; } int_ena;
+	union { uint32_t val; } int_clr;
+	union { uint32_t val; } clk_div;
+	union { uint32_t val; } auto_baud;
+	union {
+		struct {
+			uint32_t rxfifo_cnt:8;
+			uint32_t reserved1:8;
+			uint32_t txfifo_cnt:8;
+			uint32_t reserved2:8;
+		};
+		uint32_t val;
+	} status;
+} uart_dev_t;
+
+extern uart_dev_t uart0;
+
+esp_err_t uart_param_config(uart_port_t port, const uart_config_t *cfg);
+esp_err_t uart_intr_config(uart_port_t port, const uart_intr_config_t *cfg);
+esp_err_t uart_isr_register(uart_port_t port, void (*isr)(void*),
+		void *arg);
+esp_err_t uart_set_baudrate(uart_port_t port, uint32_t baud);
+
+/*** WiFi and TCP/IP adapter ***/
+
+typedef struct {
+	uint32_t addr;
+} ip4_addr_t;
+typedef ip4_addr_t ip_addr_t;
+
+typedef struct {
+	ip4_addr_t ip;
+	ip4_addr_t netmask;
+	ip4_addr_t gw;
+} tcpip_adapter_ip_info_t;
+
+typedef enum {
+	WIFI_AUTH_OPEN = 0,
+	WIFI_AUTH_MAX = 6
+} wifi_auth_mode_t;
+
+typedef struct {
+	uint8_t bssid[6];
+	uint8_t ssid[33];
+	uint8_t primary;
+	int8_t rssi;
+	wifi_auth_mode_t authmode;
+} wifi_ap_record_t;
+
+typedef enum {
+	SYSTEM_EVENT_STA_START,
+	SYSTEM_EVENT_STA_STOP,
+	SYSTEM_EVENT_STA_CONNECTED,
+	SYSTEM_EVENT_STA_DISCONNECTED,
+	SYSTEM_EVENT_STA_GOT_IP,
+	SYSTEM_EVENT_STA_LOST_IP,
+	SYSTEM_EVENT_SCAN_DONE,
+	SYSTEM_EVENT_MAX
+} system_event_id_t;
+
+typedef struct {
+	system_event_id_t event_id;
+	union {
+		struct {
+			tcpip_adapter_ip_info_t ip_info;
+		} got_ip;
+		struct {
+			uint8_t bssid[6];
+		} connected;
+		struct {
+			uint8_t reason;
+		} disconnected;
+		struct {
+			uint32_t status;
+			uint8_t number;
+			uint8_t scan_id;
+		} scan_done;
+	} event_info;
+} system_event_t;
+
+typedef struct {
+	int x;
+} wifi_scan_config_t;
+
+typedef struct {
+	struct {
+		uint8_t ssid[32];
+		uint8_t password[64];
+	} sta;
+} wifi_config_t;
+
+typedef struct {
+	int ampdu_rx_enable;
+	int amsdu_rx_enable;
+	int left_continuous_rx_buf_num;
+	int qos_enable;
+	int rx_ampdu_buf_len;
+	int rx_ampdu_buf_num;
+	int rx_ba_win;
+	int rx_buf_len;
+	int rx_buf_num;
+	int rx_max_single_pkt_len;
+	int rx_pkt_num;
+	int tx_buf_num;
+} wifi_init_config_t;
+
+#define WIFI_INIT_CONFIG_DEFAULT()	{0}
+
+#define WIFI_PROTOCOL_11B		1
+#define WIFI_PROTOCOL_11G		2
+#define WIFI_PROTOCOL_11N		4
+#define WIFI_REASON_BASIC_RATE_NOT_SUPPORT	207
+#define WIFI_STORAGE_RAM		1
+#define WIFI_MODE_STA			1
+#define ESP_IF_WIFI_STA			0
+#define TCPIP_ADAPTER_IF_STA		0
+#define WIFI_AMPDU_RX_ENABLED		0
+#define WIFI_AMSDU_RX_ENABLED		0
+#define WIFI_QOS_ENABLED		0
+#define WIFI_AMPDU_RX_AMPDU_BUF_LEN	0
+#define WIFI_AMPDU_RX_AMPDU_BUF_NUM	0
+#define WIFI_AMPDU_RX_BA_WIN		0
+#define WIFI_HW_RX_BUFFER_LEN		0
+#define WIFI_RX_MAX_SINGLE_PKT_LEN	0
+
+#define MACSTR		"%02x:%02x:%02x:%02x:%02x:%02x"
+#define MAC2STR(a)	(a)[0], (a)[1], (a)[2], (a)[3], (a)[4], (a)[5]
+
+typedef esp_err_t (*system_event_cb_t)(void *ctx, system_event_t *event);
+
+esp_err_t esp_event_loop_init(system_event_cb_t cb, void *ctx);
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *cfg);
+esp_err_t esp_wifi_set_storage(int storage);
+esp_err_t esp_wifi_set_mode(int mode);
+esp_err_t esp_wifi_start(void);
+esp_err_t esp_wifi_stop(void);
+esp_err_t esp_wifi_connect(void);
+esp_err_t esp_wifi_disconnect(void);
+esp_err_t esp_wifi_scan_start(const wifi_scan_config_t *cfg, bool block);
+esp_err_t esp_wifi_scan_get_ap_num(uint16_t *num);
+esp_err_t esp_wifi_scan_get_ap_records(uint16_t *num,
+		wifi_ap_record_t *aps);
+esp_err_t esp_wifi_set_config(int iface, wifi_config_t *cfg);
+esp_err_t esp_wifi_set_protocol(int iface, uint8_t protos);
+esp_err_t esp_wifi_get_mac(int iface, uint8_t *mac);
+
+void tcpip_adapter_init(void);
+esp_err_t tcpip_adapter_dhcpc_stop(int iface);
+esp_err_t tcpip_adapter_dhcpc_start(int iface);
+esp_err_t tcpip_adapter_set_ip_info(int iface,
+		const tcpip_adapter_ip_info_t *info);
+esp_err_t tcpip_adapter_get_ip_info(int iface, tcpip_adapter_ip_info_t *info);
+esp_err_t tcpip_adapter_set_hostname(int iface, const char *name);
+
+/*** lwIP ***/
+
+#define LWIP_SOCKET_OFFSET	0
+#define AF_INET			2
+#define PF_INET			AF_INET
+#define SOCK_STREAM		1
+#define SOCK_DGRAM		2
+#define SOL_SOCKET		0xFFF
+#define SO_REUSEADDR		0x0004
+#define SO_ERROR		0x1007
+#define INADDR_ANY		0
+#define F_GETFL			3
+#define F_SETFL			4
+#define O_NONBLOCK		1
+#define MSG_DONTWAIT		0x08
+
+typedef uint32_t socklen_t;
+typedef uint8_t sa_family_t;
+typedef uint32_t in_addr_t;
+
+struct in_addr {
+	in_addr_t s_addr;
+};
+
+struct sockaddr {
+	uint8_t sa_len;
+	sa_family_t sa_family;
+	char sa_data[14];
+};
+
+struct sockaddr_in {
+	uint8_t sin_len;
+	sa_family_t sin_family;
+	uint16_t sin_port;
+	struct in_addr sin_addr;
+	char sin_zero[8];
+};
+
+struct addrinfo {
+	int ai_flags;
+	int ai_family;
+	int ai_socktype;
+	int ai_protocol;
+	socklen_t ai_addrlen;
+	struct sockaddr *ai_addr;
+	char *ai_canonname;
+	struct addrinfo *ai_next;
+};
+
+int lwip_socket(int domain, int type, int protocol);
+int lwip_close(int s);
+int lwip_connect(int s, const struct sockaddr *addr, socklen_t len);
+int lwip_bind(int s, const struct sockaddr *addr, socklen_t len);
+int lwip_listen(int s, int backlog);
+int lwip_accept(int s, struct sockaddr *addr, socklen_t *len);
+int lwip_send(int s, const void *data, size_t len, int flags);
+int lwip_recv(int s, void *data, size_t len, int flags);
+int lwip_sendto(int s, const void *data, size_t len, int flags,
+		const struct sockaddr *to, socklen_t to_len);
+int lwip_recvfrom(int s, void *data, size_t len, int flags,
+		struct sockaddr *from, socklen_t *from_len);
+int lwip_setsockopt(int s, int level, int opt, const void *val,
+		socklen_t len);
+int lwip_getsockopt(int s, int level, int opt, void *val, socklen_t *len);
+int lwip_fcntl(int s, int cmd, int val);
+int lwip_select(int max, fd_set *rd, fd_set *wr, fd_set *ex,
+		struct timeval *tout);
+uint32_t lwip_htonl(uint32_t x);
+uint16_t lwip_htons(uint16_t x);
+
+#define htonl		lwip_htonl
+#define htons		lwip_htons
+#define ntohl		lwip_htonl
+#define ntohs		lwip_htons
+#define select		lwip_select
+#define accept		lwip_accept
+#define bind		lwip_bind
+
+char *inet_ntoa(struct in_addr addr);
+char *ip4addr_ntoa(const ip4_addr_t *addr);
+int getaddrinfo(const char *node, const char *service,
+		const struct addrinfo *hints, struct addrinfo **res);
+void freeaddrinfo(struct addrinfo *res);
+void dns_setserver(uint8_t idx, const ip_addr_t *addr);
+const ip_addr_t *dns_getserver(uint8_t idx);
+
+#define SNTP_OPMODE_POLL	0
+#define SNTP_MAX_SERVERS	3
+
+void sntp_setoperatingmode(int mode);
+void sntp_setservername(int idx, char *name);
+void sntp_init(void);
+void sntp_set_time_sync_notification_cb(void (*cb)(struct timeval *tv));
+
+/*** Hashes ***/
+
+typedef struct {
+	int unused;
+} esp_sha1_t;
+
+void mbedtls_md5(const unsigned char *data, size_t len, unsigned char *md5);
+void esp_sha1_init(esp_sha1_t *ctx);
+void esp_sha1_update(esp_sha1_t *ctx, const void *data, size_t len);
+void esp_sha1_finish(esp_sha1_t *ctx, void *sha1);
+
+/*** Flash partitions ***/
+
+typedef struct {
+	uint32_t address;
+	uint32_t size;
+} esp_partition_t;
+
+const esp_partition_t *esp_partition_find_first(int type, int subtype,
+		const char *label);
+esp_err_t esp_partition_read(const esp_partition_t *p, size_t off, void *dst,
+		size_t len);
+esp_err_t esp_partition_write(const esp_partition_t *p, size_t off,
+		const void *src, size_t len);
+esp_err_t esp_partition_erase_range(const esp_partition_t *p, size_t off,
+		size_t len);
+uint32_t spi_flash_get_chip_size(void);
+uint32_t spi_flash_get_id(void);
+
+/*** HTTP client ***/
+
+typedef void *esp_http_client_handle_t;
+
+typedef enum {
+	HTTP_METHOD_GET = 0
+} esp_http_client_method_t;
+
+typedef esp_err_t (*http_event_handle_cb)(void *evt);
+
+typedef struct {
+	const char *url;
+	const char *cert_pem;
+	int timeout_ms;
+	http_event_handle_cb event_handler;
+} esp_http_client_config_t;
+
+esp_http_client_handle_t esp_http_client_init(
+		const esp_http_client_config_t *cfg);
+esp_err_t esp_http_client_set_url(esp_http_client_handle_t h,
+		const char *url);
+esp_err_t esp_http_client_set_method(esp_http_client_handle_t h,
+		esp_http_client_method_t method);
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t h,
+		const char *key, const char *value);
+esp_err_t esp_http_client_delete_header(esp_http_client_handle_t h,
+		const char *key);
+esp_err_t esp_http_client_open(esp_http_client_handle_t h, int write_len);
+int esp_http_client_write(esp_http_client_handle_t h, const char *data,
+		int len);
+int esp_http_client_fetch_headers(esp_http_client_handle_t h);
+bool esp_http_client_is_chunked_response(esp_http_client_handle_t h);
+int esp_http_client_get_status_code(esp_http_client_handle_t h);
+int esp_http_client_read(esp_http_client_handle_t h, char *data, int len);
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t h);
+esp_err_t esp_https_ota(const esp_http_client_config_t *cfg);
+
+/*** GPIO ***/
+
+typedef struct {
+	int pin_bit_mask;
+	int mode;
+	int pull_up_en;
+	int pull_down_en;
+	int intr_type;
+} gpio_config_t;
+
+#define GPIO_INTR_DISABLE	0
+#define GPIO_MODE_OUTPUT	1
+
+int gpio_config(const gpio_config_t *cfg);
+int gpio_set_level(int gpio, uint32_t level);
+int gpio_get_level(int gpio);
+
+#endif /*_SDK_HOST_H_*/
@@ -0,0 +1,668 @@
+// FreeRTOS API on top of POSIX threads, to run the firmware modules on the
+// host. Tasks are threads, and all of them run concurrently (priorities are
+// ignored), so a module working here does not rely on a task not being
+// preempted. Critical sections take a single recursive lock, and code
+// standing in for interrupt handlers must run holding it.
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <FreeRTOS.h>
+#include <task.h>
+#include <queue.h>
+#include <semphr.h>
+#include <timers.h>
+
+#include "util.h"
+
+// Task, holding its notification value
+struct task {
+	pthread_t th;
+	TaskFunction_t fn;
+	void *arg;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint32_t notify;
+	bool pending;
+};
+
+// Counting semaphore, also used for mutexes
+struct sem {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	UBaseType_t count;
+	UBaseType_t max;
+	pthread_t owner;		///< Holder of a recursive mutex
+	UBaseType_t depth;		///< Times a recursive mutex is held
+};
+
+// Queue of fixed length items
+struct queue {
+	pthread_mutex_t lock;
+	pthread_cond_t items;		///< Signals an item was queued
+	pthread_cond_t room;		///< Signals an item was received
+	uint8_t *buf;
+	UBaseType_t item_len;
+	UBaseType_t len;
+	UBaseType_t head;
+	UBaseType_t used;
+};
+
+// Software timer
+struct timer {
+	struct timer *next;
+	TimerCallbackFunction_t cb;
+	void *id;
+	TickType_t period;
+	TickType_t expiry;
+	bool reload;
+	bool active;
+};
+
+static pthread_mutex_t crit = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static __thread struct task *self;
+
+// Timer service data
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_once_t once;
+	struct timer *list;
+} tmr = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.once = PTHREAD_ONCE_INIT
+};
+
+static void cond_init(pthread_cond_t *cond)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+static struct timespec now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts;
+}
+
+// Waits on cond until signaled or wait ticks have elapsed since start.
+// Returns FALSE on timeout.
+static bool cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock,
+		const struct timespec *start, TickType_t wait)
+{
+	struct timespec ts = *start;
+	uint64_t ns;
+
+	if (portMAX_DELAY == wait) {
+		return !pthread_cond_wait(cond, lock);
+	}
+	if (!wait) {
+		return FALSE;
+	}
+	ns = ts.tv_nsec + (uint64_t)wait * portTICK_PERIOD_MS * 1000000;
+	ts.tv_sec += ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+
+	return !pthread_cond_timedwait(cond, lock, &ts);
+}
+
+static struct task *task_new(TaskFunction_t fn, void *arg)
+{
+	struct task *t = calloc(1, sizeof(struct task));
+
+	t->fn = fn;
+	t->arg = arg;
+	pthread_mutex_init(&t->lock, NULL);
+	cond_init(&t->cond);
+
+	return t;
+}
+
+static void *task_run(void *arg)
+{
+	self = arg;
+	self->fn(self->arg);
+	// FreeRTOS tasks must not return
+	abort();
+
+	return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack,
+		void *arg, UBaseType_t prio, TaskHandle_t *task)
+{
+	struct task *t = task_new(fn, arg);
+
+	(void)name;
+	(void)stack;
+	(void)prio;
+	if (pthread_create(&t->th, NULL, task_run, t)) {
+		free(t);
+		return pdFAIL;
+	}
+	pthread_detach(t->th);
+	if (task) {
+		*task = t;
+	}
+
+	return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+	// Only a task deleting itself is supported
+	if (!task || task == self) {
+		pthread_exit(NULL);
+	}
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+	if (ticks) {
+		usleep(ticks * portTICK_PERIOD_MS * 1000);
+	} else {
+		sched_yield();
+	}
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+	struct timespec ts = now();
+
+	return (uint64_t)ts.tv_sec * (1000 / portTICK_PERIOD_MS) +
+		ts.tv_nsec / (portTICK_PERIOD_MS * 1000000);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+	// Threads not created with xTaskCreate() (e.g. main) get a task on
+	// first use
+	if (!self) {
+		self = task_new(NULL, NULL);
+		self->th = pthread_self();
+	}
+
+	return self;
+}
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction act)
+{
+	struct task *t = task;
+
+	pthread_mutex_lock(&t->lock);
+	switch (act) {
+	case eSetBits:
+		t->notify |= value;
+		break;
+
+	case eIncrement:
+		t->notify++;
+		break;
+
+	default:
+		break;
+	}
+	t->pending = TRUE;
+	pthread_cond_signal(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+
+	return pdPASS;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+	return xTaskNotify(task, 0, eIncrement);
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken)
+{
+	xTaskNotifyGive(task);
+	if (woken) {
+		*woken = pdTRUE;
+	}
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait)
+{
+	struct task *t = xTaskGetCurrentTaskHandle();
+	struct timespec start = now();
+	uint32_t value;
+
+	pthread_mutex_lock(&t->lock);
+	while (!t->notify && cond_wait(&t->cond, &t->lock, &start, wait));
+	value = t->notify;
+	if (value) {
+		t->notify = clear ? 0 : value - 1;
+	}
+	t->pending = FALSE;
+	pthread_mutex_unlock(&t->lock);
+
+	return value;
+}
+
+BaseType_t xTaskNotifyWait(uint32_t clr_entry, uint32_t clr_exit,
+		uint32_t *value, TickType_t wait)
+{
+	struct task *t = xTaskGetCurrentTaskHandle();
+	struct timespec start = now();
+	BaseType_t ret;
+
+	pthread_mutex_lock(&t->lock);
+	if (!t->pending) {
+		t->notify &= ~clr_entry;
+	}
+	while (!t->pending && cond_wait(&t->cond, &t->lock, &start, wait));
+	if (value) {
+		*value = t->notify;
+	}
+	ret = t->pending;
+	if (ret) {
+		t->notify &= ~clr_exit;
+		t->pending = FALSE;
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	return ret;
+}
+
+void vTaskSetTimeOutState(TimeOut_t *tout)
+{
+	tout->start = xTaskGetTickCount();
+}
+
+BaseType_t xTaskCheckForTimeOut(TimeOut_t *tout, TickType_t *wait)
+{
+	TickType_t tick = xTaskGetTickCount();
+	TickType_t elapsed = tick - tout->start;
+
+	if (portMAX_DELAY == *wait) {
+		return pdFALSE;
+	}
+	if (elapsed >= *wait) {
+		*wait = 0;
+		return pdTRUE;
+	}
+	*wait -= elapsed;
+	tout->start = tick;
+
+	return pdFALSE;
+}
+
+void taskYIELD(void)
+{
+	sched_yield();
+}
+
+void vPortEnterCritical(void)
+{
+	pthread_mutex_lock(&crit);
+}
+
+void vPortExitCritical(void)
+{
+	pthread_mutex_unlock(&crit);
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t item_len)
+{
+	struct queue *q = calloc(1, sizeof(struct queue));
+
+	q->buf = malloc(len * item_len);
+	q->item_len = item_len;
+	q->len = len;
+	pthread_mutex_init(&q->lock, NULL);
+	cond_init(&q->items);
+	cond_init(&q->room);
+
+	return q;
+}
+
+static BaseType_t queue_send(struct queue *q, const void *item,
+		TickType_t wait, bool front)
+{
+	struct timespec start = now();
+	UBaseType_t pos;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->used == q->len) {
+		if (!cond_wait(&q->room, &q->lock, &start, wait)) {
+			pthread_mutex_unlock(&q->lock);
+			return pdFALSE;
+		}
+	}
+	if (front) {
+		q->head = (q->head + q->len - 1) % q->len;
+		pos = q->head;
+	} else {
+		pos = (q->head + q->used) % q->len;
+	}
+	memcpy(q->buf + pos * q->item_len, item, q->item_len);
+	q->used++;
+	pthread_cond_signal(&q->items);
+	pthread_mutex_unlock(&q->lock);
+
+	return pdTRUE;
+}
+
+BaseType_t xQueueSendToBack(QueueHandle_t q, const void *item,
+		TickType_t wait)
+{
+	return queue_send(q, item, wait, FALSE);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t q, const void *item,
+		TickType_t wait)
+{
+	return queue_send(q, item, wait, TRUE);
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t q, const void *item,
+		BaseType_t *woken)
+{
+	BaseType_t ret = queue_send(q, item, 0, FALSE);
+
+	if (ret && woken) {
+		*woken = pdTRUE;
+	}
+
+	return ret;
+}
+
+static BaseType_t queue_recv(struct queue *q, void *item, TickType_t wait,
+		bool peek)
+{
+	struct timespec start = now();
+
+	pthread_mutex_lock(&q->lock);
+	while (!q->used) {
+		if (!cond_wait(&q->items, &q->lock, &start, wait)) {
+			pthread_mutex_unlock(&q->lock);
+			return pdFALSE;
+		}
+	}
+	memcpy(item, q->buf + q->head * q->item_len, q->item_len);
+	if (!peek) {
+		q->head = (q->head + 1) % q->len;
+		q->used--;
+		pthread_cond_signal(&q->room);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t wait)
+{
+	return queue_recv(q, item, wait, FALSE);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t q, void *item, TickType_t wait)
+{
+	return queue_recv(q, item, wait, TRUE);
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+	struct queue *qu = q;
+	UBaseType_t used;
+
+	pthread_mutex_lock(&qu->lock);
+	used = qu->used;
+	pthread_mutex_unlock(&qu->lock);
+
+	return used;
+}
+
+static SemaphoreHandle_t sem_new(UBaseType_t max, UBaseType_t initial)
+{
+	struct sem *s = calloc(1, sizeof(struct sem));
+
+	s->max = max;
+	s->count = initial;
+	pthread_mutex_init(&s->lock, NULL);
+	cond_init(&s->cond);
+
+	return s;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max,
+		UBaseType_t initial)
+{
+	return sem_new(max, initial);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+	return sem_new(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+	return sem_new(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void)
+{
+	return sem_new(1, 1);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t wait)
+{
+	struct sem *s = sem;
+	struct timespec start = now();
+
+	pthread_mutex_lock(&s->lock);
+	while (!s->count) {
+		if (!cond_wait(&s->cond, &s->lock, &start, wait)) {
+			pthread_mutex_unlock(&s->lock);
+			return pdFALSE;
+		}
+	}
+	s->count--;
+	pthread_mutex_unlock(&s->lock);
+
+	return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+	struct sem *s = sem;
+	BaseType_t ret = pdFALSE;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->count < s->max) {
+		s->count++;
+		pthread_cond_signal(&s->cond);
+		ret = pdTRUE;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return ret;
+}
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t sem, BaseType_t *woken)
+{
+	BaseType_t ret = xSemaphoreGive(sem);
+
+	if (ret && woken) {
+		*woken = pdTRUE;
+	}
+
+	return ret;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t sem, TickType_t wait)
+{
+	struct sem *s = sem;
+
+	if (s->depth && pthread_equal(s->owner, pthread_self())) {
+		s->depth++;
+		return pdTRUE;
+	}
+	if (!xSemaphoreTake(sem, wait)) {
+		return pdFALSE;
+	}
+	s->owner = pthread_self();
+	s->depth = 1;
+
+	return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t sem)
+{
+	struct sem *s = sem;
+
+	if (!s->depth || !pthread_equal(s->owner, pthread_self())) {
+		return pdFALSE;
+	}
+	if (!--s->depth) {
+		xSemaphoreGive(sem);
+	}
+
+	return pdTRUE;
+}
+
+// Timer service task. Callbacks run with the service lock released, so they
+// can use the timer API.
+static void *tmr_service(void *arg)
+{
+	struct timer *t;
+	struct timespec start;
+	TickType_t tick;
+	TickType_t wait;
+
+	(void)arg;
+	pthread_mutex_lock(&tmr.lock);
+	while (1) {
+		tick = xTaskGetTickCount();
+		wait = portMAX_DELAY;
+		for (t = tmr.list; t; t = t->next) {
+			if (!t->active) {
+				continue;
+			}
+			if ((int32_t)(t->expiry - tick) <= 0) {
+				break;
+			}
+			wait = MIN(wait, t->expiry - tick);
+		}
+		if (!t) {
+			start = now();
+			cond_wait(&tmr.cond, &tmr.lock, &start, wait);
+			continue;
+		}
+		if (t->reload) {
+			t->expiry += t->period;
+		} else {
+			t->active = FALSE;
+		}
+		pthread_mutex_unlock(&tmr.lock);
+		t->cb(t);
+		pthread_mutex_lock(&tmr.lock);
+	}
+
+	return NULL;
+}
+
+static void tmr_service_start(void)
+{
+	pthread_t th;
+
+	cond_init(&tmr.cond);
+	pthread_create(&th, NULL, tmr_service, NULL);
+	pthread_detach(th);
+}
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period,
+		UBaseType_t reload, void *id, TimerCallbackFunction_t cb)
+{
+	struct timer *t = calloc(1, sizeof(struct timer));
+
+	(void)name;
+	pthread_once(&tmr.once, tmr_service_start);
+	t->cb = cb;
+	t->id = id;
+	t->period = period;
+	t->reload = reload;
+	pthread_mutex_lock(&tmr.lock);
+	t->next = tmr.list;
+	tmr.list = t;
+	pthread_mutex_unlock(&tmr.lock);
+
+	return t;
+}
+
+BaseType_t xTimerReset(TimerHandle_t tim, TickType_t wait)
+{
+	struct timer *t = tim;
+
+	(void)wait;
+	pthread_mutex_lock(&tmr.lock);
+	t->expiry = xTaskGetTickCount() + t->period;
+	t->active = TRUE;
+	pthread_cond_signal(&tmr.cond);
+	pthread_mutex_unlock(&tmr.lock);
+
+	return pdPASS;
+}
+
+BaseType_t xTimerStart(TimerHandle_t tim, TickType_t wait)
+{
+	return xTimerReset(tim, wait);
+}
+
+BaseType_t xTimerStop(TimerHandle_t tim, TickType_t wait)
+{
+	struct timer *t = tim;
+
+	(void)wait;
+	pthread_mutex_lock(&tmr.lock);
+	t->active = FALSE;
+	pthread_mutex_unlock(&tmr.lock);
+
+	return pdPASS;
+}
+
+BaseType_t xTimerChangePeriod(TimerHandle_t tim, TickType_t period,
+		TickType_t wait)
+{
+	struct timer *t = tim;
+
+	pthread_mutex_lock(&tmr.lock);
+	t->period = period;
+	pthread_mutex_unlock(&tmr.lock);
+
+	return xTimerReset(tim, wait);
+}
+
+BaseType_t xTimerDelete(TimerHandle_t tim, TickType_t wait)
+{
+	struct timer **t;
+
+	(void)wait;
+	pthread_mutex_lock(&tmr.lock);
+	for (t = &tmr.list; *t; t = &(*t)->next) {
+		if (*t == tim) {
+			*t = (*t)->next;
+			free(tim);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&tmr.lock);
+
+	return pdPASS;
+}
+
+void *pvTimerGetTimerID(TimerHandle_t tim)
+{
+	return ((struct timer*)tim)->id;
+}
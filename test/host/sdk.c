@@ -0,0 +1,645 @@
+// Stubs of the SDK functions used by the firmware modules, enough to run
+// them on the host. Peripherals do nothing, the UART registers are a plain
+// structure (see sdk_host.h), and WiFi, sockets, HTTP and flash always
+// fail.
+
+#include <time.h>
+
+#include <esp_err.h>
+#include <esp_timer.h>
+#include <driver/uart.h>
+#include <esp_wifi.h>
+#include <lwip/sockets.h>
+#include <esp_partition.h>
+#include <esp_http_client.h>
+
+/*** ESP8266 RTOS SDK ***/
+
+const char *esp_err_to_name(esp_err_t err)
+{
+	return ESP_OK == err ? "ESP_OK" : "ESP_FAIL";
+}
+
+int64_t esp_timer_get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint32_t esp_random(void)
+{
+	return random();
+}
+
+void esp_deep_sleep(uint64_t time_us)
+{
+	(void)time_us;
+}
+
+esp_err_t esp_event_loop_init(system_event_cb_t cb, void *ctx)
+{
+	(void)cb;
+	(void)ctx;
+
+	return ESP_FAIL;
+}
+
+/*** UART ***/
+
+uart_dev_t uart0;
+
+esp_err_t uart_param_config(uart_port_t port, const uart_config_t *cfg)
+{
+	(void)port;
+	(void)cfg;
+
+	return ESP_OK;
+}
+
+esp_err_t uart_intr_config(uart_port_t port, const uart_intr_config_t *cfg)
+{
+	(void)port;
+	uart0.int_ena.val = cfg->intr_enable_mask;
+
+	return ESP_OK;
+}
+
+esp_err_t uart_isr_register(uart_port_t port, void (*isr)(void*),
+		void *arg)
+{
+	(void)port;
+	(void)isr;
+	(void)arg;
+
+	return ESP_OK;
+}
+
+esp_err_t uart_set_baudrate(uart_port_t port, uint32_t baud)
+{
+	(void)port;
+	(void)baud;
+
+	return ESP_OK;
+}
+
+/*** WiFi and TCP/IP adapter: never connected ***/
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *cfg)
+{
+	(void)cfg;
+
+	return ESP_FAIL;
+}
+
+esp_err_t esp_wifi_set_storage(int storage)
+{
+	(void)storage;
+
+	return ESP_FAIL;
+}
+
+esp_err_t esp_wifi_set_mode(int mode)
+{
+	(void)mode;
+
+	return ESP_FAIL;
+}
+
+esp_err_t esp_wifi_start(void)
+{
+	return ESP_FAIL;
+}
+
+esp_err_t esp_wifi_stop(void)
+{
+	return ESP_OK;
+}
+
+esp_err_t esp_wifi_connect(void)
+{
+	return ESP_FAIL;
+}
+
+esp_err_t esp_wifi_disconnect(void)
+{
+	return ESP_OK;
+}
+
+esp_err_t esp_wifi_scan_start(const wifi_scan_config_t *cfg, bool block)
+{
+	(void)cfg;
+	(void)block;
+
+	return ESP_FAIL;
+}
+
+esp_err_t esp_wifi_scan_get_ap_num(uint16_t *num)
+{
+	*num = 0;
+
+	return ESP_OK;
+}
+
+esp_err_t esp_wifi_scan_get_ap_records(uint16_t *num,
+		wifi_ap_record_t *aps)
+{
+	(void)aps;
+
+	*num = 0;
+
+	return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_config(int iface, wifi_config_t *cfg)
+{
+	(void)iface;
+	(void)cfg;
+
+	return ESP_FAIL;
+}
+
+esp_err_t esp_wifi_set_protocol(int iface, uint8_t protos)
+{
+	(void)iface;
+	(void)protos;
+
+	return ESP_FAIL;
+}
+
+esp_err_t esp_wifi_get_mac(int iface, uint8_t *mac)
+{
+	(void)iface;
+
+	memset(mac, 0, 6);
+
+	return ESP_OK;
+}
+
+void tcpip_adapter_init(void)
+{
+}
+
+esp_err_t tcpip_adapter_dhcpc_stop(int iface)
+{
+	(void)iface;
+
+	return ESP_OK;
+}
+
+esp_err_t tcpip_adapter_dhcpc_start(int iface)
+{
+	(void)iface;
+
+	return ESP_OK;
+}
+
+esp_err_t tcpip_adapter_set_ip_info(int iface,
+		const tcpip_adapter_ip_info_t *info)
+{
+	(void)iface;
+	(void)info;
+
+	return ESP_FAIL;
+}
+
+esp_err_t tcpip_adapter_get_ip_info(int iface, tcpip_adapter_ip_info_t *info)
+{
+	(void)iface;
+
+	memset(info, 0, sizeof(tcpip_adapter_ip_info_t));
+
+	return ESP_OK;
+}
+
+esp_err_t tcpip_adapter_set_hostname(int iface, const char *name)
+{
+	(void)iface;
+	(void)name;
+
+	return ESP_FAIL;
+}
+
+/*** lwIP: sockets cannot be created ***/
+
+int lwip_socket(int domain, int type, int protocol)
+{
+	(void)domain;
+	(void)type;
+	(void)protocol;
+
+	errno = ENFILE;
+
+	return -1;
+}
+
+int lwip_close(int s)
+{
+	(void)s;
+
+	return -1;
+}
+
+int lwip_connect(int s, const struct sockaddr *addr, socklen_t len)
+{
+	(void)s;
+	(void)addr;
+	(void)len;
+
+	return -1;
+}
+
+int lwip_bind(int s, const struct sockaddr *addr, socklen_t len)
+{
+	(void)s;
+	(void)addr;
+	(void)len;
+
+	return -1;
+}
+
+int lwip_listen(int s, int backlog)
+{
+	(void)s;
+	(void)backlog;
+
+	return -1;
+}
+
+int lwip_accept(int s, struct sockaddr *addr, socklen_t *len)
+{
+	(void)s;
+	(void)addr;
+	(void)len;
+
+	return -1;
+}
+
+int lwip_send(int s, const void *data, size_t len, int flags)
+{
+	(void)s;
+	(void)data;
+	(void)len;
+	(void)flags;
+
+	return -1;
+}
+
+int lwip_recv(int s, void *data, size_t len, int flags)
+{
+	(void)s;
+	(void)data;
+	(void)len;
+	(void)flags;
+
+	return -1;
+}
+
+int lwip_sendto(int s, const void *data, size_t len, int flags,
+		const struct sockaddr *to, socklen_t to_len)
+{
+	(void)s;
+	(void)data;
+	(void)len;
+	(void)flags;
+	(void)to;
+	(void)to_len;
+
+	return -1;
+}
+
+int lwip_recvfrom(int s, void *data, size_t len, int flags,
+		struct sockaddr *from, socklen_t *from_len)
+{
+	(void)s;
+	(void)data;
+	(void)len;
+	(void)flags;
+	(void)from;
+	(void)from_len;
+
+	return -1;
+}
+
+int lwip_setsockopt(int s, int level, int opt, const void *val,
+		socklen_t len)
+{
+	(void)s;
+	(void)level;
+	(void)opt;
+	(void)val;
+	(void)len;
+
+	return -1;
+}
+
+int lwip_getsockopt(int s, int level, int opt, void *val, socklen_t *len)
+{
+	(void)s;
+	(void)level;
+	(void)opt;
+	(void)val;
+	(void)len;
+
+	return -1;
+}
+
+int lwip_fcntl(int s, int cmd, int val)
+{
+	(void)s;
+	(void)cmd;
+	(void)val;
+
+	return -1;
+}
+
+int lwip_select(int max, fd_set *rd, fd_set *wr, fd_set *ex,
+		struct timeval *tout)
+{
+	(void)max;
+	(void)rd;
+	(void)wr;
+	(void)ex;
+	(void)tout;
+
+	return -1;
+}
+
+uint32_t lwip_htonl(uint32_t x)
+{
+	return __builtin_bswap32(x);
+}
+
+uint16_t lwip_htons(uint16_t x)
+{
+	return __builtin_bswap16(x);
+}
+
+int getaddrinfo(const char *node, const char *service,
+		const struct addrinfo *hints, struct addrinfo **res)
+{
+	(void)node;
+	(void)service;
+	(void)hints;
+	(void)res;
+
+	return -1;
+}
+
+void freeaddrinfo(struct addrinfo *res)
+{
+	(void)res;
+}
+
+void dns_setserver(uint8_t idx, const ip_addr_t *addr)
+{
+	(void)idx;
+	(void)addr;
+}
+
+const ip_addr_t *dns_getserver(uint8_t idx)
+{
+	static const ip_addr_t any;
+
+	(void)idx;
+
+	return &any;
+}
+
+void sntp_setoperatingmode(int mode)
+{
+	(void)mode;
+}
+
+void sntp_setservername(int idx, char *name)
+{
+	(void)idx;
+	(void)name;
+}
+
+void sntp_init(void)
+{
+}
+
+void sntp_set_time_sync_notification_cb(void (*cb)(struct timeval *tv))
+{
+	(void)cb;
+}
+
+/*** Hashes: not computed ***/
+
+void mbedtls_md5(const unsigned char *data, size_t len, unsigned char *md5)
+{
+	(void)data;
+	(void)len;
+
+	memset(md5, 0, 16);
+}
+
+void esp_sha1_init(esp_sha1_t *ctx)
+{
+	(void)ctx;
+}
+
+void esp_sha1_update(esp_sha1_t *ctx, const void *data, size_t len)
+{
+	(void)ctx;
+	(void)data;
+	(void)len;
+}
+
+void esp_sha1_finish(esp_sha1_t *ctx, void *sha1)
+{
+	(void)ctx;
+
+	memset(sha1, 0, 20);
+}
+
+/*** Flash: there are no partitions ***/
+
+const esp_partition_t *esp_partition_find_first(int type, int subtype,
+		const char *label)
+{
+	(void)type;
+	(void)subtype;
+	(void)label;
+
+	return NULL;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *p, size_t off, void *dst,
+		size_t len)
+{
+	(void)p;
+	(void)off;
+	(void)dst;
+	(void)len;
+
+	return ESP_FAIL;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *p, size_t off,
+		const void *src, size_t len)
+{
+	(void)p;
+	(void)off;
+	(void)src;
+	(void)len;
+
+	return ESP_FAIL;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *p, size_t off,
+		size_t len)
+{
+	(void)p;
+	(void)off;
+	(void)len;
+
+	return ESP_FAIL;
+}
+
+uint32_t spi_flash_get_chip_size(void)
+{
+	return 0;
+}
+
+uint32_t spi_flash_get_id(void)
+{
+	return 0;
+}
+
+/*** HTTP client: clients cannot be created ***/
+
+esp_http_client_handle_t esp_http_client_init(
+		const esp_http_client_config_t *cfg)
+{
+	(void)cfg;
+
+	return NULL;
+}
+
+esp_err_t esp_http_client_set_url(esp_http_client_handle_t h,
+		const char *url)
+{
+	(void)h;
+	(void)url;
+
+	return ESP_FAIL;
+}
+
+esp_err_t esp_http_client_set_method(esp_http_client_handle_t h,
+		esp_http_client_method_t method)
+{
+	(void)h;
+	(void)method;
+
+	return ESP_FAIL;
+}
+
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t h,
+		const char *key, const char *value)
+{
+	(void)h;
+	(void)key;
+	(void)value;
+
+	return ESP_FAIL;
+}
+
+esp_err_t esp_http_client_delete_header(esp_http_client_handle_t h,
+		const char *key)
+{
+	(void)h;
+	(void)key;
+
+	return ESP_FAIL;
+}
+
+esp_err_t esp_http_client_open(esp_http_client_handle_t h, int write_len)
+{
+	(void)h;
+	(void)write_len;
+
+	return ESP_FAIL;
+}
+
+int esp_http_client_write(esp_http_client_handle_t h, const char *data,
+		int len)
+{
+	(void)h;
+	(void)data;
+	(void)len;
+
+	return -1;
+}
+
+int esp_http_client_fetch_headers(esp_http_client_handle_t h)
+{
+	(void)h;
+
+	return -1;
+}
+
+bool esp_http_client_is_chunked_response(esp_http_client_handle_t h)
+{
+	(void)h;
+
+	return false;
+}
+
+int esp_http_client_get_status_code(esp_http_client_handle_t h)
+{
+	(void)h;
+
+	return -1;
+}
+
+int esp_http_client_read(esp_http_client_handle_t h, char *data, int len)
+{
+	(void)h;
+	(void)data;
+	(void)len;
+
+	return -1;
+}
+
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t h)
+{
+	(void)h;
+
+	return ESP_OK;
+}
+
+esp_err_t esp_https_ota(const esp_http_client_config_t *cfg)
+{
+	(void)cfg;
+
+	return ESP_FAIL;
+}
+
+/*** GPIO ***/
+
+int gpio_config(const gpio_config_t *cfg)
+{
+	(void)cfg;
+
+	return ESP_OK;
+}
+
+int gpio_set_level(int gpio, uint32_t level)
+{
+	(void)gpio;
+	(void)level;
+
+	return ESP_OK;
+}
+
+int gpio_get_level(int gpio)
+{
+	(void)gpio;
+
+	return 0;
+}
@@ -0,0 +1,279 @@
+// Benchmark of the LSD receive parser. Streams of frames recorded from the
+// module transmitter (or captured from a link, read from a file) are fed
+// to the parser in spans, as the receive task gets them from the ring, and
+// the parsing rate and CPU cycles per frame are reported for each framing.
+// Then replies made of a command header and data (as the ECHO one) are
+// sent through the transmit task gathered with LsdSendV(), copied to a
+// buffer and sent with LsdSend(), and sent as a split frame.
+//
+// Usage: lsd_bench [frames]
+//        lsd_bench -r <capture file> <link options>
+//        lsd_bench -w <capture file> <link options> [frames]
+
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "lsd_test.h"
+#include "megawifi.h"
+
+/// Times each stream is parsed
+#define REPS		20
+/// Frames sent through each send path
+#define SENDS		20000
+/// Span lengths fed to the parser
+static const uint32_t spans[] = {UART_FIFO_LEN, LSD_RX_RING_LEN};
+
+/// Link options benchmarked on recorded streams
+static const uint32_t opt_sets[] = {
+	0,
+	LSD_OPT_CRC16,
+	LSD_OPT_COBS,
+	LSD_OPT_COBS | LSD_OPT_CRC16
+};
+
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parses a stream in spans of up to span bytes. Returns the number of
+// frames received, and adds their payload length to payload.
+static uint32_t parse(const uint8_t *data, uint32_t len, uint32_t span,
+		uint64_t *payload)
+{
+	uint32_t frames = 0;
+	uint32_t pos = 0;
+	bool frame;
+
+	while (pos < len) {
+		frame = FALSE;
+		pos += LsdRxParse(data + pos, MIN(span, len - pos), &frame);
+		if (frame) {
+			// Frame handed to the FSM, and processed
+			if (d.cur) {
+				LsdRxBufFree(d.cur);
+				d.cur = NULL;
+			}
+			*payload += d.rx_len;
+			frames++;
+		}
+	}
+
+	return frames;
+}
+
+// Parses a stream REPS times with the link options set, and prints the
+// results. Returns FALSE if frames of a recorded stream were lost.
+static bool bench(const char *name, const struct lsd_stream *s, uint32_t span)
+{
+	uint64_t payload = 0;
+	uint32_t frames = 0;
+	uint64_t start_cyc;
+	uint64_t cyc;
+	double start;
+	double secs;
+	int i;
+
+	LsdRxOptApply();
+	start = now_s();
+	start_cyc = cycles();
+	for (i = 0; i < REPS; i++) {
+		frames += parse(s->data, s->len, span, &payload);
+	}
+	cyc = cycles() - start_cyc;
+	secs = now_s() - start;
+	printf("%-12s %5" PRIu32 "  %9.1f  %9.1f  %10.0f  %6" PRIu32 "\n",
+			name, span, s->len * (double)REPS / secs / 1e6,
+			payload / secs / 1e6, frames ? (double)cyc / frames : 0.0,
+			frames / REPS);
+
+	return !s->frames || frames == s->frames * REPS;
+}
+
+// Sends SENDS replies of a header and len data bytes through the control
+// channel using each send path, and prints the time per frame. The frames
+// are also encoded without the transmit task, gathered and copied, as the
+// task handoff takes most of the time on the host.
+static void bench_send(const char *name, uint16_t len)
+{
+	static uint8_t data[MW_MSG_MAX_BUFLEN];
+	static uint8_t buf[MW_MSG_MAX_BUFLEN];
+	uint8_t hdr[MW_CMD_HEADLEN] = {0};
+	struct lsd_iov iov[2] = {
+		{.data = hdr, .len = MW_CMD_HEADLEN},
+		{.data = data, .len = len}
+	};
+	uint16_t total = MW_CMD_HEADLEN + len;
+	struct lsd_tx_req gather = {.iov = iov, .iovcnt = 2, .len = total};
+	struct lsd_tx_req copy = {.data = buf, .len = total};
+	double t[5];
+	double start;
+	int i;
+
+	start = now_s();
+	for (i = 0; i < SENDS; i++) {
+		LsdSendV(iov, 2, 0);
+	}
+	t[0] = now_s() - start;
+
+	start = now_s();
+	for (i = 0; i < SENDS; i++) {
+		memcpy(buf, hdr, MW_CMD_HEADLEN);
+		memcpy(buf + MW_CMD_HEADLEN, data, len);
+		LsdSend(buf, total, 0);
+	}
+	t[1] = now_s() - start;
+
+	start = now_s();
+	for (i = 0; i < SENDS; i++) {
+		LsdSplitStart(hdr, MW_CMD_HEADLEN, total, 0);
+		LsdSplitEnd(data, len);
+	}
+	t[2] = now_s() - start;
+
+	start = now_s();
+	for (i = 0; i < SENDS; i++) {
+		LsdTxFrame(0, &gather, 0, total, -1);
+	}
+	t[3] = now_s() - start;
+
+	start = now_s();
+	for (i = 0; i < SENDS; i++) {
+		memcpy(buf, hdr, MW_CMD_HEADLEN);
+		memcpy(buf + MW_CMD_HEADLEN, data, len);
+		LsdTxFrame(0, &copy, 0, total, -1);
+	}
+	t[4] = now_s() - start;
+
+	printf("%-12s %5u", name, total);
+	for (i = 0; i < 5; i++) {
+		printf("  %8.0f", t[i] / SENDS * 1e9);
+	}
+	putchar('\n');
+}
+
+// Reads a captured stream from a file
+static bool stream_read(struct lsd_stream *s, const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	long len;
+
+	memset(s, 0, sizeof(struct lsd_stream));
+	if (!f) {
+		return FALSE;
+	}
+	if (fseek(f, 0, SEEK_END) || (len = ftell(f)) <= 0) {
+		fclose(f);
+		return FALSE;
+	}
+	rewind(f);
+	s->data = malloc(len);
+	s->len = fread(s->data, 1, len, f);
+	fclose(f);
+
+	return TRUE;
+}
+
+// Writes a recorded stream to a file
+static bool stream_write(const struct lsd_stream *s, const char *path)
+{
+	FILE *f = fopen(path, "wb");
+	bool ok;
+
+	if (!f) {
+		return FALSE;
+	}
+	ok = fwrite(s->data, 1, s->len, f) == s->len;
+
+	return !fclose(f) && ok;
+}
+
+int main(int argc, char **argv)
+{
+	const uint8_t lanes[] = {8};
+	struct lsd_stream s;
+	struct mq q;
+	uint32_t frames = 2000;
+	uint32_t opts;
+	char name[16];
+	unsigned i, j;
+
+	mq_init(&q, lanes, 1);
+	lsd_test_init(&q, 0);
+	if (argc > 3 && !strcmp(argv[1], "-w")) {
+		LsdOptSet(strtoul(argv[3], NULL, 0));
+		lsd_test_stream(&s, 0, argc > 4 ? atoi(argv[4]) : frames);
+		if (!stream_write(&s, argv[2])) {
+			printf("cannot write %s\n", argv[2]);
+			return 1;
+		}
+		return 0;
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	printf("framing       span  wire MB/s  data MB/s  cycles/frm  frames\n");
+#else
+	printf("framing       span  wire MB/s  data MB/s      ns/frm  frames\n");
+#endif
+	if (argc > 3 && !strcmp(argv[1], "-r")) {
+		opts = strtoul(argv[3], NULL, 0);
+		if (!stream_read(&s, argv[2])) {
+			printf("cannot read %s\n", argv[2]);
+			return 1;
+		}
+		LsdOptSet(opts);
+		lsd_test_opts_name(opts, name);
+		for (j = 0; j < ARRAY_SIZE(spans); j++) {
+			bench(name, &s, spans[j]);
+		}
+		return 0;
+	}
+
+	if (argc > 1) {
+		frames = atoi(argv[1]);
+	}
+	for (i = 0; i < ARRAY_SIZE(opt_sets); i++) {
+		LsdOptSet(opt_sets[i]);
+		lsd_test_stream(&s, 0, frames);
+		lsd_test_opts_name(opt_sets[i], name);
+		for (j = 0; j < ARRAY_SIZE(spans); j++) {
+			if (!bench(name, &s, spans[j])) {
+				printf("FAIL: %" PRIu32 " frames sent\n", frames);
+				return 1;
+			}
+		}
+		free(s.data);
+	}
+
+	printf("\n%18s%30s%20s\n", "", "sent (ns/frame)",
+			"encoded (ns/frame)");
+	printf("framing        len    gather      copy     split    gather  "
+			"    copy\n");
+	for (i = 0; i < ARRAY_SIZE(opt_sets); i += ARRAY_SIZE(opt_sets) - 1) {
+		LsdOptSet(opt_sets[i]);
+		lsd_test_opts_name(opt_sets[i], name);
+		bench_send(name, 0);
+		bench_send("", 64);
+		bench_send("", MW_MSG_MAX_BUFLEN - MW_CMD_HEADLEN);
+	}
+
+	return 0;
+}
@@ -0,0 +1,125 @@
+#ifndef _LSD_TEST_H_
+#define _LSD_TEST_H_
+
+// Helpers for the LSD host programs. The module is included, so they can
+// reach its internals (module data, parser and ISR).
+
+#include "../main/lsd.c"
+
+// Stream of encoded frames, as received from the UART
+struct lsd_stream {
+	uint8_t *data;		///< Encoded frames
+	uint32_t len;		///< Length of data
+	uint32_t frames;	///< Number of frames
+	uint64_t payload;	///< Sum of the payload lengths
+};
+
+// Initializes the module (starting its tasks), enables all the channels
+// and sets the link options. Frames received by the receive task are sent
+// to lane 0 of q.
+static void lsd_test_init(struct mq *q, uint32_t opts)
+{
+	int ch;
+
+	buf_pool_init();
+	LsdInit(q, 0);
+	for (ch = 0; ch < LSD_MAX_CH; ch++) {
+		LsdChEnable(ch);
+	}
+	LsdOptSet(opts);
+}
+
+// Writes the name of the framing set by the link options
+static void lsd_test_opts_name(uint32_t opts, char *name)
+{
+	sprintf(name, "%s%s", opts & LSD_OPT_COBS ? "cobs" : "stx/etx",
+			opts & LSD_OPT_CRC16 ? "+crc" : "");
+}
+
+// Payload length of frame k, from 4 to MW_MSG_MAX_BUFLEN bytes
+static uint16_t lsd_test_len(uint32_t k)
+{
+	return 4 + (k * 2654435761u >> 8) % (MW_MSG_MAX_BUFLEN - 3);
+}
+
+// Channel frame k is sent through
+static uint8_t lsd_test_ch(uint32_t k)
+{
+	return k % LSD_MAX_CH;
+}
+
+// Fills the payload of frame k: the frame number, followed by runs of 8
+// equal bytes taking every value (including the STX/ETX and COBS
+// delimiter ones)
+static void lsd_test_fill(uint8_t *data, uint16_t len, uint32_t k)
+{
+	uint16_t i;
+
+	memcpy(data, &k, sizeof(k));
+	for (i = sizeof(k); i < len; i++) {
+		data[i] = k * 7 + (i>>3);
+	}
+}
+
+// Checks a received buffer holds frame k. Returns TRUE if it does.
+static bool lsd_test_check(const MwMsgBuf *buf, uint32_t k)
+{
+	uint32_t got;
+	uint16_t i;
+
+	memcpy(&got, buf->data, sizeof(got));
+	if (got != k || buf->ch != lsd_test_ch(k) ||
+			buf->len != lsd_test_len(k)) {
+		return FALSE;
+	}
+	for (i = sizeof(k); i < buf->len; i++) {
+		if (buf->data[i] != (uint8_t)(k * 7 + (i>>3))) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+// Encodes a frame using the link options set, the same way the transmit
+// task does. Returns the length of the frame written to out.
+static uint32_t lsd_test_encode(uint8_t ch, const uint8_t *data, uint16_t len,
+		uint8_t *out)
+{
+	uint32_t out_len;
+
+	LsdTxBegin(ch, len);
+	LsdTxData(data, len);
+	LsdTxFinish();
+	// Sent frame is kept in the transmit buffer
+	out_len = d.tx_pos;
+	memcpy(out, d.tx_buf, out_len);
+
+	return out_len;
+}
+
+// Builds a stream with frames first to first + frames - 1
+static void lsd_test_stream(struct lsd_stream *s, uint32_t first,
+		uint32_t frames)
+{
+	uint8_t payload[MW_MSG_MAX_BUFLEN];
+	uint32_t cap = 0;
+	uint32_t k;
+	uint16_t len;
+
+	memset(s, 0, sizeof(struct lsd_stream));
+	for (k = first; k < first + frames; k++) {
+		if (cap - s->len < LSD_TX_BUF_LEN) {
+			cap = 2 * cap + LSD_TX_BUF_LEN;
+			s->data = realloc(s->data, cap);
+		}
+		len = lsd_test_len(k);
+		lsd_test_fill(payload, len, k);
+		s->len += lsd_test_encode(lsd_test_ch(k), payload, len,
+				s->data + s->len);
+		s->payload += len;
+	}
+	s->frames = frames;
+}
+
+#endif /*_LSD_TEST_H_*/
@@ -0,0 +1,148 @@
+// Stress benchmark of the FSM message queue. Producer tasks send messages
+// as fast as they can while the FSM task receives them, and the rate is
+// compared with the single queue the FSM used before: one FreeRTOS queue
+// of 8 messages shared by all the producers, copied on each send, blocking
+// the producers when full, and read one message at a time. Both run on the
+// host FreeRTOS port, where a FreeRTOS queue takes a lock on each
+// operation. Message order is checked for each producer.
+//
+// Usage: mq_bench [messages per producer]
+
+#include <time.h>
+#include <unistd.h>
+
+#include "mq.h"
+#include "util.h"
+#include <task.h>
+#include <queue.h>
+
+/// Maximum number of producers
+#define PROD_MAX	4
+/// Length of each lane, and of the FreeRTOS queue
+#define QUEUE_LEN	8
+/// Messages the FSM gets at once from mq
+#define FSM_BATCH	8
+
+// Benchmark data
+static struct {
+	struct mq q;
+	QueueHandle_t fq;	///< FreeRTOS queue
+	bool use_mq;		///< Use mq instead of the FreeRTOS queue
+	uint32_t msgs;		///< Messages per producer
+	uint32_t done;		///< Producers finished
+	uint32_t errors;
+} b;
+
+// Sends msgs messages, numbered from 0, through a lane or the queue
+static void prod_tsk(void *arg)
+{
+	uint8_t lane = (uintptr_t)arg;
+	MwFsmMsg m = {.e = lane};
+	uint32_t i;
+
+	for (i = 0; i < b.msgs; i++) {
+		m.d = (void*)(uintptr_t)i;
+		if (b.use_mq) {
+			mq_send(&b.q, lane, &m, portMAX_DELAY);
+		} else {
+			xQueueSend(b.fq, &m, portMAX_DELAY);
+		}
+	}
+	__atomic_add_fetch(&b.done, 1, __ATOMIC_RELEASE);
+	vTaskDelete(NULL);
+}
+
+// Receives the messages of all the producers, checking their order.
+// Returns the number of receive calls.
+static uint32_t fsm_recv(int prods)
+{
+	uint32_t next[PROD_MAX] = {0};
+	uint32_t left = b.msgs * prods;
+	uint32_t calls = 0;
+	MwFsmMsg m[FSM_BATCH];
+	int n;
+	int i;
+
+	while (left) {
+		if (b.use_mq) {
+			n = mq_recv(&b.q, m, FSM_BATCH, portMAX_DELAY);
+		} else {
+			n = xQueueReceive(b.fq, m, portMAX_DELAY);
+		}
+		calls++;
+		for (i = 0; i < n; i++) {
+			if ((uintptr_t)m[i].d != next[m[i].e]++) {
+				b.errors++;
+			}
+		}
+		left -= n;
+	}
+
+	return calls;
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs the producers and the FSM. Returns the messages per second.
+static double run(int prods, bool use_mq, double *batch)
+{
+	double start;
+	double end;
+	uint32_t calls;
+	int i;
+
+	b.use_mq = use_mq;
+	b.done = 0;
+	start = now_s();
+	for (i = 0; i < prods; i++) {
+		xTaskCreate(prod_tsk, "PROD", 0, (void*)(uintptr_t)i, 1, NULL);
+	}
+	calls = fsm_recv(prods);
+	end = now_s();
+	while (__atomic_load_n(&b.done, __ATOMIC_ACQUIRE) < (uint32_t)prods) {
+		usleep(1000);
+	}
+	*batch = (double)b.msgs * prods / calls;
+
+	return b.msgs * prods / (end - start);
+}
+
+int main(int argc, char **argv)
+{
+	const uint8_t lanes[PROD_MAX] = {QUEUE_LEN, QUEUE_LEN, QUEUE_LEN,
+		QUEUE_LEN};
+	double fq_rate, mq_rate;
+	double fq_batch, mq_batch;
+	uint32_t full = 0;
+	int prods;
+	int i;
+
+	b.msgs = argc > 1 ? atoi(argv[1]) : 200000;
+	mq_init(&b.q, lanes, PROD_MAX);
+	b.fq = xQueueCreate(QUEUE_LEN, sizeof(MwFsmMsg));
+
+	printf("producers  queue (msg/s)  mq (msg/s)  speedup  mq batch\n");
+	for (prods = 1; prods <= PROD_MAX; prods++) {
+		fq_rate = run(prods, FALSE, &fq_batch);
+		mq_rate = run(prods, TRUE, &mq_batch);
+		printf("%9d  %13.0f  %10.0f  %6.2fx  %8.2f\n", prods, fq_rate,
+				mq_rate, mq_rate / fq_rate, mq_batch);
+	}
+	for (i = 0; i < PROD_MAX; i++) {
+		full += mq_full_count(&b.q, i);
+	}
+	if (b.errors || full) {
+		printf("FAIL: %u out of order, %u not queued\n", b.errors,
+				full);
+		return 1;
+	}
+
+	return 0;
+}
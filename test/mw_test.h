@@ -0,0 +1,205 @@
+#ifndef _MW_TEST_H_
+#define _MW_TEST_H_
+
+// Helpers for the host tests of the command interpreter. The module is
+// included, so they can reach its internals (module data, FSM and command
+// handlers), and the frames it sends are captured instead of going to LSD:
+// its sends are redirected to the functions here.
+
+#define LsdSend		mw_test_send
+#define LsdSendV	mw_test_send_v
+#define LsdSendAsync	mw_test_send_async
+
+#include "../main/megawifi.c"
+
+/// Frames kept by the capture
+#define MW_TEST_FRAMES	32
+
+// Frame sent by the module
+struct mw_test_frame {
+	uint8_t ch;			///< Channel
+	uint16_t len;			///< Length of data
+	union {
+		uint8_t data[MW_MSG_MAX_BUFLEN];
+		MwCmd cmd;
+	};
+};
+
+// Test data
+static struct {
+	struct mw_test_frame frame[MW_TEST_FRAMES];	///< Frames captured
+	uint32_t frames;	///< Frames sent (captured or not)
+	bool async_full;	///< LsdSendAsync() finds the queue full
+	bool workers;		///< Worker tasks started
+	uint32_t fails;		///< Checks failed
+} mt;
+
+// Captures a frame gathered from several buffers
+int mw_test_send_v(const struct lsd_iov *iov, int iovcnt, uint8_t ch)
+{
+	struct mw_test_frame *f;
+	uint16_t len = 0;
+	int i;
+
+	taskENTER_CRITICAL();
+	f = &mt.frame[mt.frames++ % MW_TEST_FRAMES];
+	f->ch = ch;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(f->data + len, iov[i].data,
+				MIN(iov[i].len, sizeof(f->data) - len));
+		len += MIN(iov[i].len, sizeof(f->data) - len);
+	}
+	f->len = len;
+	taskEXIT_CRITICAL();
+
+	return len;
+}
+
+int mw_test_send(const uint8_t *data, uint16_t len, uint8_t ch)
+{
+	struct lsd_iov iov = {.data = data, .len = len};
+
+	return mw_test_send_v(&iov, 1, ch);
+}
+
+// Captures a frame and runs its callback at once, as if it had been sent,
+// unless the queue is set to be full
+int mw_test_send_async(const uint8_t *data, uint16_t len, uint8_t ch,
+		lsd_tx_cb cb, void *ctx)
+{
+	if (mt.async_full) {
+		return 0;
+	}
+	len = mw_test_send(data, len, ch);
+	if (cb) {
+		cb(ctx);
+	}
+
+	return len;
+}
+
+// Checks a condition, printing it if it does not hold. Returns the
+// condition.
+#define mw_test_check(cond)	mw_test_check_at(cond, #cond, __LINE__)
+
+static bool mw_test_check_at(bool cond, const char *what, int line)
+{
+	if (!cond) {
+		printf("line %d: %s failed\n", line, what);
+		mt.fails++;
+	}
+
+	return cond;
+}
+
+// Initializes the module data as MwInit() does, without the tasks and the
+// SDK, leaving the module on the state. Workers are started (once, as they
+// outlive the module data) if a test runs jobs.
+static void mw_test_init(uint8_t state, bool workers)
+{
+	const uint8_t lane_len[MW_LANES] = MW_FSM_LANE_LEN;
+	int i;
+
+	memset(&d, 0, sizeof(d));
+	buf_pool_init();
+	for (i = 0; i < MW_MAX_SOCK; i++) {
+		d.sock[i] = -1;
+		d.chan[i] = -1;
+	}
+	mq_init(&d.q, lane_len, MW_LANES);
+	if (workers && !mt.workers) {
+		worker_pool_init(MW_WORKERS, MW_JOBS, MW_WORKER_PRIO,
+				MW_WORKER_STACK_LEN, job_done_cb);
+		mt.workers = TRUE;
+	}
+	LsdInit(&d.q, MW_LANE_SER);
+	LsdChEnable(MW_CTRL_CH);
+	d.s.sys_stat = state;
+}
+
+// Forgets the frames captured
+static void mw_test_clear(void)
+{
+	taskENTER_CRITICAL();
+	mt.frames = 0;
+	taskEXIT_CRITICAL();
+}
+
+// Returns the frame captured n frames after the last clear
+static const struct mw_test_frame *mw_test_frame(uint32_t n)
+{
+	return &mt.frame[n % MW_TEST_FRAMES];
+}
+
+// Waits up to ms milliseconds until n frames have been captured. Returns
+// TRUE if they were.
+static bool mw_test_wait(uint32_t n, uint32_t ms)
+{
+	while (mt.frames < n && ms) {
+		vTaskDelay(1);
+		ms -= MIN(ms, portTICK_PERIOD_MS);
+	}
+
+	return mt.frames >= n;
+}
+
+// Processes a request received on the control channel, as the FSM does,
+// from a buffer taken from the pool as the LSD receiver does
+static void mw_test_req(uint8_t tag, uint8_t cmd, const void *data,
+		uint16_t len)
+{
+	MwMsgBuf *b = buf_alloc(0);
+
+	b->cmd.cmd = htons(MW_CMD_TAGGED(tag, cmd));
+	b->cmd.datalen = htons(len);
+	memcpy(b->cmd.data, data, len);
+	b->ch = MW_CTRL_CH;
+	b->len = MW_CMD_HEADLEN + len;
+	MwFsmCmdProc(&b->cmd, b->len);
+	buf_unref(b);
+}
+
+// Processes the messages queued for the FSM, waiting up to ms milliseconds
+// for the first one. Returns the number of messages processed.
+static int mw_test_fsm_run(uint32_t ms)
+{
+	MwFsmMsg m[MW_FSM_BATCH];
+	TickType_t wait = pdMS_TO_TICKS(ms);
+	int total = 0;
+	int n, i;
+
+	while ((n = mq_recv(&d.q, m, MW_FSM_BATCH, wait))) {
+		for (i = 0; i < n; i++) {
+			MwFsm(&m[i]);
+		}
+		total += n;
+		wait = 0;
+	}
+
+	return total;
+}
+
+// Checks a captured frame is a reply (or event) with the command word and
+// data length. Returns TRUE if it is.
+static bool mw_test_reply(const struct mw_test_frame *f, uint16_t cmd,
+		uint16_t len)
+{
+	return mw_test_check(MW_CTRL_CH == f->ch) &&
+		mw_test_check(ntohs(f->cmd.cmd) == cmd) &&
+		mw_test_check(ntohs(f->cmd.datalen) == len) &&
+		mw_test_check(f->len == MW_CMD_HEADLEN + len);
+}
+
+// Prints the result. Returns the program exit code.
+static int mw_test_end(void)
+{
+	if (mt.fails) {
+		printf("%" PRIu32 " checks failed\nFAIL\n", mt.fails);
+		return 1;
+	}
+	printf("PASS\n");
+
+	return 0;
+}
+
+#endif /*_MW_TEST_H_*/
@@ -0,0 +1,160 @@
+// Stress test of the LSD receive path: the ISR filling the ring, and the
+// receive task parsing it. A thread stands in for the UART, raising the RX
+// interrupt with the FIFO loaded from a stream of encoded frames, while a
+// slow FSM stands in for the consumer of the received frames, so the ring
+// fills and reception is stopped and resumed. All the frames must be
+// received in order and intact, without errors, and with all the buffers
+// returned to the pool.
+//
+// Usage: ring_stress [frames per option set]
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "lsd_test.h"
+
+/// Messages the FSM gets at once
+#define FSM_BATCH	8
+
+/// Link option sets tested, in order
+static const uint32_t opt_sets[] = {
+	LSD_OPT_CRC16,
+	LSD_OPT_COBS | LSD_OPT_CRC16,
+	LSD_OPT_COBS | LSD_OPT_EXT_HDR
+};
+
+// Test data
+static struct {
+	struct mq q;		///< FSM queue
+	uint32_t next;		///< Next frame expected by the FSM
+	uint32_t recv;		///< Frames received by the FSM
+	uint32_t errors;	///< Frames received with wrong contents
+	uint32_t isr;		///< RX interrupts raised
+	uint32_t stalls;	///< Times the UART found reception stopped
+} t;
+
+// Consumes the frames received, as the FSM does, checking them. Every few
+// frames, it sleeps for a while for the ring to fill.
+static void fsm_tsk(void *arg)
+{
+	MwFsmMsg m[FSM_BATCH];
+	MwMsgBuf *b;
+	int n;
+	int i;
+
+	(void)arg;
+	while (1) {
+		n = mq_recv(&t.q, m, FSM_BATCH, portMAX_DELAY);
+		for (i = 0; i < n; i++) {
+			b = m[i].d;
+			if (MW_EV_SER_RX != m[i].e ||
+					!lsd_test_check(b, t.next)) {
+				if (t.errors++ < 10) {
+					printf("frame %u: bad contents\n", t.next);
+				}
+			}
+			LsdRxBufFree(b);
+			t.next++;
+			__atomic_add_fetch(&t.recv, 1, __ATOMIC_RELEASE);
+			if (!(t.next % 97)) {
+				usleep(1000);
+			}
+		}
+	}
+}
+
+// Moves the stream to the RX FIFO and raises the RX interrupt, while
+// reception is enabled (otherwise flow control stops the sender). The FIFO
+// registers hold a single data byte, so the FIFO is loaded with a run of
+// equal bytes each time. The ISR runs with interrupts disabled.
+static void uart_rx(const uint8_t *data, uint32_t len)
+{
+	uint32_t pos = 0;
+	uint32_t head;
+	uint32_t run;
+
+	while (pos < len) {
+		taskENTER_CRITICAL();
+		if (!(uart0.int_ena.val & LSD_UART_RX_INT)) {
+			taskEXIT_CRITICAL();
+			t.stalls++;
+			sched_yield();
+			continue;
+		}
+		for (run = 1; run < UART_FIFO_LEN && pos + run < len &&
+				data[pos + run] == data[pos]; run++);
+		uart0.fifo.rw_byte = data[pos];
+		uart0.status.rxfifo_cnt = run;
+		uart0.int_st.val = UART_RXFIFO_FULL_INT_ST_M;
+		head = d.rx_ring.head;
+		LsdUartIsr(NULL);
+		// Data left in the FIFO is sent again when reception resumes
+		pos += d.rx_ring.head - head;
+		t.isr++;
+		taskEXIT_CRITICAL();
+	}
+}
+
+// Waits until the FSM gets the frames up to end. Returns FALSE on timeout.
+static bool fsm_wait(uint32_t end)
+{
+	int i;
+
+	for (i = 0; i < 10000; i++) {
+		if (__atomic_load_n(&t.recv, __ATOMIC_ACQUIRE) >= end) {
+			return TRUE;
+		}
+		usleep(1000);
+	}
+
+	return FALSE;
+}
+
+int main(int argc, char **argv)
+{
+	const uint8_t lanes[] = {8};
+	uint32_t frames = argc > 1 ? atoi(argv[1]) : 5000;
+	struct lsd_stream s;
+	struct lsd_stats st;
+	uint32_t errors = 0;
+	uint32_t first = 0;
+	unsigned i;
+	int ch;
+
+	mq_init(&t.q, lanes, 1);
+	lsd_test_init(&t.q, opt_sets[0]);
+	xTaskCreate(fsm_tsk, "FSM", 0, NULL, 0, NULL);
+	for (i = 0; i < ARRAY_SIZE(opt_sets); i++) {
+		// Options are changed with the link idle
+		LsdOptSet(opt_sets[i]);
+		lsd_test_stream(&s, first, frames);
+		uart_rx(s.data, s.len);
+		first += frames;
+		if (!fsm_wait(first)) {
+			printf("options 0x%02" PRIX32 ": timeout, %u/%u frames\n",
+					opt_sets[i], t.recv, first);
+			return 1;
+		}
+		printf("options 0x%02" PRIX32 ": %u frames, %u bytes\n",
+				opt_sets[i], s.frames, s.len);
+		free(s.data);
+	}
+
+	LsdStatsGet(&st);
+	for (ch = 0; ch < LSD_MAX_CH; ch++) {
+		errors += st.crc_err[ch] + st.resync[ch] + st.oversize[ch];
+	}
+	printf("%u interrupts, %u stalls (%u polls stopped), %u errors, "
+			"%u bad frames, %d buffers free\n", t.isr,
+			st.rx_stall, t.stalls, errors, t.errors,
+			buf_free_count());
+	if (errors || t.errors || st.rx_ovf || !st.rx_stall ||
+			buf_free_count() != BUF_POOL_LEN) {
+		printf("FAIL\n");
+		return 1;
+	}
+	printf("PASS\n");
+
+	return 0;
+}
@@ -0,0 +1,351 @@
+// Test of the TCP connections made without blocking the FSM. MW_CMD_TCP_CON
+// requests run on the workers against fake lwIP sockets, whose connect
+// completes, is refused, or never completes, as selected by the port
+// requested. The connect timeout is checked to come from the request, and
+// MW_CMD_CLOSE to cancel a connection in progress, also when the channel is
+// reserved again right away. Connected sockets must be recorded and back in
+// blocking mode, and at the end no socket, address or pool buffer must be
+// left behind.
+//
+// Usage: tcp_con_test
+
+// Sockets and DNS lookups of the module are the fake ones below
+#define lwip_socket	tc_socket
+#define lwip_close	tc_close
+#define lwip_connect	tc_connect
+#define lwip_fcntl	tc_fcntl
+#define lwip_getsockopt	tc_getsockopt
+#define lwip_select	tc_select
+#define net_dns_lookup	tc_dns_lookup
+#define freeaddrinfo	tc_freeaddrinfo
+
+#include "mw_test.h"
+
+/// Ports selecting how the connect ends
+enum con_mode {
+	CON_PENDING = 1,	///< Never completes
+	CON_REFUSED,		///< Refused by the server
+	CON_OK			///< Completes
+};
+
+/// Timeout of the connects expected to time out (ms)
+#define CON_TMO_MS	300
+
+// Fake socket
+struct fake_sock {
+	bool open;		///< Socket is open
+	bool nonblock;		///< Non-blocking mode set
+	uint8_t mode;		///< How the connect ends (enum con_mode)
+};
+
+// Address returned by the fake DNS lookup
+struct fake_addr {
+	struct addrinfo ai;
+	struct sockaddr_in sa;
+};
+
+// Test data
+static struct {
+	/// Sockets, numbered as the module expects them
+	struct fake_sock sock[MW_MAX_SOCK + 1];
+	int open;		///< Sockets open
+	int addrs;		///< Addresses not freed
+	int blocking;		///< Connects made in blocking mode
+} t;
+
+int tc_socket(int domain, int type, int protocol)
+{
+	int s = -1;
+	int i;
+
+	taskENTER_CRITICAL();
+	for (i = 0; i <= MW_MAX_SOCK && s < 0; i++) {
+		if (!t.sock[i].open) {
+			memset(&t.sock[i], 0, sizeof(struct fake_sock));
+			t.sock[i].open = TRUE;
+			t.open++;
+			s = i + LWIP_SOCKET_OFFSET;
+		}
+	}
+	taskEXIT_CRITICAL();
+
+	if (s < 0) {
+		errno = ENFILE;
+	}
+
+	return s;
+}
+
+int tc_close(int s)
+{
+	taskENTER_CRITICAL();
+	mw_test_check(t.sock[s].open);
+	t.sock[s].open = FALSE;
+	t.open--;
+	taskEXIT_CRITICAL();
+
+	return 0;
+}
+
+int tc_fcntl(int s, int cmd, int val)
+{
+	if (F_SETFL == cmd) {
+		t.sock[s].nonblock = val & O_NONBLOCK;
+	}
+
+	return 0;
+}
+
+int tc_connect(int s, const struct sockaddr *addr, socklen_t len)
+{
+	t.sock[s].mode = ntohs(((const struct sockaddr_in*)addr)->sin_port);
+	if (!t.sock[s].nonblock) {
+		t.blocking++;
+	}
+	errno = EINPROGRESS;
+
+	return -1;
+}
+
+// Only the socket connecting is in the sets
+int tc_select(int max, fd_set *rd, fd_set *wr, fd_set *ex,
+		struct timeval *tout)
+{
+	if (CON_PENDING == t.sock[max - 1].mode) {
+		vTaskDelayMs(tout->tv_sec * 1000 + tout->tv_usec / 1000);
+		FD_ZERO(wr);
+		FD_ZERO(ex);
+		return 0;
+	}
+
+	return 1;
+}
+
+int tc_getsockopt(int s, int level, int opt, void *val, socklen_t *len)
+{
+	*(int*)val = CON_REFUSED == t.sock[s].mode ? ECONNREFUSED : 0;
+
+	return 0;
+}
+
+int tc_dns_lookup(const char *addr, const char *port, struct addrinfo **res)
+{
+	struct fake_addr *a = calloc(1, sizeof(struct fake_addr));
+
+	a->sa.sin_family = AF_INET;
+	a->sa.sin_port = htons(atoi(port));
+	a->ai.ai_family = AF_INET;
+	a->ai.ai_socktype = SOCK_STREAM;
+	a->ai.ai_addr = (struct sockaddr*)&a->sa;
+	a->ai.ai_addrlen = sizeof(struct sockaddr_in);
+	*res = &a->ai;
+	taskENTER_CRITICAL();
+	t.addrs++;
+	taskEXIT_CRITICAL();
+
+	return 0;
+}
+
+void tc_freeaddrinfo(struct addrinfo *res)
+{
+	free(res);
+	taskENTER_CRITICAL();
+	t.addrs--;
+	taskEXIT_CRITICAL();
+}
+
+// Requests a connection on the channel, to the port selecting the connect
+// end. The timeout (ms) is appended if not negative.
+static void con_req(uint8_t tag, uint8_t ch, enum con_mode mode, int tmo_ms)
+{
+	MwMsgInAddr a = {.channel = ch};
+	uint16_t len = offsetof(MwMsgInAddr, data);
+	uint16_t host_len;
+
+	sprintf(a.dst_port, "%d", mode);
+	strcpy(a.data, "example.com");
+	host_len = strlen(a.data) + 1;
+	if (tmo_ms >= 0) {
+		a.data[host_len] = tmo_ms>>8;
+		a.data[host_len + 1] = tmo_ms & 0xFF;
+		len += 2;
+	}
+	mw_test_req(tag, MW_CMD_TCP_CON, &a, len + host_len);
+}
+
+static void close_req(uint8_t tag, uint8_t ch)
+{
+	mw_test_req(tag, MW_CMD_CLOSE, &ch, 1);
+}
+
+// Waits up to ms milliseconds for the reply with the tag. Returns its
+// command code, or -1 if it is not received.
+static int reply_wait(uint8_t tag, uint32_t ms)
+{
+	TickType_t end = xTaskGetTickCount() + pdMS_TO_TICKS(ms);
+	const struct mw_test_frame *f;
+	uint32_t n = 0;
+	uint16_t cmd;
+
+	while (TRUE) {
+		for (; n < mt.frames; n++) {
+			f = mw_test_frame(n);
+			cmd = ntohs(f->cmd.cmd);
+			if (MW_CMD_TAG(cmd) == tag) {
+				mw_test_reply(f, cmd, 0);
+				return MW_CMD_CODE(cmd);
+			}
+		}
+		if (xTaskGetTickCount() >= end) {
+			return -1;
+		}
+		vTaskDelay(1);
+	}
+}
+
+// Completes the jobs that have run, as the FSM does
+static void jobs_complete(void)
+{
+	int i;
+
+	for (i = 0; i < MW_JOBS; i++) {
+		while (d.job[i].busy && mw_test_fsm_run(1000));
+	}
+}
+
+// Checks the channel has a socket connected, in blocking mode
+static void connected_check(uint8_t ch)
+{
+	int s = d.sock[ch - 1];
+
+	mw_test_check(MW_SOCK_TCP_EST == d.ss[ch - 1]);
+	if (!mw_test_check(s >= 0)) {
+		return;
+	}
+	mw_test_check(t.sock[s].open && !t.sock[s].nonblock);
+	mw_test_check(d.chan[s - LWIP_SOCKET_OFFSET] == ch);
+	mw_test_check(FD_ISSET(s, &d.fds));
+}
+
+// Timeout is taken from the request, or the default one
+static void test_tmo(void)
+{
+	MwMsgInAddr a = {.data = "example.com\0\x12\x34"};
+	uint16_t len = offsetof(MwMsgInAddr, data) + 12;
+
+	mw_test_check(MW_TCP_CON_TMO_MS == tcp_con_tmo(&a, len));
+	mw_test_check(0x1234 == tcp_con_tmo(&a, len + 2));
+	a.data[12] = a.data[13] = 0;
+	mw_test_check(MW_TCP_CON_TMO_MS == tcp_con_tmo(&a, len + 2));
+}
+
+// Connect not completing times out when the request says
+static void test_timeout(void)
+{
+	TickType_t start = xTaskGetTickCount();
+	uint32_t ms;
+
+	mw_test_clear();
+	con_req(1, 1, CON_PENDING, CON_TMO_MS);
+	mw_test_check(MW_CMD_ERROR == reply_wait(1, 4 * CON_TMO_MS));
+	ms = (xTaskGetTickCount() - start) * portTICK_PERIOD_MS;
+	if (!mw_test_check(ms >= CON_TMO_MS &&
+				ms < CON_TMO_MS + 3 * MW_TCP_CON_POLL_MS)) {
+		printf("timed out after %" PRIu32 " ms\n", ms);
+	}
+	jobs_complete();
+	mw_test_check(MW_SOCK_NONE == d.ss[0]);
+}
+
+// MW_CMD_CLOSE cancels the connection, the FSM not waiting for it
+static void test_cancel(void)
+{
+	TickType_t start;
+	uint32_t ms;
+
+	mw_test_clear();
+	con_req(1, 1, CON_PENDING, -1);
+	vTaskDelayMs(2 * MW_TCP_CON_POLL_MS);
+	mw_test_check(MW_SOCK_TCP_CONNECTING == d.ss[0]);
+	start = xTaskGetTickCount();
+	close_req(2, 1);
+	mw_test_check(MW_CMD_OK == reply_wait(2, 0));
+	mw_test_check(MW_CMD_ERROR == reply_wait(1, 4 * MW_TCP_CON_POLL_MS));
+	ms = (xTaskGetTickCount() - start) * portTICK_PERIOD_MS;
+	mw_test_check(ms <= 2 * MW_TCP_CON_POLL_MS);
+	jobs_complete();
+	mw_test_check(MW_SOCK_NONE == d.ss[0]);
+}
+
+// Channel reserved again while the cancelled connection is still polling:
+// the cancelled one ends, and the new one keeps the channel
+static void test_rereserve(void)
+{
+	int i;
+
+	mw_test_clear();
+	con_req(1, 1, CON_PENDING, -1);
+	vTaskDelayMs(MW_TCP_CON_POLL_MS / 2);
+	close_req(2, 1);
+	con_req(3, 1, CON_PENDING, -1);
+	mw_test_check(MW_CMD_OK == reply_wait(2, 0));
+	mw_test_check(MW_CMD_ERROR == reply_wait(1, 4 * MW_TCP_CON_POLL_MS));
+	mw_test_check(MW_SOCK_TCP_CONNECTING == d.ss[0]);
+	mw_test_check(1 == t.open);
+
+	// Server accepts the new connection
+	for (i = 0; i <= MW_MAX_SOCK; i++) {
+		if (t.sock[i].open) {
+			t.sock[i].mode = CON_OK;
+		}
+	}
+	mw_test_check(MW_CMD_OK == reply_wait(3, 4 * MW_TCP_CON_POLL_MS));
+	jobs_complete();
+	connected_check(1);
+
+	close_req(4, 1);
+	mw_test_check(MW_CMD_OK == reply_wait(4, 0));
+	mw_test_check(MW_SOCK_NONE == d.ss[0] && d.sock[0] < 0);
+}
+
+// Refused and completed connections
+static void test_connect(void)
+{
+	mw_test_clear();
+	con_req(1, 2, CON_REFUSED, -1);
+	mw_test_check(MW_CMD_ERROR == reply_wait(1, 1000));
+	jobs_complete();
+	mw_test_check(MW_SOCK_NONE == d.ss[1] && d.sock[1] < 0);
+
+	con_req(2, 2, CON_OK, CON_TMO_MS);
+	mw_test_check(MW_CMD_OK == reply_wait(2, 1000));
+	jobs_complete();
+	connected_check(2);
+	// Channel is in use
+	con_req(3, 2, CON_OK, -1);
+	mw_test_check(MW_CMD_ERROR == reply_wait(3, 1000));
+	jobs_complete();
+	connected_check(2);
+
+	close_req(4, 2);
+	mw_test_check(MW_CMD_OK == reply_wait(4, 0));
+	mw_test_check(MW_SOCK_NONE == d.ss[1] && d.sock[1] < 0);
+}
+
+int main(void)
+{
+	mw_test_init(MW_ST_READY, TRUE);
+
+	test_tmo();
+	test_timeout();
+	test_cancel();
+	test_rereserve();
+	test_connect();
+
+	mw_test_check(!t.open);
+	mw_test_check(!t.addrs);
+	mw_test_check(!t.blocking);
+	mw_test_check(BUF_POOL_LEN == buf_free_count());
+
+	return mw_test_end();
+}
@@ -0,0 +1,162 @@
+// Test of the WiFi event slots. A burst of events longer than the slots is
+// fed to the event handler while the FSM is stalled: the events that do not
+// fit must be dropped and counted without blocking, and the ones queued
+// must reach the FSM intact and in order. With a lane shorter than the
+// slots, events are dropped when the lane fills, freeing their slot. The
+// FSM must get the lanes in priority order, all the slots must be returned,
+// and MW_CMD_FSM_STATS must reply the counts.
+//
+// Usage: wifi_ev_test
+
+#include "mw_test.h"
+
+/// Events in the burst
+#define BURST		(MW_EV_SLOTS + 3)
+/// Length of the WiFi lane, when shorter than the slots
+#define SHORT_LANE	4
+
+// Feeds n disconnect events to the event handler, with reasons counting from
+// first. Returns the time taken, in ms.
+static uint32_t burst(int n, uint8_t first)
+{
+	system_event_t ev = {.event_id = SYSTEM_EVENT_STA_DISCONNECTED};
+	TickType_t start = xTaskGetTickCount();
+	int i;
+
+	for (i = 0; i < n; i++) {
+		ev.event_info.disconnected.reason = first + i;
+		mw_test_check(ESP_OK == event_handler(&d.q, &ev));
+	}
+
+	return (xTaskGetTickCount() - start) * portTICK_PERIOD_MS;
+}
+
+static int slots_used(void)
+{
+	int used = 0;
+	int i;
+
+	for (i = 0; i < MW_EV_SLOTS; i++) {
+		used += d.ev_used[i];
+	}
+
+	return used;
+}
+
+// Requests the statistics, and checks the reply holds the counts
+static void stats_check(uint32_t no_slot, uint32_t q_full, uint32_t hwm)
+{
+	const struct mw_test_frame *f = mw_test_frame(0);
+
+	mw_test_clear();
+	mw_test_req(7, MW_CMD_FSM_STATS, NULL, 0);
+	if (mw_test_check(1 == mt.frames) && mw_test_reply(f,
+				MW_CMD_TAGGED(7, MW_CMD_OK),
+				sizeof(struct mw_fsm_stats))) {
+		mw_test_check(ntohl(f->cmd.fsm_stats.ev_no_slot) == no_slot);
+		mw_test_check(ntohl(f->cmd.fsm_stats.ev_q_full) == q_full);
+		mw_test_check(ntohl(f->cmd.fsm_stats.ev_hwm) == hwm);
+	}
+}
+
+// Burst longer than the slots: the last events are dropped
+static void test_burst(void)
+{
+	uint32_t enable = htonl(MW_EVENT_BIT(MW_EVENT_WIFI_DOWN));
+	uint32_t ms;
+	int i;
+
+	mw_test_init(MW_ST_READY, FALSE);
+	mw_test_req(0, MW_CMD_EVENT_SET, &enable, sizeof(enable));
+
+	ms = burst(BURST, 0);
+	mw_test_check(ms < 50);
+	mw_test_check(BURST - MW_EV_SLOTS == d.ev_no_slot);
+	mw_test_check(!mq_full_count(&d.q, MW_LANE_WIFI));
+	mw_test_check(MW_EV_SLOTS == slots_used());
+
+	// Each event queued is notified, with its own reason
+	mw_test_clear();
+	mw_test_fsm_run(0);
+	mw_test_check(!slots_used());
+	if (mw_test_check(MW_EV_SLOTS == mt.frames)) {
+		for (i = 0; i < MW_EV_SLOTS; i++) {
+			mw_test_check(MW_EVENT_WIFI_DOWN == mw_test_frame(i)->
+					cmd.event.type);
+			mw_test_check(i == ntohl(mw_test_frame(i)->
+						cmd.event.data));
+		}
+	}
+
+	// Slots are reused
+	burst(MW_EV_SLOTS, 0);
+	mw_test_check(BURST - MW_EV_SLOTS == d.ev_no_slot);
+	mw_test_fsm_run(0);
+	mw_test_check(!slots_used());
+	stats_check(BURST - MW_EV_SLOTS, 0, MW_EV_SLOTS);
+	mw_test_check(BUF_POOL_LEN == buf_free_count());
+}
+
+// Lane filling before the slots: the events dropped return their slot
+static void test_lane_full(void)
+{
+	uint8_t lane_len[MW_LANES] = MW_FSM_LANE_LEN;
+
+	mw_test_init(MW_ST_READY, FALSE);
+	// Queue is built again (leaking the first one) with a short lane
+	lane_len[MW_LANE_WIFI] = SHORT_LANE;
+	mq_init(&d.q, lane_len, MW_LANES);
+
+	burst(SHORT_LANE + 2, 0);
+	mw_test_check(!d.ev_no_slot);
+	mw_test_check(2 == mq_full_count(&d.q, MW_LANE_WIFI));
+	mw_test_check(SHORT_LANE == slots_used());
+	mw_test_fsm_run(0);
+	mw_test_check(!slots_used());
+	// Slot of the event dropped is counted while taken
+	stats_check(0, 2, SHORT_LANE + 1);
+}
+
+// FSM gets the system, serial, job and WiFi lanes in that order, whatever
+// the order the messages were queued
+static void test_lane_order(void)
+{
+	MwFsmMsg m[MW_FSM_BATCH];
+	MwFsmMsg msg = {.e = MW_EV_NONE};
+	int lane, n, i;
+	int got = 0;
+
+	mw_test_init(MW_ST_READY, FALSE);
+	burst(2, 0);
+	// Messages tell their lane
+	for (lane = MW_LANE_WIFI - 1; lane >= MW_LANE_SYS; lane--) {
+		msg.d = (void*)(uintptr_t)lane;
+		mw_test_check(mq_send(&d.q, lane, &msg, 0));
+		mw_test_check(mq_send(&d.q, lane, &msg, 0));
+	}
+
+	// Taken 3 at a time, not to get them all at once
+	while ((n = mq_recv(&d.q, m, 3, 0))) {
+		for (i = 0; i < n; i++, got++) {
+			lane = MIN(got / 2, MW_LANE_WIFI);
+			if (MW_LANE_WIFI == lane) {
+				mw_test_check(MW_EV_WIFI == m[i].e);
+				MwFsm(&m[i]);
+			} else {
+				mw_test_check(MW_EV_NONE == m[i].e &&
+						(uintptr_t)m[i].d == lane);
+			}
+		}
+	}
+	mw_test_check(2 * MW_LANES == got);
+	mw_test_check(!slots_used());
+}
+
+int main(void)
+{
+	test_burst();
+	test_lane_full();
+	test_lane_order();
+
+	return mw_test_end();
+}